@@ -13,6 +13,7 @@ local table = table
 local print = print
 local _BASE_GAMEMODE = _BASE_GAMEMODE
 local _G = _G
+local invalidate = hookcache and hookcache.invalidate or function() end
 
 module( "gamemode" )
 
@@ -54,4 +55,5 @@ function register( tGamemode, strName, strBaseClass )
     tGamemode = table.inherit( tGamemode, get( strBaseClass ) )
   end
   tGamemodes[ strName ] = tGamemode
+  invalidate()
 end
@@ -9,6 +9,7 @@ local Warning = dbg.Warning
 local tostring = tostring
 local pcall = pcall
 local unpack = unpack
+local invalidate = hookcache and hookcache.invalidate or function() end
 
 module( "hook" )
 
@@ -25,6 +26,7 @@ local tReturns = {}
 function add( strEventName, strHookName, pFn )
   tHooks[ strEventName ] = tHooks[ strEventName ] or {}
   tHooks[ strEventName ][ strHookName ] = pFn
+  invalidate( strEventName )
 end
 
 -------------------------------------------------------------------------------
@@ -40,12 +42,14 @@ function call( strEventName, tGamemode, ... )
       if ( v == nil ) then
         Warning( "Hook '" .. tostring( k ) .. "' (" .. tostring( strEventName ) .. ") tried to call a nil function!\n" )
         tHooks[ k ] = nil
+        invalidate( strEventName )
         break
       else
         tReturns = { pcall( v, ... ) }
         if ( tReturns[ 1 ] == false ) then
           Warning( "Hook '" .. tostring( k ) .. "' (" .. tostring( strEventName ) .. ") Failed: " .. tostring( tReturns[ 2 ] ) .. "\n" )
           tHooks[ k ] = nil
+          invalidate( strEventName )
         elseif ( tReturns[ 2 ] ~= nil ) then
           return unpack( tReturns, 2 )
         end
@@ -61,6 +65,7 @@ function call( strEventName, tGamemode, ... )
       if ( tReturns[ 1 ] == false ) then
         Warning( "ERROR: GAMEMODE: '" .. tostring( strEventName ) .. "' Failed: " .. tostring( tReturns[ 2 ] ) .. "\n" )
         tGamemode[ strEventName ] = nil
+        invalidate( strEventName )
         return nil
       end
       return unpack( tReturns, 2 )
@@ -90,5 +95,6 @@ end
 function remove( strEventName, strHookName )
   if ( tHooks[ strEventName ][ strHookName ] ) then
     tHooks[ strEventName ][ strHookName ] = nil
+    invalidate( strEventName )
   end
 end
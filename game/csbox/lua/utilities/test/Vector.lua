@@ -0,0 +1,56 @@
+--======== Copyleft  2010-2011, Team Sandbox, Some rights reserved. ========--
+--
+-- Purpose: Measures Lua allocations per frame for Vector math written with
+--          operators versus the in-place methods.
+--
+--===========================================================================--
+
+local allocationcount = allocationcount
+local Vector = Vector
+local print = print
+local FRAMES = 66
+local ITERATIONS = 1000
+
+local vecA = Vector( 1, 2, 3 )
+local vecB = Vector( 4, 5, 6 )
+local vecOut = Vector()
+
+local tTests = {
+  {
+    "operators",
+    function()
+      for i = 1, ITERATIONS do
+        vecOut = vecA + vecB * 0.5
+      end
+    end
+  },
+  {
+    "in-place",
+    function()
+      for i = 1, ITERATIONS do
+        vecOut:Set( vecB ):Mul( 0.5 ):Add( vecA )
+      end
+    end
+  }
+}
+
+local iTest = 1
+local iFrame = 0
+local nStart = 0
+
+hook.add( "Think", "Vector", function()
+  local tTest = tTests[ iTest ]
+  if ( iFrame == 0 ) then
+    nStart = allocationcount()
+  end
+  tTest[ 2 ]()
+  iFrame = iFrame + 1
+  if ( iFrame == FRAMES ) then
+    print( tTest[ 1 ] .. ": " .. ( allocationcount() - nStart ) / FRAMES .. " allocations per frame" )
+    iFrame = 0
+    iTest = iTest + 1
+    if ( tTests[ iTest ] == nil ) then
+      hook.remove( "Think", "Vector" )
+    end
+  end
+end )
@@ -1498,6 +1498,13 @@ void C_BaseAnimating::BuildTransformations( CStudioHdr *hdr, Vector *pos, Quater
 		}
 	}
 
+	matrix3x4_t *pLocalBones = NULL;
+	if ( Studio_UseSIMDBoneKernels() )
+	{
+		pLocalBones = (matrix3x4_t *)stackalloc( hdr->numbones() * sizeof( matrix3x4_t ) );
+		Studio_BuildLocalMatricesSIMD( hdr, pos, q, pLocalBones, boneMask );
+	}
+
 	for (int i = 0; i < hdr->numbones(); i++) 
 	{
 		// Only update bones reference by the bone mask.
@@ -1522,7 +1529,14 @@ void C_BaseAnimating::BuildTransformations( CStudioHdr *hdr, Vector *pos, Quater
 		}
 		else
 		{
-			QuaternionMatrix( q[i], pos[i], bonematrix );
+			if ( pLocalBones )
+			{
+				MatrixCopy( pLocalBones[i], bonematrix );
+			}
+			else
+			{
+				QuaternionMatrix( q[i], pos[i], bonematrix );
+			}
 
 			Assert( fabs( pos[i].x ) < 100000 );
 			Assert( fabs( pos[i].y ) < 100000 );
@@ -2712,10 +2726,85 @@ ConVar cl_threaded_bone_setup("cl_threaded_bone_setup", "0", 0, "Enable parallel
 // Purpose: Do the default sequence blending rules as done in HL1
 //-----------------------------------------------------------------------------
 
-static void SetupBonesOnBaseAnimating( C_BaseAnimating *&pBaseAnimating )
+//-----------------------------------------------------------------------------
+// Threaded bone setup. Entities are grouped by the root of their move
+// hierarchy: a bone merged weapon or a follower reads its owner's bones while
+// setting up its own, so a whole hierarchy runs on one thread, owners before
+// followers. Independent hierarchies run in parallel.
+//-----------------------------------------------------------------------------
+struct BoneSetupJob_t
+{
+	int m_iFirst;
+	int m_nCount;
+};
+
+struct BoneSetupEntry_t
+{
+	C_BaseAnimating *m_pAnimating;
+	C_BaseEntity *m_pRoot;
+	int m_nDepth;
+	int m_iOrder;
+};
+
+static CUtlVector< BoneSetupEntry_t > g_BoneSetupEntries;
+static CUtlVector< BoneSetupJob_t > g_BoneSetupJobs;
+static int g_nBoneSetupJobMask = -1;
+
+static int BoneSetupEntryCompare( const BoneSetupEntry_t *pLeft, const BoneSetupEntry_t *pRight )
+{
+	if ( pLeft->m_pRoot != pRight->m_pRoot )
+		return ( pLeft->m_pRoot < pRight->m_pRoot ) ? -1 : 1;
+	if ( pLeft->m_nDepth != pRight->m_nDepth )
+		return pLeft->m_nDepth - pRight->m_nDepth;
+	return pLeft->m_iOrder - pRight->m_iOrder;
+}
+
+static int BoneSetupJobCompare( const BoneSetupJob_t *pLeft, const BoneSetupJob_t *pRight )
 {
-	if ( !pBaseAnimating->GetMoveParent() )
-		pBaseAnimating->SetupBones( NULL, -1, -1, gpGlobals->curtime );
+	// Biggest hierarchies first so they don't end up at the tail of the frame
+	if ( pLeft->m_nCount != pRight->m_nCount )
+		return pRight->m_nCount - pLeft->m_nCount;
+	return pLeft->m_iFirst - pRight->m_iFirst;
+}
+
+static void BuildBoneSetupJobs( C_BaseAnimating **ppAnimating, int nCount )
+{
+	g_BoneSetupEntries.SetCount( nCount );
+	for ( int i = 0; i < nCount; ++i )
+	{
+		BoneSetupEntry_t &entry = g_BoneSetupEntries[i];
+		entry.m_pAnimating = ppAnimating[i];
+		entry.m_pRoot = ppAnimating[i];
+		entry.m_nDepth = 0;
+		entry.m_iOrder = i;
+		while ( entry.m_pRoot->GetMoveParent() )
+		{
+			entry.m_pRoot = entry.m_pRoot->GetMoveParent();
+			++entry.m_nDepth;
+		}
+	}
+	g_BoneSetupEntries.Sort( BoneSetupEntryCompare );
+
+	g_BoneSetupJobs.RemoveAll();
+	for ( int i = 0; i < nCount; ++i )
+	{
+		if ( i == 0 || g_BoneSetupEntries[i].m_pRoot != g_BoneSetupEntries[i - 1].m_pRoot )
+		{
+			BoneSetupJob_t &job = g_BoneSetupJobs[ g_BoneSetupJobs.AddToTail() ];
+			job.m_iFirst = i;
+			job.m_nCount = 0;
+		}
+		g_BoneSetupJobs.Tail().m_nCount++;
+	}
+	g_BoneSetupJobs.Sort( BoneSetupJobCompare );
+}
+
+static void SetupBonesForJob( BoneSetupJob_t &job )
+{
+	for ( int i = job.m_iFirst; i < job.m_iFirst + job.m_nCount; ++i )
+	{
+		g_BoneSetupEntries[i].m_pAnimating->SetupBones( NULL, -1, g_nBoneSetupJobMask, gpGlobals->curtime );
+	}
 }
 
 static void PreThreadedBoneSetup()
@@ -2731,6 +2820,21 @@ static void PostThreadedBoneSetup()
 static bool g_bInThreadedBoneSetup;
 static bool g_bDoThreadedBoneSetup;
 
+static void RunBoneSetupJobs( C_BaseAnimating **ppAnimating, int nCount, int boneMask )
+{
+	VPROF_BUDGET( "C_BaseAnimating::ThreadedBoneSetup", VPROF_BUDGETGROUP_CLIENT_ANIMATION );
+
+	BuildBoneSetupJobs( ppAnimating, nCount );
+	g_nBoneSetupJobMask = boneMask;
+
+	g_bInThreadedBoneSetup = true;
+	ParallelProcess( "C_BaseAnimating::ThreadedBoneSetup", g_BoneSetupJobs.Base(), g_BoneSetupJobs.Count(), &SetupBonesForJob, &PreThreadedBoneSetup, &PostThreadedBoneSetup );
+	g_bInThreadedBoneSetup = false;
+
+	g_BoneSetupEntries.RemoveAll();
+	g_BoneSetupJobs.RemoveAll();
+}
+
 void C_BaseAnimating::InitBoneSetupThreadPool()
 {
 }				 
@@ -2741,23 +2845,91 @@ void C_BaseAnimating::ShutdownBoneSetupThreadPool()
 
 void C_BaseAnimating::ThreadedBoneSetup()
 {
-	g_bDoThreadedBoneSetup = cl_threaded_bone_setup.GetBool();
+	g_bDoThreadedBoneSetup = cl_threaded_bone_setup.GetBool() && g_pThreadPool->NumThreads();
 	if ( g_bDoThreadedBoneSetup )
 	{
 		int nCount = g_PreviousBoneSetups.Count();
 		if ( nCount > 1 )
 		{
-			g_bInThreadedBoneSetup = true;
-
-			ParallelProcess( "C_BaseAnimating::ThreadedBoneSetup", g_PreviousBoneSetups.Base(), nCount, &SetupBonesOnBaseAnimating, &PreThreadedBoneSetup, &PostThreadedBoneSetup );
-
-			g_bInThreadedBoneSetup = false;
+			RunBoneSetupJobs( g_PreviousBoneSetups.Base(), nCount, -1 );
 		}
 	}
 	g_iPreviousBoneCounter++;
 	g_PreviousBoneSetups.RemoveAll();
 }
 
+//-----------------------------------------------------------------------------
+// Sets up every animating entity serially and through the job graph and
+// reports any entity whose bone matrices differ between the two.
+//-----------------------------------------------------------------------------
+CON_COMMAND_F( cl_threaded_bone_setup_verify, "Compare threaded and serial SetupBones results for all animating entities", FCVAR_CHEAT )
+{
+	CUtlVector< C_BaseAnimating * > animating;
+	for ( C_BaseEntity *pEnt = ClientEntityList().FirstBaseEntity(); pEnt; pEnt = ClientEntityList().NextBaseEntity( pEnt ) )
+	{
+		C_BaseAnimating *pAnimating = pEnt->GetBaseAnimating();
+		if ( !pAnimating || pAnimating->IsDormant() || !pAnimating->GetModelPtr() || pAnimating->GetSequence() == -1 )
+			continue;
+		animating.AddToTail( pAnimating );
+	}
+
+	int nCount = animating.Count();
+	if ( !nCount )
+	{
+		Msg( "No animating entities to test.\n" );
+		return;
+	}
+
+	C_BaseAnimating::AutoAllowBoneAccess boneAccess( true, true );
+
+	// Two serial passes tell apart entities whose pose isn't repeatable within a frame (IK, client side
+	// timers) from genuine threading differences.
+	CUtlVector< matrix3x4_t > serial, control, threaded;
+	serial.SetCount( nCount * MAXSTUDIOBONES );
+	control.SetCount( nCount * MAXSTUDIOBONES );
+	threaded.SetCount( nCount * MAXSTUDIOBONES );
+
+	CUtlVector< matrix3x4_t > *pPasses[3] = { &serial, &threaded, &control };
+	for ( int nPass = 0; nPass < 3; ++nPass )
+	{
+		for ( int i = 0; i < nCount; ++i )
+		{
+			animating[i]->InvalidateBoneCache();
+		}
+
+		if ( pPasses[nPass] == &threaded )
+		{
+			RunBoneSetupJobs( animating.Base(), nCount, BONE_USED_BY_ANYTHING );
+		}
+
+		for ( int i = 0; i < nCount; ++i )
+		{
+			animating[i]->SetupBones( pPasses[nPass]->Base() + i * MAXSTUDIOBONES, MAXSTUDIOBONES, BONE_USED_BY_ANYTHING, gpGlobals->curtime );
+		}
+	}
+
+	int nMismatched = 0, nUnrepeatable = 0;
+	for ( int i = 0; i < nCount; ++i )
+	{
+		int nBones = animating[i]->GetModelPtr()->numbones();
+		size_t nSize = nBones * sizeof( matrix3x4_t );
+		if ( memcmp( serial.Base() + i * MAXSTUDIOBONES, control.Base() + i * MAXSTUDIOBONES, nSize ) )
+		{
+			++nUnrepeatable;
+			continue;
+		}
+
+		if ( memcmp( serial.Base() + i * MAXSTUDIOBONES, threaded.Base() + i * MAXSTUDIOBONES, nSize ) )
+		{
+			++nMismatched;
+			Msg( "  mismatch: %s (%d) %s\n", animating[i]->GetClassname(), animating[i]->entindex(), modelinfo->GetModelName( animating[i]->GetModel() ) );
+		}
+	}
+
+	Msg( "Threaded bone setup: %d entities, %d compared, %d mismatched, %d not repeatable serially\n",
+		nCount, nCount - nUnrepeatable, nMismatched, nUnrepeatable );
+}
+
 bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, int boneMask, float currentTime )
 {
 	VPROF_BUDGET( "C_BaseAnimating::SetupBones", VPROF_BUDGETGROUP_CLIENT_ANIMATION );
@@ -2859,7 +3031,8 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 	}
 
 	int nBoneCount = m_CachedBoneData.Count();
-	if ( g_bDoThreadedBoneSetup && !g_bInThreadedBoneSetup && ( nBoneCount >= 16 ) && !GetMoveParent() && m_iMostRecentBoneSetupRequest != g_iPreviousBoneCounter )
+	// Followers are queued regardless of size; the job graph keeps them on their owner's thread
+	if ( g_bDoThreadedBoneSetup && !g_bInThreadedBoneSetup && ( nBoneCount >= 16 || GetMoveParent() ) && m_iMostRecentBoneSetupRequest != g_iPreviousBoneCounter )
 	{
 		m_iMostRecentBoneSetupRequest = g_iPreviousBoneCounter;
 		Assert( g_PreviousBoneSetups.Find( this ) == -1 );
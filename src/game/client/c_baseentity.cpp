@@ -42,6 +42,7 @@
 #include "proto_version.h"
 #ifdef LUA_SDK
 #include "luamanager.h"
+#include "lbaseentity_shared.h"
 #include "mathlib/lvector.h"
 #endif
 
@@ -5057,6 +5058,12 @@ void C_BaseEntity::UpdateOnRemove( void )
 {
 	VPhysicsDestroyObject(); 
 
+#if defined( LUA_SDK )
+	// Release the Lua userdata cached for this entity
+	if ( g_bLuaInitialized )
+		lua_removecachedentity( L, this );
+#endif
+
 	Assert( !GetMoveParent() );
 	UnlinkFromHierarchy();
 	SetGroundEntity( NULL );
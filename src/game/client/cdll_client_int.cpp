@@ -1729,22 +1729,15 @@ void CHLClient::LevelInitPreEntity(char const* pMapName)
 	lcf_recursivedeletefile(LUA_PATH_CACHE);
 
 	// Add the Lua environment.
-	// Andrew; unarchive the Lua Cache File
+	// Andrew; mount the Lua Cache File, its scripts are loaded from memory
+	// alongside the ones on disk
 	if (gpGlobals->maxClients > 1)
 	{
-		luasrc_ExtractLcf();
+		luasrc_MountLcf();
 	}
 
 	luasrc_init();
 
-	if (gpGlobals->maxClients > 1)
-	{
-		luasrc_dofolder(L, LUA_PATH_CACHE LUA_PATH_EXTENSIONS);
-		luasrc_dofolder(L, LUA_PATH_CACHE LUA_PATH_MODULES);
-		luasrc_dofolder(L, LUA_PATH_CACHE LUA_PATH_GAME_SHARED);
-		luasrc_dofolder(L, LUA_PATH_CACHE LUA_PATH_GAME_CLIENT);
-	}
-
 	luasrc_dofolder(L, LUA_PATH_EXTENSIONS);
 	luasrc_dofolder(L, LUA_PATH_MODULES);
 	luasrc_dofolder(L, LUA_PATH_GAME_SHARED);
@@ -2495,6 +2488,10 @@ void CHLClient::FrameStageNotify(ClientFrameStage_t curStage)
 		OnRenderEnd();
 
 		PREDICTION_SPEWVALUECHANGES();
+
+#if defined ( LUA_SDK )
+		luasrc_gcstep();
+#endif
 	}
 	break;
 
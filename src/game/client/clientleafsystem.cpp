@@ -23,6 +23,7 @@
 #include "datacache/imdlcache.h"
 #include "view.h"
 #include "viewrender.h"
+#include "tier0/fasttimer.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -32,7 +33,8 @@ class VMatrix;  // forward decl
 static ConVar cl_drawleaf("cl_drawleaf", "-1", FCVAR_CHEAT );
 static ConVar r_PortalTestEnts( "r_PortalTestEnts", "1", FCVAR_CHEAT, "Clip entities against portal frustums." );
 static ConVar r_portalsopenall( "r_portalsopenall", "0", FCVAR_CHEAT, "Open all portals" );
-static ConVar cl_threaded_client_leaf_system("cl_threaded_client_leaf_system", "0"  );
+static ConVar cl_threaded_client_leaf_system("cl_threaded_client_leaf_system", "1", 0, "Reinsert moved renderables into the leaf system on the job threads." );
+static ConVar cl_threaded_client_leaf_system_threshold("cl_threaded_client_leaf_system_threshold", "16", 0, "Minimum number of dirty renderables before the leaf reinsert is threaded." );
 
 
 DEFINE_FIXEDSIZE_ALLOCATOR( CClientRenderablesList, 1, CUtlMemoryPool::GROW_SLOW );
@@ -163,6 +165,11 @@ private:
 	void InsertIntoTree( ClientRenderHandle_t &handle );
 	void RemoveFromTree( ClientRenderHandle_t handle );
 
+	// Reinserts the first nDirty dirty renderables using the job threads
+	struct EnumResultList_t;
+	void InsertIntoTreeThreaded( int nDirty );
+	void GatherLeavesInTree( EnumResultList_t &list );
+
 	// Returns if it's a view model render group
 	inline bool IsViewModelRenderGroup( RenderGroup_t group ) const;
 
@@ -286,12 +293,54 @@ private:
 		EnumResult_t *pNext;
 	};
 
+	// Leaf lists gathered on the job threads come out of a per-thread arena
+	// which is rewound once the main thread has consumed them.
+	class CEnumResultArena
+	{
+	public:
+		enum
+		{
+			BLOCK_SIZE = 512,
+		};
+
+		CEnumResultArena() : m_nUsed( 0 ) {}
+		~CEnumResultArena()
+		{
+			for ( int i = 0; i < m_Blocks.Count(); ++i )
+			{
+				delete [] m_Blocks[i];
+			}
+		}
+
+		EnumResult_t *Alloc()
+		{
+			int nBlock = m_nUsed / BLOCK_SIZE;
+			if ( nBlock == m_Blocks.Count() )
+			{
+				m_Blocks.AddToTail( new EnumResult_t[BLOCK_SIZE] );
+			}
+			return &m_Blocks[nBlock][ m_nUsed++ % BLOCK_SIZE ];
+		}
+
+		void Reset() { m_nUsed = 0; }
+
+	private:
+		CUtlVector< EnumResult_t * > m_Blocks;
+		int m_nUsed;
+	};
+
 	struct EnumResultList_t
 	{
 		EnumResult_t *pHead;
+		EnumResult_t *pTail;
+		CEnumResultArena *pArena;	// NULL means add straight to the leaves
 		ClientRenderHandle_t handle;
+		Vector absMins;
+		Vector absMaxs;
 	};
 
+	CEnumResultArena *GetThreadArena();
+
 	// Stores data associated with each leaf.
 	CUtlVector< ClientLeaf_t >	m_Leaf;
 
@@ -323,7 +372,12 @@ private:
 	// A little enumerator to help us when adding shadows to renderables
 	int	m_ShadowEnum;
 
-	CTSList<EnumResultList_t> m_DeferredInserts;
+	// One entry per dirty renderable during a threaded reinsert
+	CUtlVector< EnumResultList_t > m_DeferredInserts;
+
+	CThreadLocalPtr< CEnumResultArena > m_pThreadArena;
+	CUtlVector< CEnumResultArena * > m_ThreadArenas;
+	CThreadFastMutex m_ArenaMutex;
 };
 
 
@@ -446,6 +500,7 @@ CClientLeafSystem::CClientLeafSystem() : m_DrawStaticProps(true), m_DrawSmallObj
 
 CClientLeafSystem::~CClientLeafSystem()
 {
+	m_ThreadArenas.PurgeAndDeleteElements();
 }
 
 //-----------------------------------------------------------------------------
@@ -550,7 +605,12 @@ void CClientLeafSystem::PreRender()
 			RemoveFromTree( handle );
 		}
 
-		bool bThreaded = false;//( nDirty > 5 && cl_threaded_client_leaf_system.GetBool() && g_pThreadPool->NumThreads() );
+		VPROF_INCREMENT_COUNTER( "ClientLeafSystem dirty renderables", nDirty );
+
+		CFastTimer timer;
+		timer.Start();
+
+		bool bThreaded = ( nDirty >= cl_threaded_client_leaf_system_threshold.GetInt() && cl_threaded_client_leaf_system.GetBool() && g_pThreadPool->NumThreads() );
 
 		if ( !bThreaded )
 		{
@@ -561,27 +621,11 @@ void CClientLeafSystem::PreRender()
 		}
 		else
 		{
-			// InsertIntoTree can result in new renderables being added, so copy:
-			ClientRenderHandle_t *pDirtyRenderables = (ClientRenderHandle_t *)alloca( sizeof(ClientRenderHandle_t) * nDirty );
-			memcpy( pDirtyRenderables, m_DirtyRenderables.Base(), sizeof(ClientRenderHandle_t) * nDirty );
-			ParallelProcess( "CClientLeafSystem::PreRender", pDirtyRenderables, nDirty, this, &CClientLeafSystem::InsertIntoTree, &CClientLeafSystem::FrameLock, &CClientLeafSystem::FrameUnlock );
+			InsertIntoTreeThreaded( nDirty );
 		}
 
-		if ( m_DeferredInserts.Count() )
-		{
-			EnumResultList_t enumResultList;
-			while ( m_DeferredInserts.PopItem( &enumResultList ) )
-			{
-				m_ShadowEnum++;
-				while ( enumResultList.pHead )
-				{
-					EnumResult_t *p = enumResultList.pHead;
-					enumResultList.pHead = p->pNext;
-					AddRenderableToLeaf( p->leaf, enumResultList.handle );
-					delete p;
-				}
-			}
-		}
+		timer.End();
+		VPROF_INCREMENT_COUNTER( "ClientLeafSystem reinsert (us)", timer.GetDuration().GetMicroseconds() );
 
 		for ( i = nDirty; --i >= 0; )
 		{
@@ -1183,44 +1227,107 @@ void CClientLeafSystem::AddRenderableToLeaves( ClientRenderHandle_t handle, int
 bool CClientLeafSystem::EnumerateLeaf( int leaf, int context )
 {
 	EnumResultList_t *pList = (EnumResultList_t *)context;
-	if ( ThreadInMainThread() )
+	if ( !pList->pArena )
 	{
 		AddRenderableToLeaf( leaf, pList->handle );
+		return true;
+	}
+
+	// Keep the enumeration order so the threaded path links leaves exactly as the serial one does
+	EnumResult_t *p = pList->pArena->Alloc();
+	p->leaf = leaf;
+	p->pNext = NULL;
+	if ( pList->pTail )
+	{
+		pList->pTail->pNext = p;
 	}
 	else
 	{
-		EnumResult_t *p = new EnumResult_t;
-		p->leaf = leaf;
-		p->pNext = pList->pHead;
 		pList->pHead = p;
 	}
+	pList->pTail = p;
 	return true;
 }
 
 void CClientLeafSystem::InsertIntoTree( ClientRenderHandle_t &handle )
 {
-	if ( ThreadInMainThread() )
-	{
-		// When we insert into the tree, increase the shadow enumerator
-		// to make sure each shadow is added exactly once to each renderable
-		m_ShadowEnum++;
-	}
+	// When we insert into the tree, increase the shadow enumerator
+	// to make sure each shadow is added exactly once to each renderable
+	m_ShadowEnum++;
 
-	EnumResultList_t list = { NULL, handle };
+	EnumResultList_t list;
+	list.pHead = list.pTail = NULL;
+	list.pArena = NULL;
+	list.handle = handle;
 
 	// NOTE: The render bounds here are relative to the renderable's coordinate system
-	IClientRenderable* pRenderable = m_Renderables[handle].m_pRenderable;
-	Vector absMins, absMaxs;
-	
-	CalcRenderableWorldSpaceAABB_Fast( pRenderable, absMins, absMaxs );
-	Assert( absMins.IsValid() && absMaxs.IsValid() );
+	CalcRenderableWorldSpaceAABB_Fast( m_Renderables[handle].m_pRenderable, list.absMins, list.absMaxs );
+	Assert( list.absMins.IsValid() && list.absMaxs.IsValid() );
 
 	ISpatialQuery* pQuery = engine->GetBSPTreeQuery();
-	pQuery->EnumerateLeavesInBox( absMins, absMaxs, this, (int)&list );
+	pQuery->EnumerateLeavesInBox( list.absMins, list.absMaxs, this, (int)&list );
+}
+
+
+//-----------------------------------------------------------------------------
+// Threaded reinsert. Bounds can run SetupBones and other renderable code, so
+// they are computed on the main thread first; the job threads only walk the
+// bsp. Every change to the leaf lists happens afterwards on the main thread,
+// in the same order as the serial path.
+//-----------------------------------------------------------------------------
+CClientLeafSystem::CEnumResultArena *CClientLeafSystem::GetThreadArena()
+{
+	CEnumResultArena *pArena = m_pThreadArena;
+	if ( !pArena )
+	{
+		pArena = new CEnumResultArena;
+		m_pThreadArena = pArena;
+
+		AUTO_LOCK_FM( m_ArenaMutex );
+		m_ThreadArenas.AddToTail( pArena );
+	}
+	return pArena;
+}
+
+void CClientLeafSystem::GatherLeavesInTree( EnumResultList_t &list )
+{
+	list.pArena = GetThreadArena();
+
+	ISpatialQuery* pQuery = engine->GetBSPTreeQuery();
+	pQuery->EnumerateLeavesInBox( list.absMins, list.absMaxs, this, (int)&list );
+}
+
+void CClientLeafSystem::InsertIntoTreeThreaded( int nDirty )
+{
+	// Computing bounds can mark more renderables dirty, so work from a copy.
+	// Walk back to front so bones are set up in the same order as the serial path.
+	m_DeferredInserts.SetCount( nDirty );
+	for ( int i = nDirty; --i >= 0; )
+	{
+		EnumResultList_t &list = m_DeferredInserts[i];
+		list.pHead = list.pTail = NULL;
+		list.pArena = NULL;
+		list.handle = m_DirtyRenderables[i];
+
+		CalcRenderableWorldSpaceAABB_Fast( m_Renderables[list.handle].m_pRenderable, list.absMins, list.absMaxs );
+		Assert( list.absMins.IsValid() && list.absMaxs.IsValid() );
+	}
+
+	ParallelProcess( "CClientLeafSystem::PreRender", m_DeferredInserts.Base(), nDirty, this, &CClientLeafSystem::GatherLeavesInTree, &CClientLeafSystem::FrameLock, &CClientLeafSystem::FrameUnlock );
+
+	for ( int i = nDirty; --i >= 0; )
+	{
+		EnumResultList_t &list = m_DeferredInserts[i];
+		m_ShadowEnum++;
+		for ( EnumResult_t *p = list.pHead; p; p = p->pNext )
+		{
+			AddRenderableToLeaf( p->leaf, list.handle );
+		}
+	}
 
-	if ( list.pHead )
+	for ( int i = 0; i < m_ThreadArenas.Count(); ++i )
 	{
-		m_DeferredInserts.PushItem( list );
+		m_ThreadArenas[i]->Reset();
 	}
 }
 
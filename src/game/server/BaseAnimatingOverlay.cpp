@@ -15,6 +15,7 @@
 
 #include "saverestore_utlvector.h"
 #include "dt_utlvector_send.h"
+#include "tier1/utlbuffer.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -492,6 +493,32 @@ void CBaseAnimatingOverlay::GetSkeleton( CStudioHdr *pStudioHdr, Vector pos[], Q
 
 
 
+//-----------------------------------------------------------------------------
+// Purpose: The overlays feed GetSkeleton, so they're part of the bone cache key
+//-----------------------------------------------------------------------------
+void CBaseAnimatingOverlay::GetBoneSetupState( CUtlBuffer &state )
+{
+	BaseClass::GetBoneSetupState( state );
+
+	for ( int i = 0; i < m_AnimOverlay.Count(); i++ )
+	{
+		CAnimationLayer &layer = m_AnimOverlay[i];
+		if ( !layer.IsActive() || layer.m_flWeight <= 0 )
+			continue;
+
+		int nOrder = layer.m_nOrder;
+		int nSequence = layer.m_nSequence;
+		float flCycle = layer.m_flCycle;
+		float flWeight = layer.m_flWeight;
+		state.Put( &i, sizeof( i ) );
+		state.Put( &nOrder, sizeof( nOrder ) );
+		state.Put( &nSequence, sizeof( nSequence ) );
+		state.Put( &flCycle, sizeof( flCycle ) );
+		state.Put( &flWeight, sizeof( flWeight ) );
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: zero's out all non-restore safe fields
 // Output :
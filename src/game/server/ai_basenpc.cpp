@@ -3893,6 +3893,23 @@ bool CAI_BaseNPC::CheckPVSCondition()
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Best guess, before the think loop starts, at whether NPCThink will
+//			get to RunAI this tick. Used to pick the NPCs ai_parallel_think
+//			gathers for.
+//-----------------------------------------------------------------------------
+bool CAI_BaseNPC::IsDueToRunAI()
+{
+	if ( GetEfficiency() >= AIE_DORMANT || GetSleepState() != AISS_AWAKE || IsFlaggedEfficient() )
+		return false;
+
+	int nextThinkTick = GetNextThinkTick();
+	if ( nextThinkTick == TICK_NEVER_THINK || nextThinkTick > gpGlobals->tickcount )
+		return false;
+
+	return ( m_flNextDecisionTime <= gpGlobals->curtime );
+}
+
 //-----------------------------------------------------------------------------
 // NPC Think - calls out to core AI functions and handles this
 // npc's specific animation events
@@ -607,6 +607,7 @@ public:
 
 	virtual bool		ShouldAlwaysThink();
 	void				ForceGatherConditions()	{ m_bForceConditionsGather = true; SetEfficiency( AIE_NORMAL ); }	// Force an NPC out of PVS to call GatherConditions on next think
+	bool				IsDueToRunAI();
 
 	virtual float		LineOfSightDist( const Vector &vecDir = vec3_invalid, float zEye = FLT_MAX );
 
@@ -984,6 +985,10 @@ public:
 
 	// If true, AI will try to see this entity regardless of distance.
 	virtual bool		ShouldNotDistanceCull() { return false; }
+
+	// False if FInViewCone is overridden to see outside m_flFieldOfView. The sight
+	// grid then won't skip candidates that lie outside this NPC's view cone.
+	virtual bool		HasStandardViewCone() { return true; }
 	
 	virtual int			GetSoundInterests( void );
 	virtual int			GetSoundPriority( CSound *pSound );
@@ -527,6 +527,81 @@ void CC_NPC_Create_Aimed( const CCommand &args )
 }
 static ConCommand npc_create_aimed("npc_create_aimed", CC_NPC_Create_Aimed, "Creates an NPC aimed away from the player of the given type where the player is looking (if the given NPC can actually stand at that location).  Note that this only works for npc classes that are already in the world.  You can not create an entity that doesn't have an instance in the level.\n\tArguments:	{npc_class_name}", FCVAR_CHEAT);
 
+//------------------------------------------------------------------------------
+// Purpose: Create a square grid of NPCs of the given type in front of the
+//			player, e.g. to load up a map for ai_think_bench
+//------------------------------------------------------------------------------
+void CC_NPC_Create_Grid( const CCommand &args )
+{
+	CBasePlayer *pPlayer = UTIL_GetCommandClient();
+	if ( !pPlayer || args.ArgC() < 3 )
+	{
+		Msg( "Usage: npc_create_grid {npc_class_name} {count} [spacing] [forward distance]\n" );
+		return;
+	}
+
+	MDLCACHE_CRITICAL_SECTION();
+
+	bool allowPrecache = CBaseEntity::IsPrecacheAllowed();
+	CBaseEntity::SetAllowPrecache( true );
+
+	int nCount = atoi( args[2] );
+	float flSpacing = ( args.ArgC() > 3 ) ? atof( args[3] ) : 96.0f;
+	float flForward = ( args.ArgC() > 4 ) ? atof( args[4] ) : 512.0f;
+	int nSide = (int)ceil( sqrt( (float)nCount ) );
+
+	Vector forward, right;
+	pPlayer->EyeVectors( &forward, &right );
+	forward.z = right.z = 0;
+	VectorNormalize( forward );
+	VectorNormalize( right );
+	Vector vecCenter = pPlayer->GetAbsOrigin() + forward * flForward;
+
+	int nCreated = 0;
+	for ( int i = 0; i < nCount; i++ )
+	{
+		CAI_BaseNPC *baseNPC = dynamic_cast< CAI_BaseNPC * >( CreateEntityByName( args[1] ) );
+		if ( !baseNPC )
+		{
+			Msg( "Can't create %s\n", args[1] );
+			break;
+		}
+
+		baseNPC->Precache();
+		DispatchSpawn( baseNPC );
+
+		float flRow = ( i / nSide ) - ( nSide - 1 ) * 0.5f;
+		float flColumn = ( i % nSide ) - ( nSide - 1 ) * 0.5f;
+		Vector vecPos = vecCenter + forward * ( flRow * flSpacing ) + right * ( flColumn * flSpacing );
+		vecPos.z += 12;
+
+		QAngle angles( 0, RandomFloat( 0, 360 ), 0 );
+		baseNPC->Teleport( &vecPos, &angles, NULL );
+		if ( !( baseNPC->CapabilitiesGet() & bits_CAP_MOVE_FLY ) )
+		{
+			UTIL_DropToFloor( baseNPC, MASK_NPCSOLID );
+		}
+
+		trace_t tr;
+		Vector vUpBit = baseNPC->GetAbsOrigin();
+		vUpBit.z += 1;
+		AI_TraceHull( baseNPC->GetAbsOrigin(), vUpBit, baseNPC->GetHullMins(), baseNPC->GetHullMaxs(), 
+			MASK_NPCSOLID, baseNPC, COLLISION_GROUP_NONE, &tr );
+		if ( tr.startsolid || (tr.fraction < 1.0) )
+		{
+			baseNPC->SUB_Remove();
+			continue;
+		}
+
+		baseNPC->Activate();
+		nCreated++;
+	}
+
+	Msg( "npc_create_grid: created %d of %d %s\n", nCreated, nCount, args[1] );
+	CBaseEntity::SetAllowPrecache( allowPrecache );
+}
+static ConCommand npc_create_grid("npc_create_grid", CC_NPC_Create_Grid, "Creates a square grid of NPCs of the given type centered in front of the player. Positions the NPC can't stand at are skipped.\n\tArguments:	{npc_class_name} {count} [spacing] [forward distance]", FCVAR_CHEAT);
+
 //------------------------------------------------------------------------------
 // Purpose: Destroy unselected NPCs
 //------------------------------------------------------------------------------
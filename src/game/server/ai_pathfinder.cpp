@@ -21,6 +21,7 @@
 #include "ai_dynamiclink.h"
 #include "ai_hint.h"
 #include "bitstring.h"
+#include "vstdlib/random.h"
 
 //@todo: bad dependency!
 #include "ai_navigator.h"
@@ -272,6 +273,155 @@ int CAI_Pathfinder::NearestNodeToPoint( const Vector &vecOrigin )
 	return GetNetwork()->NearestNodeToPoint( GetOuter(), vecOrigin );
 }
 
+//-----------------------------------------------------------------------------
+// Per-node A* state shared by every pathfinder, along with the open list as a
+// binary heap indexed by node. A node's entries are only meaningful when its
+// generation matches the current query's, so nothing is cleared per query.
+//-----------------------------------------------------------------------------
+class CAI_PathfindScratch
+{
+public:
+	CAI_PathfindScratch()
+	 :	m_iGeneration( 0 )
+	{
+	}
+
+	void Begin( int nNodes )
+	{
+		if ( m_Generation.Count() < nNodes )
+		{
+			int nOld = m_Generation.Count();
+			m_Generation.AddMultipleToTail( nNodes - nOld );
+			m_Parent.AddMultipleToTail( nNodes - nOld );
+			m_HeapIndex.AddMultipleToTail( nNodes - nOld );
+			m_G.AddMultipleToTail( nNodes - nOld );
+			m_F.AddMultipleToTail( nNodes - nOld );
+			for ( int i = nOld; i < nNodes; i++ )
+			{
+				m_Generation[i] = 0;
+			}
+		}
+
+		if ( ++m_iGeneration == 0 )
+		{
+			// wrapped, so old stamps could look current
+			for ( int i = 0; i < m_Generation.Count(); i++ )
+			{
+				m_Generation[i] = 0;
+			}
+			m_iGeneration = 1;
+		}
+
+		m_Open.RemoveAll();
+	}
+
+	// has the node been reached by this query?
+	bool IsVisited( int iNode ) const	{ return m_Generation[iNode] == m_iGeneration; }
+
+	void Visit( int iNode )
+	{
+		if ( !IsVisited( iNode ) )
+		{
+			m_Generation[iNode] = m_iGeneration;
+			m_HeapIndex[iNode] = -1;
+		}
+	}
+
+	int *Parents()					{ return m_Parent.Base(); }
+	int &Parent( int iNode )		{ return m_Parent[iNode]; }
+	float &G( int iNode )			{ return m_G[iNode]; }
+	float &F( int iNode )			{ return m_F[iNode]; }
+
+	bool IsOpenEmpty() const		{ return m_Open.Count() == 0; }
+
+	// add a visited node to the open list, or reposition it after its F changed
+	void Open( int iNode )
+	{
+		Assert( IsVisited( iNode ) );
+		int i = m_HeapIndex[iNode];
+		if ( i == -1 )
+		{
+			i = m_Open.AddToTail( iNode );
+			m_HeapIndex[iNode] = i;
+		}
+		HeapDown( i );
+		HeapUp( m_HeapIndex[iNode] );
+	}
+
+	// remove and return the open node with the smallest F
+	int PopSmallest()
+	{
+		int iNode = m_Open[0];
+		int iLast = m_Open[m_Open.Count() - 1];
+		m_Open.Remove( m_Open.Count() - 1 );
+		if ( iLast != iNode )
+		{
+			HeapSet( 0, iLast );
+			HeapDown( 0 );
+		}
+		m_HeapIndex[iNode] = -1;
+		return iNode;
+	}
+
+private:
+	// lowest F first, then lowest node ID, the order CAI_Network::FindBSSmallest picked
+	bool Before( int iNodeA, int iNodeB ) const
+	{
+		if ( m_F[iNodeA] != m_F[iNodeB] )
+			return m_F[iNodeA] < m_F[iNodeB];
+		return iNodeA < iNodeB;
+	}
+
+	void HeapSet( int i, int iNode )
+	{
+		m_Open[i] = iNode;
+		m_HeapIndex[iNode] = i;
+	}
+
+	void HeapUp( int i )
+	{
+		int iNode = m_Open[i];
+		while ( i > 0 )
+		{
+			int parent = ( i - 1 ) / 2;
+			if ( !Before( iNode, m_Open[parent] ) )
+				break;
+			HeapSet( i, m_Open[parent] );
+			i = parent;
+		}
+		HeapSet( i, iNode );
+	}
+
+	void HeapDown( int i )
+	{
+		int iNode = m_Open[i];
+		int count = m_Open.Count();
+		for ( ;; )
+		{
+			int child = 2 * i + 1;
+			if ( child >= count )
+				break;
+			if ( child + 1 < count && Before( m_Open[child + 1], m_Open[child] ) )
+				child++;
+			if ( !Before( m_Open[child], iNode ) )
+				break;
+			HeapSet( i, m_Open[child] );
+			i = child;
+		}
+		HeapSet( i, iNode );
+	}
+
+	unsigned			m_iGeneration;
+	CUtlVector<unsigned> m_Generation;
+	CUtlVector<int>		m_Parent;
+	CUtlVector<int>		m_HeapIndex;
+	CUtlVector<float>	m_G;
+	CUtlVector<float>	m_F;
+	CUtlVector<int>		m_Open;
+};
+
+static CAI_PathfindScratch g_PathfindScratch;
+
 //-----------------------------------------------------------------------------
 // Purpose: Build a path between two nodes
 //-----------------------------------------------------------------------------
@@ -290,35 +440,21 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	int nNodes = GetNetwork()->NumNodes();
 	CAI_Node **pAInode = GetNetwork()->AccessNodes();
 
-	CVarBitVec	openBS(nNodes);
-	CVarBitVec	closeBS(nNodes);
-
 	// ------------- INITIALIZE ------------------------
-	float* nodeG = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeH = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeF = (float *)stackalloc( nNodes * sizeof(float) );
-	int*   nodeP = (int *)stackalloc( nNodes * sizeof(int) );		// Node parent 
-
-	for (int node=0;node<nNodes;node++)
-	{
-		nodeG[node] = FLT_MAX;
-		nodeP[node] = -1;
-	}
-
-	nodeG[startID] = 0;
+	CAI_PathfindScratch &scratch = g_PathfindScratch;
+	scratch.Begin( nNodes );
 
-	nodeH[startID] = 0.1*(pAInode[startID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length(); // Don't want to over estimate
-	nodeF[startID] = nodeG[startID] + nodeH[startID];
+	scratch.Visit( startID );
+	scratch.Parent( startID ) = NO_NODE;
+	scratch.G( startID ) = 0;
+	scratch.F( startID ) = 0.1*(pAInode[startID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length(); // Don't want to over estimate
 
-	openBS.Set(startID);
-	closeBS.Set( startID );
+	scratch.Open( startID );
 
 	// --------------- FIND BEST PATH ------------------
-	while (!openBS.IsAllClear()) 
+	while (!scratch.IsOpenEmpty()) 
 	{
-		int smallestID = CAI_Network::FindBSSmallest(&openBS,nodeF,nNodes);
-	
-		openBS.Clear(smallestID);
+		int smallestID = scratch.PopSmallest();
 
 		CAI_Node *pSmallestNode = pAInode[smallestID];
 		
@@ -327,7 +463,7 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 
 		if (smallestID == endID) 
 		{
-			AI_Waypoint_t* route = MakeRouteFromParents(&nodeP[0], endID);
+			AI_Waypoint_t* route = MakeRouteFromParents(scratch.Parents(), endID);
 			return route;
 		}
 
@@ -351,17 +487,16 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 			if ( dist == FLT_MAX )
 				continue;
 
-			float new_g  = nodeG[smallestID] + dist;
+			float new_g  = scratch.G( smallestID ) + dist;
 
-			if ( !closeBS.IsBitSet(testID) || (new_g < nodeG[testID]) ) 
+			if ( !scratch.IsVisited(testID) || (new_g < scratch.G( testID )) ) 
 			{
-				nodeP[testID] = smallestID;
-				nodeG[testID] = new_g;
-				nodeH[testID] = (pAInode[testID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length();
-				nodeF[testID] = nodeG[testID] + nodeH[testID];
+				scratch.Visit( testID );
+				scratch.Parent( testID ) = smallestID;
+				scratch.G( testID ) = new_g;
+				scratch.F( testID ) = new_g + (pAInode[testID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length();
 
-				closeBS.Set( testID );
-				openBS.Set( testID );
+				scratch.Open( testID );
 			}
 		}
 	}
@@ -369,6 +504,72 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	return NULL;   
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Times FindBestPath between random node pairs on the loaded graph
+//-----------------------------------------------------------------------------
+CON_COMMAND( ai_pathfind_bench, "Time pathfinding between random nodes. Arguments: [queries] [npc name]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nQueries = ( args.ArgC() > 1 ) ? atoi( args[1] ) : 1000;
+	if ( nQueries <= 0 )
+		nQueries = 1000;
+
+	// pathfinding is done on behalf of an NPC, for its hull and capabilities
+	CAI_BaseNPC *pNPC = NULL;
+	if ( args.ArgC() > 2 )
+	{
+		pNPC = dynamic_cast<CAI_BaseNPC *>( gEntList.FindEntityByName( NULL, args[2] ) );
+	}
+	else if ( g_AI_Manager.NumAIs() )
+	{
+		pNPC = g_AI_Manager.AccessAIs()[0];
+	}
+
+	if ( !pNPC || !pNPC->GetPathfinder() || !pNPC->GetNavigator() )
+	{
+		Msg( "ai_pathfind_bench: no NPC to pathfind for\n" );
+		return;
+	}
+
+	int nNodes = g_pBigAINet ? g_pBigAINet->NumNodes() : 0;
+	if ( nNodes < 2 )
+	{
+		Msg( "ai_pathfind_bench: the node graph has fewer than two nodes\n" );
+		return;
+	}
+
+	// same pairs every run so timings are comparable
+	CUniformRandomStream random;
+	random.SetSeed( 0x5eed );
+
+	int nFound = 0;
+	int nWaypoints = 0;
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nQueries; i++ )
+	{
+		int startID = random.RandomInt( 0, nNodes - 1 );
+		int endID = random.RandomInt( 0, nNodes - 1 );
+
+		AI_Waypoint_t *pRoute = pNPC->GetPathfinder()->FindBestPath( startID, endID );
+		if ( pRoute )
+		{
+			nFound++;
+			for ( AI_Waypoint_t *pWaypoint = pRoute; pWaypoint; pWaypoint = pWaypoint->GetNext() )
+			{
+				nWaypoints++;
+			}
+			DeleteAll( pRoute );
+		}
+	}
+	double flElapsed = Plat_FloatTime() - flStart;
+
+	Msg( "ai_pathfind_bench: %d queries on %d nodes as %s in %.2f ms (%.0f queries/sec), %d found, %.1f nodes per path\n",
+		nQueries, nNodes, pNPC->GetDebugName(), flElapsed * 1000.0, ( flElapsed > 0 ) ? nQueries / flElapsed : 0.0,
+		nFound, nFound ? (float)nWaypoints / nFound : 0.0f );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Find a short random path of at least pathLength distance.  If
 //			vDirection is given random path will expand in the given direction,
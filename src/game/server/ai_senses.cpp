@@ -13,6 +13,10 @@
 #include "team.h"
 #include "ai_basenpc.h"
 #include "saverestore_utlvector.h"
+#include "ndebugoverlay.h"
+#include "fmtstr.h"
+#include "collisionutils.h"
+#include "vstdlib/jobthread.h"
 
 #ifdef PORTAL
 	#include "portal_util_shared.h"
@@ -53,6 +57,349 @@ struct AISightIterVal_t
 
 #pragma pack(pop)
 
+//=============================================================================
+//
+// CAI_SightGrid
+//
+// Uniform 2D grid of the players, NPCs and objects NPCs look for, rebuilt
+// once per tick. A look only walks the cells that overlap its distance and
+// view cone, then runs the usual exact tests on what comes back. Entities are
+// binned where they were when the grid was built, so queries are padded by
+// ai_sight_grid_slack to cover movement during the rest of the tick.
+//
+//=============================================================================
+
+ConVar ai_sight_grid( "ai_sight_grid", "1", 0, "Use a per-tick spatial grid to gather sight candidates" );
+ConVar ai_sight_grid_cell( "ai_sight_grid_cell", "512" );
+ConVar ai_sight_grid_slack( "ai_sight_grid_slack", "128" );
+ConVar ai_show_sight_stats( "ai_show_sight_stats", "0", 0, "Show sight candidates tested vs seen above each NPC" );
+
+enum SightList_t
+{
+	SIGHT_PLAYERS,
+	SIGHT_NPCS,
+	SIGHT_OBJECTS,
+
+	NUM_SIGHT_LISTS
+};
+
+class CAI_SightGrid
+{
+public:
+	CAI_SightGrid()
+	 :	m_iTick( -1 )
+	{
+	}
+
+	void	Update();
+	void	Reset();
+
+	// Returns false if walking the grid wouldn't beat walking the whole list
+	bool	Query( SightList_t list, CAI_BaseNPC *pLooker, float flDist, CUtlVector<CBaseEntity *> *pResult );
+
+private:
+	struct Entry_t
+	{
+		int		key;
+		int		order;
+		EHANDLE	hEntity;
+	};
+
+	void	AddEntry( SightList_t list, CBaseEntity *pEntity, int order );
+	int		LowerBound( int key ) const;
+	int		CellCoord( float flCoord ) const;
+	bool	CellInViewCone( int cx, int cy, const Vector2D &vecEye, const Vector2D &vecFacing, float flConeAngle, float flPad ) const;
+
+	static int MakeKey( int list, int cx, int cy )					{ return ( list << 28 ) | ( cx << 14 ) | cy; }
+	static int EntryLess( const Entry_t *pLeft, const Entry_t *pRight );
+	static int OrderLess( const Entry_t *pLeft, const Entry_t *pRight );
+
+	enum
+	{
+		CELL_BITS = 14,
+		CELL_MAX = ( 1 << CELL_BITS ) - 1,
+	};
+
+	int					m_iTick;
+	float				m_flCellSize;
+	float				m_flMaxCenterOffset;	// furthest WorldSpaceCenter() is from GetAbsOrigin(), in 2D
+	CUtlVector<Entry_t>	m_Entries;				// sorted by cell
+	CUtlVector<Entry_t>	m_NoCullNPCs;			// NPCs that want to be seen at any distance
+	int					m_nCount[NUM_SIGHT_LISTS];
+};
+
+static CAI_SightGrid g_AI_SightGrid;
+
+//-----------------------------------------------------------------------------
+
+void CAI_SightGrid::Update()
+{
+	if ( m_iTick == gpGlobals->tickcount )
+		return;
+
+	AI_PROFILE_SENSES(CAI_SightGrid_Update);
+
+	m_iTick = gpGlobals->tickcount;
+	m_flCellSize = MAX( ai_sight_grid_cell.GetFloat(), 64.0f );
+	m_flMaxCenterOffset = 0;
+	m_Entries.RemoveAll();
+	m_NoCullNPCs.RemoveAll();
+	memset( m_nCount, 0, sizeof( m_nCount ) );
+
+	int i;
+	for ( i = 1; i <= gpGlobals->maxClients; i++ )
+	{
+		CBaseEntity *pPlayer = UTIL_PlayerByIndex( i );
+		if ( pPlayer )
+		{
+			AddEntry( SIGHT_PLAYERS, pPlayer, i );
+		}
+	}
+
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		if ( ppAIs[i]->ShouldNotDistanceCull() )
+		{
+			Entry_t &entry = m_NoCullNPCs[ m_NoCullNPCs.AddToTail() ];
+			entry.key = 0;
+			entry.order = i;
+			entry.hEntity = ppAIs[i];
+		}
+		else
+		{
+			AddEntry( SIGHT_NPCS, ppAIs[i], i );
+		}
+	}
+
+	int iter;
+	i = 0;
+	CBaseEntity *pEnt = g_AI_SensedObjectsManager.GetFirst( &iter );
+	while ( pEnt )
+	{
+		AddEntry( SIGHT_OBJECTS, pEnt, i++ );
+		pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
+	}
+
+	m_Entries.Sort( EntryLess );
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SightGrid::Reset()
+{
+	m_iTick = -1;
+	m_Entries.Purge();
+	m_NoCullNPCs.Purge();
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_SightGrid::AddEntry( SightList_t list, CBaseEntity *pEntity, int order )
+{
+	const Vector &origin = pEntity->GetAbsOrigin();
+	Vector vecCenterOffset = pEntity->WorldSpaceCenter() - origin;
+	m_flMaxCenterOffset = MAX( m_flMaxCenterOffset, vecCenterOffset.Length2D() );
+
+	Entry_t &entry = m_Entries[ m_Entries.AddToTail() ];
+	entry.key = MakeKey( list, CellCoord( origin.x ), CellCoord( origin.y ) );
+	entry.order = order;
+	entry.hEntity = pEntity;
+
+	m_nCount[list]++;
+}
+
+//-----------------------------------------------------------------------------
+
+int CAI_SightGrid::LowerBound( int key ) const
+{
+	int lo = 0;
+	int hi = m_Entries.Count();
+	while ( lo < hi )
+	{
+		int mid = ( lo + hi ) / 2;
+		if ( m_Entries[mid].key < key )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+//-----------------------------------------------------------------------------
+
+int CAI_SightGrid::CellCoord( float flCoord ) const
+{
+	return clamp( (int)floor( ( flCoord + 2 * MAX_COORD_RANGE ) / m_flCellSize ), 0, (int)CELL_MAX );
+}
+
+//-----------------------------------------------------------------------------
+// Conservative version of CBaseCombatCharacter::FInViewCone for a whole cell:
+// the cell is treated as a disc of radius flPad around its center.
+//-----------------------------------------------------------------------------
+
+bool CAI_SightGrid::CellInViewCone( int cx, int cy, const Vector2D &vecEye, const Vector2D &vecFacing, float flConeAngle, float flPad ) const
+{
+	// Edge cells also hold anything clamped in from outside the world
+	if ( cx == 0 || cy == 0 || cx == CELL_MAX || cy == CELL_MAX )
+		return true;
+
+	Vector2D vecCenter( ( cx + 0.5f ) * m_flCellSize - 2 * MAX_COORD_RANGE, ( cy + 0.5f ) * m_flCellSize - 2 * MAX_COORD_RANGE );
+	Vector2D vecToCell = vecCenter - vecEye;
+	float flDist = vecToCell.Length();
+	if ( flDist <= flPad )
+		return true;
+
+	float flAngle = flConeAngle + asin( flPad / flDist );
+	if ( flAngle >= M_PI )
+		return true;
+
+	return ( DotProduct2D( vecToCell, vecFacing ) > flDist * cos( flAngle ) );
+}
+
+//-----------------------------------------------------------------------------
+
+int CAI_SightGrid::EntryLess( const Entry_t *pLeft, const Entry_t *pRight )
+{
+	if ( pLeft->key != pRight->key )
+		return ( pLeft->key < pRight->key ) ? -1 : 1;
+	return pLeft->order - pRight->order;
+}
+
+int CAI_SightGrid::OrderLess( const Entry_t *pLeft, const Entry_t *pRight )
+{
+	return pLeft->order - pRight->order;
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_SightGrid::Query( SightList_t list, CAI_BaseNPC *pLooker, float flDist, CUtlVector<CBaseEntity *> *pResult )
+{
+	if ( !ai_sight_grid.GetBool() )
+		return false;
+
+	Update();
+
+	float flSlack = ai_sight_grid_slack.GetFloat();
+	float flRadius = flDist + flSlack;
+	const Vector &origin = pLooker->GetAbsOrigin();
+	int cx0 = CellCoord( origin.x - flRadius );
+	int cx1 = CellCoord( origin.x + flRadius );
+	int cy0 = CellCoord( origin.y - flRadius );
+	int cy1 = CellCoord( origin.y + flRadius );
+
+	// Each column of cells costs a binary search
+	if ( cx1 - cx0 + 1 > m_nCount[list] )
+		return false;
+
+	// Players that could wake a wait-till-seen NPC have to be tested whatever its view cone
+	bool bCullViewCone = pLooker->HasStandardViewCone() && !pLooker->HasSpawnFlags( SF_NPC_WAIT_TILL_SEEN );
+	Vector vecEye = pLooker->EyePosition();
+	Vector vecFacing = pLooker->EyeDirection2D();
+	Vector2D vecEye2D( vecEye.x, vecEye.y );
+	Vector2D vecFacing2D( vecFacing.x, vecFacing.y );
+	float flConeAngle = acos( clamp( pLooker->GetFieldOfView(), -1.0f, 1.0f ) );
+	float flPad = m_flCellSize * 0.7072f + flSlack + m_flMaxCenterOffset;
+
+	CUtlVectorFixedGrowable<Entry_t, 64> matches;
+
+	for ( int cx = cx0; cx <= cx1; cx++ )
+	{
+		int keyEnd = MakeKey( list, cx, cy1 );
+		int keyCell = -1;
+		bool bCellInViewCone = false;
+
+		for ( int i = LowerBound( MakeKey( list, cx, cy0 ) ); i < m_Entries.Count() && m_Entries[i].key <= keyEnd; i++ )
+		{
+			if ( m_Entries[i].key != keyCell )
+			{
+				keyCell = m_Entries[i].key;
+				bCellInViewCone = !bCullViewCone || CellInViewCone( cx, keyCell & CELL_MAX, vecEye2D, vecFacing2D, flConeAngle, flPad );
+			}
+
+			if ( bCellInViewCone )
+			{
+				matches.AddToTail( m_Entries[i] );
+			}
+		}
+	}
+
+	if ( list == SIGHT_NPCS )
+	{
+		matches.AddMultipleToTail( m_NoCullNPCs.Count(), m_NoCullNPCs.Base() );
+	}
+
+	// Hand candidates back in the same order a walk of the whole list would
+	matches.Sort( OrderLess );
+
+	for ( int i = 0; i < matches.Count(); i++ )
+	{
+		CBaseEntity *pEntity = matches[i].hEntity;
+		if ( pEntity )
+		{
+			pResult->AddToTail( pEntity );
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Appends everything in the given list that pLooker might see within
+// iDistance, in list order. Callers still do the exact distance tests.
+//-----------------------------------------------------------------------------
+
+static void AI_GetSightCandidates( SightList_t list, CAI_BaseNPC *pLooker, int iDistance, CUtlVector<CBaseEntity *> *pResult )
+{
+	bool bUseGrid = true;
+#ifdef PORTAL
+	// Players beyond iDistance can still be seen through a portal
+	bUseGrid = ( list != SIGHT_PLAYERS );
+#endif
+
+	if ( bUseGrid && g_AI_SightGrid.Query( list, pLooker, iDistance, pResult ) )
+		return;
+
+	switch ( list )
+	{
+	case SIGHT_PLAYERS:
+		{
+			for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+			{
+				CBaseEntity *pPlayer = UTIL_PlayerByIndex( i );
+				if ( pPlayer )
+				{
+					pResult->AddToTail( pPlayer );
+				}
+			}
+			break;
+		}
+
+	case SIGHT_NPCS:
+		{
+			CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+			pResult->EnsureCapacity( pResult->Count() + g_AI_Manager.NumAIs() );
+			for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+			{
+				pResult->AddToTail( ppAIs[i] );
+			}
+			break;
+		}
+
+	case SIGHT_OBJECTS:
+		{
+			int iter;
+			CBaseEntity *pEnt = g_AI_SensedObjectsManager.GetFirst( &iter );
+			while ( pEnt )
+			{
+				pResult->AddToTail( pEnt );
+				pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
+			}
+			break;
+		}
+	}
+}
+
 
 //=============================================================================
 //
@@ -340,6 +687,8 @@ void CAI_Senses::Look( int iDistance )
 {
 	if ( m_TimeLastLook != gpGlobals->curtime || m_LastLookDist != iDistance )
 	{
+		m_nSightTested = m_nSightSeen = 0;
+
 		//-----------------------------
 		
 		LookForHighPriorityEntities( iDistance );
@@ -350,6 +699,14 @@ void CAI_Senses::Look( int iDistance )
 		
 		m_LastLookDist = iDistance;
 		m_TimeLastLook = gpGlobals->curtime;
+
+		VPROF_INCREMENT_COUNTER( "AI sight candidates tested", m_nSightTested );
+		VPROF_INCREMENT_COUNTER( "AI sight candidates seen", m_nSightSeen );
+
+		if ( ai_show_sight_stats.GetBool() && m_nSightTested )
+		{
+			NDebugOverlay::EntityText( GetOuter()->entindex(), 0, CFmtStr( "sight: %d tested, %d seen", m_nSightTested, m_nSightSeen ), AI_MISC_SEARCH_TIME );
+		}
 	}
 	
 	GetOuter()->OnLooked( iDistance );
@@ -359,11 +716,14 @@ void CAI_Senses::Look( int iDistance )
 
 bool CAI_Senses::Look( CBaseEntity *pSightEnt )
 {
+	m_nSightTested++;
+
 	if ( WaitingUntilSeen( pSightEnt ) )
 		return false;
 	
 	if ( ShouldSeeEntity( pSightEnt ) && CanSeeEntity( pSightEnt ) )
 	{
+		m_nSightSeen++;
 		return SeeEntity( pSightEnt );
 	}
 	return false;
@@ -399,9 +759,12 @@ int CAI_Senses::LookForHighPriorityEntities( int iDistance )
 		const Vector &origin = GetAbsOrigin();
 		
 		// Players
-		for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+		CUtlVector<CBaseEntity *> candidates;
+		AI_GetSightCandidates( SIGHT_PLAYERS, GetOuter(), iDistance, &candidates );
+
+		for ( int i = 0; i < candidates.Count(); i++ )
 		{
-			CBaseEntity *pPlayer = UTIL_PlayerByIndex( i );
+			CBaseEntity *pPlayer = candidates[i];
 
 			if ( pPlayer )
 			{
@@ -458,13 +821,15 @@ int CAI_Senses::LookForNPCs( int iDistance )
 
 			BeginGather();
 
-			CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+			CUtlVector<CBaseEntity *> candidates;
+			AI_GetSightCandidates( SIGHT_NPCS, GetOuter(), iDistance, &candidates );
 			
-			for ( i = 0; i < g_AI_Manager.NumAIs(); i++ )
+			for ( i = 0; i < candidates.Count(); i++ )
 			{
-				if ( ppAIs[i] != GetOuter() && ( ppAIs[i]->ShouldNotDistanceCull() || origin.DistToSqr(ppAIs[i]->GetAbsOrigin()) < distSq ) )
+				CAI_BaseNPC *pNPC = candidates[i]->MyNPCPointer();
+				if ( pNPC && pNPC != GetOuter() && ( pNPC->ShouldNotDistanceCull() || origin.DistToSqr(pNPC->GetAbsOrigin()) < distSq ) )
 				{
-					if ( Look( ppAIs[i] ) )
+					if ( Look( pNPC ) )
 					{
 						nSeen++;
 					}
@@ -516,10 +881,13 @@ int CAI_Senses::LookForObjects( int iDistance )
 
 		float distSq = ( iDistance * iDistance );
 		const Vector &origin = GetAbsOrigin();
-		int iter;
-		CBaseEntity *pEnt = g_AI_SensedObjectsManager.GetFirst( &iter );
-		while ( pEnt )
+
+		CUtlVector<CBaseEntity *> candidates;
+		AI_GetSightCandidates( SIGHT_OBJECTS, GetOuter(), iDistance, &candidates );
+
+		for ( int i = 0; i < candidates.Count(); i++ )
 		{
+			CBaseEntity *pEnt = candidates[i];
 			if ( pEnt->GetFlags() & BOX_QUERY_MASK )
 			{
 				if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
@@ -527,7 +895,6 @@ int CAI_Senses::LookForObjects( int iDistance )
 					nSeen++;
 				}
 			}
-			pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
 		}
 		
 		EndGather( nSeen, &m_SeenMisc );
@@ -558,6 +925,70 @@ float CAI_Senses::GetTimeLastUpdate( CBaseEntity *pEntity )
 	return m_TimeLastLookMisc;
 }
 
+//-----------------------------------------------------------------------------
+// Appends the entities the next Look( m_LookDist ) is expected to trace to.
+// Only does the cheap parts of ShouldSeeEntity and CanSeeEntity, so it may
+// guess wrong; a wrong guess just costs ai_parallel_think a trace.
+//-----------------------------------------------------------------------------
+
+void CAI_Senses::GetLookCandidates( CUtlVector<CBaseEntity *> *pResult )
+{
+	CAI_BaseNPC *pOuter = GetOuter();
+	int iDistance = m_LookDist;
+
+	if ( HasSensingFlags( SENSING_FLAGS_DONT_LOOK ) || pOuter->HasSpawnFlags( SF_NPC_WAIT_TILL_SEEN ) )
+		return;
+
+	if ( m_TimeLastLook == gpGlobals->curtime && m_LastLookDist == iDistance )
+		return;
+
+	float distSq = ( iDistance * iDistance );
+	const Vector &origin = GetAbsOrigin();
+	AI_Efficiency_t efficiency = pOuter->GetEfficiency();
+	float timeNPCs = ( efficiency < AIE_VERY_EFFICIENT ) ? AI_STANDARD_NPC_SEARCH_TIME : AI_EFFICIENT_NPC_SEARCH_TIME;
+
+	CUtlVector<CBaseEntity *> candidates;
+	if ( gpGlobals->curtime - m_TimeLastLookHighPriority > AI_HIGH_PRIORITY_SEARCH_TIME )
+	{
+		AI_GetSightCandidates( SIGHT_PLAYERS, pOuter, iDistance, &candidates );
+	}
+	if ( gpGlobals->curtime - m_TimeLastLookNPCs > timeNPCs && efficiency < AIE_SUPER_EFFICIENT )
+	{
+		AI_GetSightCandidates( SIGHT_NPCS, pOuter, iDistance, &candidates );
+	}
+	if ( gpGlobals->curtime - m_TimeLastLookMisc > AI_MISC_SEARCH_TIME )
+	{
+		AI_GetSightCandidates( SIGHT_OBJECTS, pOuter, iDistance, &candidates );
+	}
+
+	for ( int i = 0; i < candidates.Count(); i++ )
+	{
+		CBaseEntity *pEnt = candidates[i];
+		if ( pEnt == pOuter || !pEnt->IsAlive() || ( pEnt->GetFlags() & FL_NOTARGET ) || ( pEnt->m_spawnflags & SF_NPC_WAIT_TILL_SEEN ) )
+			continue;
+
+		CAI_BaseNPC *pNPC = pEnt->MyNPCPointer();
+		if ( pNPC )
+		{
+			if ( !pNPC->ShouldNotDistanceCull() && origin.DistToSqr( pNPC->GetAbsOrigin() ) >= distSq )
+				continue;
+
+			Disposition_t disposition = pOuter->IRelationType( pNPC );
+			if ( disposition != D_HT && disposition != D_FR )
+				continue;
+		}
+		else if ( origin.DistToSqr( pEnt->GetAbsOrigin() ) >= distSq )
+		{
+			continue;
+		}
+
+		if ( pOuter->HasStandardViewCone() && !pOuter->FInViewCone( pEnt ) )
+			continue;
+
+		pResult->AddToTail( pEnt );
+	}
+}
+
 //-----------------------------------------------------------------------------
 
 CSound* CAI_Senses::GetFirstHeardSound( AISoundIter_t *pIter )
@@ -663,6 +1094,221 @@ void CAI_Senses::PerformSensing( void )
 		Listen();
 }
 
+//=============================================================================
+//
+// Parallel think gather
+//
+// RunAI is serial, and most of what an NPC's look costs is line of sight
+// traces. With ai_parallel_think, the pairs this tick's looks are expected to
+// trace are collected up front, together with both eye positions and the
+// target's bounds, while nothing else is running. Each pair is then traced
+// against world brushes only, across the thread pool. World only traces never
+// call into entities, trace filters, gamerules or Lua, and the world does not
+// change during a tick.
+//
+// A world hit settles the pair as blocked, unless the target's bounds reach
+// the segment before it (the full trace stops at the nearest thing it hits).
+// CBaseEntity::FVisible takes that answer only if neither eye nor the target's
+// bounds have changed since the snapshot. Everything else, including every
+// clear world trace, gets the usual full trace in the think loop.
+//
+// This is only the trace part of a gather/act split of RunAI. Moving whole
+// Look and Listen results onto the threads is not done: both go through
+// virtual NPC hooks (QuerySeeEntity, CanBeSeenBy, CanHearSound, OnListened),
+// relationship tables and Lua, none of which are safe off the main thread.
+// ai_parallel_think stays off by default until ai_think_bench shows a gain
+// for it on a real map.
+//
+//=============================================================================
+
+ConVar ai_parallel_think( "ai_parallel_think", "0", 0, "Trace this tick's NPC line of sight checks across threads before NPCs think" );
+ConVar ai_parallel_think_min( "ai_parallel_think_min", "32", 0, "Fewest line of sight traces worth handing to other threads" );
+
+extern ConVar r_visualizetraces;
+extern ConVar ai_LOS_mode;
+
+class CAI_LOSPrefetch
+{
+public:
+	CAI_LOSPrefetch() : m_iTick( -1 ) {}
+
+	void	Run();
+	bool	IsBlocked( CBaseEntity *pLooker, CBaseEntity *pTarget, const Vector &vecLookerEye, const Vector &vecTargetEye );
+
+private:
+	struct Pair_t
+	{
+		int				key;
+		CBaseEntity *	pLooker;
+		CBaseEntity *	pTarget;
+		Vector			vecLookerEye;
+		Vector			vecTargetEye;
+		Vector			vecTargetMins;
+		Vector			vecTargetMaxs;
+		int				traceMask;
+		bool			bBlocked;
+	};
+
+	static int	PairKey( CBaseEntity *pLooker, CBaseEntity *pTarget )	{ return ( pLooker->entindex() << 16 ) | pTarget->entindex(); }
+	static int	PairLess( const Pair_t *pLeft, const Pair_t *pRight )	{ return pLeft->key - pRight->key; }
+	static void	GetTargetBounds( CBaseEntity *pTarget, Vector *pMins, Vector *pMaxs );
+	static void	TracePair( Pair_t &pair );
+
+	int					m_iTick;
+	CUtlVector<Pair_t>	m_Pairs;	// sorted by key
+};
+
+static CAI_LOSPrefetch g_AI_LOSPrefetch;
+
+//-----------------------------------------------------------------------------
+
+void CAI_LOSPrefetch::Run()
+{
+	m_iTick = -1;
+	m_Pairs.RemoveAll();
+
+	if ( !ai_parallel_think.GetBool() || !g_pThreadPool || !g_pThreadPool->NumThreads() || r_visualizetraces.GetBool() )
+		return;
+
+	VPROF_BUDGET( "AI_RunParallelThinkGather", VPROF_BUDGETGROUP_NPCS );
+
+	// Same mask as CBaseEntity::FVisible( pEntity, MASK_BLOCKLOS ) for an NPC looker
+	int traceMask = MASK_BLOCKLOS;
+	if ( IsXbox() || !ai_LOS_mode.GetBool() )
+	{
+		traceMask = MASK_BLOCKLOS_AND_NPCS;
+	}
+
+	CUtlVector<CBaseEntity *> targets;
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		CAI_BaseNPC *pLooker = ppAIs[i];
+		if ( !pLooker->GetSenses() || pLooker->entindex() < 0 || !pLooker->IsDueToRunAI() )
+			continue;
+
+		targets.RemoveAll();
+		pLooker->GetSenses()->GetLookCandidates( &targets );
+		if ( !targets.Count() )
+			continue;
+
+		Vector vecLookerEye = pLooker->EyePosition();
+		for ( int j = 0; j < targets.Count(); j++ )
+		{
+			CBaseEntity *pTarget = targets[j];
+			if ( pTarget->entindex() < 0 )
+				continue;
+
+			Pair_t &pair = m_Pairs[ m_Pairs.AddToTail() ];
+			pair.key = PairKey( pLooker, pTarget );
+			pair.pLooker = pLooker;
+			pair.pTarget = pTarget;
+			pair.vecLookerEye = vecLookerEye;
+			pair.vecTargetEye = pTarget->EyePosition();
+			GetTargetBounds( pTarget, &pair.vecTargetMins, &pair.vecTargetMaxs );
+			pair.traceMask = traceMask;
+			pair.bBlocked = false;
+		}
+	}
+
+	VPROF_INCREMENT_COUNTER( "AI parallel think traces", m_Pairs.Count() );
+
+	if ( m_Pairs.Count() < ai_parallel_think_min.GetInt() )
+	{
+		m_Pairs.RemoveAll();
+		return;
+	}
+
+	m_Pairs.Sort( PairLess );
+	ParallelProcess( "AI_RunParallelThinkGather", m_Pairs.Base(), m_Pairs.Count(), &TracePair );
+
+	m_iTick = gpGlobals->tickcount;
+}
+
+//-----------------------------------------------------------------------------
+
+// Everything a full LOS trace could hit on the target: the target itself, and
+// for a player, the vehicle they are driving.
+//-----------------------------------------------------------------------------
+
+void CAI_LOSPrefetch::GetTargetBounds( CBaseEntity *pTarget, Vector *pMins, Vector *pMaxs )
+{
+	pTarget->CollisionProp()->WorldSpaceSurroundingBounds( pMins, pMaxs );
+
+	if ( pTarget->IsPlayer() )
+	{
+		CBaseEntity *pVehicle = assert_cast<CBasePlayer *>( pTarget )->GetVehicleEntity();
+		if ( pVehicle )
+		{
+			Vector vecVehicleMins, vecVehicleMaxs;
+			pVehicle->CollisionProp()->WorldSpaceSurroundingBounds( &vecVehicleMins, &vecVehicleMaxs );
+			VectorMin( *pMins, vecVehicleMins, *pMins );
+			VectorMax( *pMaxs, vecVehicleMaxs, *pMaxs );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Runs on a worker thread, so it only reads the pair and world brushes.
+//-----------------------------------------------------------------------------
+
+void CAI_LOSPrefetch::TracePair( Pair_t &pair )
+{
+	trace_t tr;
+	CTraceFilterWorldOnly traceFilter;
+	UTIL_TraceLine( pair.vecLookerEye, pair.vecTargetEye, pair.traceMask, &traceFilter, &tr );
+
+	if ( tr.fraction == 1.0 || tr.startsolid )
+		return;
+
+	pair.bBlocked = !IsBoxIntersectingRay( pair.vecTargetMins, pair.vecTargetMaxs, pair.vecLookerEye, tr.endpos - pair.vecLookerEye, 1.0f );
+}
+
+//-----------------------------------------------------------------------------
+
+bool CAI_LOSPrefetch::IsBlocked( CBaseEntity *pLooker, CBaseEntity *pTarget, const Vector &vecLookerEye, const Vector &vecTargetEye )
+{
+	if ( m_iTick != gpGlobals->tickcount || pLooker->entindex() < 0 || pTarget->entindex() < 0 )
+		return false;
+
+	int key = PairKey( pLooker, pTarget );
+	int lo = 0;
+	int hi = m_Pairs.Count();
+	while ( lo < hi )
+	{
+		int mid = ( lo + hi ) / 2;
+		if ( m_Pairs[mid].key < key )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if ( lo == m_Pairs.Count() || m_Pairs[lo].key != key )
+		return false;
+
+	const Pair_t &pair = m_Pairs[lo];
+	if ( !pair.bBlocked || pair.pLooker != pLooker || pair.pTarget != pTarget || pair.vecLookerEye != vecLookerEye || pair.vecTargetEye != vecTargetEye )
+		return false;
+
+	// Anything that changed the target's bounds since the snapshot may have
+	// moved it in front of the world hit
+	Vector vecTargetMins, vecTargetMaxs;
+	GetTargetBounds( pTarget, &vecTargetMins, &vecTargetMaxs );
+	return ( vecTargetMins == pair.vecTargetMins && vecTargetMaxs == pair.vecTargetMaxs );
+}
+
+//-----------------------------------------------------------------------------
+
+void AI_RunParallelThinkGather()
+{
+	g_AI_LOSPrefetch.Run();
+}
+
+bool AI_IsPrefetchedLOSBlocked( CBaseEntity *pLooker, CBaseEntity *pTarget, const Vector &vecLookerEye, const Vector &vecTargetEye )
+{
+	return g_AI_LOSPrefetch.IsBlocked( pLooker, pTarget, vecLookerEye, vecTargetEye );
+}
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 
@@ -683,6 +1329,8 @@ void CAI_SensedObjectsManager::Term()
 {
 	gEntList.RemoveListenerEntity( this );
 	m_SensedObjects.RemoveAll();
+
+	g_AI_SightGrid.Reset();
 }
 
 //-----------------------------------------------------------------------------
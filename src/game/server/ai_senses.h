@@ -56,7 +56,9 @@ public:
 		m_iAudibleList(0),
 		m_TimeLastLookHighPriority( -1 ),
 		m_TimeLastLookNPCs( -1 ),
-		m_TimeLastLookMisc( -1 )
+		m_TimeLastLookMisc( -1 ),
+		m_nSightTested( 0 ),
+		m_nSightSeen( 0 )
 	{
 		m_SeenArrays[0] = &m_SeenHighPriority;
 		m_SeenArrays[1] = &m_SeenNPCs;
@@ -93,6 +95,8 @@ public:
 	
 	float			GetTimeLastUpdate( CBaseEntity *pEntity );
 
+	void			GetLookCandidates( CUtlVector<CBaseEntity *> *pResult );
+
 	//---------------------------------
 
 	void			AddSensingFlags( int iFlags )		{ m_iSensingFlags |= iFlags; }
@@ -138,6 +142,10 @@ private:
 	float			m_TimeLastLookMisc;
 
 	int				m_iSensingFlags;
+
+	// Sight stats for the last Look(), shown by ai_show_sight_stats
+	int				m_nSightTested;
+	int				m_nSightSeen;
 };
 
 //-----------------------------------------------------------------------------
@@ -163,6 +171,17 @@ private:
 extern CAI_SensedObjectsManager g_AI_SensedObjectsManager;
 
 //-----------------------------------------------------------------------------
+// ai_parallel_think: traces the line of sight checks this tick's NPC looks
+// will make against the world across the thread pool before the think loop
+// runs. AI_IsPrefetchedLOSBlocked is true only for pairs the world is known
+// to block; the rest need a full trace. The rest of Look and Listen still
+// runs serially in RunAI.
+//-----------------------------------------------------------------------------
+
+void AI_RunParallelThinkGather();
+bool AI_IsPrefetchedLOSBlocked( CBaseEntity *pLooker, CBaseEntity *pTarget, const Vector &vecLookerEye, const Vector &vecTargetEye );
+
+//-----------------------------------------------------------------------------
 
 
 
@@ -27,6 +27,7 @@
 #include "datacache/idatacache.h"
 #include "smoke_trail.h"
 #include "props.h"
+#include "tier1/utlbuffer.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -1775,6 +1776,123 @@ inline bool CBaseAnimating::CanSkipAnimation( void )
 }
 
 
+//-----------------------------------------------------------------------------
+// Tick bone cache. Hitbox traces, attachment lookups, lag compensation and Lua
+// can all ask for the same entity's bones several times in one tick, often
+// after the entity was put back into a state it already had. Results are kept
+// for the rest of the tick, keyed on the entity and a CRC of everything
+// SetupBones reads, so a repeat request is a copy instead of a full
+// InitPose/AccumulatePose/BuildMatrices. The state itself is kept with each
+// entry and compared on a hit, so a CRC collision is just a miss.
+//-----------------------------------------------------------------------------
+ConVar sv_bone_cache_tick( "sv_bone_cache_tick", "1", 0, "Reuse bone setups with identical animation state within a tick." );
+
+class CTickBoneCache
+{
+public:
+	enum
+	{
+		MAX_CACHED_MATRICES = 64 * 1024,
+	};
+
+	CTickBoneCache() : m_nTick( -1 ), m_Entries( 0, 0, DefLessFunc( uint64 ) ) {}
+
+	bool Lookup( const CUtlBuffer &state, CRC32_t crc, unsigned long hEntity, int boneMask, int nBones, matrix3x4_t *pBoneToWorld )
+	{
+		AUTO_LOCK( m_Mutex );
+		CheckTick();
+
+		int i = m_Entries.Find( MakeKey( crc, hEntity ) );
+		if ( i == m_Entries.InvalidIndex() )
+			return false;
+
+		const Entry_t &entry = m_Entries[i];
+		if ( entry.m_nBones != nBones || ( entry.m_boneMask & boneMask ) != boneMask )
+			return false;
+
+		if ( entry.m_nStateBytes != state.TellPut() || memcmp( m_State.Base() + entry.m_iFirstStateByte, state.Base(), entry.m_nStateBytes ) )
+			return false;
+
+		memcpy( pBoneToWorld, m_Matrices.Base() + entry.m_iFirstMatrix, nBones * sizeof( matrix3x4_t ) );
+		return true;
+	}
+
+	void Store( const CUtlBuffer &state, CRC32_t crc, unsigned long hEntity, int boneMask, int nBones, const matrix3x4_t *pBoneToWorld )
+	{
+		AUTO_LOCK( m_Mutex );
+		CheckTick();
+
+		if ( m_Matrices.Count() + nBones > MAX_CACHED_MATRICES )
+			return;
+
+		Entry_t entry;
+		entry.m_boneMask = boneMask;
+		entry.m_nBones = nBones;
+		entry.m_iFirstMatrix = m_Matrices.AddMultipleToTail( nBones, pBoneToWorld );
+		entry.m_nStateBytes = state.TellPut();
+		entry.m_iFirstStateByte = m_State.AddMultipleToTail( entry.m_nStateBytes, (const unsigned char *)state.Base() );
+		m_Entries.InsertOrReplace( MakeKey( crc, hEntity ), entry );
+	}
+
+private:
+	struct Entry_t
+	{
+		int m_boneMask;
+		int m_nBones;
+		int m_iFirstMatrix;
+		int m_nStateBytes;
+		int m_iFirstStateByte;
+	};
+
+	static uint64 MakeKey( CRC32_t crc, unsigned long hEntity )	{ return ( (uint64)(uint32)hEntity << 32 ) | crc; }
+
+	void CheckTick()
+	{
+		if ( m_nTick == gpGlobals->tickcount )
+			return;
+
+		m_nTick = gpGlobals->tickcount;
+		m_Entries.RemoveAll();
+		m_Matrices.RemoveAll();
+		m_State.RemoveAll();
+	}
+
+	int m_nTick;
+	CUtlMap< uint64, Entry_t, int > m_Entries;	// keyed by entity handle and state CRC
+	CUtlVector< matrix3x4_t > m_Matrices;
+	CUtlVector< unsigned char > m_State;		// each entry's GetBoneSetupState output
+	CThreadFastMutex m_Mutex;
+};
+
+static CTickBoneCache s_TickBoneCache;
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes everything that affects the output of SetupBones, which
+//			is what the tick bone cache is keyed on
+//-----------------------------------------------------------------------------
+void CBaseAnimating::GetBoneSetupState( CUtlBuffer &state )
+{
+	CStudioHdr *pStudioHdr = GetModelPtr();
+	int nSequence = GetSequence();
+	float flCycle = GetCycle();
+	Vector vecOrigin = GetAbsOrigin();
+	QAngle angAngles = GetAbsAngles();
+	float flScale = GetModelScale();
+	bool bSkipAnimation = CanSkipAnimation();
+
+	state.Put( &pStudioHdr, sizeof( pStudioHdr ) );
+	state.Put( &nSequence, sizeof( nSequence ) );
+	state.Put( &flCycle, sizeof( flCycle ) );
+	state.Put( &vecOrigin, sizeof( vecOrigin ) );
+	state.Put( &angAngles, sizeof( angAngles ) );
+	state.Put( &m_flEstIkOffset, sizeof( m_flEstIkOffset ) );
+	state.Put( &flScale, sizeof( flScale ) );
+	state.Put( &bSkipAnimation, sizeof( bSkipAnimation ) );
+	state.Put( GetPoseParameterArray(), sizeof( float ) * MAXSTUDIOPOSEPARAM );
+	state.Put( GetEncodedControllerArray(), sizeof( float ) * MAXSTUDIOBONECTRLS );
+	state.Put( &gpGlobals->curtime, sizeof( gpGlobals->curtime ) );
+}
+
 void CBaseAnimating::SetupBones( matrix3x4_t *pBoneToWorld, int boneMask )
 {
 	AUTO_LOCK( m_BoneSetupMutex );
@@ -1793,6 +1911,26 @@ void CBaseAnimating::SetupBones( matrix3x4_t *pBoneToWorld, int boneMask )
 		return;
 	}
 
+	// Bone merged children depend on their parent's bones, and debug drawing wants to see every setup.
+	// IK advances m_iIKCounter and its targets and locks on every setup, so it can't be skipped either.
+	bool bUseTickCache = sv_bone_cache_tick.GetBool() && !ai_setupbones_debug.GetBool() && !m_pIk && !dynamic_cast< CBaseAnimating* >( GetMoveParent() );
+	CRC32_t tickCacheKey = 0;
+	unsigned char tickCacheStateMemory[1024];
+	CUtlBuffer tickCacheState( tickCacheStateMemory, sizeof( tickCacheStateMemory ), CUtlBuffer::EXTERNAL_GROWABLE );
+	if ( bUseTickCache )
+	{
+		GetBoneSetupState( tickCacheState );
+		tickCacheState.Put( &boneMask, sizeof( boneMask ) );
+		tickCacheKey = CRC32_ProcessSingleBuffer( tickCacheState.Base(), tickCacheState.TellPut() );
+
+		if ( s_TickBoneCache.Lookup( tickCacheState, tickCacheKey, GetRefEHandle().ToInt(), boneMask, pStudioHdr->numbones(), pBoneToWorld ) )
+		{
+			VPROF_INCREMENT_COUNTER( "Server bone cache hits", 1 );
+			return;
+		}
+		VPROF_INCREMENT_COUNTER( "Server bone cache misses", 1 );
+	}
+
 	Assert( !IsEFlagSet( EFL_SETTING_UP_BONES ) );
 
 	AddEFlags( EFL_SETTING_UP_BONES );
@@ -1867,6 +2005,11 @@ void CBaseAnimating::SetupBones( matrix3x4_t *pBoneToWorld, int boneMask )
 		pBoneToWorld,
 		boneMask );
 
+	if ( bUseTickCache )
+	{
+		s_TickBoneCache.Store( tickCacheState, tickCacheKey, GetRefEHandle().ToInt(), boneMask, pStudioHdr->numbones(), pBoneToWorld );
+	}
+
 	if (ai_setupbones_debug.GetBool())
 	{
 		// Msg("%s:%s:%s (%x)\n", GetClassname(), GetDebugName(), STRING(GetModelName()), boneMask );
@@ -3605,3 +3748,156 @@ CStudioHdr *CBaseAnimating::OnNewModel()
 
 	return hdr;
 }
+
+//-----------------------------------------------------------------------------
+// Purpose: Times the bone setup path (InitPose, a two sequence blend and
+//			Studio_BuildMatrices) with the scalar and the SIMD bone kernels,
+//			and checks that both produce the same bones.
+//-----------------------------------------------------------------------------
+static const char *s_pBoneSetupBenchModels[] =
+{
+	"models/combine_soldier.mdl",
+	"models/police.mdl",
+	"models/humans/group01/male_07.mdl",
+	"models/alyx.mdl",
+	"models/zombie/classic.mdl",
+	"models/antlion.mdl",
+};
+
+static void BenchBoneSetup( CStudioHdr *pStudioHdr, int iIteration, matrix3x4_t *pBoneToWorld )
+{
+	Vector pos[MAXSTUDIOBONES];
+	QuaternionAligned q[MAXSTUDIOBONES];
+	float poseParameter[MAXSTUDIOPOSEPARAM] = {};
+
+	int nSequences = pStudioHdr->GetNumSeq();
+	float flCycle = ( iIteration % 64 ) / 64.0f;
+
+	IBoneSetup boneSetup( pStudioHdr, BONE_USED_BY_ANYTHING, poseParameter );
+	boneSetup.InitPose( pos, q );
+	boneSetup.AccumulatePose( pos, q, iIteration % nSequences, flCycle, 1.0f, 0.0f, NULL );
+	boneSetup.AccumulatePose( pos, q, ( iIteration + 1 ) % nSequences, flCycle, 0.5f, 0.0f, NULL );
+
+	Studio_BuildMatrices( pStudioHdr, vec3_angle, vec3_origin, pos, q, -1, 1.0f, pBoneToWorld, BONE_USED_BY_ANYTHING );
+}
+
+static double TimeBoneSetup( CStudioHdr *pStudioHdr, int nIterations )
+{
+	matrix3x4_t bonetoworld[MAXSTUDIOBONES];
+
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nIterations; i++ )
+	{
+		BenchBoneSetup( pStudioHdr, i, bonetoworld );
+	}
+	return Plat_FloatTime() - flStart;
+}
+
+// Largest difference in any matrix element between the scalar and SIMD kernels
+static float CompareBoneSetup( CStudioHdr *pStudioHdr, int nIterations )
+{
+	matrix3x4_t scalar[MAXSTUDIOBONES];
+	matrix3x4_t simd[MAXSTUDIOBONES];
+
+	float flMaxDiff = 0.0f;
+	for ( int i = 0; i < nIterations; i++ )
+	{
+		Studio_ForceSIMDBoneKernels( 0 );
+		BenchBoneSetup( pStudioHdr, i, scalar );
+		Studio_ForceSIMDBoneKernels( 1 );
+		BenchBoneSetup( pStudioHdr, i, simd );
+
+		for ( int j = 0; j < pStudioHdr->numbones(); j++ )
+		{
+			const float *pScalar = scalar[j].Base();
+			const float *pSIMD = simd[j].Base();
+			for ( int k = 0; k < 12; k++ )
+			{
+				flMaxDiff = MAX( flMaxDiff, fabsf( pScalar[k] - pSIMD[k] ) );
+			}
+		}
+	}
+	Studio_ForceSIMDBoneKernels( -1 );
+	return flMaxDiff;
+}
+
+CON_COMMAND( bone_setup_bench, "Compare scalar and SIMD bone setup throughput. Arguments: [iterations] [model ...]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nIterations = ( args.ArgC() > 1 ) ? atoi( args[1] ) : 2000;
+	if ( nIterations <= 0 )
+		nIterations = 2000;
+
+	CUtlVector< const char * > models;
+	for ( int i = 2; i < args.ArgC(); i++ )
+	{
+		models.AddToTail( args[i] );
+	}
+	if ( !models.Count() )
+	{
+		models.AddMultipleToTail( ARRAYSIZE( s_pBoneSetupBenchModels ), s_pBoneSetupBenchModels );
+	}
+
+	double flTotal[2] = { 0.0, 0.0 };
+	int nTotalBones = 0;
+	float flMaxDiff = 0.0f;
+
+	for ( int i = 0; i < models.Count(); i++ )
+	{
+		MDLCACHE_CRITICAL_SECTION();
+
+		MDLHandle_t hModel = mdlcache->FindMDL( models[i] );
+		if ( hModel == MDLHANDLE_INVALID )
+			continue;
+
+		if ( mdlcache->IsErrorModel( hModel ) )
+		{
+			Msg( "bone_setup_bench: couldn't load %s\n", models[i] );
+			mdlcache->Release( hModel );
+			continue;
+		}
+
+		CStudioHdr studioHdr( mdlcache->GetStudioHdr( hModel ), mdlcache );
+		if ( !studioHdr.SequencesAvailable() || !studioHdr.GetNumSeq() )
+		{
+			mdlcache->Release( hModel );
+			continue;
+		}
+
+		// warm the animation data so the first mode timed doesn't pay for loading it
+		TimeBoneSetup( &studioHdr, 64 );
+
+		double flTime[2];
+		for ( int nSIMD = 0; nSIMD < 2; nSIMD++ )
+		{
+			Studio_ForceSIMDBoneKernels( nSIMD );
+			flTime[nSIMD] = TimeBoneSetup( &studioHdr, nIterations );
+			flTotal[nSIMD] += flTime[nSIMD];
+		}
+		Studio_ForceSIMDBoneKernels( -1 );
+
+		// rerun the first blends the timing loop did, once in each mode
+		float flDiff = CompareBoneSetup( &studioHdr, MIN( nIterations, 256 ) );
+		flMaxDiff = MAX( flMaxDiff, flDiff );
+
+		int nBones = studioHdr.numbones() * nIterations;
+		nTotalBones += nBones;
+		Msg( "  %-40s %3d bones: scalar %10.0f bones/sec, SIMD %10.0f bones/sec (%.2fx), max diff %g\n", models[i], studioHdr.numbones(),
+			nBones / MAX( flTime[0], 1e-6 ), nBones / MAX( flTime[1], 1e-6 ), flTime[0] / MAX( flTime[1], 1e-6 ), flDiff );
+
+		mdlcache->Release( hModel );
+	}
+
+	if ( !MathLib_SSE2Enabled() )
+	{
+		Msg( "bone_setup_bench: SIMD bone kernels are unavailable on this CPU, both runs used the scalar path\n" );
+	}
+
+	if ( nTotalBones )
+	{
+		Msg( "bone_setup_bench: scalar %.0f bones/sec, SIMD %.0f bones/sec (%.2fx), max diff %g\n",
+			nTotalBones / MAX( flTotal[0], 1e-6 ), nTotalBones / MAX( flTotal[1], 1e-6 ), flTotal[0] / MAX( flTotal[1], 1e-6 ), flMaxDiff );
+	}
+}
@@ -142,6 +142,7 @@ public:
 
 	virtual bool		FInViewCone( CBaseEntity *pEntity );
 	virtual bool		FInViewCone( const Vector &vecSpot );
+	float				GetFieldOfView() const { return m_flFieldOfView; }
 
 #ifdef PORTAL
 	virtual CProp_Portal*	FInViewConeThroughPortal( CBaseEntity *pEntity );
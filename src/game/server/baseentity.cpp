@@ -46,6 +46,7 @@
 #include "game.h"
 #include "tier0/vprof.h"
 #include "ai_basenpc.h"
+#include "ai_senses.h"
 #include "iservervehicle.h"
 #include "eventlist.h"
 #include "scriptevent.h"
@@ -69,6 +70,7 @@
 
 #ifdef LUA_SDK
 #include "luamanager.h"
+#include "lbaseentity_shared.h"
 #endif
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -628,6 +630,7 @@ CBaseEntity *CBaseEntity::GetFollowedEntity()
 void CBaseEntity::SetClassname( const char *className )
 {
 	m_iClassname = AllocPooledString( className );
+	gEntList.NotifyNameChanged( this );
 }
 
 void CBaseEntity::SetModelIndex( int index )
@@ -2008,6 +2011,12 @@ void CBaseEntity::UpdateOnRemove( void )
 	// Notifies entity listeners, etc
 	gEntList.NotifyRemoveEntity( GetRefEHandle() );
 
+#if defined( LUA_SDK )
+	// Release the Lua userdata cached for this entity
+	if ( g_bLuaInitialized )
+		lua_removecachedentity( L, this );
+#endif
+
 	if ( edict() )
 	{
 		AddFlag( FL_KILLME );
@@ -2801,6 +2810,11 @@ bool CBaseEntity::FVisible( CBaseEntity *pEntity, int traceMask, CBaseEntity **p
 	Vector vecLookerOrigin = EyePosition();//look through the caller's 'eyes'
 	Vector vecTargetOrigin = pEntity->EyePosition();
 
+	// ai_parallel_think may already know the world is in the way. The blocker
+	// could still be an entity in front of the world, so that needs a trace.
+	if ( traceMask == MASK_BLOCKLOS && !ppBlocker && AI_IsPrefetchedLOSBlocked( this, pEntity, vecLookerOrigin, vecTargetOrigin ) )
+		return false;
+
 	trace_t tr;
 	if ( !IsXbox() && ai_LOS_mode.GetBool() )
 	{
@@ -3023,6 +3037,12 @@ FORCEINLINE bool NamesMatch( const char *pszQuery, string_t nameToMatch )
 	return false;
 }
 
+void CBaseEntity::SetName( string_t newName )
+{
+	m_iName = newName;
+	gEntList.NotifyNameChanged( this );
+}
+
 bool CBaseEntity::NameMatchesComplex( const char *pszNameOrWildcard )
 {
 	if ( !Q_stricmp( "!player", pszNameOrWildcard) )
@@ -3275,6 +3295,9 @@ void CBaseEntity::OnRestore()
 
 	SimThink_EntityChanged( this );
 
+	// m_iName and m_iClassname were written straight into the fields
+	gEntList.NotifyNameChanged( this );
+
 	// touchlinks get recomputed
 	if ( IsEFlagSet( EFL_CHECK_UNTOUCH ) )
 	{
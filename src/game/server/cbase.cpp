@@ -642,10 +642,12 @@ DEFINE_FIXEDSIZE_ALLOCATOR( EventQueuePrioritizedEvent_t, 128, CUtlMemoryPool::G
 
 CEventQueue g_EventQueue;
 
-CEventQueue::CEventQueue()
+CEventQueue::CEventQueue() : m_CallerEvents( DefLessFunc( unsigned long ) ),
+	m_NameTargets( k_eDictCompareTypeCaseSensitive ), m_ClassnameTargets( k_eDictCompareTypeCaseSensitive )
 {
-	m_Events.m_flFireTime = -FLT_MAX;
-	m_Events.m_pNext = NULL;
+	m_iNextSerial = 0;
+	m_pFiringEvent = NULL;
+	m_iTargetCacheSerial = -1;
 
 	Init();
 }
@@ -759,21 +761,46 @@ void CEventQueue::Init( void )
 void CEventQueue::Clear( void )
 {
 	// delete all the events in the queue
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-	
-	while ( pe != NULL )
+	for ( int i = 0; i < m_Events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
-		delete pe;
-		pe = next;
+		EventQueuePrioritizedEvent_t *pe = m_Events[i];
+		pe->m_iHeapIndex = -1;
+		if ( pe != m_pFiringEvent )
+		{
+			delete pe;
+		}
 	}
 
-	m_Events.m_pNext = NULL;
+	m_Events.Purge();
+	m_CallerEvents.RemoveAll();
+
+	m_NameTargets.RemoveAll();
+	m_ClassnameTargets.RemoveAll();
+	m_CachedTargets.Purge();
+	m_iTargetCacheSerial = -1;
+}
+
+static int __cdecl EventFireOrder( EventQueuePrioritizedEvent_t * const *a, EventQueuePrioritizedEvent_t * const *b )
+{
+	if ( (*a)->m_flFireTime != (*b)->m_flFireTime )
+		return ( (*a)->m_flFireTime < (*b)->m_flFireTime ) ? -1 : 1;
+
+	if ( (*a)->m_iSerial != (*b)->m_iSerial )
+		return ( (*a)->m_iSerial < (*b)->m_iSerial ) ? -1 : 1;
+
+	return 0;
+}
+
+void CEventQueue::GetSortedEvents( CUtlVector< EventQueuePrioritizedEvent_t * > &events )
+{
+	events.CopyArray( m_Events.Base(), m_Events.Count() );
+	events.Sort( EventFireOrder );
 }
 
 void CEventQueue::Dump( void )
 {
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetSortedEvents( events );
 
 	Msg("Dumping event queue. Current time is: %.2f\n",
 #ifdef TF_DLL
@@ -783,9 +810,9 @@ void CEventQueue::Dump( void )
 #endif
 		);
 
-	while ( pe != NULL )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
+		EventQueuePrioritizedEvent_t *pe = events[i];
 
 		Msg("   (%.2f) Target: '%s', Input: '%s', Parameter '%s'. Activator: '%s', Caller '%s'.  \n", 
 			pe->m_flFireTime, 
@@ -794,8 +821,6 @@ void CEventQueue::Dump( void )
 			pe->m_VariantValue.String(),
 			pe->m_pActivator ? pe->m_pActivator->GetDebugName() : "None", 
 			pe->m_pCaller ? pe->m_pCaller->GetDebugName() : "None"  );
-
-		pe = next;
 	}
 
 	Msg("Finished dump.\n");
@@ -857,41 +882,235 @@ void CEventQueue::AddEvent( CBaseEntity *target, const char *action, float fireD
 
 
 //-----------------------------------------------------------------------------
-// Purpose: private function, adds an event into the list
+// Purpose: orders the heap; events due at the same time fire in the order
+//			they were queued
+//-----------------------------------------------------------------------------
+bool CEventQueue::FiresBefore( const EventQueuePrioritizedEvent_t *a, const EventQueuePrioritizedEvent_t *b )
+{
+	if ( a->m_flFireTime != b->m_flFireTime )
+		return a->m_flFireTime < b->m_flFireTime;
+
+	return a->m_iSerial < b->m_iSerial;
+}
+
+void CEventQueue::HeapSet( int i, EventQueuePrioritizedEvent_t *pe )
+{
+	m_Events[i] = pe;
+	pe->m_iHeapIndex = i;
+}
+
+void CEventQueue::HeapUp( int i )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Events[i];
+	while ( i > 0 )
+	{
+		int parent = ( i - 1 ) / 2;
+		if ( !FiresBefore( pe, m_Events[parent] ) )
+			break;
+
+		HeapSet( i, m_Events[parent] );
+		i = parent;
+	}
+	HeapSet( i, pe );
+}
+
+void CEventQueue::HeapDown( int i )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Events[i];
+	int count = m_Events.Count();
+	while ( 1 )
+	{
+		int child = 2 * i + 1;
+		if ( child >= count )
+			break;
+
+		if ( child + 1 < count && FiresBefore( m_Events[child + 1], m_Events[child] ) )
+		{
+			child++;
+		}
+
+		if ( !FiresBefore( m_Events[child], pe ) )
+			break;
+
+		HeapSet( i, m_Events[child] );
+		i = child;
+	}
+	HeapSet( i, pe );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: private function, adds an event into the queue
 // Input  : *newEvent - the (already built) event to add
 //-----------------------------------------------------------------------------
 void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
 {
-	// loop through the actions looking for a place to insert
-	EventQueuePrioritizedEvent_t *pe;
-	for ( pe = &m_Events; pe->m_pNext != NULL; pe = pe->m_pNext )
+	newEvent->m_iSerial = m_iNextSerial++;
+	HeapSet( m_Events.AddToTail(), newEvent );
+	HeapUp( newEvent->m_iHeapIndex );
+
+	// index it by caller so CancelEvents only visits the caller's events
+	newEvent->m_iCallerKey = newEvent->m_pCaller.ToInt();
+	newEvent->m_pPrevByCaller = NULL;
+	newEvent->m_pNextByCaller = NULL;
+	if ( newEvent->m_iCallerKey != INVALID_EHANDLE_INDEX )
 	{
-		if ( pe->m_pNext->m_flFireTime > newEvent->m_flFireTime )
+		int iCaller = m_CallerEvents.Find( newEvent->m_iCallerKey );
+		if ( iCaller == m_CallerEvents.InvalidIndex() )
 		{
-			break;
+			m_CallerEvents.Insert( newEvent->m_iCallerKey, newEvent );
+		}
+		else
+		{
+			newEvent->m_pNextByCaller = m_CallerEvents[iCaller];
+			newEvent->m_pNextByCaller->m_pPrevByCaller = newEvent;
+			m_CallerEvents[iCaller] = newEvent;
 		}
 	}
+}
 
-	Assert( pe );
+void CEventQueue::RemoveEvent( EventQueuePrioritizedEvent_t *pe )
+{
+	int i = pe->m_iHeapIndex;
+	Assert( i >= 0 && i < m_Events.Count() && m_Events[i] == pe );
 
-	// insert
-	newEvent->m_pNext = pe->m_pNext;
-	newEvent->m_pPrev = pe;
-	pe->m_pNext = newEvent;
-	if ( newEvent->m_pNext )
+	// move the last event into the hole and restore the heap around it
+	int last = m_Events.Count() - 1;
+	EventQueuePrioritizedEvent_t *pLast = m_Events[last];
+	m_Events.Remove( last );
+	if ( i != last )
 	{
-		newEvent->m_pNext->m_pPrev = newEvent;
+		HeapSet( i, pLast );
+		HeapDown( i );
+		HeapUp( pLast->m_iHeapIndex );
+	}
+	pe->m_iHeapIndex = -1;
+
+	if ( pe->m_iCallerKey != INVALID_EHANDLE_INDEX )
+	{
+		if ( pe->m_pPrevByCaller )
+		{
+			pe->m_pPrevByCaller->m_pNextByCaller = pe->m_pNextByCaller;
+		}
+		else
+		{
+			int iCaller = m_CallerEvents.Find( pe->m_iCallerKey );
+			Assert( m_CallerEvents.IsValidIndex( iCaller ) && m_CallerEvents[iCaller] == pe );
+			if ( pe->m_pNextByCaller )
+			{
+				m_CallerEvents[iCaller] = pe->m_pNextByCaller;
+			}
+			else
+			{
+				m_CallerEvents.RemoveAt( iCaller );
+			}
+		}
+
+		if ( pe->m_pNextByCaller )
+		{
+			pe->m_pNextByCaller->m_pPrevByCaller = pe->m_pPrevByCaller;
+		}
+
+		pe->m_iCallerKey = INVALID_EHANDLE_INDEX;
+		pe->m_pPrevByCaller = NULL;
+		pe->m_pNextByCaller = NULL;
 	}
 }
 
-void CEventQueue::RemoveEvent( EventQueuePrioritizedEvent_t *pe )
+//-----------------------------------------------------------------------------
+// Purpose: removes and frees an event, leaving the one being fired for
+//			ServiceEvents to free
+//-----------------------------------------------------------------------------
+void CEventQueue::DeleteEvent( EventQueuePrioritizedEvent_t *pe )
+{
+	RemoveEvent( pe );
+	if ( pe != m_pFiringEvent )
+	{
+		delete pe;
+	}
+}
+
+CBaseEntity *CEventQueue::FindTarget( CBaseEntity *pStartEntity, EventQueuePrioritizedEvent_t *pe, bool bClassname )
 {
-	Assert( pe->m_pPrev );
-	pe->m_pPrev->m_pNext = pe->m_pNext;
-	if ( pe->m_pNext )
+	if ( bClassname )
+		return gEntList.FindEntityByClassname( pStartEntity, STRING(pe->m_iTarget) );
+
+	// In the context the event, the searching entity is also the caller
+	return gEntList.FindEntityByName( pStartEntity, pe->m_iTarget, pe->m_pCaller, pe->m_pActivator, pe->m_pCaller );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: pumps the event's input into every entity its target names, or
+//			every entity of that classname
+// Output : true if there was at least one
+//-----------------------------------------------------------------------------
+bool CEventQueue::FireAtTargets( EventQueuePrioritizedEvent_t *pe, bool bClassname )
+{
+	bool targetFound = false;
+	CBaseEntity *target = NULL;
+
+	// Procedural names depend on the event; plain ones resolve the same way
+	// until an entity is added, removed or renamed, so remember them.
+	if ( STRING(pe->m_iTarget)[0] != '!' )
+	{
+		if ( m_iTargetCacheSerial != gEntList.GetNameSerial() )
+		{
+			m_NameTargets.RemoveAll();
+			m_ClassnameTargets.RemoveAll();
+			m_CachedTargets.RemoveAll();
+			m_iTargetCacheSerial = gEntList.GetNameSerial();
+		}
+
+		CUtlDict< CachedTargets_t, int > &cache = bClassname ? m_ClassnameTargets : m_NameTargets;
+		int iCache = cache.Find( STRING(pe->m_iTarget) );
+		if ( iCache == cache.InvalidIndex() )
+		{
+			CachedTargets_t targets;
+			targets.m_iFirst = m_CachedTargets.Count();
+			while ( ( target = FindTarget( target, pe, bClassname ) ) != NULL )
+			{
+				m_CachedTargets.AddToTail( target );
+			}
+			targets.m_nCount = m_CachedTargets.Count() - targets.m_iFirst;
+			iCache = cache.Insert( STRING(pe->m_iTarget), targets );
+		}
+
+		const CachedTargets_t &targets = cache[iCache];
+		int nSerial = m_iTargetCacheSerial;
+		EHANDLE hLastTarget;
+		for ( int i = 0; i < targets.m_nCount; i++ )
+		{
+			hLastTarget = m_CachedTargets[targets.m_iFirst + i];
+
+			// pump the action into the target
+			hLastTarget->AcceptInput( STRING(pe->m_iTargetInput), pe->m_pActivator, pe->m_pCaller, pe->m_VariantValue, pe->m_iOutputID );
+			targetFound = true;
+
+			if ( gEntList.GetNameSerial() != nSerial )
+				break;
+		}
+
+		if ( gEntList.GetNameSerial() == nSerial )
+			return targetFound;
+
+		// The input changed the entity list; carry on searching it from the
+		// last target, as if there had been no cache.
+		target = hLastTarget;
+		if ( !target )
+			return targetFound;
+	}
+
+	while ( 1 )
 	{
-		pe->m_pNext->m_pPrev = pe->m_pPrev;
+		target = FindTarget( target, pe, bClassname );
+		if ( !target )
+			break;
+
+		// pump the action into the target
+		target->AcceptInput( STRING(pe->m_iTargetInput), pe->m_pActivator, pe->m_pCaller, pe->m_VariantValue, pe->m_iOutputID );
+		targetFound = true;
 	}
+
+	return targetFound;
 }
 
 
@@ -905,34 +1124,23 @@ void CEventQueue::ServiceEvents( void )
 		return;
 	}
 
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-
 #ifdef TF_DLL
-	while ( pe != NULL && pe->m_flFireTime <= engine->GetServerTime() )
+	while ( m_Events.Count() && m_Events[0]->m_flFireTime <= engine->GetServerTime() )
 #else
-	while ( pe != NULL && pe->m_flFireTime <= gpGlobals->curtime )
+	while ( m_Events.Count() && m_Events[0]->m_flFireTime <= gpGlobals->curtime )
 #endif
 	{
 		MDLCACHE_CRITICAL_SECTION();
 
+		EventQueuePrioritizedEvent_t *pe = m_Events[0];
+		m_pFiringEvent = pe;
+
 		bool targetFound = false;
 
 		// find the targets
 		if ( pe->m_iTarget != NULL_STRING )
 		{
-			// In the context the event, the searching entity is also the caller
-			CBaseEntity *pSearchingEntity = pe->m_pCaller;
-			CBaseEntity *target = NULL;
-			while ( 1 )
-			{
-				target = gEntList.FindEntityByName( target, pe->m_iTarget, pSearchingEntity, pe->m_pActivator, pe->m_pCaller );
-				if ( !target )
-					break;
-
-				// pump the action into the target
-				target->AcceptInput( STRING(pe->m_iTargetInput), pe->m_pActivator, pe->m_pCaller, pe->m_VariantValue, pe->m_iOutputID );
-				targetFound = true;
-			}
+			targetFound = FireAtTargets( pe, false );
 		}
 
 		// direct pointer
@@ -947,17 +1155,7 @@ void CEventQueue::ServiceEvents( void )
 			// See if we can find a target if we treat the target as a classname
 			if ( pe->m_iTarget != NULL_STRING )
 			{
-				CBaseEntity *target = NULL;
-				while ( 1 )
-				{
-					target = gEntList.FindEntityByClassname( target, STRING(pe->m_iTarget) );
-					if ( !target )
-						break;
-
-					// pump the action into the target
-					target->AcceptInput( STRING(pe->m_iTargetInput), pe->m_pActivator, pe->m_pCaller, pe->m_VariantValue, pe->m_iOutputID );
-					targetFound = true;
-				}
+				targetFound = FireAtTargets( pe, true );
 			}
 		}
 
@@ -978,8 +1176,12 @@ void CEventQueue::ServiceEvents( void )
 			ADD_DEBUG_HISTORY( HISTORY_ENTITY_IO, szBuffer );
 		}
 
-		// remove the event from the list (remembering that the queue may have been added to)
-		RemoveEvent( pe );
+		// remove the event from the queue, unless one of its inputs cancelled it already
+		if ( pe->m_iHeapIndex != -1 )
+		{
+			RemoveEvent( pe );
+		}
+		m_pFiringEvent = NULL;
 		delete pe;
 
 		//
@@ -993,8 +1195,7 @@ void CEventQueue::ServiceEvents( void )
 			}
 		}
 
-		// restart the list (to catch any new items have probably been added to the queue)
-		pe = m_Events.m_pNext;	
+		// the head of the queue now includes anything the inputs added
 	}
 }
 
@@ -1022,7 +1223,11 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 	if (!pCaller)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	int iCaller = m_CallerEvents.Find( pCaller->GetRefEHandle().ToInt() );
+	if ( iCaller == m_CallerEvents.InvalidIndex() )
+		return;
+
+	EventQueuePrioritizedEvent_t *pCur = m_CallerEvents[iCaller];
 
 	while (pCur != NULL)
 	{
@@ -1039,12 +1244,11 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByCaller;
 
 		if (bDelete)
 		{
-			RemoveEvent( pCurSave );
-			delete pCurSave;
+			DeleteEvent( pCurSave );
 		}
 	}
 }
@@ -1060,28 +1264,24 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 	if (!pTarget)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
-
-	while (pCur != NULL)
+	// collect first, removing reorders the heap
+	CUtlVector< EventQueuePrioritizedEvent_t * > deleteList;
+	for ( int i = 0; i < m_Events.Count(); i++ )
 	{
-		bool bDelete = false;
+		EventQueuePrioritizedEvent_t *pCur = m_Events[i];
 		if (pCur->m_pEntTarget == pTarget)
 		{
 			if ( !Q_strncmp( STRING(pCur->m_iTargetInput), sInputName, strlen(sInputName) ) )
 			{
 				// Found a matching event; delete it from the queue.
-				bDelete = true;
+				deleteList.AddToTail( pCur );
 			}
 		}
+	}
 
-		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
-
-		if (bDelete)
-		{
-			RemoveEvent( pCurSave );
-			delete pCurSave;
-		}
+	for ( int i = 0; i < deleteList.Count(); i++ )
+	{
+		DeleteEvent( deleteList[i] );
 	}
 }
 
@@ -1095,10 +1295,9 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 	if (!pTarget)
 		return false;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
-
-	while (pCur != NULL)
+	for ( int i = 0; i < m_Events.Count(); i++ )
 	{
+		EventQueuePrioritizedEvent_t *pCur = m_Events[i];
 		if (pCur->m_pEntTarget == pTarget)
 		{
 			if ( !sInputName )
@@ -1107,8 +1306,6 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 			if ( !Q_strncmp( STRING(pCur->m_iTargetInput), sInputName, strlen(sInputName) ) )
 				return true;
 		}
-
-		pCur = pCur->m_pNext;
 	}
 
 	return false;
@@ -1143,29 +1340,28 @@ BEGIN_SIMPLE_DATADESC( EventQueuePrioritizedEvent_t )
 	DEFINE_FIELD( m_iOutputID, FIELD_INTEGER ),
 	DEFINE_CUSTOM_FIELD( m_VariantValue, variantFuncs ),
 
-//	DEFINE_FIELD( m_pNext, FIELD_??? ),
-//	DEFINE_FIELD( m_pPrev, FIELD_??? ),
+//	DEFINE_FIELD( m_iHeapIndex, FIELD_??? ),
+//	DEFINE_FIELD( m_pNextByCaller, FIELD_??? ),
+//	DEFINE_FIELD( m_pPrevByCaller, FIELD_??? ),
 END_DATADESC()
 
 
 int CEventQueue::Save( ISave &save )
 {
-	// count the number of items in the queue
-	EventQueuePrioritizedEvent_t *pe;
+	// save in firing order, so restoring requeues them in the same order
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetSortedEvents( events );
 
-	m_iListCount = 0;
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
-	{
-		m_iListCount++;
-	}
+	m_iListCount = events.Count();
 
 	// save that value out to disk, so we know how many to restore
 	if ( !save.WriteFields( "EventQueue", this, NULL, m_DataMap.dataDesc, m_DataMap.dataNumFields ) )
 		return 0;
 	
 	// cycle through all the events, saving them all
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
+		EventQueuePrioritizedEvent_t *pe = events[i];
 		if ( !save.WriteFields( "PEvent", pe, NULL, pe->m_DataMap.dataDesc, pe->m_DataMap.dataNumFields ) )
 			return 0;
 	}
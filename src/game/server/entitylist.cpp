@@ -17,6 +17,7 @@
 #include "ai_initutils.h"
 #include "globalstate.h"
 #include "datacache/imdlcache.h"
+#include "entityspatialindex.h"
 
 #ifdef LUA_SDK
 #include "luamanager.h"
@@ -299,6 +300,31 @@ CGlobalEntityList::CGlobalEntityList()
 {
 	m_iHighestEnt = m_iNumEnts = m_iNumEdicts = 0;
 	m_bClearingEntities = false;
+	m_iNameSerial = 0;
+
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		NameIndexEntry_t &entry = m_NameIndex[i];
+		entry.nOrder = 0;
+		entry.bPending = false;
+		for ( int j = 0; j < NUM_NAME_INDEXES; j++ )
+		{
+			entry.str[j] = NULL_STRING;
+			entry.hash[j] = 0;
+			entry.next[j] = entry.prev[j] = -1;
+		}
+	}
+	for ( int j = 0; j < NUM_NAME_INDEXES; j++ )
+	{
+		m_NameBuckets[j].SetLessFunc( DefLessFunc( unsigned int ) );
+	}
+	m_nNameIndexOrder = 0;
+
+	m_vecSphereQueryCenter.Init();
+	m_flSphereQueryRadius = 0.0f;
+	m_nSphereQuerySerial = -1;
+	m_iSphereQueryNext = 0;
+	m_pSphereQueryLast = NULL;
 }
 
 
@@ -479,6 +505,206 @@ bool CGlobalEntityList::IsEntityPtr( void *pTest )
 	return false; 
 }
 
+//-----------------------------------------------------------------------------
+// Name and classname index
+//-----------------------------------------------------------------------------
+extern ConVar ent_spatial_index;
+
+ConVar ent_name_index( "ent_name_index", "1", 0, "Answer entity searches by exact name or classname from the name index instead of walking every entity." );
+
+//-----------------------------------------------------------------------------
+// Purpose: Hash that agrees with NamesMatch: any name it considers equal to
+//			the query must land in the query's bucket.
+//-----------------------------------------------------------------------------
+static unsigned int NameIndexHash( const char *pszName )
+{
+	// NamesMatch's case conversion treats any two characters 32 apart at or
+	// below 'z' alike (so 'A' and 'a', but also '0' and 'P'), so fold all of
+	// those to their low five bits. The extra collisions are sorted out by
+	// the NameMatches/ClassMatches check on every hit.
+	unsigned int hash = 2166136261u;
+	for ( const unsigned char *p = (const unsigned char *)pszName; *p; ++p )
+	{
+		unsigned char c = *p;
+		if ( c <= 'z' )
+			c &= 31;
+		hash = ( hash ^ c ) * 16777619u;
+	}
+	return hash;
+}
+
+// Wildcards and empty queries can match names outside the query's bucket
+static inline bool CanUseNameIndex( const char *pszName )
+{
+	return pszName && *pszName && !strchr( pszName, '*' ) && ent_name_index.GetBool();
+}
+
+void CGlobalEntityList::NotifyNameChanged( CBaseEntity *pEntity )
+{
+	++m_iNameSerial;
+
+	// Entities name themselves before they're in the list; OnAddEntity picks those up
+	if ( pEntity && pEntity->GetRefEHandle().IsValid() )
+	{
+		NameIndexMarkDirty( pEntity->GetRefEHandle().GetEntryIndex() );
+	}
+}
+
+void CGlobalEntityList::NameIndexMarkDirty( int iSlot )
+{
+	if ( m_NameIndex[iSlot].bPending )
+		return;
+
+	m_NameIndex[iSlot].bPending = true;
+	m_NameIndexPending.AddToTail( iSlot );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Re-buckets every entity whose name or classname may have changed
+//			since the last search.
+//-----------------------------------------------------------------------------
+void CGlobalEntityList::NameIndexSync()
+{
+	for ( int i = 0; i < m_NameIndexPending.Count(); i++ )
+	{
+		int iSlot = m_NameIndexPending[i];
+		NameIndexEntry_t &entry = m_NameIndex[iSlot];
+
+		// Removed (and possibly re-added further down the list) since it was queued
+		if ( !entry.bPending )
+			continue;
+		entry.bPending = false;
+
+		CBaseEntity *pEntity = (CBaseEntity *)LookupEntityByNetworkIndex( iSlot );
+		if ( !pEntity )
+			continue;
+
+		string_t str[NUM_NAME_INDEXES];
+		str[NAME_INDEX_NAME] = pEntity->GetEntityName();
+		str[NAME_INDEX_CLASSNAME] = pEntity->m_iClassname;
+
+		for ( int j = 0; j < NUM_NAME_INDEXES; j++ )
+		{
+			if ( str[j] == entry.str[j] )
+				continue;
+
+			NameIndexUnlink( j, iSlot );
+			NameIndexLink( j, iSlot, str[j] );
+		}
+	}
+
+	m_NameIndexPending.RemoveAll();
+}
+
+void CGlobalEntityList::NameIndexLink( int iIndex, int iSlot, string_t str )
+{
+	NameIndexEntry_t &entry = m_NameIndex[iSlot];
+	entry.str[iIndex] = str;
+	if ( str == NULL_STRING )
+		return;
+
+	unsigned int hash = NameIndexHash( STRING( str ) );
+	entry.hash[iIndex] = hash;
+
+	CUtlMap<unsigned int, NameIndexBucket_t> &buckets = m_NameBuckets[iIndex];
+	unsigned short iBucket = buckets.Find( hash );
+	if ( iBucket == buckets.InvalidIndex() )
+	{
+		NameIndexBucket_t empty = { -1, -1 };
+		iBucket = buckets.Insert( hash, empty );
+	}
+	NameIndexBucket_t &bucket = buckets[iBucket];
+
+	// New entities go straight on the end; a rename walks back to its place in the active list
+	int iPrev = bucket.tail;
+	while ( iPrev != -1 && m_NameIndex[iPrev].nOrder > entry.nOrder )
+	{
+		iPrev = m_NameIndex[iPrev].prev[iIndex];
+	}
+
+	int iNext = ( iPrev != -1 ) ? m_NameIndex[iPrev].next[iIndex] : bucket.head;
+	entry.prev[iIndex] = iPrev;
+	entry.next[iIndex] = iNext;
+
+	if ( iPrev != -1 )
+		m_NameIndex[iPrev].next[iIndex] = iSlot;
+	else
+		bucket.head = iSlot;
+
+	if ( iNext != -1 )
+		m_NameIndex[iNext].prev[iIndex] = iSlot;
+	else
+		bucket.tail = iSlot;
+}
+
+void CGlobalEntityList::NameIndexUnlink( int iIndex, int iSlot )
+{
+	NameIndexEntry_t &entry = m_NameIndex[iSlot];
+	if ( entry.str[iIndex] == NULL_STRING )
+		return;
+
+	entry.str[iIndex] = NULL_STRING;
+
+	CUtlMap<unsigned int, NameIndexBucket_t> &buckets = m_NameBuckets[iIndex];
+	unsigned short iBucket = buckets.Find( entry.hash[iIndex] );
+	Assert( iBucket != buckets.InvalidIndex() );
+	if ( iBucket == buckets.InvalidIndex() )
+		return;
+
+	NameIndexBucket_t &bucket = buckets[iBucket];
+	int iPrev = entry.prev[iIndex];
+	int iNext = entry.next[iIndex];
+
+	if ( iPrev != -1 )
+		m_NameIndex[iPrev].next[iIndex] = iNext;
+	else
+		bucket.head = iNext;
+
+	if ( iNext != -1 )
+		m_NameIndex[iNext].prev[iIndex] = iPrev;
+	else
+		bucket.tail = iPrev;
+
+	entry.next[iIndex] = entry.prev[iIndex] = -1;
+
+	if ( bucket.head == -1 )
+	{
+		buckets.RemoveAt( iBucket );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the slot to start a bucket walk from, honouring pStartEntity
+//			the same way the linear searches do, or -1 if nothing can match.
+//-----------------------------------------------------------------------------
+int CGlobalEntityList::NameIndexFirst( int iIndex, const char *pszName, CBaseEntity *pStartEntity )
+{
+	NameIndexSync();
+
+	unsigned int hash = NameIndexHash( pszName );
+	CUtlMap<unsigned int, NameIndexBucket_t> &buckets = m_NameBuckets[iIndex];
+	unsigned short iBucket = buckets.Find( hash );
+	if ( iBucket == buckets.InvalidIndex() )
+		return -1;
+
+	if ( !pStartEntity )
+		return buckets[iBucket].head;
+
+	const NameIndexEntry_t &start = m_NameIndex[pStartEntity->GetRefEHandle().GetEntryIndex()];
+	if ( start.str[iIndex] != NULL_STRING && start.hash[iIndex] == hash )
+		return start.next[iIndex];
+
+	// pStartEntity isn't in this bucket (a caller filtering on something
+	// else, or it was renamed), so resume after it in active list order
+	for ( int iSlot = buckets[iBucket].head; iSlot != -1; iSlot = m_NameIndex[iSlot].next[iIndex] )
+	{
+		if ( m_NameIndex[iSlot].nOrder > start.nOrder )
+			return iSlot;
+	}
+
+	return -1;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Iterates the entities with a given classname.
 // Input  : pStartEntity - Last entity found, NULL to start a new iteration.
@@ -486,6 +712,19 @@ bool CGlobalEntityList::IsEntityPtr( void *pTest )
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName )
 {
+	if ( CanUseNameIndex( szName ) )
+	{
+		int iSlot = NameIndexFirst( NAME_INDEX_CLASSNAME, szName, pStartEntity );
+		for ( ; iSlot != -1; iSlot = m_NameIndex[iSlot].next[NAME_INDEX_CLASSNAME] )
+		{
+			CBaseEntity *pEntity = (CBaseEntity *)LookupEntityByNetworkIndex( iSlot );
+			if ( pEntity->ClassMatches( szName ) )
+				return pEntity;
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -595,6 +834,24 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 
 		return NULL;
 	}
+
+	if ( CanUseNameIndex( szName ) )
+	{
+		int iSlot = NameIndexFirst( NAME_INDEX_NAME, szName, pStartEntity );
+		for ( ; iSlot != -1; iSlot = m_NameIndex[iSlot].next[NAME_INDEX_NAME] )
+		{
+			CBaseEntity *ent = (CBaseEntity *)LookupEntityByNetworkIndex( iSlot );
+			if ( ent->NameMatches( szName ) )
+			{
+				if ( pFilter && !pFilter->ShouldFindEntity(ent) )
+					continue;
+
+				return ent;
+			}
+		}
+
+		return NULL;
+	}
 	
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -689,6 +946,55 @@ CBaseEntity	*CGlobalEntityList::FindEntityByTarget( CBaseEntity *pStartEntity, c
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityInSphere( CBaseEntity *pStartEntity, const Vector &vecCenter, float flRadius )
 {
+	if ( ent_spatial_index.GetBool() )
+	{
+		// Continuing the last query with nothing moved since, so carry on from the saved position
+		if ( pStartEntity && pStartEntity == m_pSphereQueryLast && m_nSphereQuerySerial == g_EntitySpatialIndex.GetSerial() &&
+			vecCenter == m_vecSphereQueryCenter && flRadius == m_flSphereQueryRadius )
+		{
+			m_pSphereQueryLast = ( m_iSphereQueryNext < m_SphereQuery.Count() ) ? m_SphereQuery[m_iSphereQueryNext++].pEntity : NULL;
+			return m_pSphereQueryLast;
+		}
+
+		CBaseEntity *pList[512];
+		int nCount = g_EntitySpatialIndex.EntitiesInSphere( vecCenter, flRadius, pList, ARRAYSIZE( pList ) );
+
+		// The index doesn't keep list order, so sort the hits and start after pStartEntity by hand.
+		// A full list may have been cut short, so that falls back to the walk.
+		if ( nCount < ARRAYSIZE( pList ) )
+		{
+			m_SphereQuery.RemoveAll();
+			for ( int i = 0; i < nCount; i++ )
+			{
+				CBaseEntity *ent = pList[i];
+				if ( !ent->edict() )
+					continue;
+
+				SphereQueryEntry_t &entry = m_SphereQuery[m_SphereQuery.AddToTail()];
+				entry.nOrder = m_NameIndex[ent->GetRefEHandle().GetEntryIndex()].nOrder;
+				entry.pEntity = ent;
+			}
+			m_SphereQuery.Sort( SphereQueryLess );
+
+			int iFirst = 0;
+			if ( pStartEntity )
+			{
+				unsigned int nStartOrder = m_NameIndex[pStartEntity->GetRefEHandle().GetEntryIndex()].nOrder;
+				while ( iFirst < m_SphereQuery.Count() && m_SphereQuery[iFirst].nOrder <= nStartOrder )
+				{
+					iFirst++;
+				}
+			}
+
+			m_vecSphereQueryCenter = vecCenter;
+			m_flSphereQueryRadius = flRadius;
+			m_nSphereQuerySerial = g_EntitySpatialIndex.GetSerial();
+			m_iSphereQueryNext = iFirst + 1;
+			m_pSphereQueryLast = ( iFirst < m_SphereQuery.Count() ) ? m_SphereQuery[iFirst].pEntity : NULL;
+			return m_pSphereQueryLast;
+		}
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -1092,6 +1398,12 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	m_iNumEnts++;
 	if ( i > m_iHighestEnt )
 		m_iHighestEnt = i;
+	m_iNameSerial++;
+
+	// Names and classnames get filled in after this, so index the entity at the next search
+	m_NameIndex[i].nOrder = m_nNameIndexOrder++;
+	NameIndexMarkDirty( i );
+	g_EntitySpatialIndex.MarkDirty( i );
 
 	// If it's a CBaseEntity, notify the listeners.
 	CBaseEntity *pBaseEnt = static_cast<IServerUnknown*>(pEnt)->GetBaseEntity();
@@ -1131,6 +1443,15 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 		m_iNumEdicts--;
 
 	m_iNumEnts--;
+	m_iNameSerial++;
+
+	int iSlot = handle.GetEntryIndex();
+	for ( int j = 0; j < NUM_NAME_INDEXES; j++ )
+	{
+		NameIndexUnlink( j, iSlot );
+	}
+	m_NameIndex[iSlot].bPending = false;
+	g_EntitySpatialIndex.RemoveEntity( iSlot );
 }
 
 void CGlobalEntityList::NotifyCreateEntity( CBaseEntity *pEnt )
@@ -14,6 +14,7 @@
 #endif
 
 #include "baseentity.h"
+#include "utlmap.h"
 
 class IEntityListener;
 
@@ -81,6 +82,67 @@ private:
 	bool m_bClearingEntities;
 	CUtlVector<IEntityListener *>	m_entityListeners;
 
+	int m_iNameSerial;
+
+	// Name and classname lookup. Entities are bucketed by a caseless hash of
+	// each string; every bucket is an intrusive list through m_NameIndex kept
+	// in the same order as the active list, so a search can resume after
+	// pStartEntity exactly like the linear walk does.
+	enum
+	{
+		NAME_INDEX_NAME = 0,
+		NAME_INDEX_CLASSNAME,
+		NUM_NAME_INDEXES
+	};
+
+	struct NameIndexEntry_t
+	{
+		unsigned int	nOrder;							// position in the active list
+		string_t		str[NUM_NAME_INDEXES];			// string the entry is bucketed under
+		unsigned int	hash[NUM_NAME_INDEXES];
+		int				next[NUM_NAME_INDEXES];
+		int				prev[NUM_NAME_INDEXES];
+		bool			bPending;						// on m_NameIndexPending
+	};
+
+	struct NameIndexBucket_t
+	{
+		int head;
+		int tail;
+	};
+
+	void	NameIndexMarkDirty( int iSlot );
+	void	NameIndexSync();
+	void	NameIndexLink( int iIndex, int iSlot, string_t str );
+	void	NameIndexUnlink( int iIndex, int iSlot );
+	int		NameIndexFirst( int iIndex, const char *pszName, CBaseEntity *pStartEntity );
+
+	NameIndexEntry_t	m_NameIndex[NUM_ENT_ENTRIES];
+	CUtlMap<unsigned int, NameIndexBucket_t>	m_NameBuckets[NUM_NAME_INDEXES];
+	CUtlVector<int>		m_NameIndexPending;
+	unsigned int		m_nNameIndexOrder;
+
+	// The last FindEntityInSphere answered from the spatial index, in active
+	// list order. A loop passing back the last result resumes from here
+	// instead of querying again, as long as nothing in the index changed.
+	struct SphereQueryEntry_t
+	{
+		unsigned int	nOrder;
+		CBaseEntity		*pEntity;
+	};
+
+	static int SphereQueryLess( const SphereQueryEntry_t *pLeft, const SphereQueryEntry_t *pRight )
+	{
+		return ( pLeft->nOrder < pRight->nOrder ) ? -1 : ( pLeft->nOrder > pRight->nOrder );
+	}
+
+	CUtlVector<SphereQueryEntry_t>	m_SphereQuery;
+	Vector				m_vecSphereQueryCenter;
+	float				m_flSphereQueryRadius;
+	int					m_nSphereQuerySerial;
+	int					m_iSphereQueryNext;
+	CBaseEntity			*m_pSphereQueryLast;
+
 public:
 	IServerNetworkable* GetServerNetworkable( CBaseHandle hEnt ) const;
 	CBaseNetworkable* GetBaseNetworkable( CBaseHandle hEnt ) const;
@@ -112,6 +174,13 @@ public:
 	void NotifyCreateEntity( CBaseEntity *pEnt );
 	void NotifySpawn( CBaseEntity *pEnt );
 	void NotifyRemoveEntity( CBaseHandle hEnt );
+
+	// Changes whenever an entity is added, removed or renamed, so results of
+	// name and classname searches can be cached until it does.
+	int		GetNameSerial() const	{ return m_iNameSerial; }
+	// Call whenever m_iName or m_iClassname is changed on a live entity.
+	void	NotifyNameChanged( CBaseEntity *pEntity );
+
 	// iteration functions
 
 	// returns the next entity after pCurrentEnt;  if pCurrentEnt is NULL, return the first entity
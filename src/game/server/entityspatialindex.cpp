@@ -0,0 +1,555 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Spatial index over every entity's collision bounds
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "entityspatialindex.h"
+#include "collisionutils.h"
+#include "props_shared.h"
+#include "datacache/imdlcache.h"
+#include "tier0/fasttimer.h"
+#include "tier0/vprof.h"
+#include "vstdlib/random.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+CEntitySpatialIndex g_EntitySpatialIndex;
+
+ConVar ent_spatial_index( "ent_spatial_index", "1", 0, "Answer FindEntityInSphere from the entity spatial index instead of walking every entity." );
+
+// Entities further out than this go in the oversized list rather than overflow a cell coordinate
+#define SPATIAL_INDEX_COORD_LIMIT	( 4.0f * MAX_COORD_FLOAT )
+
+CEntitySpatialIndex::CEntitySpatialIndex()
+{
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		Node_t &node = m_Nodes[i];
+		node.vecOrigin.Init();
+		node.flRadius = 0.0f;
+		node.nLevel = -1;
+		node.nCell[0] = node.nCell[1] = node.nCell[2] = 0;
+		node.iBucket = 0;
+		node.next = node.prev = -1;
+		node.bPending = false;
+	}
+
+	for ( int nLevel = 0; nLevel <= NUM_LEVELS; nLevel++ )
+	{
+		for ( int i = 0; i < NUM_BUCKETS; i++ )
+		{
+			m_Buckets[nLevel][i] = -1;
+		}
+		m_nLevelCount[nLevel] = 0;
+	}
+
+	m_nSerial = 0;
+}
+
+float CEntitySpatialIndex::CellSize( int nLevel )
+{
+	return 128.0f * (float)( 1 << ( 2 * nLevel ) );
+}
+
+int CEntitySpatialIndex::CellBucket( int x, int y, int z )
+{
+	unsigned int hash = ( (unsigned int)x * 73856093u ) ^ ( (unsigned int)y * 19349663u ) ^ ( (unsigned int)z * 83492791u );
+	return hash & ( NUM_BUCKETS - 1 );
+}
+
+void CEntitySpatialIndex::MarkDirty( CBaseEntity *pEntity )
+{
+	// Entities set up their collision bounds before they're in the list; OnAddEntity picks those up
+	if ( pEntity->GetRefEHandle().IsValid() )
+	{
+		MarkDirty( pEntity->GetRefEHandle().GetEntryIndex() );
+	}
+}
+
+void CEntitySpatialIndex::MarkDirty( int iSlot )
+{
+	++m_nSerial;
+
+	if ( m_Nodes[iSlot].bPending )
+		return;
+
+	m_Nodes[iSlot].bPending = true;
+	m_Pending.AddToTail( iSlot );
+}
+
+void CEntitySpatialIndex::RemoveEntity( int iSlot )
+{
+	++m_nSerial;
+	Unlink( iSlot );
+	m_Nodes[iSlot].bPending = false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Re-buckets everything that moved or resized since the last query
+//-----------------------------------------------------------------------------
+void CEntitySpatialIndex::Sync()
+{
+	for ( int i = 0; i < m_Pending.Count(); i++ )
+	{
+		int iSlot = m_Pending[i];
+
+		// Removed since it was queued
+		if ( !m_Nodes[iSlot].bPending )
+			continue;
+		m_Nodes[iSlot].bPending = false;
+
+		CBaseEntity *pEntity = (CBaseEntity *)gEntList.LookupEntityByNetworkIndex( iSlot );
+		if ( pEntity )
+		{
+			Link( iSlot, pEntity );
+		}
+		else
+		{
+			Unlink( iSlot );
+		}
+	}
+
+	m_Pending.RemoveAll();
+}
+
+void CEntitySpatialIndex::Link( int iSlot, CBaseEntity *pEntity )
+{
+	CCollisionProperty *pCollide = pEntity->CollisionProp();
+	const Vector &vecMins = pCollide->OBBMins();
+	const Vector &vecMaxs = pCollide->OBBMaxs();
+	const Vector &vecOrigin = pCollide->GetCollisionOrigin();
+
+	// Farthest the OBB can reach from the collision origin, whatever the rotation
+	Vector vecExtent( MAX( fabs( vecMins.x ), fabs( vecMaxs.x ) ), MAX( fabs( vecMins.y ), fabs( vecMaxs.y ) ), MAX( fabs( vecMins.z ), fabs( vecMaxs.z ) ) );
+	float flRadius = vecExtent.Length();
+
+	int nLevel = 0;
+	while ( nLevel < NUM_LEVELS && flRadius * 2.0f > CellSize( nLevel ) )
+	{
+		nLevel++;
+	}
+
+	int nCell[3] = { 0, 0, 0 };
+	if ( nLevel < NUM_LEVELS )
+	{
+		float flCell = CellSize( nLevel );
+		for ( int k = 0; k < 3; k++ )
+		{
+			// also catches NaNs
+			if ( !( fabs( vecOrigin[k] ) <= SPATIAL_INDEX_COORD_LIMIT ) )
+			{
+				nLevel = OVERSIZED_LEVEL;
+				break;
+			}
+			nCell[k] = (int)floor( vecOrigin[k] / flCell );
+		}
+	}
+	if ( nLevel == OVERSIZED_LEVEL )
+	{
+		nCell[0] = nCell[1] = nCell[2] = 0;
+	}
+
+	Node_t &node = m_Nodes[iSlot];
+	node.vecOrigin = vecOrigin;
+	node.flRadius = flRadius;
+
+	// Most moves stay in the same cell
+	if ( node.nLevel == nLevel && node.nCell[0] == nCell[0] && node.nCell[1] == nCell[1] && node.nCell[2] == nCell[2] )
+		return;
+
+	Unlink( iSlot );
+
+	int iBucket = ( nLevel < NUM_LEVELS ) ? CellBucket( nCell[0], nCell[1], nCell[2] ) : 0;
+	node.nLevel = nLevel;
+	node.nCell[0] = nCell[0];
+	node.nCell[1] = nCell[1];
+	node.nCell[2] = nCell[2];
+	node.iBucket = iBucket;
+	node.prev = -1;
+	node.next = m_Buckets[nLevel][iBucket];
+	if ( node.next != -1 )
+	{
+		m_Nodes[node.next].prev = iSlot;
+	}
+	m_Buckets[nLevel][iBucket] = iSlot;
+	m_nLevelCount[nLevel]++;
+}
+
+void CEntitySpatialIndex::Unlink( int iSlot )
+{
+	Node_t &node = m_Nodes[iSlot];
+	if ( node.nLevel < 0 )
+		return;
+
+	if ( node.prev != -1 )
+	{
+		m_Nodes[node.prev].next = node.next;
+	}
+	else
+	{
+		m_Buckets[node.nLevel][node.iBucket] = node.next;
+	}
+
+	if ( node.next != -1 )
+	{
+		m_Nodes[node.next].prev = node.prev;
+	}
+
+	m_nLevelCount[node.nLevel]--;
+	node.nLevel = -1;
+	node.next = node.prev = -1;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Hands every entity in the bucket whose bounding sphere touches the
+//			box to pEnum. pCell skips other cells that hash to the same bucket;
+//			pass NULL when walking a whole level.
+//-----------------------------------------------------------------------------
+bool CEntitySpatialIndex::EnumerateBucket( int nLevel, int iBucket, const int *pCell, const Vector &vecMins, const Vector &vecMaxs, IEntitySpatialEnumerator *pEnum )
+{
+	for ( int iSlot = m_Buckets[nLevel][iBucket]; iSlot != -1; iSlot = m_Nodes[iSlot].next )
+	{
+		const Node_t &node = m_Nodes[iSlot];
+		if ( pCell && ( node.nCell[0] != pCell[0] || node.nCell[1] != pCell[1] || node.nCell[2] != pCell[2] ) )
+			continue;
+
+		const Vector &vecOrigin = node.vecOrigin;
+		float flRadius = node.flRadius;
+		if ( vecOrigin.x + flRadius < vecMins.x || vecOrigin.x - flRadius > vecMaxs.x ||
+			 vecOrigin.y + flRadius < vecMins.y || vecOrigin.y - flRadius > vecMaxs.y ||
+			 vecOrigin.z + flRadius < vecMins.z || vecOrigin.z - flRadius > vecMaxs.z )
+			continue;
+
+		CBaseEntity *pEntity = (CBaseEntity *)gEntList.LookupEntityByNetworkIndex( iSlot );
+		if ( pEntity && !pEnum->EnumEntity( pEntity ) )
+			return false;
+	}
+
+	return true;
+}
+
+void CEntitySpatialIndex::EnumerateEntities( const Vector &vecMins, const Vector &vecMaxs, IEntitySpatialEnumerator *pEnum )
+{
+	VPROF( "CEntitySpatialIndex::EnumerateEntities" );
+
+	Sync();
+
+	for ( int nLevel = 0; nLevel < NUM_LEVELS; nLevel++ )
+	{
+		if ( !m_nLevelCount[nLevel] )
+			continue;
+
+		// Spheres on this level are at most a cell across, so one can poke half
+		// a cell out of the cell its origin is in
+		float flCell = CellSize( nLevel );
+		float flLimit = SPATIAL_INDEX_COORD_LIMIT + flCell;
+		int nLow[3], nHigh[3];
+		float flCells = 1.0f;
+		for ( int k = 0; k < 3; k++ )
+		{
+			float flMin = clamp( vecMins[k] - flCell * 0.5f, -flLimit, flLimit );
+			float flMax = clamp( vecMaxs[k] + flCell * 0.5f, -flLimit, flLimit );
+			nLow[k] = (int)floor( flMin / flCell );
+			nHigh[k] = (int)floor( flMax / flCell );
+			flCells *= (float)MAX( nHigh[k] - nLow[k] + 1, 0 );
+		}
+
+		if ( flCells == 0.0f )
+			continue;
+
+		if ( flCells > NUM_BUCKETS )
+		{
+			// Cheaper to look at everything on this level once
+			for ( int iBucket = 0; iBucket < NUM_BUCKETS; iBucket++ )
+			{
+				if ( !EnumerateBucket( nLevel, iBucket, NULL, vecMins, vecMaxs, pEnum ) )
+					return;
+			}
+			continue;
+		}
+
+		int nCell[3];
+		for ( nCell[0] = nLow[0]; nCell[0] <= nHigh[0]; nCell[0]++ )
+		{
+			for ( nCell[1] = nLow[1]; nCell[1] <= nHigh[1]; nCell[1]++ )
+			{
+				for ( nCell[2] = nLow[2]; nCell[2] <= nHigh[2]; nCell[2]++ )
+				{
+					int iBucket = CellBucket( nCell[0], nCell[1], nCell[2] );
+					if ( !EnumerateBucket( nLevel, iBucket, nCell, vecMins, vecMaxs, pEnum ) )
+						return;
+				}
+			}
+		}
+	}
+
+	EnumerateBucket( OVERSIZED_LEVEL, 0, NULL, vecMins, vecMaxs, pEnum );
+}
+
+//-----------------------------------------------------------------------------
+// Query enumerators
+//-----------------------------------------------------------------------------
+class CSpatialIndexListEnum : public IEntitySpatialEnumerator
+{
+public:
+	CSpatialIndexListEnum( CBaseEntity **pList, int nMaxCount ) : m_pList( pList ), m_nMaxCount( nMaxCount ), m_nCount( 0 ) {}
+
+	bool AddToList( CBaseEntity *pEntity )
+	{
+		m_pList[m_nCount++] = pEntity;
+		return m_nCount < m_nMaxCount;
+	}
+
+	CBaseEntity **m_pList;
+	int m_nMaxCount;
+	int m_nCount;
+};
+
+class CSpatialIndexSphereEnum : public CSpatialIndexListEnum
+{
+public:
+	CSpatialIndexSphereEnum( const Vector &vecCenter, float flRadius, CBaseEntity **pList, int nMaxCount ) :
+		CSpatialIndexListEnum( pList, nMaxCount ), m_vecCenter( vecCenter ), m_flRadius( flRadius ) {}
+
+	virtual bool EnumEntity( CBaseEntity *pEntity )
+	{
+		CCollisionProperty *pCollide = pEntity->CollisionProp();
+
+		Vector vecRelativeCenter;
+		pCollide->WorldToCollisionSpace( m_vecCenter, &vecRelativeCenter );
+		if ( !IsBoxIntersectingSphere( pCollide->OBBMins(), pCollide->OBBMaxs(), vecRelativeCenter, m_flRadius ) )
+			return true;
+
+		return AddToList( pEntity );
+	}
+
+	Vector m_vecCenter;
+	float m_flRadius;
+};
+
+class CSpatialIndexBoxEnum : public CSpatialIndexListEnum
+{
+public:
+	CSpatialIndexBoxEnum( const Vector &vecMins, const Vector &vecMaxs, CBaseEntity **pList, int nMaxCount ) :
+		CSpatialIndexListEnum( pList, nMaxCount ), m_vecMins( vecMins ), m_vecMaxs( vecMaxs ) {}
+
+	virtual bool EnumEntity( CBaseEntity *pEntity )
+	{
+		Vector vecWorldMins, vecWorldMaxs;
+		pEntity->CollisionProp()->WorldSpaceAABB( &vecWorldMins, &vecWorldMaxs );
+		if ( !IsBoxIntersectingBox( vecWorldMins, vecWorldMaxs, m_vecMins, m_vecMaxs ) )
+			return true;
+
+		return AddToList( pEntity );
+	}
+
+	Vector m_vecMins;
+	Vector m_vecMaxs;
+};
+
+class CSpatialIndexConeEnum : public CSpatialIndexListEnum
+{
+public:
+	CSpatialIndexConeEnum( const Vector &vecApex, const Vector &vecDir, float flLength, float flSin, float flCos, CBaseEntity **pList, int nMaxCount ) :
+		CSpatialIndexListEnum( pList, nMaxCount ), m_vecApex( vecApex ), m_vecDir( vecDir ), m_flLength( flLength ), m_flSin( flSin ), m_flCos( flCos ) {}
+
+	virtual bool EnumEntity( CBaseEntity *pEntity )
+	{
+		CCollisionProperty *pCollide = pEntity->CollisionProp();
+		Vector vecDelta = pCollide->WorldSpaceCenter() - m_vecApex;
+		float flRadius = pCollide->BoundingRadius();
+
+		// Past the base of the cone
+		float flAlong = DotProduct( vecDelta, m_vecDir );
+		if ( flAlong - flRadius > m_flLength )
+			return true;
+
+		// Moving the apex back by r / sin(angle) turns sphere-in-cone into point-in-cone...
+		Vector vecShifted = vecDelta + m_vecDir * ( flRadius / m_flSin );
+		float flShiftedAlong = DotProduct( vecShifted, m_vecDir );
+		if ( flShiftedAlong <= 0.0f || flShiftedAlong * flShiftedAlong < vecShifted.LengthSqr() * m_flCos * m_flCos )
+			return true;
+
+		// ...except behind the real apex, where the sphere has to contain the apex itself
+		float flDistSqr = vecDelta.LengthSqr();
+		if ( flAlong < 0.0f && flAlong * flAlong >= flDistSqr * m_flSin * m_flSin && flDistSqr > flRadius * flRadius )
+			return true;
+
+		return AddToList( pEntity );
+	}
+
+	Vector m_vecApex;
+	Vector m_vecDir;
+	float m_flLength;
+	float m_flSin;
+	float m_flCos;
+};
+
+int CEntitySpatialIndex::EntitiesInSphere( const Vector &vecCenter, float flRadius, CBaseEntity **pList, int nMaxCount )
+{
+	if ( nMaxCount <= 0 )
+		return 0;
+
+	CSpatialIndexSphereEnum sphereEnum( vecCenter, flRadius, pList, nMaxCount );
+	Vector vecRadius( flRadius, flRadius, flRadius );
+	EnumerateEntities( vecCenter - vecRadius, vecCenter + vecRadius, &sphereEnum );
+	return sphereEnum.m_nCount;
+}
+
+int CEntitySpatialIndex::EntitiesInBox( const Vector &vecMins, const Vector &vecMaxs, CBaseEntity **pList, int nMaxCount )
+{
+	if ( nMaxCount <= 0 )
+		return 0;
+
+	CSpatialIndexBoxEnum boxEnum( vecMins, vecMaxs, pList, nMaxCount );
+	EnumerateEntities( vecMins, vecMaxs, &boxEnum );
+	return boxEnum.m_nCount;
+}
+
+int CEntitySpatialIndex::EntitiesInCone( const Vector &vecApex, const Vector &vecDir, float flLength, float flHalfAngle, CBaseEntity **pList, int nMaxCount )
+{
+	if ( nMaxCount <= 0 )
+		return 0;
+
+	float flSin, flCos;
+	SinCos( DEG2RAD( clamp( flHalfAngle, 0.1f, 89.9f ) ), &flSin, &flCos );
+
+	// Bounds of the apex plus the disc at the base
+	Vector vecBase = vecApex + vecDir * flLength;
+	float flBaseRadius = flLength * flSin / flCos;
+	Vector vecDisc;
+	for ( int k = 0; k < 3; k++ )
+	{
+		vecDisc[k] = flBaseRadius * sqrt( MAX( 0.0f, 1.0f - vecDir[k] * vecDir[k] ) );
+	}
+
+	Vector vecMins, vecMaxs;
+	VectorMin( vecApex, vecBase - vecDisc, vecMins );
+	VectorMax( vecApex, vecBase + vecDisc, vecMaxs );
+
+	CSpatialIndexConeEnum coneEnum( vecApex, vecDir, flLength, flSin, flCos, pList, nMaxCount );
+	EnumerateEntities( vecMins, vecMaxs, &coneEnum );
+	return coneEnum.m_nCount;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Times FindEntityInSphere with and without the index, and the engine
+//			partition, on a world with a few thousand props in it.
+//-----------------------------------------------------------------------------
+CON_COMMAND_F( ent_spatial_bench, "Times sphere queries through FindEntityInSphere (with and without ent_spatial_index), UTIL_EntitiesInSphere and the spatial index.\n\tArguments:	[props to spawn] [queries] [radius] [model]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nProps = ( args.ArgC() > 1 ) ? atoi( args[1] ) : 4000;
+	int nQueries = ( args.ArgC() > 2 ) ? MAX( atoi( args[2] ), 1 ) : 1000;
+	float flRadius = ( args.ArgC() > 3 ) ? atof( args[3] ) : 256.0f;
+	const char *pszModel = ( args.ArgC() > 4 ) ? args[4] : "models/props_junk/wood_crate001a.mdl";
+
+	CBasePlayer *pPlayer = UTIL_GetCommandClient();
+	Vector vecCenter = pPlayer ? pPlayer->GetAbsOrigin() : vec3_origin;
+
+	// Props go on a cube of side flSide around the player, frozen so the layout holds still
+	const float flSpacing = 96.0f;
+	int nSide = (int)ceil( pow( (float)MAX( nProps, 1 ), 1.0f / 3.0f ) );
+	float flSide = nSide * flSpacing;
+
+	CUtlVector<EHANDLE> props;
+	if ( nProps > 0 )
+	{
+		MDLCACHE_CRITICAL_SECTION();
+
+		bool allowPrecache = CBaseEntity::IsPrecacheAllowed();
+		CBaseEntity::SetAllowPrecache( true );
+		CBaseEntity::PrecacheModel( pszModel );
+
+		for ( int i = 0; i < nProps; i++ )
+		{
+			CBaseEntity *pProp = CreateEntityByName( "prop_physics" );
+			if ( !pProp )
+				break;
+
+			Vector vecPos = vecCenter + Vector( ( i % nSide ) + 0.5f, ( ( i / nSide ) % nSide ) + 0.5f, ( i / ( nSide * nSide ) ) + 0.5f ) * flSpacing;
+			vecPos.x -= flSide * 0.5f;
+			vecPos.y -= flSide * 0.5f;
+			pProp->SetAbsOrigin( vecPos );
+			pProp->SetModelName( AllocPooledString( pszModel ) );
+			pProp->AddSpawnFlags( SF_PHYSPROP_MOTIONDISABLED );
+			DispatchSpawn( pProp );
+			props.AddToTail( pProp );
+		}
+
+		CBaseEntity::SetAllowPrecache( allowPrecache );
+	}
+
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+	CUtlVector<Vector> centers;
+	centers.EnsureCapacity( nQueries );
+	for ( int i = 0; i < nQueries; i++ )
+	{
+		Vector vecQuery = vecCenter + Vector( random.RandomFloat( -0.5f, 0.5f ) * flSide, random.RandomFloat( -0.5f, 0.5f ) * flSide, random.RandomFloat( 0.0f, 1.0f ) * flSide );
+		centers.AddToTail( vecQuery );
+	}
+
+	CBaseEntity *pList[1024];
+	int nHits[4] = { 0, 0, 0, 0 };
+	float flMs[4];
+	CFastTimer timer;
+
+	// FindEntityInSphere, walking the entity list and through the index
+	bool bWasIndexed = ent_spatial_index.GetBool();
+	for ( int nPass = 0; nPass < 2; nPass++ )
+	{
+		ent_spatial_index.SetValue( nPass );
+		timer.Start();
+		for ( int i = 0; i < nQueries; i++ )
+		{
+			for ( CBaseEntity *pEntity = gEntList.FindEntityInSphere( NULL, centers[i], flRadius ); pEntity; pEntity = gEntList.FindEntityInSphere( pEntity, centers[i], flRadius ) )
+			{
+				nHits[nPass]++;
+			}
+		}
+		timer.End();
+		flMs[nPass] = timer.GetDuration().GetMillisecondsF();
+	}
+	ent_spatial_index.SetValue( bWasIndexed );
+
+	// The engine partition, which only holds solid and trigger edicts
+	timer.Start();
+	for ( int i = 0; i < nQueries; i++ )
+	{
+		nHits[2] += UTIL_EntitiesInSphere( pList, ARRAYSIZE( pList ), centers[i], flRadius, 0 );
+	}
+	timer.End();
+	flMs[2] = timer.GetDuration().GetMillisecondsF();
+
+	// The index on its own
+	timer.Start();
+	for ( int i = 0; i < nQueries; i++ )
+	{
+		nHits[3] += g_EntitySpatialIndex.EntitiesInSphere( centers[i], flRadius, pList, ARRAYSIZE( pList ) );
+	}
+	timer.End();
+	flMs[3] = timer.GetDuration().GetMillisecondsF();
+
+	static const char *s_pszNames[] = { "FindEntityInSphere (walk)", "FindEntityInSphere (index)", "UTIL_EntitiesInSphere", "g_EntitySpatialIndex" };
+	Msg( "ent_spatial_bench: %d entities, %d queries, radius %.0f\n", gEntList.NumberOfEntities(), nQueries, flRadius );
+	for ( int i = 0; i < 4; i++ )
+	{
+		Msg( "  %-28s %8.4f ms/query  %d hits\n", s_pszNames[i], flMs[i] / nQueries, nHits[i] );
+	}
+	if ( nHits[0] != nHits[1] )
+	{
+		Warning( "ent_spatial_bench: FindEntityInSphere found %d entities walking the list but %d through the index!\n", nHits[0], nHits[1] );
+	}
+
+	for ( int i = 0; i < props.Count(); i++ )
+	{
+		UTIL_Remove( props[i] );
+	}
+}
@@ -0,0 +1,110 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Spatial index over every entity's collision bounds
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef ENTITYSPATIALINDEX_H
+#define ENTITYSPATIALINDEX_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+
+class CBaseEntity;
+
+//-----------------------------------------------------------------------------
+// Purpose: Callback for CEntitySpatialIndex::EnumerateEntities
+//-----------------------------------------------------------------------------
+abstract_class IEntitySpatialEnumerator
+{
+public:
+	// Return false to stop the enumeration
+	virtual bool EnumEntity( CBaseEntity *pEntity ) = 0;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Loose hashed grid over all entities, edict or not, solid or not.
+//			Unlike the engine's spatial partition it doesn't care about solid
+//			flags, so it can answer FindEntityInSphere-style questions without
+//			walking the whole entity list.
+//
+//			Each entity is bounded by a sphere around its collision origin that
+//			contains its OBB at any rotation, and sits in the cell containing
+//			that origin at the smallest level whose cells are at least as wide
+//			as the sphere. Entities are re-bucketed lazily: CCollisionProperty
+//			marks them dirty when they move or resize, and the next query
+//			picks them up.
+//
+//			Queries fill a caller-provided list and never allocate. Results
+//			are in no particular order.
+//-----------------------------------------------------------------------------
+class CEntitySpatialIndex
+{
+public:
+	CEntitySpatialIndex();
+
+	// Bookkeeping, from the entity list and CCollisionProperty
+	void	MarkDirty( CBaseEntity *pEntity );
+	void	MarkDirty( int iSlot );
+	void	RemoveEntity( int iSlot );
+
+	// Changes whenever an entity moves, resizes or leaves the index, so a
+	// caller can tell whether an earlier query's result is still current
+	int		GetSerial() const	{ return m_nSerial; }
+
+	// Every entity whose bounding sphere touches the box, for callers that do
+	// their own exact test
+	void	EnumerateEntities( const Vector &vecMins, const Vector &vecMaxs, IEntitySpatialEnumerator *pEnum );
+
+	// Entities whose OBB touches the sphere; the same test FindEntityInSphere uses
+	int		EntitiesInSphere( const Vector &vecCenter, float flRadius, CBaseEntity **pList, int nMaxCount );
+
+	// Entities whose world-space AABB touches the box
+	int		EntitiesInBox( const Vector &vecMins, const Vector &vecMaxs, CBaseEntity **pList, int nMaxCount );
+
+	// Entities whose bounding sphere touches the cone. vecDir must be normalized,
+	// flHalfAngle is in degrees and is clamped below 90.
+	int		EntitiesInCone( const Vector &vecApex, const Vector &vecDir, float flLength, float flHalfAngle, CBaseEntity **pList, int nMaxCount );
+
+private:
+	enum
+	{
+		NUM_LEVELS = 4,				// cells of 128, 512, 2048 and 8192 units
+		OVERSIZED_LEVEL = NUM_LEVELS,	// anything bigger, in a single list
+		NUM_BUCKETS = 4096,			// per level, a power of two
+	};
+
+	struct Node_t
+	{
+		Vector	vecOrigin;
+		float	flRadius;
+		int		nLevel;				// -1 when not in the grid
+		int		nCell[3];
+		int		iBucket;
+		int		next;
+		int		prev;
+		bool	bPending;
+	};
+
+	void	Sync();
+	void	Link( int iSlot, CBaseEntity *pEntity );
+	void	Unlink( int iSlot );
+	bool	EnumerateBucket( int nLevel, int iBucket, const int *pCell, const Vector &vecMins, const Vector &vecMaxs, IEntitySpatialEnumerator *pEnum );
+
+	static float	CellSize( int nLevel );
+	static int		CellBucket( int x, int y, int z );
+
+	Node_t			m_Nodes[NUM_ENT_ENTRIES];
+	int				m_Buckets[NUM_LEVELS + 1][NUM_BUCKETS];
+	int				m_nLevelCount[NUM_LEVELS + 1];
+	CUtlVector<int>	m_Pending;
+	int				m_nSerial;
+};
+
+extern CEntitySpatialIndex g_EntitySpatialIndex;
+
+#endif // ENTITYSPATIALINDEX_H
@@ -15,6 +15,8 @@
 #endif
 
 #include "mempool.h"
+#include "utlmap.h"
+#include "utldict.h"
 
 struct EventQueuePrioritizedEvent_t
 {
@@ -28,8 +30,15 @@ struct EventQueuePrioritizedEvent_t
 
 	variant_t m_VariantValue;	// variable-type parameter
 
-	EventQueuePrioritizedEvent_t *m_pNext;
-	EventQueuePrioritizedEvent_t *m_pPrev;
+	// position in the queue's heap, and the order events were queued in so
+	// that events due at the same time fire in that order
+	int m_iHeapIndex;
+	unsigned int m_iSerial;
+
+	// other events queued by the same caller
+	unsigned long m_iCallerKey;
+	EventQueuePrioritizedEvent_t *m_pNextByCaller;
+	EventQueuePrioritizedEvent_t *m_pPrevByCaller;
 
 	DECLARE_SIMPLE_DATADESC();
 
@@ -70,10 +79,43 @@ private:
 
 	void AddEvent( EventQueuePrioritizedEvent_t *event );
 	void RemoveEvent( EventQueuePrioritizedEvent_t *pe );
+	void DeleteEvent( EventQueuePrioritizedEvent_t *pe );
+
+	// binary min-heap on fire time
+	static bool FiresBefore( const EventQueuePrioritizedEvent_t *a, const EventQueuePrioritizedEvent_t *b );
+	void HeapSet( int i, EventQueuePrioritizedEvent_t *pe );
+	void HeapUp( int i );
+	void HeapDown( int i );
+
+	// all events in the order they will fire
+	void GetSortedEvents( CUtlVector< EventQueuePrioritizedEvent_t * > &events );
+
+	// target lookups
+	CBaseEntity *FindTarget( CBaseEntity *pStartEntity, EventQueuePrioritizedEvent_t *pe, bool bClassname );
+	bool FireAtTargets( EventQueuePrioritizedEvent_t *pe, bool bClassname );
 
 	DECLARE_SIMPLE_DATADESC();
-	EventQueuePrioritizedEvent_t m_Events;
+	CUtlVector< EventQueuePrioritizedEvent_t * > m_Events;
+	unsigned int m_iNextSerial;
 	int m_iListCount;
+
+	// the event ServiceEvents is firing; it stays queued until it's done
+	EventQueuePrioritizedEvent_t *m_pFiringEvent;
+
+	// first event queued by each caller, keyed by the caller's entity handle
+	CUtlMap< unsigned long, EventQueuePrioritizedEvent_t * > m_CallerEvents;
+
+	// Entities that plain target names and classnames resolved to, valid
+	// while gEntList's name serial is unchanged
+	struct CachedTargets_t
+	{
+		int m_iFirst;
+		int m_nCount;
+	};
+	CUtlDict< CachedTargets_t, int > m_NameTargets;
+	CUtlDict< CachedTargets_t, int > m_ClassnameTargets;
+	CUtlVector< EHANDLE > m_CachedTargets;
+	int m_iTargetCacheSerial;
 };
 
 extern CEventQueue g_EventQueue;
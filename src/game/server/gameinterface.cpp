@@ -1243,6 +1243,11 @@ void CServerGameDLL::GameServerSteamAPIShutdown( void )
 //-----------------------------------------------------------------------------
 ConVar  trace_report( "trace_report", "0" );
 
+#ifdef LUA_SDK
+// When the first tick of this host frame started, 0 if none has yet
+static double s_flLuaGCFrameStart = 0;
+#endif
+
 void CServerGameDLL::GameFrame( bool simulating )
 {
 	VPROF( "CServerGameDLL::GameFrame" );
@@ -1251,6 +1256,14 @@ void CServerGameDLL::GameFrame( bool simulating )
 	if ( g_InRestore )
 		return;
 
+#ifdef LUA_SDK
+	if ( !s_flLuaGCFrameStart )
+	{
+		s_flLuaGCFrameStart = Plat_FloatTime();
+		luasrc_gcpause();
+	}
+#endif
+
 	if ( CBaseEntity::IsSimulatingOnAlternateTicks() )
 	{
 		// only run simulation on even numbered ticks
@@ -1345,6 +1358,19 @@ void CServerGameDLL::GameFrame( bool simulating )
 //-----------------------------------------------------------------------------
 void CServerGameDLL::PreClientUpdate( bool simulating )
 {
+#ifdef LUA_SDK
+	// Collect Lua garbage once per host frame, after all of its ticks. The
+	// engine runs several ticks back to back when it's catching up, so the
+	// next one is due an interval after the first of them started, however
+	// many ran.
+	if ( s_flLuaGCFrameStart )
+	{
+		float flSpareTime = ( s_flLuaGCFrameStart + gpGlobals->interval_per_tick - Plat_FloatTime() ) * 1000.0f;
+		luasrc_gcstep( flSpareTime );
+		s_flLuaGCFrameStart = 0;
+	}
+#endif
+
 	if ( !simulating )
 		return;
 
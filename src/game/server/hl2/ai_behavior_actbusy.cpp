@@ -129,7 +129,7 @@ void CActBusyAnimData::LevelShutdownPostEntity( void )
 void CActBusyAnimData::ParseAnimDataFile( void )
 {
 	KeyValues *pKVAnimData = new KeyValues( "ActBusyAnimDatafile" );
-	if ( pKVAnimData->LoadFromFile( filesystem, "scripts/actbusy.txt" ) )
+	if ( pKVAnimData->LoadFromFileCached( filesystem, "scripts/actbusy.txt" ) )
 	{
 		// Now try and parse out each act busy anim
 		KeyValues *pKVAnim = pKVAnimData->GetFirstSubKey();
@@ -79,6 +79,7 @@ public:
 	int		ObjectCaps();
 	void	HandleAnimEvent( animevent_t *pEvent );
 	bool	FInViewCone( CBaseEntity *pEntity );
+	bool	HasStandardViewCone() { return false; }
 	bool	QuerySeeEntity( CBaseEntity *pEntity, bool bOnlyHateOrFearIfNPC = false );
 	bool	CanSeeEntityInDarkness( CBaseEntity *pEntity );
 	bool	IsCoverPosition( const Vector &vecThreat, const Vector &vecPosition );
@@ -87,6 +87,7 @@ public:
 	float		MaxYawSpeed( void );
 	bool		FInViewCone( CBaseEntity *pEntity );
 	bool		FInViewCone( const Vector &vecSpot );
+	bool		HasStandardViewCone() { return false; }
 				
 	void		Activate( void );
 	void		HandleAnimEvent( animevent_t *pEvent );
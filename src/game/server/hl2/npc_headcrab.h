@@ -270,6 +270,7 @@ public:
 	virtual void TelegraphSound( void );
 #if HL2_EPISODIC
 	virtual bool FInViewCone( CBaseEntity *pEntity );
+	virtual bool HasStandardViewCone() { return false; }
 #endif
 
 	//
@@ -83,6 +83,7 @@ public:
 	void				LaunchGrenade(CBaseEntity* pLauncher );
 	void				LauncherThink(void );
 	bool				FInViewCone( CBaseEntity *pEntity );
+	bool				HasStandardViewCone() { return false; }
 
 	int					DrawDebugTextOverlays(void);
 
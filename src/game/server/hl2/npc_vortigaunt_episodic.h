@@ -68,6 +68,7 @@ public:
 	virtual float	InnateRange1MaxRange( void ) { return sk_vortigaunt_zap_range.GetFloat()*12; }
 	virtual int		OnTakeDamage_Alive( const CTakeDamageInfo &info );
 	virtual bool	FInViewCone( CBaseEntity *pEntity );
+	virtual bool	HasStandardViewCone() { return false; }
 	virtual bool	ShouldMoveAndShoot( void );
 
 	// vorts have a very long head/neck swing, so debounce heavily
@@ -221,6 +221,7 @@ public:
 	bool QuerySeeEntity( CBaseEntity *pEntity, bool bOnlyHateOrFearIfNPC = false );
 
 	virtual bool FInViewCone( CBaseEntity *pEntity );
+	virtual bool HasStandardViewCone() { return false; }
 
 	void StartTask( const Task_t *pTask );
 	void RunTask( const Task_t *pTask );
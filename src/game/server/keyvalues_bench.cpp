@@ -0,0 +1,162 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compares the KeyValues parser with CKeyValuesDocument
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "filesystem.h"
+#include "utlbuffer.h"
+#include "tier0/fasttimer.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+struct KeyValuesBenchFile_t
+{
+	char		szName[MAX_PATH];
+	CUtlBuffer	buffer;
+};
+
+static bool IsKeyValuesBenchFile( const char *pszName )
+{
+	static const char *s_pszExtensions[] = { "res", "vmt", "txt", "vdf", "scr" };
+
+	const char *pszExtension = V_GetFileExtension( pszName );
+	if ( !pszExtension )
+		return false;
+
+	for ( int i = 0; i < ARRAYSIZE( s_pszExtensions ); i++ )
+	{
+		if ( !Q_stricmp( pszExtension, s_pszExtensions[i] ) )
+			return true;
+	}
+	return false;
+}
+
+static void FindKeyValuesBenchFiles( const char *pszDir, CUtlVector<KeyValuesBenchFile_t *> &files )
+{
+	char szWildcard[MAX_PATH];
+	Q_snprintf( szWildcard, sizeof( szWildcard ), pszDir[0] ? "%s/*.*" : "%s*.*", pszDir );
+	Q_FixSlashes( szWildcard );
+
+	CUtlVector<CUtlString> subdirs;
+
+	FileFindHandle_t fh;
+	for ( const char *pszName = filesystem->FindFirstEx( szWildcard, "MOD", &fh ); pszName; pszName = filesystem->FindNext( fh ) )
+	{
+		if ( pszName[0] == '.' )
+			continue;
+
+		char szPath[MAX_PATH];
+		Q_snprintf( szPath, sizeof( szPath ), pszDir[0] ? "%s/%s" : "%s%s", pszDir, pszName );
+
+		if ( filesystem->FindIsDirectory( fh ) )
+		{
+			subdirs.AddToTail( szPath );
+		}
+		else if ( IsKeyValuesBenchFile( pszName ) )
+		{
+			KeyValuesBenchFile_t *pFile = new KeyValuesBenchFile_t;
+			Q_strncpy( pFile->szName, szPath, sizeof( pFile->szName ) );
+			if ( filesystem->ReadFile( szPath, "MOD", pFile->buffer ) )
+			{
+				// KeyValues wants it null terminated
+				pFile->buffer.PutChar( 0 );
+				files.AddToTail( pFile );
+			}
+			else
+			{
+				delete pFile;
+			}
+		}
+	}
+	filesystem->FindClose( fh );
+
+	for ( int i = 0; i < subdirs.Count(); i++ )
+	{
+		FindKeyValuesBenchFiles( subdirs[i].Get(), files );
+	}
+}
+
+// The KeyValues parser makes one allocation per key and one per string or uint64 value
+static int CountKeyValuesAllocations( KeyValues *pKey )
+{
+	int nCount = 0;
+	for ( ; pKey; pKey = pKey->GetNextKey() )
+	{
+		nCount++;
+
+		KeyValues::types_t type = pKey->GetDataType();
+		if ( type == KeyValues::TYPE_STRING || type == KeyValues::TYPE_WSTRING || type == KeyValues::TYPE_UINT64 )
+			nCount++;
+
+		nCount += CountKeyValuesAllocations( pKey->GetFirstSubKey() );
+	}
+	return nCount;
+}
+
+CON_COMMAND_F( kv_parse_bench, "Parses every KeyValues file in the mod directory with KeyValues and with CKeyValuesDocument, and compares time and allocations.\n\tArguments:	[iterations] [directory]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nIterations = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 10;
+	const char *pszDir = ( args.ArgC() > 2 ) ? args[2] : "";
+
+	// Read everything up front so only the parsing is timed
+	CUtlVector<KeyValuesBenchFile_t *> files;
+	FindKeyValuesBenchFiles( pszDir, files );
+
+	int nBytes = 0;
+	for ( int i = 0; i < files.Count(); i++ )
+	{
+		nBytes += files[i]->buffer.TellPut() - 1;
+	}
+
+	int nAllocations[2] = { 0, 0 };
+	int nArenaBytes = 0;
+	float flMs[2];
+	CFastTimer timer;
+
+	timer.Start();
+	for ( int nIteration = 0; nIteration < nIterations; nIteration++ )
+	{
+		for ( int i = 0; i < files.Count(); i++ )
+		{
+			KeyValues *pKV = new KeyValues( files[i]->szName );
+			pKV->LoadFromBuffer( files[i]->szName, (const char *)files[i]->buffer.Base(), filesystem, "MOD" );
+			if ( nIteration == 0 )
+			{
+				nAllocations[0] += CountKeyValuesAllocations( pKV );
+			}
+			pKV->deleteThis();
+		}
+	}
+	timer.End();
+	flMs[0] = timer.GetDuration().GetMillisecondsF();
+
+	timer.Start();
+	for ( int nIteration = 0; nIteration < nIterations; nIteration++ )
+	{
+		for ( int i = 0; i < files.Count(); i++ )
+		{
+			CKeyValuesDocument doc;
+			doc.LoadFromBuffer( files[i]->szName, (const char *)files[i]->buffer.Base(), files[i]->buffer.TellPut() - 1, filesystem, "MOD" );
+			if ( nIteration == 0 )
+			{
+				nAllocations[1] += doc.GetHeapAllocationCount() + 1;
+				nArenaBytes += doc.GetArenaUsed();
+			}
+		}
+	}
+	timer.End();
+	flMs[1] = timer.GetDuration().GetMillisecondsF();
+
+	Msg( "kv_parse_bench: %d files, %d KB, %d iterations\n", files.Count(), nBytes / 1024, nIterations );
+	Msg( "  KeyValues           %8.2f ms  %8d allocations per pass\n", flMs[0], nAllocations[0] );
+	Msg( "  CKeyValuesDocument  %8.2f ms  %8d allocations per pass (%d KB of arena)\n", flMs[1], nAllocations[1], nArenaBytes / 1024 );
+
+	files.PurgeAndDeleteElements();
+}
@@ -7,6 +7,7 @@
 #include "cbase.h"
 #include "luamanager.h"
 #include "lbaseanimating.h"
+#include "lbaseentity_shared.h"
 #include "mathlib/lvector.h"
 #include "lvphysics_interface.h"
 
@@ -33,10 +34,7 @@ LUA_API lua_CBaseAnimating *lua_toanimating (lua_State *L, int idx) {
 
 
 LUA_API void lua_pushanimating (lua_State *L, CBaseAnimating *pEntity) {
-  CBaseHandle *hEntity = (CBaseHandle *)lua_newuserdata(L, sizeof(CBaseHandle));
-  hEntity->Set(pEntity);
-  luaL_getmetatable(L, "CBaseAnimating");
-  lua_setmetatable(L, -2);
+  lua_pushcachedentity(L, pEntity, "CBaseAnimating");
 }
 
 
@@ -10,6 +10,7 @@
 #include "luasrclib.h"
 #include "lbaseentity_shared.h"
 #include "mathlib/lvector.h"
+#include "entityspatialindex.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -94,6 +95,45 @@ static int gEntList_FindEntityInSphere (lua_State *L) {
   return 1;
 }
 
+#define MAX_ENTITYARRAY 1024
+
+static void lua_pushentityarray (lua_State *L, CBaseEntity **pList, int count) {
+  lua_pushinteger(L, count);
+  lua_newtable(L);
+  for( int i = 0 ; i < count ; i++ )
+  {
+	  lua_pushinteger(L, i);
+	  lua_pushentity(L, pList[ i ]);
+	  lua_settable(L, -3);
+  }
+}
+
+static int gEntList_FindEntitiesInBox (lua_State *L) {
+  CBaseEntity *pList[MAX_ENTITYARRAY];
+
+  int count = g_EntitySpatialIndex.EntitiesInBox(luaL_checkvector(L, 1), luaL_checkvector(L, 2), pList, clamp(luaL_optint(L, 3, MAX_ENTITYARRAY), 0, MAX_ENTITYARRAY));
+  lua_pushentityarray(L, pList, count);
+  return 2;
+}
+
+static int gEntList_FindEntitiesInCone (lua_State *L) {
+  CBaseEntity *pList[MAX_ENTITYARRAY];
+
+  Vector vecDir = luaL_checkvector(L, 2);
+  VectorNormalize(vecDir);
+  int count = g_EntitySpatialIndex.EntitiesInCone(luaL_checkvector(L, 1), vecDir, luaL_checknumber(L, 3), luaL_checknumber(L, 4), pList, clamp(luaL_optint(L, 5, MAX_ENTITYARRAY), 0, MAX_ENTITYARRAY));
+  lua_pushentityarray(L, pList, count);
+  return 2;
+}
+
+static int gEntList_FindEntitiesInSphere (lua_State *L) {
+  CBaseEntity *pList[MAX_ENTITYARRAY];
+
+  int count = g_EntitySpatialIndex.EntitiesInSphere(luaL_checkvector(L, 1), luaL_checknumber(L, 2), pList, clamp(luaL_optint(L, 3, MAX_ENTITYARRAY), 0, MAX_ENTITYARRAY));
+  lua_pushentityarray(L, pList, count);
+  return 2;
+}
+
 static int gEntList_FindEntityNearestFacing (lua_State *L) {
   lua_pushentity(L, gEntList.FindEntityNearestFacing(luaL_checkvector(L, 1), luaL_checkvector(L, 2), luaL_checknumber(L, 3)));
   return 1;
@@ -172,6 +212,9 @@ static const luaL_Reg gEntListlib[] = {
   {"FindEntityGenericNearest",   gEntList_FindEntityGenericNearest},
   {"FindEntityGenericWithin",   gEntList_FindEntityGenericWithin},
   {"FindEntityInSphere",   gEntList_FindEntityInSphere},
+  {"FindEntitiesInBox",   gEntList_FindEntitiesInBox},
+  {"FindEntitiesInCone",   gEntList_FindEntitiesInCone},
+  {"FindEntitiesInSphere",   gEntList_FindEntitiesInSphere},
   {"FindEntityNearestFacing",   gEntList_FindEntityNearestFacing},
   {"FindEntityProcedural",   gEntList_FindEntityProcedural},
   {"FirstEnt",   gEntList_FirstEnt},
@@ -33,6 +33,8 @@
 #include "vphysicsupdateai.h"
 #include "tier0/vcrmode.h"
 #include "pushentity.h"
+#include "ai_senses.h"
+#include "tier0/fasttimer.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -2019,6 +2021,42 @@ void Physics_SimulateEntity( CBaseEntity *pEntity )
 		pEntity->PhysicsRunThink();
 	}
 }
+
+//-----------------------------------------------------------------------------
+// ai_think_bench: times the think loop over the next N simulated ticks
+//-----------------------------------------------------------------------------
+extern ConVar ai_parallel_think;
+
+static int s_nThinkBenchTicksLeft = 0;
+static int s_nThinkBenchTicks = 0;
+static float s_flThinkBenchTotalMs = 0;
+static float s_flThinkBenchMaxMs = 0;
+
+CON_COMMAND_F( ai_think_bench, "Times entity think over the next N ticks (default 300) and reports ms/tick.", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	s_nThinkBenchTicks = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 300;
+	s_nThinkBenchTicksLeft = s_nThinkBenchTicks;
+	s_flThinkBenchTotalMs = 0;
+	s_flThinkBenchMaxMs = 0;
+
+	Msg( "ai_think_bench: timing %d ticks, %d NPCs, ai_parallel_think %d\n", s_nThinkBenchTicks, g_AI_Manager.NumAIs(), ai_parallel_think.GetInt() );
+}
+
+static void Physics_ThinkBenchSample( float flMs )
+{
+	s_flThinkBenchTotalMs += flMs;
+	s_flThinkBenchMaxMs = MAX( s_flThinkBenchMaxMs, flMs );
+
+	if ( --s_nThinkBenchTicksLeft == 0 )
+	{
+		Msg( "ai_think_bench: %d ticks, %d NPCs, ai_parallel_think %d: %.3f ms/tick avg, %.3f ms max\n",
+			s_nThinkBenchTicks, g_AI_Manager.NumAIs(), ai_parallel_think.GetInt(), s_flThinkBenchTotalMs / s_nThinkBenchTicks, s_flThinkBenchMaxMs );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Runs the main physics simulation loop against all entities ( except players )
 //-----------------------------------------------------------------------------
@@ -2060,6 +2098,15 @@ void Physics_RunThinkFunctions( bool simulating )
 		// Do we really need UTIL_RemoveImmediate()?
 		int count = SimThink_ListCopy( list, listMax );
 
+		CFastTimer benchTimer;
+		if ( s_nThinkBenchTicksLeft )
+		{
+			benchTimer.Start();
+		}
+
+		// Read-only part of this tick's NPC thinks, across threads (ai_parallel_think)
+		AI_RunParallelThinkGather();
+
 		//DevMsg(1, "Count: %d\n", count );
 		for ( int i = 0; i < count; i++ )
 		{
@@ -2070,6 +2117,12 @@ void Physics_RunThinkFunctions( bool simulating )
 			Physics_SimulateEntity( list[i] );
 		}
 
+		if ( s_nThinkBenchTicksLeft )
+		{
+			benchTimer.End();
+			Physics_ThinkBenchSample( benchTimer.GetDuration().GetMillisecondsF() );
+		}
+
 		stackfree( list );
 		UTIL_EnableRemoveImmediate();
 	}
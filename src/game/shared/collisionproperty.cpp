@@ -24,6 +24,7 @@
 #include "baseanimating.h"
 #include "sendproxy.h"
 #include "hierarchy.h"
+#include "entityspatialindex.h"
 #endif
 
 #include "predictable_entity.h"
@@ -1366,6 +1367,11 @@ void CCollisionProperty::MarkPartitionHandleDirty()
 		s_DirtyKDTree.AddEntity( m_pOuter );
 	}
 
+#ifndef CLIENT_DLL
+	// Not behind the EFL check: that flag is cleared whenever the engine partition updates
+	g_EntitySpatialIndex.MarkDirty( m_pOuter );
+#endif
+
 #ifdef CLIENT_DLL
 	GetOuter()->MarkRenderHandleDirty();
 	g_pClientShadowMgr->AddToDirtyShadowList( GetOuter() );
@@ -43,10 +43,7 @@ LUA_API lua_CHL2MP_Player *lua_tohl2mpplayer (lua_State *L, int idx) {
 
 
 LUA_API void lua_pushhl2mpplayer (lua_State *L, CHL2MP_Player *pPlayer) {
-  CBaseHandle *hPlayer = (CBaseHandle *)lua_newuserdata(L, sizeof(CBaseHandle));
-  hPlayer->Set(pPlayer);
-  luaL_getmetatable(L, "CHL2MP_Player");
-  lua_setmetatable(L, -2);
+  lua_pushcachedentity(L, pPlayer, "CHL2MP_Player");
 }
 
 
@@ -37,10 +37,7 @@ LUA_API lua_CBaseCombatWeapon *lua_toweapon (lua_State *L, int idx) {
 
 
 LUA_API void lua_pushweapon (lua_State *L, lua_CBaseCombatWeapon *pWeapon) {
-  CBaseHandle *hWeapon = (CBaseHandle *)lua_newuserdata(L, sizeof(CBaseHandle));
-  hWeapon->Set((CBaseEntity *)pWeapon);
-  luaL_getmetatable(L, "CBaseCombatWeapon");
-  lua_setmetatable(L, -2);
+  lua_pushcachedentity(L, (CBaseEntity *)pWeapon, "CBaseCombatWeapon");
 }
 
 
@@ -53,11 +53,82 @@ LUA_API lua_CBaseEntity *lua_toentity (lua_State *L, int idx) {
 */
 
 
+/*
+** Each entity metatable keeps a weak-valued cache of the userdata already
+** handed out, keyed by the entity's serial-qualified handle. Pushing the same
+** entity twice reuses one object, so no garbage is made and rawequal works.
+*/
+static char entitycachekey;  /* address is the metatable key of the cache */
+static CUtlVector< const char * > s_EntityCacheTypes;
+
+LUA_API void lua_pushcachedentity (lua_State *L, CBaseEntity *pEntity, const char *tname) {
+  luaL_getmetatable(L, tname);
+  /* entities without a valid handle would all share one key */
+  if (pEntity == NULL || !pEntity->GetRefEHandle().IsValid() || !lua_istable(L, -1)) {  /* nothing worth caching */
+    CBaseHandle *hEntity = (CBaseHandle *)lua_newuserdata(L, sizeof(CBaseHandle));
+    hEntity->Set(pEntity);
+    lua_insert(L, -2);
+    lua_setmetatable(L, -2);
+    return;
+  }
+  int key = pEntity->GetRefEHandle().ToInt();
+  lua_pushlightuserdata(L, &entitycachekey);
+  lua_rawget(L, -2);
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);  /* cache */
+    lua_newtable(L);  /* its metatable */
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, &entitycachekey);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);  /* metatable[entitycachekey] = cache */
+    int i;
+    for (i = 0; i < s_EntityCacheTypes.Count(); i++) {
+      if (Q_strcmp(s_EntityCacheTypes[ i ], tname) == 0)
+        break;
+    }
+    if (i == s_EntityCacheTypes.Count())
+      s_EntityCacheTypes.AddToTail(tname);
+  }
+  lua_rawgeti(L, -1, key);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    CBaseHandle *hEntity = (CBaseHandle *)lua_newuserdata(L, sizeof(CBaseHandle));
+    hEntity->Set(pEntity);
+    lua_pushvalue(L, -3);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, key);  /* cache[key] = userdata */
+  }
+  lua_replace(L, -3);  /* userdata replaces the metatable */
+  lua_pop(L, 1);  /* pop cache */
+}
+
+
+LUA_API void lua_removecachedentity (lua_State *L, CBaseEntity *pEntity) {
+  if (!pEntity->GetRefEHandle().IsValid())  /* never cached */
+    return;
+  int key = pEntity->GetRefEHandle().ToInt();
+  for (int i = 0; i < s_EntityCacheTypes.Count(); i++) {
+    luaL_getmetatable(L, s_EntityCacheTypes[ i ]);
+    if (lua_istable(L, -1)) {
+      lua_pushlightuserdata(L, &entitycachekey);
+      lua_rawget(L, -2);
+      if (lua_istable(L, -1)) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, key);
+      }
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+}
+
+
 LUA_API void lua_pushentity (lua_State *L, CBaseEntity *pEntity) {
-  CBaseHandle *hEntity = (CBaseHandle *)lua_newuserdata(L, sizeof(CBaseHandle));
-  hEntity->Set(pEntity);
-  luaL_getmetatable(L, "CBaseEntity");
-  lua_setmetatable(L, -2);
+  lua_pushcachedentity(L, pEntity, "CBaseEntity");
 }
 
 
@@ -1394,7 +1465,7 @@ static int CBaseEntity___newindex (lua_State *L) {
   else if (Q_strcmp(field, "m_flSpeed") == 0)
     pEntity->m_flSpeed = luaL_checknumber(L, 3);
   else if (Q_strcmp(field, "m_iClassname") == 0)
-    pEntity->m_iClassname = MAKE_STRING( luaL_checkstring(L, 3) );
+    pEntity->SetClassname( luaL_checkstring(L, 3) );
   else if (Q_strcmp(field, "m_iHealth") == 0)
     pEntity->m_iHealth = luaL_checkint(L, 3);
   else if (Q_strcmp(field, "m_nLastThinkTick") == 0)
@@ -28,6 +28,11 @@ LUA_API lua_CBaseEntity     *(lua_toentity) (lua_State *L, int idx);
 */
 LUA_API void  (lua_pushentity) (lua_State *L, lua_CBaseEntity *pEntity);
 
+/* push the cached userdata for pEntity using the metatable tname */
+LUA_API void  (lua_pushcachedentity) (lua_State *L, lua_CBaseEntity *pEntity, const char *tname);
+/* forget every cached userdata for pEntity, called from UpdateOnRemove */
+LUA_API void  (lua_removecachedentity) (lua_State *L, lua_CBaseEntity *pEntity);
+
 
 
 LUALIB_API lua_CBaseEntity *(luaL_checkentity) (lua_State *L, int narg);
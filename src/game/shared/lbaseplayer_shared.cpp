@@ -43,10 +43,7 @@ LUA_API lua_CBasePlayer *lua_toplayer (lua_State *L, int idx) {
 
 
 LUA_API void lua_pushplayer (lua_State *L, CBasePlayer *pPlayer) {
-  CBaseHandle *phPlayer = (CBaseHandle *)lua_newuserdata(L, sizeof(CBaseHandle));
-  phPlayer->Set(pPlayer);
-  luaL_getmetatable(L, "CBasePlayer");
-  lua_setmetatable(L, -2);
+  lua_pushcachedentity(L, pPlayer, "CBasePlayer");
 }
 
 
@@ -11,6 +11,8 @@
 #endif
 #include "zip/XUnzip.h"
 #include "utldict.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/utlbuffer.h"
 #include "luamanager.h"
 #include "luacachefile.h"
 
@@ -25,6 +27,221 @@
 
 static IZip *s_lcfFile = 0;
 
+#ifdef CLIENT_DLL
+static ConVar lua_bytecode_cache( "lua_bytecode_cache_cl", "1", 0, "Cache compiled Lua chunks under " LUA_PATH_BYTECODE " and reuse them while the source is unchanged." );
+#else
+static ConVar lua_bytecode_cache( "lua_bytecode_cache", "1", 0, "Cache compiled Lua chunks under " LUA_PATH_BYTECODE " and reuse them while the source is unchanged." );
+#endif
+
+#define LCF_BYTECODE_ID			(('C'<<24)+('U'<<16)+('L'<<8)+'L')	// little-endian "LLUC"
+#define LCF_BYTECODE_VERSION	1
+
+// Prefixes every chunk in the bytecode cache. The chunk is only used while
+// the source it was compiled from still matches.
+struct lcfbytecodeheader_t
+{
+	int			id;
+	int			version;
+	int			mtime;
+	int			size;
+	CRC32_t		crc;
+};
+
+static int lcf_writer (lua_State *L, const void *p, size_t sz, void *ud) {
+  ((CUtlBuffer *)ud)->Put(p, sz);
+  return 0;
+}
+
+// Compile a chunk the same way luaL_loadfile would, including skipping a
+// leading '#' line. Script files and .lcf entries come from servers and
+// downloads, and the undumper trusts its input, so only text is accepted.
+static int lcf_loadsource (lua_State *L, const char *code, int size, const char *filename) {
+  char chunkname[MAX_PATH + 1];
+  Q_snprintf( chunkname, sizeof( chunkname ), "@%s", filename );
+  const char *start = code;
+  if ( size > 0 && *start == '#' ) {
+    while ( start < code + size && *start != '\n' )
+      start++;
+  }
+  if ( start < code + size && *start == LUA_SIGNATURE[0] ) {
+    lua_pushfstring(L, "%s: refusing to load a precompiled chunk", filename);
+    return LUA_ERRSYNTAX;
+  }
+  return luaL_loadbuffer(L, start, size - (start - code), chunkname);
+}
+
+// Dump the function on top of the stack behind a header describing its source.
+static void lcf_dumpchunk (lua_State *L, int size, CRC32_t crc, int mtime, CUtlBuffer &buf) {
+  lcfbytecodeheader_t header;
+  header.id = LCF_BYTECODE_ID;
+  header.version = LCF_BYTECODE_VERSION;
+  header.mtime = mtime;
+  header.size = size;
+  header.crc = crc;
+  buf.Put(&header, sizeof( header ));
+  lua_dump(L, lcf_writer, &buf);
+}
+
+// Load a compiled chunk if it was built from the given source, leaving the
+// function on the stack. Chunks from another Lua build fail the undump check
+// and fall back to the source.
+static bool lcf_loadchunk (lua_State *L, CUtlBuffer &buf, int size, CRC32_t crc, int mtime) {
+  if ( buf.TellPut() <= (int)sizeof( lcfbytecodeheader_t ) )
+    return false;
+  const lcfbytecodeheader_t *pHeader = (const lcfbytecodeheader_t *)buf.Base();
+  if ( pHeader->id != LCF_BYTECODE_ID || pHeader->version != LCF_BYTECODE_VERSION ||
+       pHeader->mtime != mtime || pHeader->size != size || pHeader->crc != crc )
+    return false;
+  const char *chunk = (const char *)buf.Base() + sizeof( lcfbytecodeheader_t );
+  if ( luaL_loadbuffer(L, chunk, buf.TellPut() - sizeof( lcfbytecodeheader_t ), "=?") != 0 ) {
+    lua_pop(L, 1);
+    return false;
+  }
+  return true;
+}
+
+static bool lcf_loadbytecode (lua_State *L, const char *filename, const char *pathID, int size, CRC32_t crc, int mtime) {
+  if ( !filesystem->FileExists( filename, pathID ) )
+    return false;
+  CUtlBuffer buf;
+  if ( !filesystem->ReadFile( filename, pathID, buf ) )
+    return false;
+  return lcf_loadchunk(L, buf, size, crc, mtime);
+}
+
+static void lcf_bytecodename (const char *filename, char *pOut, int outLen) {
+  char path[MAX_PATH];
+  Q_strncpy( path, filename, sizeof( path ) );
+  Q_FixSlashes( path );
+  Q_strlower( path );
+  CRC32_t crc = CRC32_ProcessSingleBuffer( path, Q_strlen( path ) );
+  char hexname[ 16 ];
+  Q_binarytohex( (const byte *)&crc, sizeof( crc ), hexname, sizeof( hexname ) );
+  Q_snprintf( pOut, outLen, LUA_PATH_BYTECODE "\\%s.luac", hexname );
+}
+
+// The .lcf the client downloaded, kept in memory and indexed by entry name
+// (relative to the MOD search path) so scripts are served straight out of it.
+static CUtlBuffer s_LcfData;
+static HZIP s_hLcf = 0;
+static CUtlDict< int, int > s_LcfIndex;
+
+static void lcf_normalizename (const char *filename, char *pOut, int outLen) {
+  Q_strncpy( pOut, filename, outLen );
+  Q_FixSlashes( pOut, '/' );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Is this file served from the mounted .lcf?
+//-----------------------------------------------------------------------------
+LUA_API bool lcf_fileexists (const char *filename) {
+  if ( !s_hLcf )
+    return false;
+  char name[MAX_PATH];
+  lcf_normalizename( filename, name, sizeof( name ) );
+  return s_LcfIndex.Find( name ) != s_LcfIndex.InvalidIndex();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Read a file out of the mounted .lcf
+//-----------------------------------------------------------------------------
+LUA_API bool lcf_readfile (const char *filename, CUtlBuffer &buf) {
+  if ( !s_hLcf )
+    return false;
+  char name[MAX_PATH];
+  lcf_normalizename( filename, name, sizeof( name ) );
+  int i = s_LcfIndex.Find( name );
+  if ( i == s_LcfIndex.InvalidIndex() )
+    return false;
+  ZIPENTRY ze;
+  if ( GetZipItem( s_hLcf, s_LcfIndex[ i ], &ze ) != ZR_OK || ze.unc_size < 0 )
+    return false;
+  buf.Purge();
+  buf.EnsureCapacity( ze.unc_size );
+  if ( ze.unc_size > 0 && UnzipItem( s_hLcf, s_LcfIndex[ i ], buf.Base(), ze.unc_size, ZIP_MEMORY ) != ZR_OK )
+    return false;
+  buf.SeekPut( CUtlBuffer::SEEK_HEAD, ze.unc_size );
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Collect the names of the files with the given extension, or of
+//			the subdirectories when ext is NULL, that the mounted .lcf has
+//			directly under path.
+//-----------------------------------------------------------------------------
+LUA_API void lcf_findfiles (const char *path, const char *ext, CUtlDict< int, int > &names) {
+  if ( !s_hLcf )
+    return;
+  char prefix[MAX_PATH];
+  lcf_normalizename( path, prefix, sizeof( prefix ) );
+  int prefixLen = Q_strlen( prefix );
+  for ( int i = s_LcfIndex.First(); i != s_LcfIndex.InvalidIndex(); i = s_LcfIndex.Next( i ) )
+  {
+    const char *pName = s_LcfIndex.GetElementName( i );
+    if ( Q_strnicmp( pName, prefix, prefixLen ) || pName[ prefixLen ] != '/' )
+      continue;
+    pName += prefixLen + 1;
+    const char *pSlash = strchr( pName, '/' );
+    char entry[MAX_PATH];
+    if ( ext )
+    {
+      const char *pExt = Q_GetFileExtension( pName );
+      if ( pSlash || !pExt || Q_stricmp( pExt, ext ) )
+        continue;
+      Q_strncpy( entry, pName, sizeof( entry ) );
+    }
+    else
+    {
+      if ( !pSlash )
+        continue;
+      Q_strncpy( entry, pName, MIN( (int)sizeof( entry ), pSlash - pName + 1 ) );
+    }
+    if ( names.Find( entry ) == names.InvalidIndex() )
+      names.Insert( entry, 0 );
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Load a Lua file as a function on the stack. Files in the mounted
+//			.lcf are read from memory and always compiled from source. Other
+//			files reuse a chunk from this machine's own bytecode cache, keyed
+//			by path and validated by mtime, size and CRC, before running the
+//			parser. Same return values as luaL_loadfile.
+//-----------------------------------------------------------------------------
+LUA_API int lcf_loadfile (lua_State *L, const char *filename) {
+  CUtlBuffer source;
+  if ( lcf_readfile( filename, source ) )
+    return lcf_loadsource(L, (const char *)source.Base(), source.TellPut(), filename);
+
+  if ( !filesystem->ReadFile( filename, NULL, source ) ) {
+    lua_pushfstring(L, "cannot open %s", filename);
+    return LUA_ERRFILE;
+  }
+
+  const char *code = (const char *)source.Base();
+  int size = source.TellPut();
+  CRC32_t crc = CRC32_ProcessSingleBuffer( code, size );
+
+  if ( !lua_bytecode_cache.GetBool() )
+    return lcf_loadsource(L, code, size, filename);
+
+  int mtime = (int)filesystem->GetFileTime( filename );
+  char cachename[MAX_PATH];
+  lcf_bytecodename( filename, cachename, sizeof( cachename ) );
+  // Only trust chunks this machine wrote itself; addons and custom folders
+  // also sit on the MOD path and must never supply bytecode.
+  if ( lcf_loadbytecode(L, cachename, "DEFAULT_WRITE_PATH", size, crc, mtime) )
+    return 0;
+
+  int status = lcf_loadsource(L, code, size, filename);
+  if ( status == 0 ) {
+    CUtlBuffer bytecode;
+    lcf_dumpchunk(L, size, crc, mtime, bytecode);
+    filesystem->WriteFile( cachename, "DEFAULT_WRITE_PATH", bytecode );
+  }
+  return status;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: // Get a lcffile instance
 // Output : IZip*
@@ -50,8 +267,13 @@ LUA_API void luasrc_AddFileToLcf( const char *relativename, const char *fullpath
 
 #ifdef CLIENT_DLL
 
-LUA_API void luasrc_ExtractLcf ()
+//-----------------------------------------------------------------------------
+// Purpose: Map the server's .lcf into memory and index its entries
+//-----------------------------------------------------------------------------
+LUA_API void luasrc_MountLcf ()
 {
+	luasrc_UnmountLcf();
+
 	INetworkStringTable *downloadables = networkstringtable->FindTable( "downloadables" );
 	const char *pFilename = NULL;
 	for ( int i=0; i<downloadables->GetNumStrings(); i++ )
@@ -62,56 +284,75 @@ LUA_API void luasrc_ExtractLcf ()
 
 		if ( !Q_stricmp( ext, "lcf" ) )
 		{
-			char current[ 512 ] = { 0 };
-			char cachePath[MAX_PATH];
-			bool bGetCurrentDirectory = V_GetCurrentDirectory( current, sizeof( current ) );
-			if ( bGetCurrentDirectory )
+			if ( !filesystem->ReadFile( pFilename, "MOD", s_LcfData ) )
 			{
-#ifdef CLIENT_DLL
-				const char *gamePath = engine->GetGameDirectory();
-#else
-				char gamePath[ 256 ];
-				engine->GetGameDir( gamePath, 256 );
-#endif
-				Q_strncpy( cachePath, gamePath, sizeof( cachePath ) );
-				Q_strncat( cachePath, "\\"LUA_PATH_CACHE, sizeof( cachePath ), COPY_ALL_CHARACTERS );
-				V_SetCurrentDirectory( cachePath );
+				Warning( "LCF: couldn't read %s!\n", pFilename );
+				break;
+			}
+
+			s_hLcf = OpenZip( s_LcfData.Base(), s_LcfData.TellPut(), ZIP_MEMORY );
+			if ( !s_hLcf )
+			{
+				Warning( "LCF: %s is not a valid Lua cache file!\n", pFilename );
+				s_LcfData.Purge();
+				break;
 			}
 
-			char fullpath[MAX_PATH];
-			filesystem->RelativePathToFullPath( pFilename, "MOD", fullpath, sizeof( fullpath ) );
-			HZIP hz = OpenZip( fullpath, 0, ZIP_FILENAME );
 			ZIPENTRY ze;
-			GetZipItem( hz, -1, &ze );
+			GetZipItem( s_hLcf, -1, &ze );
 			int numitems = ze.index;
 			for ( int i = 0; i < numitems; i++ )
 			{
-				GetZipItem( hz, i, &ze );
-				// forget directories, we create hierarchies from file names
+				GetZipItem( s_hLcf, i, &ze );
+				// forget directories, entries are looked up by file name
 				if ((ze.attr /* & FILE_ATTRIBUTE_DIRECTORY */ ) != 1)
 				{
-					char fullpath[MAX_PATH];
-					char path[MAX_PATH];
-					Q_snprintf( path, sizeof( path ), LUA_PATH_CACHE"\\%s", ze.name );
-					Q_StripFilename( path );
-					filesystem->CreateDirHierarchy( path, "MOD" );
-					Q_snprintf( fullpath, sizeof( fullpath ), "%s%s", cachePath, path + Q_strlen( LUA_PATH_CACHE ) );
-					// DevMsg( "LCF: setting current directory to %s...\n", fullpath );
-					V_SetCurrentDirectory( fullpath );
-					// DevMsg( "LCF: unpacking %s...\n", ze.name );
-					UnzipItem( hz, i, (void *)V_UnqualifiedFileName( ze.name ), 0, ZIP_FILENAME );
+					char name[MAX_PATH];
+					lcf_normalizename( ze.name, name, sizeof( name ) );
+					s_LcfIndex.Insert( name, i );
 				}
 			}
-			CloseZip( hz );
-
-			if ( bGetCurrentDirectory )
-				V_SetCurrentDirectory( current );
 
 			break;
 		}
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Release the mounted .lcf
+//-----------------------------------------------------------------------------
+LUA_API void luasrc_UnmountLcf ()
+{
+	if ( s_hLcf )
+	{
+		CloseZip( s_hLcf );
+		s_hLcf = 0;
+	}
+	s_LcfIndex.RemoveAll();
+	s_LcfData.Purge();
+}
+
+// package.loaders entry for require(), after the filesystem searcher so a
+// module on disk still wins over the server's copy, like a search path.
+static int lcf_loader (lua_State *L) {
+  char modname[MAX_PATH];
+  Q_strncpy( modname, luaL_checkstring(L, 1), sizeof( modname ) );
+  for ( char *pc = modname; *pc; ++pc ) {
+    if ( *pc == '.' )
+      *pc = '\\';
+  }
+  char filename[MAX_PATH];
+  Q_snprintf( filename, sizeof( filename ), LUA_PATH_MODULES "\\%s.lua", modname );
+  if ( !lcf_fileexists( filename ) ) {
+    lua_pushfstring(L, "\n\tno file '%s' in the Lua cache file", filename);
+    return 1;
+  }
+  if ( lcf_loadfile(L, filename) != 0 )
+    luaL_error(L, "error loading module " LUA_QS " from the Lua cache file:\n\t%s",
+               lua_tostring(L, 1), lua_tostring(L, -1));
+  return 1;
+}
+
 #else
 
 static CUtlDict< char *, int > m_LcfDatabase;
@@ -200,7 +441,21 @@ extern void lcf_open (lua_State *L) {
 #else
   // force create this directory incase it doesn't exist
   filesystem->CreateDirHierarchy( LUA_PATH_CACHE, "MOD");
+
+  // insert lcf_loader after the Lua file searcher
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "loaders");
+  if (lua_istable(L, -1)) {
+    for (int i = lua_objlen(L, -1); i >= 3; i--) {
+      lua_rawgeti(L, -1, i);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushcfunction(L, lcf_loader);
+    lua_rawseti(L, -2, 3);
+  }
+  lua_pop(L, 2);
 #endif
+  filesystem->CreateDirHierarchy( LUA_PATH_BYTECODE, "DEFAULT_WRITE_PATH");
 }
 
 extern void lcf_recursivedeletefile( const char *current ) {
@@ -235,7 +490,15 @@ extern void lcf_recursivedeletefile( const char *current ) {
 					Q_snprintf( nextdir, sizeof( nextdir ), "%s", fn );
 				}
 
-				lcf_recursivedeletefile( nextdir );
+				// the bytecode cache outlives the downloaded files
+				char bytecodedir[ 512 ];
+				Q_strncpy( bytecodedir, LUA_PATH_BYTECODE, sizeof( bytecodedir ) );
+				Q_FixSlashes( bytecodedir );
+				Q_FixSlashes( nextdir );
+				if ( Q_stricmp( nextdir, bytecodedir ) )
+				{
+					lcf_recursivedeletefile( nextdir );
+				}
 			}
 			else
 			{
@@ -270,7 +533,7 @@ extern void lcf_close (lua_State *L) {
 	}
 	m_LcfDatabase.RemoveAll();
 #else
-	lcf_recursivedeletefile( LUA_PATH_CACHE );
+	luasrc_UnmountLcf();
 #endif
 }
 
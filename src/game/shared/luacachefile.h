@@ -12,14 +12,24 @@
 #endif
 
 #include "zip_utils.h"
+#include "utldict.h"
+
+class CUtlBuffer;
 
 // Embedded pack/pak file
 IZip				*luasrc_GetLcfFile( void );
 void				luasrc_AddFileToLcf( const char *pRelativeName, const char *fullpath );
 #ifdef CLIENT_DLL
-void				luasrc_ExtractLcf( void );
+void				luasrc_MountLcf( void );
+void				luasrc_UnmountLcf( void );
 #endif
 
+// Files served from the mounted .lcf, named relative to the MOD search path
+extern bool lcf_fileexists (const char *filename);
+extern bool lcf_readfile (const char *filename, CUtlBuffer &buf);
+extern void lcf_findfiles (const char *path, const char *ext, CUtlDict< int, int > &names);
+
+extern int lcf_loadfile (lua_State *L, const char *filename);
 extern void lcf_recursivedeletefile( const char *current );
 extern void lcf_open (lua_State *L);
 extern void lcf_close (lua_State *L);
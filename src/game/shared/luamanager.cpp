@@ -6,6 +6,9 @@
 
 #include "cbase.h"
 #include "filesystem.h"
+#include "utldict.h"
+#include "tier1/mempool.h"
+#include "tier0/vprof.h"
 #ifndef CLIENT_DLL
 #include "gameinterface.h"
 #endif
@@ -26,6 +29,14 @@
 #include "tier0/memdbgon.h"
 
 ConVar gamemode( "gamemode", "sandbox", FCVAR_ARCHIVE | FCVAR_REPLICATED );
+#ifdef CLIENT_DLL
+static ConVar lua_gc_budget( "lua_gc_budget_cl", "1", 0, "Milliseconds per frame the Lua garbage collector may run for. 0 leaves collection to the allocator." );
+static ConVar lua_gc_stepsize( "lua_gc_stepsize_cl", "4", 0, "Kilobytes of Lua allocations the collector catches up on per step." );
+#else
+static ConVar lua_gc_budget( "lua_gc_budget", "1", 0, "Milliseconds per frame the Lua garbage collector may run for. 0 leaves collection to the allocator." );
+static ConVar lua_gc_spare( "lua_gc_spare", "0.5", 0, "Fraction of the time left before the next tick is due that may also be spent collecting Lua garbage." );
+static ConVar lua_gc_stepsize( "lua_gc_stepsize", "4", 0, "Kilobytes of Lua allocations the collector catches up on per step." );
+#endif
 static char contentSearchPath[MAX_PATH];
 
 static void tag_error (lua_State *L, int narg, int tag) {
@@ -47,6 +58,110 @@ LUALIB_API int luaL_optboolean (lua_State *L, int narg,
 }
 
 
+//-----------------------------------------------------------------------------
+// Allocator for L. Small blocks (strings, tables, closures and the Vector and
+// QAngle userdata scripts churn through) are served from per-size-class
+// CUtlMemoryPools; anything larger goes to the heap. The pools are torn down
+// with the state, so long-running servers don't fragment the engine heap.
+//-----------------------------------------------------------------------------
+#define LUA_SMALLBLOCK_MAX		256
+
+static const int s_LuaSizeClasses[] = { 16, 32, 48, 64, 96, 128, 192, 256 };
+#define LUA_NUM_SIZECLASSES		ARRAYSIZE( s_LuaSizeClasses )
+#define LUA_SIZECLASS_LARGE		LUA_NUM_SIZECLASSES
+
+// size class for each 16 byte step up to LUA_SMALLBLOCK_MAX
+static const unsigned char s_LuaSizeClassLookup[ LUA_SMALLBLOCK_MAX / 16 ] = {
+  0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+};
+
+struct luamemclass_t
+{
+	int		nBlocks;		// live blocks
+	int		nBytes;			// live bytes requested by Lua
+	int		nPeakBytes;
+};
+
+static CUtlMemoryPool *s_pLuaPools[ LUA_NUM_SIZECLASSES ];
+static luamemclass_t s_LuaMemStats[ LUA_NUM_SIZECLASSES + 1 ];
+static unsigned int s_nLuaAllocations = 0;
+
+static inline int luasrc_sizeclass (size_t size) {
+  return size <= LUA_SMALLBLOCK_MAX ? s_LuaSizeClassLookup[ (size - 1) >> 4 ] : LUA_SIZECLASS_LARGE;
+}
+
+static void luasrc_meminit (void) {
+  for (int i = 0; i < LUA_NUM_SIZECLASSES; i++) {
+    int nBlockSize = s_LuaSizeClasses[ i ];
+    s_pLuaPools[ i ] = new CUtlMemoryPool( nBlockSize, MAX( 32, 16384 / nBlockSize ), CUtlMemoryPool::GROW_SLOW, "lua_State", 8 );
+  }
+  Q_memset( s_LuaMemStats, 0, sizeof( s_LuaMemStats ) );
+}
+
+static void luasrc_memshutdown (void) {
+  for (int i = 0; i < LUA_NUM_SIZECLASSES; i++) {
+    delete s_pLuaPools[ i ];
+    s_pLuaPools[ i ] = NULL;
+  }
+}
+
+static inline void luasrc_memfree (void *ptr, int sizeclass, size_t size) {
+  if (sizeclass == LUA_SIZECLASS_LARGE)
+    free(ptr);
+  else
+    s_pLuaPools[ sizeclass ]->Free(ptr);
+  luamemclass_t &stats = s_LuaMemStats[ sizeclass ];
+  --stats.nBlocks;
+  stats.nBytes -= size;
+}
+
+static void *luasrc_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  int oclass = ptr ? luasrc_sizeclass(osize) : -1;
+  if (nsize == 0) {
+    if (ptr)
+      luasrc_memfree(ptr, oclass, osize);
+    return NULL;
+  }
+
+  ++s_nLuaAllocations;
+  int nclass = luasrc_sizeclass(nsize);
+  void *pNew;
+  if (oclass == nclass && nclass != LUA_SIZECLASS_LARGE) {
+    pNew = ptr;  /* block already has room */
+    s_LuaMemStats[ nclass ].nBytes += (int)nsize - (int)osize;
+  }
+  else if (oclass == LUA_SIZECLASS_LARGE && nclass == LUA_SIZECLASS_LARGE) {
+    pNew = realloc(ptr, nsize);
+    if (pNew == NULL)
+      return NULL;
+    s_LuaMemStats[ nclass ].nBytes += (int)nsize - (int)osize;
+  }
+  else {
+    /* new block, or one moving between size classes */
+    pNew = (nclass == LUA_SIZECLASS_LARGE) ? malloc(nsize) : s_pLuaPools[ nclass ]->Alloc();
+    if (pNew == NULL)
+      return NULL;
+    if (ptr) {
+      memcpy(pNew, ptr, MIN(osize, nsize));
+      luasrc_memfree(ptr, oclass, osize);
+    }
+    ++s_LuaMemStats[ nclass ].nBlocks;
+    s_LuaMemStats[ nclass ].nBytes += nsize;
+  }
+
+  luamemclass_t &stats = s_LuaMemStats[ nclass ];
+  if (stats.nBytes > stats.nPeakBytes)
+    stats.nPeakBytes = stats.nBytes;
+  return pNew;
+}
+
+
+static int luasrc_panic (lua_State *L) {
+  Warning( "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1) );
+  return 0;
+}
+
+
 #ifdef CLIENT_DLL
 lua_State *LGameUI;
 #endif
@@ -56,6 +171,99 @@ lua_State *L;
 // Lua system
 bool g_bLuaInitialized;
 
+//-----------------------------------------------------------------------------
+// Garbage collection pacing
+//
+// Left alone, Lua collects whenever an allocation tips it over its threshold,
+// which lands multi-millisecond pauses in the middle of entity think. Instead
+// the automatic collector is kept stopped and luasrc_gcstep runs it in small
+// increments once per frame within lua_gc_budget. A new cycle is only started
+// once the heap has doubled since the last one finished, like Lua's default
+// pause. If scripts allocate faster than the budget can collect, the
+// automatic collector is turned back on until we catch up.
+//
+// The server only holds the collector off while its ticks run: it calls
+// luasrc_gcpause before the first tick of a host frame and luasrc_gcstep
+// after the last, which leaves it running again. Level loads, transitions
+// and anything else that allocates without ticking get Lua's usual
+// collection instead of growing without bound.
+//-----------------------------------------------------------------------------
+#define LUA_GC_PAUSE			2	// start a cycle at this multiple of the last live size
+#define LUA_GC_FALLBEHIND		4	// give up pacing at this multiple
+
+static bool s_bGCPaced = false;
+static bool s_bGCCycleActive = false;
+static int s_nGCBaseKB = 0;
+
+void luasrc_gcstep (float flSpareTime) {
+  if (!g_bLuaInitialized)
+    return;
+
+  float flBudget = lua_gc_budget.GetFloat();
+  if (flBudget <= 0.0f) {
+    if (s_bGCPaced) {
+      lua_gc(L, LUA_GCRESTART, 0);
+      s_bGCPaced = false;
+    }
+    return;
+  }
+
+  VPROF_BUDGET( "luasrc_gcstep", "Lua" );
+
+  if (!s_bGCPaced) {
+    s_bGCPaced = true;
+    s_bGCCycleActive = false;
+    s_nGCBaseKB = lua_gc(L, LUA_GCCOUNT, 0);
+  }
+
+  int nKB = lua_gc(L, LUA_GCCOUNT, 0);
+  if (!s_bGCCycleActive && nKB >= s_nGCBaseKB * LUA_GC_PAUSE)
+    s_bGCCycleActive = true;
+
+  int nSteps = 0;
+  double flStart = Plat_FloatTime();
+  if (s_bGCCycleActive) {
+#ifndef CLIENT_DLL
+    flBudget += MAX(flSpareTime, 0.0f) * lua_gc_spare.GetFloat();
+#endif
+    double flEnd = flStart + flBudget / 1000.0;
+    int nStepSize = MAX(lua_gc_stepsize.GetInt(), 1);
+    do {
+      ++nSteps;
+      if (lua_gc(L, LUA_GCSTEP, nStepSize)) {
+        /* cycle finished */
+        s_bGCCycleActive = false;
+        s_nGCBaseKB = lua_gc(L, LUA_GCCOUNT, 0);
+        break;
+      }
+    } while (Plat_FloatTime() < flEnd);
+  }
+
+  VPROF_INCREMENT_COUNTER( "Lua GC steps", nSteps );
+  VPROF_INCREMENT_COUNTER( "Lua GC microseconds", (int)((Plat_FloatTime() - flStart) * 1000000.0) );
+
+#ifdef CLIENT_DLL
+  /* LUA_GCSTEP re-arms the automatic collector, keep it off until next frame */
+  if (lua_gc(L, LUA_GCCOUNT, 0) < s_nGCBaseKB * LUA_GC_FALLBEHIND)
+    lua_gc(L, LUA_GCSTOP, 0);
+  else
+    lua_gc(L, LUA_GCRESTART, 0);
+#else
+  /* no tick is running until the next luasrc_gcpause */
+  lua_gc(L, LUA_GCRESTART, 0);
+#endif
+}
+
+#ifndef CLIENT_DLL
+void luasrc_gcpause (void) {
+  if (!g_bLuaInitialized || !s_bGCPaced)
+    return;
+
+  if (lua_gc(L, LUA_GCCOUNT, 0) < s_nGCBaseKB * LUA_GC_FALLBEHIND)
+    lua_gc(L, LUA_GCSTOP, 0);
+}
+#endif
+
 static int luasrc_print (lua_State *L) {
   int n = lua_gettop(L);  /* number of arguments */
   int i;
@@ -106,12 +314,25 @@ static int luasrc_include (lua_State *L) {
   Q_StripFilename( source );
   char filename[MAX_PATH];
   Q_snprintf( filename, sizeof( filename ), "%s\\%s", source, luaL_checkstring(L, 1) );
+  // resolve relative chunk sources against the MOD search path
+  if ( !Q_IsAbsolutePath( filename ) ) {
+    char fullpath[MAX_PATH];
+    if ( filesystem->RelativePathToFullPath( filename, "MOD", fullpath, sizeof( fullpath ) ) )
+      Q_strncpy( filename, fullpath, sizeof( filename ) );
+  }
   luasrc_dofile(L, filename);
   return 0;
 }
 
 
+static int luasrc_allocationcount (lua_State *L) {
+  lua_pushinteger(L, s_nLuaAllocations);
+  return 1;
+}
+
+
 static const luaL_Reg base_funcs[] = {
+  {"allocationcount", luasrc_allocationcount},
   {"print", luasrc_print},
   {"type", luasrc_type},
   {"include", luasrc_include},
@@ -179,6 +400,259 @@ void luasrc_setmodulepaths(lua_State *L) {
   lua_pop(L, 1);  /* pop result */
 }
 
+//-----------------------------------------------------------------------------
+// Hook dispatch table
+//
+// Every BEGIN_LUA_CALL_HOOK call site owns a static hook ID. For each ID we
+// lazily resolve whether hook.add has any listeners for the event and which
+// function the current gamemode provides for it. Hooks with neither are
+// skipped outright, hooks with only a gamemode method call it directly, and
+// everything else goes through the Lua-side hook.call dispatcher. Entries are
+// invalidated by hook.add/hook.remove, gamemode changes and script loads.
+// Gamemode methods can also be assigned, rawset or the whole _GAMEMODE table
+// swapped without telling us, so every dispatch checks the cached method is
+// still what _GAMEMODE[name] holds.
+//-----------------------------------------------------------------------------
+struct luahook_t
+{
+	const char	*pszName;
+	int		nGeneration;	// s_nHookGeneration this entry was resolved for
+	int		nListeners;		// non-zero if hook.add has listeners
+	int		nFunctionRef;	// gamemode method, or LUA_NOREF
+	int		nCalls;
+	int		nSkips;
+};
+
+static CUtlDict< int, int > s_HookIDs;
+static CUtlVector< luahook_t > s_Hooks;
+static int s_nHookGeneration = 1;
+static int s_nHookRefGeneration = 0;
+static int s_nHookCallRef = LUA_NOREF;
+static int s_nHookGetHooksRef = LUA_NOREF;
+static int s_nGamemodeRef = LUA_NOREF;
+
+static void luasrc_hook_unref (lua_State *L, int &ref) {
+  if (L && ref != LUA_NOREF && ref != LUA_REFNIL)
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  ref = LUA_NOREF;
+}
+
+static void luasrc_hook_resolverefs (lua_State *L) {
+  if (s_nHookRefGeneration == s_nHookGeneration)
+    return;
+  s_nHookRefGeneration = s_nHookGeneration;
+  luasrc_hook_unref(L, s_nHookCallRef);
+  luasrc_hook_unref(L, s_nHookGetHooksRef);
+  luasrc_hook_unref(L, s_nGamemodeRef);
+
+  lua_getglobal(L, "hook");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "call");
+    if (lua_isfunction(L, -1))
+      s_nHookCallRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    else
+      lua_pop(L, 1);
+    lua_getfield(L, -1, "gethooks");
+    if (lua_isfunction(L, -1))
+      s_nHookGetHooksRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    else
+      lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+
+  lua_getglobal(L, "_GAMEMODE");
+  if (lua_istable(L, -1))
+    s_nGamemodeRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  else
+    lua_pop(L, 1);
+}
+
+static void luasrc_hook_resolve (lua_State *L, int hookID) {
+  luasrc_hook_resolverefs(L);
+
+  luahook_t &hook = s_Hooks[ hookID ];
+  const char *hookName = hook.pszName;
+  hook.nGeneration = s_nHookGeneration;
+  hook.nListeners = 0;
+  luasrc_hook_unref(L, hook.nFunctionRef);
+
+  if (s_nHookGetHooksRef != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s_nHookGetHooksRef);
+    lua_pushstring(L, hookName);
+    if (lua_pcall(L, 1, 1, 0) == 0) {
+      if (lua_istable(L, -1)) {
+        lua_pushnil(L);
+        if (lua_next(L, -2)) {
+          hook.nListeners = 1;
+          lua_pop(L, 2);  /* pop key and value */
+        }
+      }
+    }
+    lua_pop(L, 1);  /* pop result or error */
+  }
+  else if (s_nHookCallRef != LUA_NOREF) {
+    // hook.call without hook.gethooks; we can't tell, so always dispatch
+    hook.nListeners = 1;
+  }
+
+  if (s_nGamemodeRef != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s_nGamemodeRef);
+    lua_getfield(L, -1, hookName);
+    if (lua_isfunction(L, -1))
+      hook.nFunctionRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    else
+      lua_pop(L, 1);
+    lua_pop(L, 1);  /* pop _GAMEMODE */
+  }
+}
+
+static bool luasrc_hook_isstale (lua_State *L, const luahook_t &hook) {
+  lua_getglobal(L, "_GAMEMODE");
+  if (s_nGamemodeRef == LUA_NOREF) {
+    bool stale = lua_istable(L, -1) != 0;
+    lua_pop(L, 1);
+    if (stale)
+      ++s_nHookGeneration;  /* a gamemode appeared, resolve everything again */
+    return stale;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, s_nGamemodeRef);
+  if (!lua_rawequal(L, -1, -2)) {
+    lua_pop(L, 2);
+    ++s_nHookGeneration;  /* the gamemode table was swapped */
+    return true;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, -1, hook.pszName);
+  bool stale;
+  if (hook.nFunctionRef == LUA_NOREF)
+    stale = lua_isfunction(L, -1) != 0;
+  else {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, hook.nFunctionRef);
+    stale = !lua_rawequal(L, -1, -2);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);  /* pop method and _GAMEMODE */
+  return stale;
+}
+
+int luasrc_hook_getid (const char *hookName) {
+  int i = s_HookIDs.Find( hookName );
+  if ( i != s_HookIDs.InvalidIndex() )
+    return s_HookIDs[ i ];
+
+  luahook_t hook;
+  hook.pszName = 0;
+  hook.nGeneration = 0;
+  hook.nListeners = 0;
+  hook.nFunctionRef = LUA_NOREF;
+  hook.nCalls = 0;
+  hook.nSkips = 0;
+  int hookID = s_Hooks.AddToTail( hook );
+  i = s_HookIDs.Insert( hookName, hookID );
+  s_Hooks[ hookID ].pszName = s_HookIDs.GetElementName( i );
+  return hookID;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Pushes the callable and its leading arguments for a hook
+// Output : Number of leading arguments pushed, or -1 if the hook has nothing
+//          to call
+//-----------------------------------------------------------------------------
+int luasrc_hook_push (lua_State *L, int hookID) {
+  if (!g_bLuaInitialized)
+    return -1;
+
+  luahook_t &hook = s_Hooks[ hookID ];
+  if (hook.nGeneration != s_nHookGeneration || luasrc_hook_isstale(L, hook))
+    luasrc_hook_resolve(L, hookID);
+
+  if (s_nHookCallRef == LUA_NOREF ||
+      (!hook.nListeners && hook.nFunctionRef == LUA_NOREF)) {
+    ++hook.nSkips;
+    return -1;
+  }
+
+  ++hook.nCalls;
+  if (hook.nListeners) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s_nHookCallRef);
+    lua_pushstring(L, hook.pszName);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s_nGamemodeRef);
+    return 2;
+  }
+
+  // Only the gamemode implements this hook, call it directly
+  lua_rawgeti(L, LUA_REGISTRYINDEX, hook.nFunctionRef);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, s_nGamemodeRef);
+  return 1;
+}
+
+void luasrc_hook_pcall (lua_State *L, int hookID, int nhookargs, int nargs, int nresults) {
+  if (nhookargs != 1) {
+    luasrc_pcall(L, nargs, nresults, 0);
+    return;
+  }
+
+  // Mirror hook.call's handling of a failing gamemode method
+  if (lua_pcall(L, nargs, nresults, 0) != 0) {
+    const char *hookName = s_Hooks[ hookID ].pszName;
+    Warning( "ERROR: GAMEMODE: '%s' Failed: %s\n", hookName, lua_tostring(L, -1) );
+    lua_pop(L, 1);
+    if (s_nGamemodeRef != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, s_nGamemodeRef);
+      lua_pushnil(L);
+      lua_setfield(L, -2, hookName);
+      lua_pop(L, 1);
+    }
+    s_Hooks[ hookID ].nGeneration = 0;
+  }
+}
+
+void luasrc_hook_pushnil (lua_State *L, int nresults) {
+  for (int i = 0; i < nresults; i++)
+    lua_pushnil(L);
+}
+
+void luasrc_hook_invalidate (const char *hookName) {
+  if (hookName) {
+    int i = s_HookIDs.Find( hookName );
+    if ( i != s_HookIDs.InvalidIndex() )
+      s_Hooks[ s_HookIDs[ i ] ].nGeneration = 0;
+    return;
+  }
+  ++s_nHookGeneration;
+}
+
+static void luasrc_hook_reset (void) {
+  // The Lua state is going away, so just forget the references
+  for (int i = 0; i < s_Hooks.Count(); i++) {
+    s_Hooks[ i ].nGeneration = 0;
+    s_Hooks[ i ].nFunctionRef = LUA_NOREF;
+  }
+  s_nHookCallRef = LUA_NOREF;
+  s_nHookGetHooksRef = LUA_NOREF;
+  s_nGamemodeRef = LUA_NOREF;
+  ++s_nHookGeneration;
+}
+
+static int hookcache_invalidate (lua_State *L) {
+  luasrc_hook_invalidate(luaL_optstring(L, 1, 0));
+  return 0;
+}
+
+
+static const luaL_Reg hookcache_funcs[] = {
+  {"invalidate", hookcache_invalidate},
+  {NULL, NULL}
+};
+
+
+static void hookcache_open (lua_State *L) {
+  luaL_register(L, "hookcache", hookcache_funcs);
+  lua_pop(L, 1);
+}
+
+
 #ifdef CLIENT_DLL
 void luasrc_init_gameui (void) {
   LGameUI = luaL_newstate();
@@ -213,10 +687,13 @@ void luasrc_init (void) {
 	  return;
   g_bLuaInitialized = true;
 
-  L = lua_open();
+  luasrc_meminit();
+  L = lua_newstate(luasrc_alloc, NULL);
+  lua_atpanic(L, luasrc_panic);
 
   luaL_openlibs(L);
   base_open(L);
+  hookcache_open(L);
   lcf_open(L);
 
   // Andrew; Someone set us up the path for great justice
@@ -248,10 +725,15 @@ void luasrc_shutdown (void) {
 
   lcf_close(L);
   lua_close(L);
+  luasrc_hook_reset();
+  luasrc_memshutdown();
+  s_bGCPaced = false;
 }
 
 LUA_API int luasrc_dostring (lua_State *L, const char *string) {
   int iError = luaL_dostring(L, string);
+  // the chunk may have redefined gamemode methods
+  luasrc_hook_invalidate();
   if (iError != 0) {
     Warning( "%s\n", lua_tostring(L, -1) );
     lua_pop(L, 1);
@@ -260,7 +742,8 @@ LUA_API int luasrc_dostring (lua_State *L, const char *string) {
 }
 
 LUA_API int luasrc_dofile (lua_State *L, const char *filename) {
-  int iError = luaL_dofile(L, filename);
+  int iError = lcf_loadfile(L, filename) || lua_pcall(L, 0, LUA_MULTRET, 0);
+  luasrc_hook_invalidate();
   if (iError != 0) {
     Warning( "%s\n", lua_tostring(L, -1) );
     lua_pop(L, 1);
@@ -275,6 +758,8 @@ LUA_API void luasrc_dofolder (lua_State *L, const char *path)
 	char searchPath[ 512 ];
 	Q_snprintf( searchPath, sizeof( searchPath ), "%s\\*.lua", path );
 
+	// files on disk first, then whatever only the mounted .lcf has
+	CUtlDict< int, int > loaded;
 	char const *fn = g_pFullFileSystem->FindFirstEx( searchPath, "MOD", &fh );
 	while ( fn )
 	{
@@ -290,12 +775,24 @@ LUA_API void luasrc_dofolder (lua_State *L, const char *path)
 				Q_snprintf( relative, sizeof( relative ), "%s\\%s", path, fn );
 				filesystem->RelativePathToFullPath( relative, "MOD", loadname, sizeof( loadname ) );
 				luasrc_dofile( L, loadname );
+				loaded.Insert( fn, 0 );
 			}
 		}
 
 		fn = g_pFullFileSystem->FindNext( fh );
 	}
 	g_pFullFileSystem->FindClose( fh );
+
+	CUtlDict< int, int > cached;
+	lcf_findfiles( path, "lua", cached );
+	for ( int i = cached.First(); i != cached.InvalidIndex(); i = cached.Next( i ) )
+	{
+		if ( loaded.Find( cached.GetElementName( i ) ) != loaded.InvalidIndex() )
+			continue;
+		char relative[ 512 ];
+		Q_snprintf( relative, sizeof( relative ), "%s\\%s", path, cached.GetElementName( i ) );
+		luasrc_dofile( L, relative );
+	}
 }
 
 LUA_API int luasrc_pcall (lua_State *L, int nargs, int nresults, int errfunc) {
@@ -335,6 +832,23 @@ LUA_API void luasrc_dumpstack(lua_State *L) {
   lua_pop(L, 1);  /* pop function */
 }
 
+// Resolve a script relative to the MOD search path. Files on disk win over
+// the mounted .lcf, which loads by the relative name.
+static bool luasrc_findfile (const char *filename, char *fullpath, int size)
+{
+	if ( filesystem->FileExists( filename, "MOD" ) )
+	{
+		filesystem->RelativePathToFullPath( filename, "MOD", fullpath, size );
+		return true;
+	}
+	if ( lcf_fileexists( filename ) )
+	{
+		Q_strncpy( fullpath, filename, size );
+		return true;
+	}
+	return false;
+}
+
 void luasrc_LoadEntities (const char *path)
 {
 	FileFindHandle_t fh;
@@ -352,85 +866,90 @@ void luasrc_LoadEntities (const char *path)
 
 	Q_snprintf( root, sizeof( root ), "%s" LUA_PATH_ENTITIES "\\*", path );
 
+	// directories on disk and in the mounted .lcf
+	CUtlDict< int, int > classNames;
 	char const *fn = g_pFullFileSystem->FindFirstEx( root, "MOD", &fh );
 	while ( fn )
 	{
-		Q_strcpy( className, fn );
-		Q_strlower( className );
-		if ( fn[0] != '.' )
+		if ( fn[0] != '.' && g_pFullFileSystem->FindIsDirectory( fh ) && classNames.Find( fn ) == classNames.InvalidIndex() )
 		{
-			if ( g_pFullFileSystem->FindIsDirectory( fh ) )
-			{
+			classNames.Insert( fn, 0 );
+		}
+
+		fn = g_pFullFileSystem->FindNext( fh );
+	}
+	g_pFullFileSystem->FindClose( fh );
+	Q_StripFilename( root );
+	lcf_findfiles( root, NULL, classNames );
+
+	for ( int i = classNames.First(); i != classNames.InvalidIndex(); i = classNames.Next( i ) )
+	{
+		Q_strncpy( className, classNames.GetElementName( i ), sizeof( className ) );
+		Q_strlower( className );
 #ifdef CLIENT_DLL
-				Q_snprintf( filename, sizeof( filename ), "%s" LUA_PATH_ENTITIES "\\%s\\cl_init.lua", path, className );
+		Q_snprintf( filename, sizeof( filename ), "%s" LUA_PATH_ENTITIES "\\%s\\cl_init.lua", path, className );
 #else
-				Q_snprintf( filename, sizeof( filename ), "%s" LUA_PATH_ENTITIES "\\%s\\init.lua", path, className );
+		Q_snprintf( filename, sizeof( filename ), "%s" LUA_PATH_ENTITIES "\\%s\\init.lua", path, className );
 #endif
-				if ( filesystem->FileExists( filename, "MOD" ) )
+		if ( luasrc_findfile( filename, fullpath, sizeof( fullpath ) ) )
+		{
+			lua_newtable( L );
+			char entDir[ MAX_PATH ];
+			Q_snprintf( entDir, sizeof( entDir ), "entities\\%s", className );
+			lua_pushstring( L, entDir );
+			lua_setfield( L, -2, "__folder" );
+			lua_pushstring( L, LUA_BASE_ENTITY_CLASS );
+			lua_setfield( L, -2, "__base" );
+			lua_pushstring( L, LUA_BASE_ENTITY_FACTORY );
+			lua_setfield( L, -2, "__factory" );
+			lua_setglobal( L, "ENT" );
+			if ( luasrc_dofile( L, fullpath ) == 0 )
+			{
+				lua_getglobal( L, "entity" );
+				if ( lua_istable( L, -1 ) )
 				{
-					filesystem->RelativePathToFullPath( filename, "MOD", fullpath, sizeof( fullpath ) );
-					lua_newtable( L );
-					char entDir[ MAX_PATH ];
-					Q_snprintf( entDir, sizeof( entDir ), "entities\\%s", className );
-					lua_pushstring( L, entDir );
-					lua_setfield( L, -2, "__folder" );
-					lua_pushstring( L, LUA_BASE_ENTITY_CLASS );
-					lua_setfield( L, -2, "__base" );
-					lua_pushstring( L, LUA_BASE_ENTITY_FACTORY );
-					lua_setfield( L, -2, "__factory" );
-					lua_setglobal( L, "ENT" );
-					if ( luasrc_dofile( L, fullpath ) == 0 )
+					lua_getfield( L, -1, "register" );
+					if ( lua_isfunction( L, -1 ) )
 					{
-						lua_getglobal( L, "entity" );
+						lua_remove( L, -2 );
+						lua_getglobal( L, "ENT" );
+						lua_pushstring( L, className );
+						luasrc_pcall( L, 2, 0, 0 );
+						lua_getglobal( L, "ENT" );
 						if ( lua_istable( L, -1 ) )
 						{
-							lua_getfield( L, -1, "register" );
-							if ( lua_isfunction( L, -1 ) )
+							lua_getfield( L, -1, "__factory" );
+							if ( lua_isstring( L, -1 ) )
 							{
-								lua_remove( L, -2 );
-								lua_getglobal( L, "ENT" );
-								lua_pushstring( L, className );
-								luasrc_pcall( L, 2, 0, 0 );
-								lua_getglobal( L, "ENT" );
-								if ( lua_istable( L, -1 ) )
-								{
-									lua_getfield( L, -1, "__factory" );
-									if ( lua_isstring( L, -1 ) )
-									{
-										const char *pszClassname = lua_tostring( L, -1 );
-										if (Q_strcmp(pszClassname, "CBaseAnimating") == 0)
-											RegisterScriptedEntity( className );
+								const char *pszClassname = lua_tostring( L, -1 );
+								if (Q_strcmp(pszClassname, "CBaseAnimating") == 0)
+									RegisterScriptedEntity( className );
 #ifndef CLIENT_DLL
-										else if (Q_strcmp(pszClassname, "CBaseTrigger") == 0)
-											RegisterScriptedTrigger( className );
+								else if (Q_strcmp(pszClassname, "CBaseTrigger") == 0)
+									RegisterScriptedTrigger( className );
 #endif
-									}
-									lua_pop( L, 2 );
-								}
-								else
-								{
-									lua_pop( L, 1 );
-								}
-							}
-							else
-							{
-								lua_pop( L, 2 );
 							}
+							lua_pop( L, 2 );
 						}
 						else
 						{
 							lua_pop( L, 1 );
 						}
 					}
-					lua_pushnil( L );
-					lua_setglobal( L, "ENT" );
+					else
+					{
+						lua_pop( L, 2 );
+					}
+				}
+				else
+				{
+					lua_pop( L, 1 );
 				}
 			}
+			lua_pushnil( L );
+			lua_setglobal( L, "ENT" );
 		}
-
-		fn = g_pFullFileSystem->FindNext( fh );
 	}
-	g_pFullFileSystem->FindClose( fh );
 }
 
 void luasrc_LoadWeapons (const char *path)
@@ -450,64 +969,69 @@ void luasrc_LoadWeapons (const char *path)
 
 	Q_snprintf( root, sizeof( root ), "%s" LUA_PATH_WEAPONS "\\*", path );
 
+	// directories on disk and in the mounted .lcf
+	CUtlDict< int, int > classNames;
 	char const *fn = g_pFullFileSystem->FindFirstEx( root, "MOD", &fh );
 	while ( fn )
 	{
-		Q_strcpy( className, fn );
-		Q_strlower( className );
-		if ( fn[0] != '.' )
+		if ( fn[0] != '.' && g_pFullFileSystem->FindIsDirectory( fh ) && classNames.Find( fn ) == classNames.InvalidIndex() )
 		{
-			if ( g_pFullFileSystem->FindIsDirectory( fh ) )
-			{
+			classNames.Insert( fn, 0 );
+		}
+
+		fn = g_pFullFileSystem->FindNext( fh );
+	}
+	g_pFullFileSystem->FindClose( fh );
+	Q_StripFilename( root );
+	lcf_findfiles( root, NULL, classNames );
+
+	for ( int i = classNames.First(); i != classNames.InvalidIndex(); i = classNames.Next( i ) )
+	{
+		Q_strncpy( className, classNames.GetElementName( i ), sizeof( className ) );
+		Q_strlower( className );
 #ifdef CLIENT_DLL
-				Q_snprintf( filename, sizeof( filename ), "%s" LUA_PATH_WEAPONS "\\%s\\cl_init.lua", path, className );
+		Q_snprintf( filename, sizeof( filename ), "%s" LUA_PATH_WEAPONS "\\%s\\cl_init.lua", path, className );
 #else
-				Q_snprintf( filename, sizeof( filename ), "%s" LUA_PATH_WEAPONS "\\%s\\init.lua", path, className );
+		Q_snprintf( filename, sizeof( filename ), "%s" LUA_PATH_WEAPONS "\\%s\\init.lua", path, className );
 #endif
-				if ( filesystem->FileExists( filename, "MOD" ) )
+		if ( luasrc_findfile( filename, fullpath, sizeof( fullpath ) ) )
+		{
+			lua_newtable( L );
+			char entDir[ MAX_PATH ];
+			Q_snprintf( entDir, sizeof( entDir ), "weapons\\%s", className );
+			lua_pushstring( L, entDir );
+			lua_setfield( L, -2, "__folder" );
+			lua_pushstring( L, LUA_BASE_WEAPON );
+			lua_setfield( L, -2, "__base" );
+			lua_setglobal( L, "SWEP" );
+			if ( luasrc_dofile( L, fullpath ) == 0 )
+			{
+				lua_getglobal( L, "weapon" );
+				if ( lua_istable( L, -1 ) )
 				{
-					filesystem->RelativePathToFullPath( filename, "MOD", fullpath, sizeof( fullpath ) );
-					lua_newtable( L );
-					char entDir[ MAX_PATH ];
-					Q_snprintf( entDir, sizeof( entDir ), "weapons\\%s", className );
-					lua_pushstring( L, entDir );
-					lua_setfield( L, -2, "__folder" );
-					lua_pushstring( L, LUA_BASE_WEAPON );
-					lua_setfield( L, -2, "__base" );
-					lua_setglobal( L, "SWEP" );
-					if ( luasrc_dofile( L, fullpath ) == 0 )
+					lua_getfield( L, -1, "register" );
+					if ( lua_isfunction( L, -1 ) )
 					{
-						lua_getglobal( L, "weapon" );
-						if ( lua_istable( L, -1 ) )
-						{
-							lua_getfield( L, -1, "register" );
-							if ( lua_isfunction( L, -1 ) )
-							{
-								lua_remove( L, -2 );
-								lua_getglobal( L, "SWEP" );
-								lua_pushstring( L, className );
-								luasrc_pcall( L, 2, 0, 0 );
-								RegisterScriptedWeapon( className );
-							}
-							else
-							{
-								lua_pop( L, 2 );
-							}
-						}
-						else
-						{
-							lua_pop( L, 1 );
-						}
+						lua_remove( L, -2 );
+						lua_getglobal( L, "SWEP" );
+						lua_pushstring( L, className );
+						luasrc_pcall( L, 2, 0, 0 );
+						RegisterScriptedWeapon( className );
+					}
+					else
+					{
+						lua_pop( L, 2 );
 					}
-					lua_pushnil( L );
-					lua_setglobal( L, "SWEP" );
+				}
+				else
+				{
+					lua_pop( L, 1 );
 				}
 			}
+			lua_pushnil( L );
+			lua_setglobal( L, "SWEP" );
 		}
-
-		fn = g_pFullFileSystem->FindNext( fh );
 	}
-	g_pFullFileSystem->FindClose( fh );
 }
 
 bool luasrc_LoadGamemode (const char *gamemode) {
@@ -525,9 +1049,8 @@ bool luasrc_LoadGamemode (const char *gamemode) {
 #else
   Q_snprintf( filename, sizeof( filename ), "%s\\gamemode\\init.lua", gamemodepath );
 #endif
-  if ( filesystem->FileExists( filename, "MOD" ) )
+  if ( luasrc_findfile( filename, fullpath, sizeof( fullpath ) ) )
   {
-    filesystem->RelativePathToFullPath( filename, "MOD", fullpath, sizeof( fullpath ) );
 	if (luasrc_dofile(L, fullpath) == 0) {
 	  lua_getglobal(L, "gamemode");
 	  lua_getfield(L, -1, "register");
@@ -570,6 +1093,7 @@ bool luasrc_SetGamemode (const char *gamemode) {
 	  lua_pushstring(L, gamemode);
 	  luasrc_pcall(L, 1, 1, 0);
 	  lua_setglobal(L, "_GAMEMODE");
+	  luasrc_hook_invalidate();
 	  Q_snprintf( contentSearchPath, sizeof( contentSearchPath ), "gamemodes\\%s\\content", gamemode );
 	  filesystem->AddSearchPath( contentSearchPath, "MOD" );
 	  char loadPath[MAX_PATH];
@@ -648,6 +1172,78 @@ bool luasrc_SetGamemode (const char *gamemode) {
 	}
 #endif
 
+static void DumpHooks( void )
+{
+	Msg( "%-32s %9s %9s %9s %9s\n", "hook", "listeners", "gamemode", "calls", "skipped" );
+	for ( int i = 0; i < s_Hooks.Count(); i++ )
+	{
+		const luahook_t &hook = s_Hooks[ i ];
+		bool bResolved = hook.nGeneration == s_nHookGeneration;
+		Msg( "%-32s %9s %9s %9d %9d\n", hook.pszName,
+			bResolved ? ( hook.nListeners ? "yes" : "no" ) : "?",
+			bResolved ? ( hook.nFunctionRef != LUA_NOREF ? "yes" : "no" ) : "?",
+			hook.nCalls, hook.nSkips );
+	}
+}
+
+#ifdef CLIENT_DLL
+	CON_COMMAND( lua_hook_dump_cl, "Prints the Lua hook dispatch table" )
+	{
+		DumpHooks();
+	}
+#else
+	CON_COMMAND( lua_hook_dump, "Prints the Lua hook dispatch table" )
+	{
+		if ( !UTIL_IsCommandIssuedByServerAdmin() )
+			return;
+
+		DumpHooks();
+	}
+#endif
+
+static void DumpMemStats( void )
+{
+	int nTotalBlocks = 0;
+	int nTotalBytes = 0;
+	Msg( "%-10s %10s %12s %12s %12s\n", "class", "blocks", "live bytes", "peak bytes", "reserved" );
+	for ( int i = 0; i <= LUA_NUM_SIZECLASSES; i++ )
+	{
+		const luamemclass_t &stats = s_LuaMemStats[ i ];
+		char name[ 16 ];
+		if ( i == LUA_SIZECLASS_LARGE )
+			Q_snprintf( name, sizeof( name ), ">%d", LUA_SMALLBLOCK_MAX );
+		else
+			Q_snprintf( name, sizeof( name ), "%d", s_LuaSizeClasses[ i ] );
+		// pooled blocks always take the full class size
+		int nReserved = ( i == LUA_SIZECLASS_LARGE ) ? stats.nBytes : stats.nBlocks * s_LuaSizeClasses[ i ];
+		Msg( "%-10s %10d %12d %12d %12d\n", name, stats.nBlocks, stats.nBytes, stats.nPeakBytes, nReserved );
+		nTotalBlocks += stats.nBlocks;
+		nTotalBytes += stats.nBytes;
+	}
+	Msg( "%-10s %10d %12d\n", "total", nTotalBlocks, nTotalBytes );
+}
+
+#ifdef CLIENT_DLL
+	CON_COMMAND( lua_mem_stats_cl, "Prints Lua memory usage per allocator size class" )
+	{
+		if ( !g_bLuaInitialized )
+			return;
+
+		DumpMemStats();
+	}
+#else
+	CON_COMMAND( lua_mem_stats, "Prints Lua memory usage per allocator size class" )
+	{
+		if ( !g_bLuaInitialized )
+			return;
+
+		if ( !UTIL_IsCommandIssuedByServerAdmin() )
+			return;
+
+		DumpMemStats();
+	}
+#endif
+
 static int DoFileCompletion( const char *partial, char commands[ COMMAND_COMPLETION_MAXITEMS ][ COMMAND_COMPLETION_ITEM_LENGTH ] )
 {
 	int current = 0;
@@ -15,6 +15,7 @@
 
 #define LUA_ROOT					"lua" // Can't be "LUA_PATH" because luaconf.h uses it.
 #define LUA_PATH_CACHE				"lua_cache"
+#define LUA_PATH_BYTECODE			LUA_PATH_CACHE "\\bytecode"
 #define LUA_PATH_ADDONS				"addons"
 #define LUA_PATH_ENUM				LUA_ROOT "\\includes\\enum"
 #define LUA_PATH_EXTENSIONS			LUA_ROOT "\\includes\\extensions"
@@ -53,26 +54,23 @@
   lua_setfield(L, -2, lib); \
   lua_pop(L, 1);
 
+// Hook calls go through a pre-resolved dispatch table (see luasrc_hook_push).
+// Hooks with neither a hook.add listener nor a gamemode method are skipped
+// without touching the Lua state beyond pushing nresults nils.
 #define BEGIN_LUA_CALL_HOOK(functionName) \
-  lua_getglobal(L, "hook"); \
-  if (lua_istable(L, -1)) { \
-    lua_getfield(L, -1, "call"); \
-	if (lua_isfunction(L, -1)) { \
-	  lua_remove(L, -2); \
-	  int args = 0; \
-	  lua_pushstring(L, functionName); \
-	  lua_getglobal(L, "_GAMEMODE"); \
-	  args = 2;
+  { \
+    static int s_nHookID = luasrc_hook_getid(functionName); \
+    int nHookArgs = luasrc_hook_push(L, s_nHookID); \
+    if (nHookArgs >= 0) { \
+	  int args = nHookArgs;
 
 #define END_LUA_CALL_HOOK(nArgs, nresults) \
 	  args += nArgs; \
-	  luasrc_pcall(L, args, nresults, 0); \
+	  luasrc_hook_pcall(L, s_nHookID, nHookArgs, args, nresults); \
 	} \
 	else \
-	  lua_pop(L, 2); \
-  } \
-  else \
-    lua_pop(L, 1);
+	  luasrc_hook_pushnil(L, nresults); \
+  }
 
 #define BEGIN_LUA_CALL_WEAPON_METHOD(functionName) \
   lua_getref(L, m_nTableReference); \
@@ -323,6 +321,14 @@ void       luasrc_shutdown_gameui (void);
 void       luasrc_init (void);
 void       luasrc_shutdown (void);
 
+// Run the garbage collector within this frame's budget; flSpareTime is how
+// many milliseconds are left before the next tick is due
+void       luasrc_gcstep (float flSpareTime = 0.0f);
+#ifndef CLIENT_DLL
+// Hold the automatic collector off for this host frame's ticks
+void       luasrc_gcpause (void);
+#endif
+
 LUA_API int   (luasrc_dostring) (lua_State *L, const char *string);
 LUA_API int   (luasrc_dofile) (lua_State *L, const char *filename);
 LUA_API void  (luasrc_dofolder) (lua_State *L, const char *path);
@@ -335,6 +341,13 @@ LUA_API void  (luasrc_dumpstack) (lua_State *L);
 void       luasrc_LoadEntities (const char *path = 0);
 void       luasrc_LoadWeapons (const char *path = 0);
 
+// Hook dispatch table
+int        luasrc_hook_getid (const char *hookName);
+int        luasrc_hook_push (lua_State *L, int hookID);
+void       luasrc_hook_pcall (lua_State *L, int hookID, int nhookargs, int nargs, int nresults);
+void       luasrc_hook_pushnil (lua_State *L, int nresults);
+void       luasrc_hook_invalidate (const char *hookName = 0);
+
 bool       luasrc_LoadGamemode (const char *gamemode);
 bool       luasrc_SetGamemode (const char *gamemode);
 
@@ -537,7 +537,11 @@ void AddSurfacepropFile( const char *pFileName, IPhysicsSurfaceProps *pProps, IF
 void PhysParseSurfaceData( IPhysicsSurfaceProps *pProps, IFileSystem *pFileSystem )
 {
 	KeyValues *manifest = new KeyValues( SURFACEPROP_MANIFEST_FILE );
+#ifdef GAME_DLL
+	if ( manifest->LoadFromFileCached( pFileSystem, SURFACEPROP_MANIFEST_FILE, "GAME" ) )
+#else
 	if ( manifest->LoadFromFile( pFileSystem, SURFACEPROP_MANIFEST_FILE, "GAME" ) )
+#endif
 	{
 		for ( KeyValues *sub = manifest->GetFirstSubKey(); sub != NULL; sub = sub->GetNextKey() )
 		{
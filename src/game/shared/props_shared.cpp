@@ -214,7 +214,11 @@ void CPropData::LevelShutdownPostEntity( void )
 void CPropData::ParsePropDataFile( void )
 {
 	m_pKVPropData = new KeyValues( "PropDatafile" );
+#ifdef GAME_DLL
+	if ( !m_pKVPropData->LoadFromFileCached( filesystem, "scripts/propdata.txt" ) )
+#else
 	if ( !m_pKVPropData->LoadFromFile( filesystem, "scripts/propdata.txt" ) )
+#endif
 	{
 		m_pKVPropData->deleteThis();
 		m_pKVPropData = NULL;
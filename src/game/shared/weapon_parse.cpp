@@ -166,7 +166,11 @@ void PrecacheFileWeaponInfoDatabase( IFileSystem *filesystem, const unsigned cha
 		return;
 
 	KeyValues *manifest = new KeyValues( "weaponscripts" );
+#ifdef GAME_DLL
+	if ( manifest->LoadFromFileCached( filesystem, "scripts/weapon_manifest.txt", "GAME" ) )
+#else
 	if ( manifest->LoadFromFile( filesystem, "scripts/weapon_manifest.txt", "GAME" ) )
+#endif
 	{
 		for ( KeyValues *sub = manifest->GetFirstSubKey(); sub != NULL ; sub = sub->GetNextKey() )
 		{
@@ -210,7 +214,12 @@ KeyValues* ReadEncryptedKVFile( IFileSystem *filesystem, const char *szFilenameW
 
 	Q_snprintf(szFullName,sizeof(szFullName), "%s.txt", szFilenameWithoutExtension);
 
-	if ( bForceReadEncryptedFile || !pKV->LoadFromFile( filesystem, szFullName, pSearchPath ) ) // try to load the normal .txt file first
+	// try to load the normal .txt file first; only the server trusts a compiled copy of it, clients read what sv_pure checks
+#ifdef GAME_DLL
+	if ( bForceReadEncryptedFile || !pKV->LoadFromFileCached( filesystem, szFullName, pSearchPath ) )
+#else
+	if ( bForceReadEncryptedFile || !pKV->LoadFromFile( filesystem, szFullName, pSearchPath ) )
+#endif
 	{
 #ifndef _XBOX
 		if ( pICEKey )
@@ -1246,6 +1246,243 @@ FORCEINLINE fltx4 QuaternionAccumulateSIMD( const fltx4 &p, float s, const fltx4
 
 
 
+//-----------------------------------------------------------------------------
+// SIMD bone kernels. Four bones are processed per fltx4: their quaternions are
+// transposed into x/y/z/w lanes and positions into a FourVectors, so every op
+// below works on four bones at once. The last group of bones, and any group
+// containing a case the lanes can't express, goes through the scalar code.
+//-----------------------------------------------------------------------------
+static ConVar anim_simd_bones( "anim_simd_bones", "1", FCVAR_REPLICATED, "Use the SIMD bone kernels in SlerpBones and Studio_BuildMatrices." );
+
+static int s_nForceSIMDBones = -1;
+
+void Studio_ForceSIMDBoneKernels( int nForce )
+{
+	s_nForceSIMDBones = nForce;
+}
+
+bool Studio_UseSIMDBoneKernels()
+{
+	static bool s_bSIMDAvailable = MathLib_SSE2Enabled();
+	if ( !s_bSIMDAvailable )
+		return false;
+	if ( s_nForceSIMDBones >= 0 )
+		return s_nForceSIMDBones != 0;
+	return anim_simd_bones.GetBool();
+}
+
+//-----------------------------------------------------------------------------
+// Slerp weights without trig or division, after Eberly's "A Fast and Accurate
+// Algorithm for Computing SLERP". sin( t * omega ) / sin( omega ) is a series
+// in t^2 and cos( omega ) - 1; the last term is scaled up to absorb what the
+// truncation leaves off. Good for cos( omega ) in [0, 1], to within 1e-6.
+//-----------------------------------------------------------------------------
+#define SLERP_SERIES_TERMS	12
+#define SLERP_SERIES_MU		1.894f
+
+static const float s_flSlerpSeriesU[SLERP_SERIES_TERMS] =		// 1 / ( i * ( 2i + 1 ) )
+{
+	1.0f / ( 1 * 3 ), 1.0f / ( 2 * 5 ), 1.0f / ( 3 * 7 ), 1.0f / ( 4 * 9 ), 1.0f / ( 5 * 11 ), 1.0f / ( 6 * 13 ),
+	1.0f / ( 7 * 15 ), 1.0f / ( 8 * 17 ), 1.0f / ( 9 * 19 ), 1.0f / ( 10 * 21 ), 1.0f / ( 11 * 23 ), SLERP_SERIES_MU / ( 12 * 25 )
+};
+
+static const float s_flSlerpSeriesV[SLERP_SERIES_TERMS] =		// i / ( 2i + 1 )
+{
+	1.0f / 3, 2.0f / 5, 3.0f / 7, 4.0f / 9, 5.0f / 11, 6.0f / 13,
+	7.0f / 15, 8.0f / 17, 9.0f / 19, 10.0f / 21, 11.0f / 23, SLERP_SERIES_MU * 12 / 25
+};
+
+static FORCEINLINE fltx4 SlerpWeightSIMD( const fltx4 &t, const fltx4 &cosomMinusOne )
+{
+	fltx4 tt = MulSIMD( t, t );
+	fltx4 result = Four_Ones;
+	for ( int k = SLERP_SERIES_TERMS - 1; k >= 0; --k )
+	{
+		fltx4 b = MulSIMD( SubSIMD( MulSIMD( ReplicateX4( s_flSlerpSeriesU[k] ), tt ), ReplicateX4( s_flSlerpSeriesV[k] ) ), cosomMinusOne );
+		result = MaddSIMD( b, result, Four_Ones );
+	}
+	return MulSIMD( t, result );
+}
+
+static FORCEINLINE void LoadQuaternionsSIMD( const Quaternion *q, fltx4 &x, fltx4 &y, fltx4 &z, fltx4 &w )
+{
+	x = LoadUnalignedSIMD( q[0].Base() );
+	y = LoadUnalignedSIMD( q[1].Base() );
+	z = LoadUnalignedSIMD( q[2].Base() );
+	w = LoadUnalignedSIMD( q[3].Base() );
+	TransposeSIMD( x, y, z, w );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: SlerpBones inner loop for the non-delta case. Returns the number of
+//			bones handled; the caller finishes the rest.
+//-----------------------------------------------------------------------------
+static int SlerpBonesSIMD( const CStudioHdr *pStudioHdr, Quaternion q1[], Vector pos1[], const QuaternionAligned q2[], const Vector pos2[], const float *pS2, int nBoneCount )
+{
+	// the last group stays scalar so the Vector loads can't read past the arrays
+	int nGroups = ( nBoneCount - 1 ) / 4;
+	int i;
+	for ( i = 0; i < nGroups * 4; i += 4 )
+	{
+		fltx4 s2 = LoadUnalignedSIMD( pS2 + i );
+		fltx4 active = CmpGtSIMD( s2, Four_Zeros );
+		if ( IsAllZeros( active ) )
+			continue;
+
+		// QuaternionSlerp( q2[i], q1[i], s1, q3 ): p = q2, q = q1, t = s1
+		fltx4 t = SubSIMD( Four_Ones, s2 );
+		fltx4 px, py, pz, pw, qx, qy, qz, qw;
+		LoadQuaternionsSIMD( q2 + i, px, py, pz, pw );
+		LoadQuaternionsSIMD( q1 + i, qx, qy, qz, qw );
+
+		fltx4 cosom = MulSIMD( px, qx );
+		cosom = MaddSIMD( py, qy, cosom );
+		cosom = MaddSIMD( pz, qz, cosom );
+		cosom = MaddSIMD( pw, qw, cosom );
+
+		// QuaternionAlign flips q into p's hemisphere, except on fixed alignment bones
+		ALIGN16 uint32 fixedAlign[4] ALIGN16_POST;
+		for ( int k = 0; k < 4; ++k )
+		{
+			fixedAlign[k] = ( pStudioHdr->boneFlags( i + k ) & BONE_FIXED_ALIGNMENT ) ? ~0u : 0;
+		}
+		fltx4 flip = AndNotSIMD( LoadAlignedSIMD( fixedAlign ), CmpLtSIMD( cosom, Four_Zeros ) );
+		fltx4 sign = MaskedAssign( flip, Four_NegativeOnes, Four_Ones );
+		qx = MulSIMD( qx, sign );
+		qy = MulSIMD( qy, sign );
+		qz = MulSIMD( qz, sign );
+		qw = MulSIMD( qw, sign );
+		cosom = MulSIMD( cosom, sign );
+
+		// Only fixed alignment bones can still be in opposite hemispheres here. The
+		// series doesn't cover them, nor the nearly opposite case in QuaternionSlerpNoAlign.
+		if ( !IsAllZeros( AndSIMD( active, CmpLtSIMD( cosom, Four_Zeros ) ) ) )
+		{
+			for ( int k = 0; k < 4; ++k )
+			{
+				float flS2 = pS2[i + k];
+				if ( flS2 <= 0.0f )
+					continue;
+
+				float flS1 = 1.0f - flS2;
+				QuaternionAligned q3;
+				if ( pStudioHdr->boneFlags( i + k ) & BONE_FIXED_ALIGNMENT )
+				{
+					QuaternionSlerpNoAlign( q2[i + k], q1[i + k], flS1, q3 );
+				}
+				else
+				{
+					QuaternionSlerp( q2[i + k], q1[i + k], flS1, q3 );
+				}
+				q1[i + k] = q3;
+				pos1[i + k] = pos1[i + k] * flS1 + pos2[i + k] * flS2;
+			}
+			continue;
+		}
+
+		// The series goes to a plain lerp as the quaternions converge, so nearly
+		// identical lanes need no special case
+		fltx4 cosomMinusOne = SubSIMD( cosom, Four_Ones );
+		fltx4 sclp = SlerpWeightSIMD( SubSIMD( Four_Ones, t ), cosomMinusOne );
+		fltx4 sclq = SlerpWeightSIMD( t, cosomMinusOne );
+
+		fltx4 result[4];
+		result[0] = MaddSIMD( sclp, px, MulSIMD( sclq, qx ) );
+		result[1] = MaddSIMD( sclp, py, MulSIMD( sclq, qy ) );
+		result[2] = MaddSIMD( sclp, pz, MulSIMD( sclq, qz ) );
+		result[3] = MaddSIMD( sclp, pw, MulSIMD( sclq, qw ) );
+		TransposeSIMD( result[0], result[1], result[2], result[3] );
+
+		FourVectors v1, v2;
+		v1.LoadAndSwizzle( pos1[i], pos1[i + 1], pos1[i + 2], pos1[i + 3] );
+		v2.LoadAndSwizzle( pos2[i], pos2[i + 1], pos2[i + 2], pos2[i + 3] );
+		v1 *= t;
+		v2 *= s2;
+		v1 += v2;
+
+		for ( int k = 0; k < 4; ++k )
+		{
+			if ( pS2[i + k] <= 0.0f )
+				continue;
+			StoreUnalignedSIMD( q1[i + k].Base(), result[k] );
+			pos1[i + k] = v1.Vec( k );
+		}
+	}
+
+	return i;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds QuaternionMatrix( q[i], pos[i] ) for every bone in the mask,
+//			four bones at a time.
+//-----------------------------------------------------------------------------
+void Studio_BuildLocalMatricesSIMD( const CStudioHdr *pStudioHdr, const Vector pos[], const Quaternion q[], matrix3x4_t local[], int boneMask )
+{
+	int nBoneCount = pStudioHdr->numbones();
+	int nGroups = ( nBoneCount - 1 ) / 4;
+	int i;
+	for ( i = 0; i < nGroups * 4; i += 4 )
+	{
+		if ( !( ( pStudioHdr->boneFlags( i ) | pStudioHdr->boneFlags( i + 1 ) | pStudioHdr->boneFlags( i + 2 ) | pStudioHdr->boneFlags( i + 3 ) ) & boneMask ) )
+			continue;
+
+		fltx4 x, y, z, w;
+		LoadQuaternionsSIMD( q + i, x, y, z, w );
+
+		FourVectors origin;
+		origin.LoadAndSwizzle( pos[i], pos[i + 1], pos[i + 2], pos[i + 3] );
+
+		fltx4 x2 = AddSIMD( x, x ), y2 = AddSIMD( y, y ), z2 = AddSIMD( z, z );
+		fltx4 xx = MulSIMD( x, x2 ), yy = MulSIMD( y, y2 ), zz = MulSIMD( z, z2 );
+		fltx4 xy = MulSIMD( x, y2 ), xz = MulSIMD( x, z2 ), yz = MulSIMD( y, z2 );
+		fltx4 wx = MulSIMD( w, x2 ), wy = MulSIMD( w, y2 ), wz = MulSIMD( w, z2 );
+
+		// rows of the four matrices, one bone per lane
+		fltx4 m00 = SubSIMD( Four_Ones, AddSIMD( yy, zz ) );
+		fltx4 m01 = SubSIMD( xy, wz );
+		fltx4 m02 = AddSIMD( xz, wy );
+		fltx4 m03 = origin.x;
+
+		fltx4 m10 = AddSIMD( xy, wz );
+		fltx4 m11 = SubSIMD( Four_Ones, AddSIMD( xx, zz ) );
+		fltx4 m12 = SubSIMD( yz, wx );
+		fltx4 m13 = origin.y;
+
+		fltx4 m20 = SubSIMD( xz, wy );
+		fltx4 m21 = AddSIMD( yz, wx );
+		fltx4 m22 = SubSIMD( Four_Ones, AddSIMD( xx, yy ) );
+		fltx4 m23 = origin.z;
+
+		// ...and back to one bone per register
+		TransposeSIMD( m00, m01, m02, m03 );
+		TransposeSIMD( m10, m11, m12, m13 );
+		TransposeSIMD( m20, m21, m22, m23 );
+
+		StoreUnalignedSIMD( local[i][0], m00 );
+		StoreUnalignedSIMD( local[i][1], m10 );
+		StoreUnalignedSIMD( local[i][2], m20 );
+		StoreUnalignedSIMD( local[i + 1][0], m01 );
+		StoreUnalignedSIMD( local[i + 1][1], m11 );
+		StoreUnalignedSIMD( local[i + 1][2], m21 );
+		StoreUnalignedSIMD( local[i + 2][0], m02 );
+		StoreUnalignedSIMD( local[i + 2][1], m12 );
+		StoreUnalignedSIMD( local[i + 2][2], m22 );
+		StoreUnalignedSIMD( local[i + 3][0], m03 );
+		StoreUnalignedSIMD( local[i + 3][1], m13 );
+		StoreUnalignedSIMD( local[i + 3][2], m23 );
+	}
+
+	for ( ; i < nBoneCount; i++ )
+	{
+		if ( pStudioHdr->boneFlags( i ) & boneMask )
+		{
+			QuaternionMatrix( q[i], pos[i], local[i] );
+		}
+	}
+}
+
+
+
 //-----------------------------------------------------------------------------
 // Purpose: blend together in world space q1,pos1 with q2,pos2.  Return result in q1,pos1.  
 //			0 returns q1, pos1.  1 returns q2, pos2
@@ -1481,8 +1718,14 @@ void SlerpBones(
 		return;
 	}
 
+	i = 0;
+	if ( Studio_UseSIMDBoneKernels() )
+	{
+		i = SlerpBonesSIMD( pStudioHdr, q1, pos1, q2, pos2, pS2, nBoneCount );
+	}
+
 	QuaternionAligned q3;
-	for (i = 0; i < nBoneCount; i++)
+	for ( ; i < nBoneCount; i++)
 	{
 		s2 = pS2[i];
 		if ( s2 <= 0.0f )
@@ -4560,12 +4803,27 @@ void Studio_BuildMatrices(
 		VectorScale( rotationmatrix[2], flScale, rotationmatrix[2] );
 	}
 
+	// The local matrices don't depend on each other, so build them all up front for a whole skeleton
+	matrix3x4_t *pLocal = NULL;
+	if ( iBone == -1 && Studio_UseSIMDBoneKernels() )
+	{
+		pLocal = g_MatrixPool.Alloc();
+		Studio_BuildLocalMatricesSIMD( pStudioHdr, pos, q, pLocal, boneMask );
+	}
+
 	for (j = chainlength - 1; j >= 0; j--)
 	{
 		i = chain[j];
 		if (pStudioHdr->boneFlags(i) & boneMask)
 		{
-			QuaternionMatrix( q[i], pos[i], bonematrix );
+			if ( pLocal )
+			{
+				MatrixCopy( pLocal[i], bonematrix );
+			}
+			else
+			{
+				QuaternionMatrix( q[i], pos[i], bonematrix );
+			}
 
 			if (pStudioHdr->boneParent(i) == -1) 
 			{
@@ -4577,6 +4835,11 @@ void Studio_BuildMatrices(
 			}
 		}
 	}
+
+	if ( pLocal )
+	{
+		g_MatrixPool.Free( pLocal );
+	}
 }
 
 
@@ -332,6 +332,14 @@ void Studio_BuildMatrices(
 	);
 
 
+// SIMD bone kernels, used by SlerpBones and Studio_BuildMatrices when anim_simd_bones is set and the CPU has SSE2.
+// Studio_ForceSIMDBoneKernels( 0 or 1 ) overrides the convar for benchmarking, -1 restores it.
+bool Studio_UseSIMDBoneKernels();
+void Studio_ForceSIMDBoneKernels( int nForce );
+
+// Builds QuaternionMatrix( q[i], pos[i] ) into local[i] for every bone in boneMask
+void Studio_BuildLocalMatricesSIMD( const CStudioHdr *pStudioHdr, const Vector pos[], const Quaternion q[], matrix3x4_t local[], int boneMask );
+
 // Get a bone->bone relative transform
 void Studio_CalcBoneToBoneTransform( const CStudioHdr *pStudioHdr, int inputBoneIndex, int outputBoneIndex, matrix3x4_t &matrixOut );
 
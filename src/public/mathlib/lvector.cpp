@@ -79,6 +79,16 @@ LUALIB_API lua_QAngle &luaL_optangle (lua_State *L, int narg,
 }
 
 
+/*
+** The in-place methods below modify and return self, so per-tick math can be
+** written without creating a new userdata for every intermediate result.
+*/
+static int Vector_Add (lua_State *L) {
+  luaL_checkvector(L, 1) += luaL_checkvector(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int Vector_Cross (lua_State *L) {
   lua_pushvector(L, luaL_checkvector(L, 1).Cross(luaL_checkvector(L, 2)));
   return 1;
@@ -94,6 +104,12 @@ static int Vector_DistToSqr (lua_State *L) {
   return 1;
 }
 
+static int Vector_Div (lua_State *L) {
+  luaL_checkvector(L, 1) /= (vec_t)luaL_checknumber(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int Vector_Dot (lua_State *L) {
   lua_pushnumber(L, luaL_checkvector(L, 1).Dot(luaL_checkvector(L, 2)));
   return 1;
@@ -154,6 +170,15 @@ static int Vector_Min (lua_State *L) {
   return 1;
 }
 
+static int Vector_Mul (lua_State *L) {
+  if (lua_isnumber(L, 2))
+    luaL_checkvector(L, 1) *= (vec_t)lua_tonumber(L, 2);
+  else
+    luaL_checkvector(L, 1) *= luaL_checkvector(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int Vector_MulAdd (lua_State *L) {
   luaL_checkvector(L, 1).MulAdd(luaL_checkvector(L, 2), luaL_checkvector(L, 3), luaL_checknumber(L, 4));
   return 0;
@@ -164,6 +189,12 @@ static int Vector_Negate (lua_State *L) {
   return 0;
 }
 
+static int Vector_Normalize (lua_State *L) {
+  VectorNormalize(luaL_checkvector(L, 1));
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int Vector_NormalizeInPlace (lua_State *L) {
   lua_pushnumber(L, luaL_checkvector(L, 1).NormalizeInPlace());
   return 1;
@@ -174,6 +205,18 @@ static int Vector_Random (lua_State *L) {
   return 0;
 }
 
+static int Vector_Set (lua_State *L) {
+  luaL_checkvector(L, 1) = luaL_checkvector(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int Vector_Sub (lua_State *L) {
+  luaL_checkvector(L, 1) -= luaL_checkvector(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int Vector_WithinAABox (lua_State *L) {
   lua_pushboolean(L, luaL_checkvector(L, 1).WithinAABox(luaL_checkvector(L, 2), luaL_checkvector(L, 3)));
   return 1;
@@ -257,9 +300,11 @@ static int Vector___unm (lua_State *L) {
 
 
 static const luaL_Reg Vectormeta[] = {
+  {"Add", Vector_Add},
   {"Cross", Vector_Cross},
   {"DistTo", Vector_DistTo},
   {"DistToSqr", Vector_DistToSqr},
+  {"Div", Vector_Div},
   {"Dot", Vector_Dot},
   {"Init", Vector_Init},
   {"Invalidate", Vector_Invalidate},
@@ -272,10 +317,14 @@ static const luaL_Reg Vectormeta[] = {
   {"LengthSqr", Vector_LengthSqr},
   {"Max", Vector_Max},
   {"Min", Vector_Min},
+  {"Mul", Vector_Mul},
   {"MulAdd", Vector_MulAdd},
   {"Negate", Vector_Negate},
+  {"Normalize", Vector_Normalize},
   {"NormalizeInPlace", Vector_NormalizeInPlace},
   {"Random", Vector_Random},
+  {"Set", Vector_Set},
+  {"Sub", Vector_Sub},
   {"WithinAABox", Vector_WithinAABox},
   {"Zero", Vector_Zero},
   {"__index", Vector___index},
@@ -323,6 +372,12 @@ LUALIB_API int luaopen_Vector (lua_State *L) {
 }
 
 
+static int QAngle_Add (lua_State *L) {
+  luaL_checkangle(L, 1) += luaL_checkangle(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int QAngle_Init (lua_State *L) {
   luaL_checkangle(L, 1).Init(luaL_optnumber(L, 1, 0.0f), luaL_optnumber(L, 1, 0.0f), luaL_optnumber(L, 1, 0.0f));
   return 0;
@@ -348,6 +403,24 @@ static int QAngle_LengthSqr (lua_State *L) {
   return 1;
 }
 
+static int QAngle_Mul (lua_State *L) {
+  luaL_checkangle(L, 1) *= (vec_t)luaL_checknumber(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int QAngle_Set (lua_State *L) {
+  luaL_checkangle(L, 1) = luaL_checkangle(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int QAngle_Sub (lua_State *L) {
+  luaL_checkangle(L, 1) -= luaL_checkangle(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int QAngle___index (lua_State *L) {
   QAngle v = luaL_checkangle(L, 1);
   const char *field = luaL_checkstring(L, 2);
@@ -413,11 +486,15 @@ static int QAngle___unm (lua_State *L) {
 
 
 static const luaL_Reg QAnglemeta[] = {
+  {"Add", QAngle_Add},
   {"Init", QAngle_Init},
   {"Invalidate", QAngle_Invalidate},
   {"IsValid", QAngle_IsValid},
   {"Length", QAngle_Length},
   {"LengthSqr", QAngle_LengthSqr},
+  {"Mul", QAngle_Mul},
+  {"Set", QAngle_Set},
+  {"Sub", QAngle_Sub},
   {"__index", QAngle___index},
   {"__newindex", QAngle___newindex},
   {"__tostring", QAngle___tostring},
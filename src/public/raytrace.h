@@ -84,8 +84,8 @@ struct TriGeometryData_t
 	float m_VertexCoordData[9];								// can't use a vector in a union
 
 	uint8 m_nFlags;											// triangle flags
-	signed char m_nTmpData0;								// used by kd-tree builder
-	signed char m_nTmpData1;								// used by kd-tree builder
+	signed char m_nTmpData0;								// no longer used
+	signed char m_nTmpData1;								// no longer used
 
 
 	// accessors to get around union annoyance
@@ -193,6 +193,26 @@ protected:
 };
 
 
+//-----------------------------------------------------------------------------
+// A 4-wide bounding volume hierarchy node, the alternative to the kd-tree. The
+// bounds of all four children live in the parent, one child per column, so a
+// node is two cache lines and a ray packet tests every child without touching
+// the children themselves. Unlike the kd-tree each triangle is referenced by
+// exactly one leaf.
+//-----------------------------------------------------------------------------
+struct CacheOptimizedBVHNode
+{
+	float m_flChildMins[3][4];								// [axis][child]
+	float m_flChildMaxs[3][4];
+	int32 m_nChild[4];										// node index, or for leaves the first
+															// entry in BVHTriangleIndexList. -1
+															// marks an unused slot; used slots
+															// come first
+	int32 m_nTriCount[4];									// triangles in a leaf child, 0 for a
+															// node
+};
+
+
 struct RayTracingSingleResult
 {
 	Vector surface_normal;									// surface normal at intersection
@@ -220,6 +240,7 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_USE_BVH 8									// build a bvh instead of a kd-tree
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -264,6 +285,8 @@ public:
 	CUtlVector<CacheOptimizedKDNode> OptimizedKDTree;		//< the packed kdtree. root is 0
 	CUtlBlockVector<CacheOptimizedTriangle> OptimizedTriangleList; //< the packed triangles
 	CUtlVector<int32> TriangleIndexList;					//< the list of triangle indices.
+	CUtlVector<CacheOptimizedBVHNode> OptimizedBVH;			//< the bvh, if RTE_FLAGS_USE_BVH. root is 0
+	CUtlVector<int32> BVHTriangleIndexList;					//< triangles referenced by bvh leaves
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
@@ -294,7 +317,8 @@ public:
 										const Vector &color);
 
 
-	// SetupAccelerationStructure to prepare for tracing
+	// SetupAccelerationStructure to prepare for tracing. Builds the kd-tree, or the bvh if
+	// RTE_FLAGS_USE_BVH is set; both find the same closest hits.
 	void SetupAccelerationStructure(void);
 
 
@@ -356,6 +380,18 @@ public:
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
 
+	// builds the kd-tree. the build is multithreaded below the top levels of the tree and
+	// gives the same tree for any number of threads.
+	void BuildKDTree(void);
+
+	// bvh construction and traversal. the build is multithreaded below the top levels of the
+	// tree and gives the same tree for any number of threads.
+	void BuildBVH(void);
+
+	void Trace4RaysBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+					   FourVectors const &OneOverRayDir, RayTracingResult *rslt_out,
+					   int32 skip_id, ITransparentTriangleCallback *pCallback);
+
 	void AddInfinitePointLight(Vector position,				// light center
 							   Vector intensity);			// rgb amount
 
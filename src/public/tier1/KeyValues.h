@@ -24,6 +24,7 @@
 
 #include "utlvector.h"
 #include "Color.h"
+#include "memstack.h"
 
 #define FOR_EACH_SUBKEY( kvRoot, kvSubKey ) \
 	for ( KeyValues * kvSubKey = kvRoot->GetFirstSubKey(); kvSubKey != NULL; kvSubKey = kvSubKey->GetNextKey() )
@@ -39,6 +40,7 @@ class CUtlBuffer;
 class Color;
 typedef void * FileHandle_t;
 class CKeyValuesGrowableStringTable;
+class CKeyValuesDocument;
 
 //-----------------------------------------------------------------------------
 // Purpose: Simple recursive data access class
@@ -121,6 +123,11 @@ public:
 	void UsesEscapeSequences(bool state); // default false
 	void UsesConditionals(bool state); // default true
 	bool LoadFromFile( IBaseFileSystem *filesystem, const char *resourceName, const char *pathID = NULL, bool refreshCache = false );
+
+	// Same as LoadFromFile, but keeps the parsed file as binary in <resourceName>.kvc in the MOD
+	// path and reads that instead while the text is unchanged. The .kvc is trusted whenever its
+	// header matches the text, so don't use this where sv_pure has to police what the client loads.
+	bool LoadFromFileCached( IBaseFileSystem *filesystem, const char *resourceName, const char *pathID = NULL );
 	bool SaveToFile( IBaseFileSystem *filesystem, const char *resourceName, const char *pathID = NULL, bool sortKeys = false, bool bAllowEmptyString = false, bool bCacheResult = false );
 
 	// Read from a buffer...  Note that the buffer must be null terminated
@@ -262,6 +269,8 @@ public:
 	void RecursiveMergeKeyValues( KeyValues *baseKV );
 
 private:
+	friend class CKeyValuesDocument;
+
 	KeyValues( KeyValues& );	// prevent copy constructor being used
 
 	// prevent delete being called except through deleteThis()
@@ -328,12 +337,18 @@ private:
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
 	char	   m_bEvaluateConditionals; // true, if while parsing this KeyValue, conditionals blocks are evaluated (default true)
-	char	   unused[1];
+	char	   m_nDocumentFlags; // DOCUMENT_ flags, set on keys parsed by a CKeyValuesDocument
 
 	KeyValues *m_pPeer;	// pointer to next key in list
 	KeyValues *m_pSub;	// pointer to Start of a new sub key list
 	KeyValues *m_pChain;// Search here if it's not in our list
 
+	enum
+	{
+		DOCUMENT_NODE = 0x01,	// the key lives in a document's arena, not on the heap
+		DOCUMENT_VALUE = 0x02,	// m_sValue points into a document's memory
+	};
+
 private:
 	// Statics to implement the optional growable string table
 	// Function pointers that will determine which mode we are in
@@ -357,6 +372,58 @@ public:
 
 typedef KeyValues::AutoDelete KeyValuesAD;
 
+//-----------------------------------------------------------------------------
+// Purpose: Read-mostly KeyValues parsed in place.
+//			The file is read once into a per-document arena and tokenized
+//			where it lies: string values point straight into the text and
+//			keys are carved out of the same arena, so loading a file costs one
+//			arena instead of a heap allocation per key and per string. All of
+//			it is released at once when the document is cleared or destroyed.
+//
+//			The keys are ordinary KeyValues and can be read, changed and added
+//			to; anything set or added later lives on the heap and is freed
+//			with the document too. Keys must not outlive the document or be
+//			moved into another tree, use MakeCopy() for that.
+//-----------------------------------------------------------------------------
+class CKeyValuesDocument
+{
+public:
+	CKeyValuesDocument();
+	~CKeyValuesDocument();
+
+	// Both return the first top level key, or NULL if the document couldn't be loaded.
+	// Anything already in the document is released first.
+	KeyValues *LoadFromFile( IBaseFileSystem *filesystem, const char *resourceName, const char *pathID = NULL );
+	KeyValues *LoadFromBuffer( char const *resourceName, const char *pBuffer, int nLength = -1, IBaseFileSystem* pFileSystem = NULL, const char *pPathID = NULL );
+
+	KeyValues *GetRoot() const { return m_pRoot; }
+	void Clear();
+
+	// Parse options, same as the KeyValues ones
+	void UsesEscapeSequences( bool state ) { m_bHasEscapeSequences = state; }
+	void UsesConditionals( bool state ) { m_bEvaluateConditionals = state; }
+
+	// Stats
+	int GetArenaUsed() { return m_Arena.GetBase() ? m_Arena.GetUsed() : 0; }
+	int GetHeapAllocationCount() const;
+
+private:
+	class CTokenizer;
+
+	KeyValues *Parse( char const *resourceName, char *pText, int nLength, IBaseFileSystem* pFileSystem, const char *pPathID );
+	void RecursiveParse( KeyValues *pParent, CTokenizer &tokenizer );
+	char *AllocText( int nLength );
+	void *AllocArena( unsigned nBytes );
+	KeyValues *AllocKey( const char *pName );
+	void SetValue( KeyValues *pKey, char *pValue );
+	static int CountHeapAllocations( const KeyValues *pKey );
+
+	CMemoryStack m_Arena;
+	KeyValues *m_pRoot;
+	bool m_bHasEscapeSequences;
+	bool m_bEvaluateConditionals;
+};
+
 enum KeyValuesUnpackDestinationTypes_t
 {
 	UNPACK_TYPE_FLOAT,										// dest is a float
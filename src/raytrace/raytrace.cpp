@@ -4,6 +4,7 @@
 #include "raytrace.h"
 #include <filesystem_tools.h>
 #include <cmdlib.h>
+#include <threads.h>
 #include <stdio.h>
 
 static bool SameSign(float a, float b)
@@ -276,6 +277,109 @@ static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
 	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
 }
 
+//-----------------------------------------------------------------------------
+// Tests four rays against one triangle and records any hit closer than the
+// current one. Shared by the kd-tree and bvh traversals so they give the same
+// hits down to the last bit.
+//-----------------------------------------------------------------------------
+static FORCEINLINE void IntersectTriangle4( const FourRays &rays, int tnum, TriIntersectData_t const *tri,
+										   RayTracingResult *rslt_out, ITransparentTriangleCallback *pCallback )
+{
+	n_intersection_calculations++;
+
+	// compute plane intersection
+	FourVectors N;
+	N.x = ReplicateX4( tri->m_flNx );
+	N.y = ReplicateX4( tri->m_flNy );
+	N.z = ReplicateX4( tri->m_flNz );
+
+	fltx4 DDotN = rays.direction * N;
+	// mask off zero or near zero (ray parallel to surface)
+	fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
+							CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
+
+	fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
+
+	fltx4 isect_t=DivSIMD( numerator,DDotN );
+	// now, we have the distance to the plane. lets update our mask
+	did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
+	//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
+	did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// now, check 3 edges
+	fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
+						MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
+	fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
+						   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+	
+	// do barycentric coordinate check
+	fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+
+	B0 = AddSIMD(
+		B0,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+	B0 = AddSIMD(
+		B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
+
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
+
+	fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+	B1 = AddSIMD(
+		B1,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
+
+	B1 = AddSIMD(
+		B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
+	
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
+
+	fltx4 B2 = AddSIMD( B1, B0 );
+	did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// if the triangle is transparent
+	if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+	{
+		if ( pCallback )
+		{
+			// assuming a triangle indexed as v0, v1, v2
+			// the projected edge equations are set up such that the vert opposite the first
+			// equation is v2, and the vert opposite the second equation is v0
+			// Therefore we pass them back in 1, 2, 0 order
+			// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
+			// barycentric coordinate.  Compute that now and pass it to the callback
+			fltx4 b2 = SubSIMD( Four_Ones, B2 );
+			if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
+			{
+				did_hit = Four_Zeros;
+			}
+		}
+	}
+	// now, set the hit_id and closest_hit fields for any enabled rays
+	fltx4 replicated_n = ReplicateIX4(tnum);
+	StoreAlignedSIMD((float *) rslt_out->HitIds,
+				 OrSIMD(AndSIMD(replicated_n,did_hit),
+						   AndNotSIMD(did_hit,LoadAlignedSIMD(
+											 (float *) rslt_out->HitIds))));
+	rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
+					 AndNotSIMD(did_hit,rslt_out->HitDistance));
+
+	rslt_out->surface_normal.x=OrSIMD(
+		AndSIMD(N.x,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.x));
+	rslt_out->surface_normal.y=OrSIMD(
+		AndSIMD(N.y,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.y));
+	rslt_out->surface_normal.z=OrSIMD(
+		AndSIMD(N.z,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.z));
+}
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
@@ -372,6 +476,12 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 	if (! IsAnyNegative(active) )
 		return;												// missed bounding box
 
+	if ( OptimizedBVH.Count() )
+	{
+		Trace4RaysBVH( rays, TMin, TMax, OneOverRayDir, rslt_out, skip_id, pCallback );
+		return;
+	}
+
 	int32 mailboxids[MAILBOX_HASH_SIZE];					// used to avoid redundant triangle tests
 	memset(mailboxids,0xff,sizeof(mailboxids));				// !!speed!! keep around?
 
@@ -476,102 +586,8 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
 				if ( ( mailboxids[mbox_slot] != tnum ) && ( tri->m_nTriangleID != skip_id ) )
 				{
-					n_intersection_calculations++;
 					mailboxids[mbox_slot] = tnum;
-					// compute plane intersection
-
-
-					FourVectors N;
-					N.x = ReplicateX4( tri->m_flNx );
-					N.y = ReplicateX4( tri->m_flNy );
-					N.z = ReplicateX4( tri->m_flNz );
-
-					fltx4 DDotN = rays.direction * N;
-					// mask off zero or near zero (ray parallel to surface)
-					fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
-											CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
-
-					fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
-
-					fltx4 isect_t=DivSIMD( numerator,DDotN );
-					// now, we have the distance to the plane. lets update our mask
-					did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
-					//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
-					did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// now, check 3 edges
-					fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
-										MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
-					fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
-										   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
-					
-					// do barycentric coordinate check
-					fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
-
-					B0 = AddSIMD(
-						B0,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
-					B0 = AddSIMD(
-						B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
-
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
-
-					fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
-					B1 = AddSIMD(
-						B1,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
-
-					B1 = AddSIMD(
-						B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
-					
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
-
-					fltx4 B2 = AddSIMD( B1, B0 );
-					did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// if the triangle is transparent
-					if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
-					{
-						if ( pCallback )
-						{
-							// assuming a triangle indexed as v0, v1, v2
-							// the projected edge equations are set up such that the vert opposite the first
-							// equation is v2, and the vert opposite the second equation is v0
-							// Therefore we pass them back in 1, 2, 0 order
-							// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
-							// barycentric coordinate.  Compute that now and pass it to the callback
-							fltx4 b2 = SubSIMD( Four_Ones, B2 );
-							if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
-							{
-								did_hit = Four_Zeros;
-							}
-						}
-					}
-					// now, set the hit_id and closest_hit fields for any enabled rays
-					fltx4 replicated_n = ReplicateIX4(tnum);
-					StoreAlignedSIMD((float *) rslt_out->HitIds,
-								 OrSIMD(AndSIMD(replicated_n,did_hit),
-										   AndNotSIMD(did_hit,LoadAlignedSIMD(
-															 (float *) rslt_out->HitIds))));
-					rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
-									 AndNotSIMD(did_hit,rslt_out->HitDistance));
-
-					rslt_out->surface_normal.x=OrSIMD(
-						AndSIMD(N.x,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.x));
-					rslt_out->surface_normal.y=OrSIMD(
-						AndSIMD(N.y,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.y));
-					rslt_out->surface_normal.z=OrSIMD(
-						AndSIMD(N.z,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.z));
-					
+					IntersectTriangle4( rays, tnum, tri, rslt_out, pCallback );
 				}
 			} while (--ntris);
 			// now, check if all rays have terminated
@@ -656,13 +672,9 @@ float RayTracingEnvironment::CalculateCostsOfSplit(
 	Vector MinBound,Vector MaxBound, float &split_value,
 	int &nleft, int &nright, int &nboth)
 {
-	// determine the costs of splitting on a given axis, and label triangles with respect to
-	// that axis by storing the value in coordselect0. It will also return the number of
-	// tris in the left, right, and nboth groups, in order to facilitate memory
-	nleft=nboth=nright=0;
-	
-	// now, label each triangle. Since we have not converted the triangles into
-	// intersection fromat yet, we can use the CoordSelect0 field of each as a temp.
+	// determine the costs of splitting on a given axis. It will also return the number of
+	// tris in the left, right, and nboth groups, in order to facilitate memory. The triangles
+	// are only read, so this can be called from several threads at once.
 	nleft=0;
 	nright=0;
 	nboth=0;
@@ -681,17 +693,14 @@ float RayTracingEnvironment::CalculateCostsOfSplit(
 		{
 			case PLANECHECK_NEGATIVE:
 				nleft++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_NEGATIVE;
 				break;
 
 			case PLANECHECK_POSITIVE:
 				nright++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_POSITIVE;
 				break;
 
 			case PLANECHECK_STRADDLING:
 				nboth++;
-				tri.m_Data.m_GeometryData.m_nTmpData0 = PLANECHECK_STRADDLING;
 				break;
 		}
 	}
@@ -718,161 +727,290 @@ float RayTracingEnvironment::CalculateCostsOfSplit(
 
 
 #define NEVER_SPLIT 0
+#define KDTREE_NUM_BINS 32									// candidate split planes per axis
+#define KDTREE_TASK_TRIS 2048								// subtrees this small are built by workers
 
-void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int ntris,
-									   Vector MinBound,Vector MaxBound, int depth)
+struct KDBuildTask_t
 {
-	if (ntris<3)											// never split empty lists
+	int m_nNode;											// placeholder for the subtree's root
+	int32 *m_pTriList;										// owned by the task
+	int m_nTris;
+	Vector m_MinBound;
+	Vector m_MaxBound;
+	int m_nDepth;
+};
+
+//-----------------------------------------------------------------------------
+// Builds a kd-tree, or a subtree of one, into the node and triangle index lists
+// it is given. Triangles are only read, never written, so any number of
+// builders can run at once on the same environment. A builder with a task
+// size leaves subtrees that small in m_Tasks instead of building them.
+//-----------------------------------------------------------------------------
+class CKDTreeBuilder
+{
+public:
+	CKDTreeBuilder() : m_pEnv( NULL ), m_pNodes( NULL ), m_pTriangleIndexList( NULL ), m_nTaskTris( 0 ) {}
+
+	void Init( RayTracingEnvironment *pEnv, CUtlVector<CacheOptimizedKDNode> *pNodes,
+			   CUtlVector<int32> *pTriangleIndexList, int nTaskTris )
 	{
-		// no point in continuing
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+		m_pEnv = pEnv;
+		m_pNodes = pNodes;
+		m_pTriangleIndexList = pTriangleIndexList;
+		m_nTaskTris = nTaskTris;
+	}
+
+	void RefineNode(int node_number,int32 const *tri_list,int ntris,
+					Vector MinBound,Vector MaxBound, int depth);
+
+	CUtlVector<KDBuildTask_t> m_Tasks;
+
+	// storage for a worker's subtree
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;
+	CUtlVector<int32> m_TriangleIndexList;
+
+private:
+	void MakeLeaf(int node_number,int32 const *tri_list,int ntris,
+				  Vector MinBound,Vector MaxBound);
+	float FindBinnedSplit(int32 const *tri_list,int ntris,Vector MinBound,Vector MaxBound,
+						  int &split_plane, float &split_value);
 
+	RayTracingEnvironment *m_pEnv;
+	CUtlVector<CacheOptimizedKDNode> *m_pNodes;
+	CUtlVector<int32> *m_pTriangleIndexList;
+	int m_nTaskTris;
+};
+
+void CKDTreeBuilder::MakeLeaf(int node_number,int32 const *tri_list,int ntris,
+							  Vector MinBound,Vector MaxBound)
+{
+	CacheOptimizedKDNode &node=(*m_pNodes)[node_number];
+	node.Children=KDNODE_STATE_LEAF+(m_pTriangleIndexList->Count()<<2);
+	node.SetNumberOfTrianglesInLeafNode(ntris);
 #ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
+	node.vecMins = MinBound;
+	node.vecMaxs = MaxBound;
 #endif
+	m_pTriangleIndexList->AddMultipleToTail(ntris,tri_list);
+}
 
+//-----------------------------------------------------------------------------
+// Estimates the cost of KDTREE_NUM_BINS-1 evenly spaced planes on each axis
+// from histograms of where the triangles start and end, instead of classifying
+// every triangle against every candidate. Returns the best estimated cost, or
+// 1.0e23 if the node can't be split.
+//-----------------------------------------------------------------------------
+float CKDTreeBuilder::FindBinnedSplit(int32 const *tri_list,int ntris,Vector MinBound,Vector MaxBound,
+									  int &split_plane, float &split_value)
+{
+	float best_cost=1.0e23;
+	float ISA=1.0/BoxSurfaceArea(MinBound,MaxBound);
+	for(int axis=0;axis<3;axis++)
+	{
+		float lo=MinBound[axis];
+		float hi=MaxBound[axis];
+		if (! (hi>lo))
+			continue;
+		float scale=KDTREE_NUM_BINS/(hi-lo);
+
+		int nstart[KDTREE_NUM_BINS];
+		int nend[KDTREE_NUM_BINS];
+		memset(nstart,0,sizeof(nstart));
+		memset(nend,0,sizeof(nend));
 		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
+		{
+			CacheOptimizedTriangle const &tri=m_pEnv->OptimizedTriangleList[tri_list[t]];
+			float minc=min(tri.Vertex(0)[axis],min(tri.Vertex(1)[axis],tri.Vertex(2)[axis]));
+			float maxc=max(tri.Vertex(0)[axis],max(tri.Vertex(1)[axis],tri.Vertex(2)[axis]));
+			// triangles straddling the node's bounds land in the end bins
+			nstart[(int) clamp((minc-lo)*scale,0.0f,KDTREE_NUM_BINS-1.0f)]++;
+			nend[(int) clamp((maxc-lo)*scale,0.0f,KDTREE_NUM_BINS-1.0f)]++;
+		}
+
+		// plane b is the boundary between bins b-1 and b. triangles ending below
+		// it go left, ones starting above it go right
+		int nleft=0;
+		int nright=ntris;
+		for(int b=1;b<KDTREE_NUM_BINS;b++)
+		{
+			nleft+=nend[b-1];
+			nright-=nstart[b-1];
+			int nboth=ntris-nleft-nright;
+			float trial_splitvalue=lo+(hi-lo)*b/KDTREE_NUM_BINS;
+
+			Vector LeftMaxes=MaxBound;
+			Vector RightMins=MinBound;
+			LeftMaxes[axis]=trial_splitvalue;
+			RightMins[axis]=trial_splitvalue;
+			float trial_cost=COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
+				(BoxSurfaceArea(MinBound,LeftMaxes)*ISA*nleft)+(BoxSurfaceArea(RightMins,MaxBound)*ISA*nright));
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=trial_splitvalue;
+			}
+		}
+	}
+	return best_cost;
+}
+
+void CKDTreeBuilder::RefineNode(int node_number,int32 const *tri_list,int ntris,
+								Vector MinBound,Vector MaxBound, int depth)
+{
+	if (ntris<3)											// never split empty lists
+	{
+		// no point in continuing
+		MakeLeaf(node_number,tri_list,ntris,MinBound,MaxBound);
 		return;
 	}
 
+	// pick a plane from the bins, then get its exact cost and counts
 	float best_cost=1.0e23;
 	int best_nleft=0,best_nright=0,best_nboth=0;
+	float classify_value=0;
 	float best_splitvalue=0;
 	int split_plane=0;
-
-	int tri_skip=1+(ntris/10);								// don't try all trinagles as split
-															// points when there are a lot of them
-	for(int axis=0;axis<3;axis++)
+	if (FindBinnedSplit(tri_list,ntris,MinBound,MaxBound,split_plane,classify_value)<1.0e23)
 	{
-		for(int ts=-1;ts<ntris;ts+=tri_skip)
-		{
-			for(int tv=0;tv<3;tv++)
-			{
-				int trial_nleft,trial_nright,trial_nboth;
-				float trial_splitvalue;
-				if (ts==-1)
-					trial_splitvalue=0.5*(MinBound[axis]+MaxBound[axis]);
-				else
-				{
-					// else, split at the triangle vertex if possible
-					CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[ts]];
-					trial_splitvalue = tri.Vertex(tv)[axis];
-					if ((trial_splitvalue>MaxBound[axis]) || (trial_splitvalue<MinBound[axis]))
-						continue;							// don't try this vertex - not inside
-					
-				}
-//				printf("ts=%d tv=%d tp=%f\n",ts,tv,trial_splitvalue);
-				float trial_cost=
-					CalculateCostsOfSplit(axis,tri_list,ntris,MinBound,MaxBound,trial_splitvalue,
-										  trial_nleft,trial_nright, trial_nboth);
-// 				printf("try %d cost=%f nl=%d nr=%d nb=%d sp=%f\n",axis,trial_cost,trial_nleft,trial_nright, trial_nboth,
-// 					   trial_splitvalue);
-				if (trial_cost<best_cost)
-				{
-					split_plane=axis;
-					best_cost=trial_cost;
-					best_nleft=trial_nleft;
-					best_nright=trial_nright;
-					best_nboth=trial_nboth;
-					best_splitvalue=trial_splitvalue;
-					// save away the axis classification of each triangle
-					for(int t=0 ; t < ntris; t++)
-					{
-						CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-						tri.m_Data.m_GeometryData.m_nTmpData1 = tri.m_Data.m_GeometryData.m_nTmpData0;
-					}
-				}
-				if (ts==-1)
-					break;
-			}
-		}
-
+		best_splitvalue=classify_value;
+		best_cost=m_pEnv->CalculateCostsOfSplit(split_plane,tri_list,ntris,MinBound,MaxBound,
+												best_splitvalue,best_nleft,best_nright,best_nboth);
 	}
+
 	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
 	if ( (cost_of_no_split<=best_cost) || NEVER_SPLIT || (depth>MAX_TREE_DEPTH))
 	{
 		// no benefit to splitting. just make this a leaf node
-		OptimizedKDTree[node_number].Children=KDNODE_STATE_LEAF+(TriangleIndexList.Count()<<2);
-		OptimizedKDTree[node_number].SetNumberOfTrianglesInLeafNode(ntris);
-#ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
-#endif
-		for(int t=0;t<ntris;t++)
-			TriangleIndexList.AddToTail(tri_list[t]);
+		MakeLeaf(node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
 	}
-	else
+
+	// its worth splitting!
+	// we will achieve the splitting without sorting by using a selection algorithm.
+	int32 *new_triangle_list;
+	new_triangle_list=new int32[ntris];
+
+	Vector LeftMins=MinBound;
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	Vector RightMaxes=MaxBound;
+	LeftMaxes[split_plane]=best_splitvalue;
+	RightMins[split_plane]=best_splitvalue;
+
+	// classify against the plane CalculateCostsOfSplit counted with, which
+	// differs from best_splitvalue when an empty side was grown
+	int n_left_output=0;
+	int n_both_output=0;
+	int n_right_output=0;
+	for(int t=0;t<ntris;t++)
 	{
-// 		printf("best split was %d at %f (mid=%f,n=%d, sk=%d)\n",split_plane,best_splitvalue,
-// 			   0.5*(MinBound[split_plane]+MaxBound[split_plane]),ntris,tri_skip);
-		// its worth splitting!
-		// we will achieve the splitting without sorting by using a selection algorithm.
-		int32 *new_triangle_list;
-		new_triangle_list=new int32[ntris];
-
-		// now, perform surface area/cost check to determine whether this split was worth it
-		Vector LeftMins=MinBound;
-		Vector LeftMaxes=MaxBound;
-		Vector RightMins=MinBound;
-		Vector RightMaxes=MaxBound;
-		LeftMaxes[split_plane]=best_splitvalue;
-		RightMins[split_plane]=best_splitvalue;
-		
-		int n_left_output=0;
-		int n_both_output=0;
-		int n_right_output=0;
-		for(int t=0;t<ntris;t++)
+		CacheOptimizedTriangle &tri=m_pEnv->OptimizedTriangleList[tri_list[t]];
+		switch( tri.ClassifyAgainstAxisSplit(split_plane,classify_value) )
 		{
-			CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
-			switch( tri.m_Data.m_GeometryData.m_nTmpData1 )
-			{
-				case PLANECHECK_NEGATIVE:
-//					printf("%d goes left\n",t);
-					new_triangle_list[n_left_output++]=tri_list[t];
-					break;
-				case PLANECHECK_POSITIVE:
-					n_right_output++;
-//					printf("%d goes right\n",t);
-					new_triangle_list[ntris-n_right_output]=tri_list[t];
-					break;
-				case PLANECHECK_STRADDLING:
-//					printf("%d goes both\n",t);
-					new_triangle_list[best_nleft+n_both_output]=tri_list[t];
-					n_both_output++;
-					break;
-
-					
-			}
+			case PLANECHECK_NEGATIVE:
+				new_triangle_list[n_left_output++]=tri_list[t];
+				break;
+			case PLANECHECK_POSITIVE:
+				n_right_output++;
+				new_triangle_list[ntris-n_right_output]=tri_list[t];
+				break;
+			case PLANECHECK_STRADDLING:
+				new_triangle_list[best_nleft+n_both_output]=tri_list[t];
+				n_both_output++;
+				break;
 		}
-		int left_child=OptimizedKDTree.Count();
-		int right_child=left_child+1;
-// 		printf("node %d split on axis %d at %f, nl=%d nr=%d nb=%d lc=%d rc=%d\n",node_number,
-// 			   split_plane,best_splitvalue,best_nleft,best_nright,best_nboth,
-// 			   left_child,right_child);
-		OptimizedKDTree[node_number].Children=split_plane+(left_child<<2);
-		OptimizedKDTree[node_number].SplittingPlaneValue=best_splitvalue;
+	}
+	Assert( n_left_output==best_nleft && n_right_output==best_nright && n_both_output==best_nboth );
+
+	int left_child=m_pNodes->Count();
+	int right_child=left_child+1;
+	CacheOptimizedKDNode &node=(*m_pNodes)[node_number];
+	node.Children=split_plane+(left_child<<2);
+	node.SplittingPlaneValue=best_splitvalue;
 #ifdef DEBUG_RAYTRACE
-		OptimizedKDTree[node_number].vecMins = MinBound;
-		OptimizedKDTree[node_number].vecMaxs = MaxBound;
+	node.vecMins = MinBound;
+	node.vecMaxs = MaxBound;
 #endif
-		CacheOptimizedKDNode newnode;
-		OptimizedKDTree.AddToTail(newnode);
-		OptimizedKDTree.AddToTail(newnode);
-		// now, recurse!
-		if ( (ntris<20) && ((best_nleft==0) || (best_nright==0)) )
-			depth+=100;
-		RefineNode(left_child,new_triangle_list,best_nleft+best_nboth,LeftMins,LeftMaxes,depth+1);
-		RefineNode(right_child,new_triangle_list+best_nleft,best_nright+best_nboth,
-				   RightMins,RightMaxes,depth+1);
-		delete[] new_triangle_list;
-	}	
+	CacheOptimizedKDNode newnode;
+	m_pNodes->AddToTail(newnode);
+	m_pNodes->AddToTail(newnode);
+
+	// now, recurse, or leave the children for the workers
+	if ( (ntris<20) && ((best_nleft==0) || (best_nright==0)) )
+		depth+=100;
+
+	int child_node[2]={left_child,right_child};
+	int32 const *child_list[2]={new_triangle_list,new_triangle_list+best_nleft};
+	int child_ntris[2]={best_nleft+best_nboth,best_nright+best_nboth};
+	Vector child_mins[2]={LeftMins,RightMins};
+	Vector child_maxs[2]={LeftMaxes,RightMaxes};
+	for(int c=0;c<2;c++)
+	{
+		if (m_nTaskTris && (child_ntris[c]<=m_nTaskTris))
+		{
+			KDBuildTask_t &task=m_Tasks[m_Tasks.AddToTail()];
+			task.m_nNode=child_node[c];
+			task.m_pTriList=new int32[max(child_ntris[c],1)];
+			memcpy(task.m_pTriList,child_list[c],child_ntris[c]*sizeof(int32));
+			task.m_nTris=child_ntris[c];
+			task.m_MinBound=child_mins[c];
+			task.m_MaxBound=child_maxs[c];
+			task.m_nDepth=depth+1;
+		}
+		else
+		{
+			RefineNode(child_node[c],child_list[c],child_ntris[c],child_mins[c],child_maxs[c],depth+1);
+		}
+	}
+	delete[] new_triangle_list;
 }
 
+void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int ntris,
+									   Vector MinBound,Vector MaxBound, int depth)
+{
+	CKDTreeBuilder builder;
+	builder.Init(this,&OptimizedKDTree,&TriangleIndexList,0);
+	builder.RefineNode(node_number,tri_list,ntris,MinBound,MaxBound,depth);
+}
 
-void RayTracingEnvironment::SetupAccelerationStructure(void)
+static RayTracingEnvironment *s_pKDBuildEnv;
+static KDBuildTask_t *s_pKDBuildTasks;
+static CKDTreeBuilder *s_pKDTaskBuilders;
+
+static void BuildKDSubtree( int iThread, int iTask )
+{
+	KDBuildTask_t &task=s_pKDBuildTasks[iTask];
+	CKDTreeBuilder &builder=s_pKDTaskBuilders[iTask];
+	builder.Init(s_pKDBuildEnv,&builder.m_Nodes,&builder.m_TriangleIndexList,0);
+
+	// the subtree's root is local node 0
+	CacheOptimizedKDNode root;
+	builder.m_Nodes.AddToTail(root);
+	builder.RefineNode(0,task.m_pTriList,task.m_nTris,task.m_MinBound,task.m_MaxBound,task.m_nDepth);
+
+	delete[] task.m_pTriList;
+	task.m_pTriList=NULL;
+}
+
+// moves a node built by a worker to where its subtree ends up. local node 0
+// replaces the placeholder, and local node n>0 lands at nNodeBase+n-1
+static CacheOptimizedKDNode RelocateKDNode(CacheOptimizedKDNode node,int nNodeBase,int nTriBase)
+{
+	if (node.NodeType()==KDNODE_STATE_LEAF)
+		node.Children+=(nTriBase<<2);
+	else
+		node.Children+=((nNodeBase-1)<<2);
+	return node;
+}
+
+//-----------------------------------------------------------------------------
+// Builds the kd-tree. The top of the tree is built here until the nodes get down
+// to KDTREE_TASK_TRIS triangles, then workers build the subtrees below those into
+// their own lists, which are appended in the order the subtrees were found. The
+// split doesn't depend on the thread count, so neither does the tree.
+//-----------------------------------------------------------------------------
+void RayTracingEnvironment::BuildKDTree(void)
 {
 	CacheOptimizedKDNode root;
 	OptimizedKDTree.AddToTail(root);
@@ -881,9 +1019,53 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 		root_triangle_list[t]=t;
 	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
 								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+
+	CKDTreeBuilder top;
+	top.Init(this,&OptimizedKDTree,&TriangleIndexList,KDTREE_TASK_TRIS);
+	if (OptimizedTriangleList.Count()<=KDTREE_TASK_TRIS)
+	{
+		// not worth the threads
+		top.Init(this,&OptimizedKDTree,&TriangleIndexList,0);
+	}
+	top.RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
 	delete[] root_triangle_list;
 
+	int nTasks=top.m_Tasks.Count();
+	if (!nTasks)
+		return;
+
+	CKDTreeBuilder *pTaskBuilders=new CKDTreeBuilder[nTasks];
+	s_pKDBuildEnv=this;
+	s_pKDBuildTasks=top.m_Tasks.Base();
+	s_pKDTaskBuilders=pTaskBuilders;
+	RunThreadsOnIndividual(nTasks,false,BuildKDSubtree);
+
+	for(int i=0;i<nTasks;i++)
+	{
+		CKDTreeBuilder const &builder=pTaskBuilders[i];
+		int nNodeBase=OptimizedKDTree.Count();
+		int nTriBase=TriangleIndexList.Count();
+		OptimizedKDTree[top.m_Tasks[i].m_nNode]=RelocateKDNode(builder.m_Nodes[0],nNodeBase,nTriBase);
+		for(int n=1;n<builder.m_Nodes.Count();n++)
+			OptimizedKDTree.AddToTail(RelocateKDNode(builder.m_Nodes[n],nNodeBase,nTriBase));
+		TriangleIndexList.AddMultipleToTail(builder.m_TriangleIndexList.Count(),
+											builder.m_TriangleIndexList.Base());
+	}
+	delete[] pTaskBuilders;
+}
+
+
+void RayTracingEnvironment::SetupAccelerationStructure(void)
+{
+	if ( Flags & RTE_FLAGS_USE_BVH )
+	{
+		BuildBVH();
+	}
+	else
+	{
+		BuildKDTree();
+	}
+
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
 		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
@@ -891,6 +1073,465 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 
 
 
+//-----------------------------------------------------------------------------
+// Bounding volume hierarchy
+//
+// The bvh is built top down with a binned surface area heuristic over triangle
+// centroids, using the same cost constants as the kd-tree. Each node is split
+// up to twice, giving up to four children. The top of the tree is built on the
+// calling thread until the remaining subtrees are small enough, then those
+// subtrees are built by worker threads into their own node lists, which are
+// appended in a fixed order. Nothing depends on which thread builds what, so
+// the tree is the same for any thread count.
+//-----------------------------------------------------------------------------
+#define BVH_NUM_BINS 16
+#define BVH_MIN_LEAF_TRIS 4									// never split lists this small
+#define BVH_MAX_LEAF_TRIS 16								// always split lists larger than this
+#define BVH_MAX_DEPTH 64
+#define BVH_TASK_TRIS 4096									// subtrees this small are built by workers
+#define BVH_STACK_SIZE ( 3 * BVH_MAX_DEPTH + 8 )
+
+struct BVHBuildTri_t
+{
+	Vector m_vecMins;
+	Vector m_vecMaxs;
+	Vector m_vecCentroid;
+};
+
+struct BVHBuildTask_t
+{
+	int m_nNode;											// node and slot in the top of the tree
+	int m_nSlot;											// to hook the subtree up to
+	int m_nFirst;
+	int m_nCount;
+	int m_nDepth;
+};
+
+// child boxes are grown a little so a triangle lying in the face of its box
+// can't be missed by rounding in the slab test
+static float BVHBoundsEpsilon( float flCoord )
+{
+	return 0.01f + 1.0e-5f * fabs( flCoord );
+}
+
+class CBVHBuilder
+{
+public:
+	CBVHBuilder() : m_pTris( NULL ), m_pIndices( NULL ), m_nTaskTris( 0 ) {}
+
+	void Init( BVHBuildTri_t const *pTris, int32 *pIndices, int nTaskTris )
+	{
+		m_pTris = pTris;
+		m_pIndices = pIndices;
+		m_nTaskTris = nTaskTris;
+	}
+
+	int BuildNode( int nFirst, int nCount, int nDepth );
+
+	CUtlVector<CacheOptimizedBVHNode> m_Nodes;
+	CUtlVector<BVHBuildTask_t> m_Tasks;						// subtrees left for the workers
+
+private:
+	void CalculateBounds( int nFirst, int nCount, Vector &vecMins, Vector &vecMaxs ) const;
+	bool Split( int nFirst, int nCount, int &nLeft );
+
+	BVHBuildTri_t const *m_pTris;
+	int32 *m_pIndices;										// reordered in place as ranges split
+	int m_nTaskTris;										// 0 to build everything here
+};
+
+void CBVHBuilder::CalculateBounds( int nFirst, int nCount, Vector &vecMins, Vector &vecMaxs ) const
+{
+	vecMins.Init( 1.0e23, 1.0e23, 1.0e23 );
+	vecMaxs.Init( -1.0e23, -1.0e23, -1.0e23 );
+	for ( int i = nFirst; i < nFirst + nCount; i++ )
+	{
+		BVHBuildTri_t const &tri = m_pTris[m_pIndices[i]];
+		VectorMin( vecMins, tri.m_vecMins, vecMins );
+		VectorMax( vecMaxs, tri.m_vecMaxs, vecMaxs );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Splits a range of triangles in two, reordering it so the first nLeft go
+// left. Returns false if the range is better off as a leaf.
+//-----------------------------------------------------------------------------
+bool CBVHBuilder::Split( int nFirst, int nCount, int &nLeft )
+{
+	if ( nCount <= BVH_MIN_LEAF_TRIS )
+		return false;
+
+	Vector vecMins, vecMaxs;
+	CalculateBounds( nFirst, nCount, vecMins, vecMaxs );
+
+	Vector vecCentroidMins( 1.0e23, 1.0e23, 1.0e23 );
+	Vector vecCentroidMaxs( -1.0e23, -1.0e23, -1.0e23 );
+	for ( int i = nFirst; i < nFirst + nCount; i++ )
+	{
+		VectorMin( vecCentroidMins, m_pTris[m_pIndices[i]].m_vecCentroid, vecCentroidMins );
+		VectorMax( vecCentroidMaxs, m_pTris[m_pIndices[i]].m_vecCentroid, vecCentroidMaxs );
+	}
+
+	float flBestCost = 1.0e30;
+	int nBestAxis = -1;
+	int nBestBin = 0;
+	for ( int axis = 0; axis < 3; axis++ )
+	{
+		float flExtent = vecCentroidMaxs[axis] - vecCentroidMins[axis];
+		if ( flExtent <= 0 )
+			continue;
+		float flScale = BVH_NUM_BINS / flExtent;
+
+		int nBinCount[BVH_NUM_BINS];
+		Vector vecBinMins[BVH_NUM_BINS], vecBinMaxs[BVH_NUM_BINS];
+		for ( int b = 0; b < BVH_NUM_BINS; b++ )
+		{
+			nBinCount[b] = 0;
+			vecBinMins[b].Init( 1.0e23, 1.0e23, 1.0e23 );
+			vecBinMaxs[b].Init( -1.0e23, -1.0e23, -1.0e23 );
+		}
+		for ( int i = nFirst; i < nFirst + nCount; i++ )
+		{
+			BVHBuildTri_t const &tri = m_pTris[m_pIndices[i]];
+			int b = min( BVH_NUM_BINS - 1, (int)( ( tri.m_vecCentroid[axis] - vecCentroidMins[axis] ) * flScale ) );
+			nBinCount[b]++;
+			VectorMin( vecBinMins[b], tri.m_vecMins, vecBinMins[b] );
+			VectorMax( vecBinMaxs[b], tri.m_vecMaxs, vecBinMaxs[b] );
+		}
+
+		// sweep from the right to get the area and count right of each plane,
+		// then from the left to cost each one
+		float flRightArea[BVH_NUM_BINS];
+		int nRightCount[BVH_NUM_BINS];
+		Vector vecRightMins( 1.0e23, 1.0e23, 1.0e23 ), vecRightMaxs( -1.0e23, -1.0e23, -1.0e23 );
+		int nRight = 0;
+		for ( int b = BVH_NUM_BINS - 1; b > 0; b-- )
+		{
+			VectorMin( vecRightMins, vecBinMins[b], vecRightMins );
+			VectorMax( vecRightMaxs, vecBinMaxs[b], vecRightMaxs );
+			nRight += nBinCount[b];
+			nRightCount[b] = nRight;
+			flRightArea[b] = nRight ? BoxSurfaceArea( vecRightMins, vecRightMaxs ) : 0;
+		}
+
+		Vector vecLeftMins( 1.0e23, 1.0e23, 1.0e23 ), vecLeftMaxs( -1.0e23, -1.0e23, -1.0e23 );
+		int nLeftCount = 0;
+		for ( int b = 0; b < BVH_NUM_BINS - 1; b++ )
+		{
+			VectorMin( vecLeftMins, vecBinMins[b], vecLeftMins );
+			VectorMax( vecLeftMaxs, vecBinMaxs[b], vecLeftMaxs );
+			nLeftCount += nBinCount[b];
+			if ( !nLeftCount || !nRightCount[b + 1] )
+				continue;
+			float flCost = BoxSurfaceArea( vecLeftMins, vecLeftMaxs ) * nLeftCount +
+				flRightArea[b + 1] * nRightCount[b + 1];
+			if ( flCost < flBestCost )
+			{
+				flBestCost = flCost;
+				nBestAxis = axis;
+				nBestBin = b;
+			}
+		}
+	}
+
+	if ( nBestAxis == -1 )
+	{
+		// every centroid is in the same place. only split if the leaf would be too big
+		if ( nCount <= BVH_MAX_LEAF_TRIS )
+			return false;
+		nLeft = nCount / 2;
+		return true;
+	}
+
+	// same cost model as the kd-tree
+	float flArea = BoxSurfaceArea( vecMins, vecMaxs );
+	float flCostOfSplit = COST_OF_TRAVERSAL + COST_OF_INTERSECTION * flBestCost / max( flArea, 1.0e-6f );
+	float flCostOfNoSplit = COST_OF_INTERSECTION * nCount;
+	if ( ( flCostOfNoSplit <= flCostOfSplit ) && ( nCount <= BVH_MAX_LEAF_TRIS ) )
+		return false;
+
+	// partition in place around the chosen plane
+	float flScale = BVH_NUM_BINS / ( vecCentroidMaxs[nBestAxis] - vecCentroidMins[nBestAxis] );
+	int i = nFirst;
+	int j = nFirst + nCount - 1;
+	while ( i <= j )
+	{
+		float flCentroid = m_pTris[m_pIndices[i]].m_vecCentroid[nBestAxis];
+		int b = min( BVH_NUM_BINS - 1, (int)( ( flCentroid - vecCentroidMins[nBestAxis] ) * flScale ) );
+		if ( b <= nBestBin )
+		{
+			i++;
+		}
+		else
+		{
+			V_swap( m_pIndices[i], m_pIndices[j] );
+			j--;
+		}
+	}
+	nLeft = i - nFirst;
+	Assert( nLeft > 0 && nLeft < nCount );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Builds the node for a range of triangles and, unless they are left for the
+// workers, everything below it. Returns the node's index.
+//-----------------------------------------------------------------------------
+int CBVHBuilder::BuildNode( int nFirst, int nCount, int nDepth )
+{
+	int nNode = m_Nodes.AddToTail();
+
+	// split the biggest remaining range until there are four
+	int nRangeFirst[4], nRangeCount[4];
+	bool bRangeLeaf[4];
+	int nRanges = 1;
+	nRangeFirst[0] = nFirst;
+	nRangeCount[0] = nCount;
+	bRangeLeaf[0] = ( nDepth >= BVH_MAX_DEPTH );
+	while ( nRanges < 4 )
+	{
+		int nSplit = -1;
+		for ( int r = 0; r < nRanges; r++ )
+		{
+			if ( !bRangeLeaf[r] && ( ( nSplit == -1 ) || ( nRangeCount[r] > nRangeCount[nSplit] ) ) )
+				nSplit = r;
+		}
+		if ( nSplit == -1 )
+			break;
+
+		int nLeft;
+		if ( !Split( nRangeFirst[nSplit], nRangeCount[nSplit], nLeft ) )
+		{
+			bRangeLeaf[nSplit] = true;
+			continue;
+		}
+		nRangeFirst[nRanges] = nRangeFirst[nSplit] + nLeft;
+		nRangeCount[nRanges] = nRangeCount[nSplit] - nLeft;
+		bRangeLeaf[nRanges] = false;
+		nRangeCount[nSplit] = nLeft;
+		nRanges++;
+	}
+
+	for ( int r = 0; r < 4; r++ )
+	{
+		// m_Nodes may grow while recursing, so don't hold on to the node. the
+		// root of an empty scene has no children at all
+		if ( ( r >= nRanges ) || !nRangeCount[r] )
+		{
+			for ( int c = 0; c < 3; c++ )
+			{
+				m_Nodes[nNode].m_flChildMins[c][r] = 0;
+				m_Nodes[nNode].m_flChildMaxs[c][r] = 0;
+			}
+			m_Nodes[nNode].m_nChild[r] = -1;
+			m_Nodes[nNode].m_nTriCount[r] = 0;
+			continue;
+		}
+
+		Vector vecMins, vecMaxs;
+		CalculateBounds( nRangeFirst[r], nRangeCount[r], vecMins, vecMaxs );
+		for ( int c = 0; c < 3; c++ )
+		{
+			m_Nodes[nNode].m_flChildMins[c][r] = vecMins[c] - BVHBoundsEpsilon( vecMins[c] );
+			m_Nodes[nNode].m_flChildMaxs[c][r] = vecMaxs[c] + BVHBoundsEpsilon( vecMaxs[c] );
+		}
+
+		if ( bRangeLeaf[r] )
+		{
+			m_Nodes[nNode].m_nChild[r] = nRangeFirst[r];
+			m_Nodes[nNode].m_nTriCount[r] = nRangeCount[r];
+		}
+		else if ( nRangeCount[r] <= m_nTaskTris )
+		{
+			BVHBuildTask_t &task = m_Tasks[m_Tasks.AddToTail()];
+			task.m_nNode = nNode;
+			task.m_nSlot = r;
+			task.m_nFirst = nRangeFirst[r];
+			task.m_nCount = nRangeCount[r];
+			task.m_nDepth = nDepth + 1;
+			m_Nodes[nNode].m_nChild[r] = -1;
+			m_Nodes[nNode].m_nTriCount[r] = 0;
+		}
+		else
+		{
+			int nChild = BuildNode( nRangeFirst[r], nRangeCount[r], nDepth + 1 );
+			m_Nodes[nNode].m_nChild[r] = nChild;
+			m_Nodes[nNode].m_nTriCount[r] = 0;
+		}
+	}
+	return nNode;
+}
+
+static BVHBuildTri_t const *s_pBVHBuildTris;
+static int32 *s_pBVHBuildIndices;
+static BVHBuildTask_t const *s_pBVHBuildTasks;
+static CBVHBuilder *s_pBVHTaskBuilders;
+
+static void BuildBVHSubtree( int iThread, int iTask )
+{
+	BVHBuildTask_t const &task = s_pBVHBuildTasks[iTask];
+	CBVHBuilder &builder = s_pBVHTaskBuilders[iTask];
+	builder.Init( s_pBVHBuildTris, s_pBVHBuildIndices, 0 );
+	builder.BuildNode( task.m_nFirst, task.m_nCount, task.m_nDepth );
+}
+
+void RayTracingEnvironment::BuildBVH(void)
+{
+	int ntris = OptimizedTriangleList.Count();
+
+	BVHBuildTri_t *pTris = new BVHBuildTri_t[ntris];
+	BVHTriangleIndexList.SetCount( ntris );
+	m_MinBound.Init( 1.0e23, 1.0e23, 1.0e23 );
+	m_MaxBound.Init( -1.0e23, -1.0e23, -1.0e23 );
+	for ( int t = 0; t < ntris; t++ )
+	{
+		CacheOptimizedTriangle const &tri = OptimizedTriangleList[t];
+		BVHBuildTri_t &buildTri = pTris[t];
+		buildTri.m_vecMins = tri.Vertex( 0 );
+		buildTri.m_vecMaxs = tri.Vertex( 0 );
+		for ( int v = 1; v < 3; v++ )
+		{
+			VectorMin( buildTri.m_vecMins, tri.Vertex( v ), buildTri.m_vecMins );
+			VectorMax( buildTri.m_vecMaxs, tri.Vertex( v ), buildTri.m_vecMaxs );
+		}
+		buildTri.m_vecCentroid = 0.5f * ( buildTri.m_vecMins + buildTri.m_vecMaxs );
+		VectorMin( m_MinBound, buildTri.m_vecMins, m_MinBound );
+		VectorMax( m_MaxBound, buildTri.m_vecMaxs, m_MaxBound );
+		BVHTriangleIndexList[t] = t;
+	}
+
+	// the top of the tree
+	CBVHBuilder top;
+	top.Init( pTris, BVHTriangleIndexList.Base(), BVH_TASK_TRIS );
+	top.BuildNode( 0, ntris, 0 );
+
+	// the subtrees below it
+	int nTasks = top.m_Tasks.Count();
+	CBVHBuilder *pTaskBuilders = new CBVHBuilder[ max( nTasks, 1 ) ];
+	if ( nTasks )
+	{
+		s_pBVHBuildTris = pTris;
+		s_pBVHBuildIndices = BVHTriangleIndexList.Base();
+		s_pBVHBuildTasks = top.m_Tasks.Base();
+		s_pBVHTaskBuilders = pTaskBuilders;
+		RunThreadsOnIndividual( nTasks, false, BuildBVHSubtree );
+	}
+
+	// stitch everything together in task order
+	OptimizedBVH.Purge();
+	OptimizedBVH.AddMultipleToTail( top.m_Nodes.Count(), top.m_Nodes.Base() );
+	for ( int i = 0; i < nTasks; i++ )
+	{
+		BVHBuildTask_t const &task = top.m_Tasks[i];
+		CUtlVector<CacheOptimizedBVHNode> &subtree = pTaskBuilders[i].m_Nodes;
+		int nBase = OptimizedBVH.Count();
+		OptimizedBVH[task.m_nNode].m_nChild[task.m_nSlot] = nBase;
+		for ( int n = 0; n < subtree.Count(); n++ )
+		{
+			CacheOptimizedBVHNode &node = subtree[n];
+			for ( int c = 0; c < 4; c++ )
+			{
+				if ( ( node.m_nChild[c] != -1 ) && !node.m_nTriCount[c] )
+					node.m_nChild[c] += nBase;
+			}
+		}
+		OptimizedBVH.AddMultipleToTail( subtree.Count(), subtree.Base() );
+	}
+
+	delete[] pTaskBuilders;
+	delete[] pTris;
+}
+
+struct BVHNodeToVisit
+{
+	fltx4 TMin;												// where each ray enters the child
+	int32 nChild;
+	int32 nTriCount;
+};
+
+void RayTracingEnvironment::Trace4RaysBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+										  FourVectors const &OneOverRayDir, RayTracingResult *rslt_out,
+										  int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	BVHNodeToVisit NodeStack[BVH_STACK_SIZE];
+	int nStack = 0;
+	NodeStack[0].TMin = TMin;
+	NodeStack[0].nChild = 0;
+	NodeStack[0].nTriCount = 0;
+	nStack++;
+
+	while ( nStack )
+	{
+		BVHNodeToVisit visit = NodeStack[--nStack];
+
+		// skip it if every ray has already found something closer
+		fltx4 TFar = MinSIMD( TMax, rslt_out->HitDistance );
+		if ( ! IsAnyNegative( CmpLeSIMD( visit.TMin, TFar ) ) )
+			continue;
+
+		if ( visit.nTriCount )
+		{
+			int32 const *tlist = &( BVHTriangleIndexList[visit.nChild] );
+			for ( int t = 0; t < visit.nTriCount; t++ )
+			{
+				int tnum = tlist[t];
+				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( tri->m_nTriangleID != skip_id )
+					IntersectTriangle4( rays, tnum, tri, rslt_out, pCallback );
+			}
+			continue;
+		}
+
+		// test the packet against every child, and visit the ones it hits near to far
+		CacheOptimizedBVHNode const &node = OptimizedBVH[visit.nChild];
+		fltx4 ChildTMin[4];
+		float flChildKey[4];
+		int nOrder[4];
+		int nHits = 0;
+		for ( int c = 0; ( c < 4 ) && ( node.m_nChild[c] != -1 ); c++ )
+		{
+			fltx4 tnear = TMin;
+			fltx4 tfar = TFar;
+			for ( int axis = 0; axis < 3; axis++ )
+			{
+				fltx4 t0 = MulSIMD( SubSIMD( ReplicateX4( node.m_flChildMins[axis][c] ), rays.origin[axis] ),
+									OneOverRayDir[axis] );
+				fltx4 t1 = MulSIMD( SubSIMD( ReplicateX4( node.m_flChildMaxs[axis][c] ), rays.origin[axis] ),
+									OneOverRayDir[axis] );
+				tnear = MaxSIMD( tnear, MinSIMD( t0, t1 ) );
+				tfar = MinSIMD( tfar, MaxSIMD( t0, t1 ) );
+			}
+			fltx4 hit = CmpLeSIMD( tnear, tfar );
+			if ( ! IsAnyNegative( hit ) )
+				continue;
+
+			ChildTMin[c] = MaskedAssign( hit, tnear, Four_FLT_MAX );
+			float flKey = min( min( SubFloat( ChildTMin[c], 0 ), SubFloat( ChildTMin[c], 1 ) ),
+							   min( SubFloat( ChildTMin[c], 2 ), SubFloat( ChildTMin[c], 3 ) ) );
+			int i = nHits++;
+			for ( ; ( i > 0 ) && ( flChildKey[i - 1] > flKey ); i-- )
+			{
+				flChildKey[i] = flChildKey[i - 1];
+				nOrder[i] = nOrder[i - 1];
+			}
+			flChildKey[i] = flKey;
+			nOrder[i] = c;
+		}
+
+		// push far to near so the nearest is popped first
+		Assert( nStack + nHits <= BVH_STACK_SIZE );
+		for ( int i = nHits - 1; i >= 0; i-- )
+		{
+			int c = nOrder[i];
+			BVHNodeToVisit &push = NodeStack[nStack++];
+			push.TMin = ChildTMin[c];
+			push.nChild = node.m_nChild[c];
+			push.nTriCount = node.m_nTriCount[c];
+		}
+	}
+}
+
+
 void RayTracingEnvironment::AddInfinitePointLight(Vector position, Vector intensity)
 {
 	LightDesc_t mylight(position,intensity);
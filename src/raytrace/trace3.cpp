@@ -36,6 +36,7 @@ void RayTracingEnvironment::AddBSPFace(int id,dface_t const &face)
 	texinfo_t *tx =(face.texinfo>=0)?&(texinfo[face.texinfo]):0;
 // 	if (tx && (tx->flags & (SURF_SKY|SURF_NODRAW)))
 // 		return;
+#ifdef DEBUG_RAYTRACE
 	if (tx)
 	{
 		printf("id %d flags=%x\n",id,tx->flags);
@@ -46,6 +47,7 @@ void RayTracingEnvironment::AddBSPFace(int id,dface_t const &face)
 		printf("(%f %f %f) ",XYZ(VertCoord(face,v)));
 	}
 	printf("\n");
+#endif
 	int ntris=face.numedges-2;
 	for(int tri=0;tri<ntris;tri++)
 	{
@@ -116,7 +118,7 @@ void RayTracingEnvironment::InitializeFromLoadedBSP(void)
 // 		dface_t const &f=dorigfaces[c];
 // 		AddBSPFace(c,dorigfaces[c]);
 // 	}
-	for(int c=0;c<numfaces;c++)
+	for(int c=0;c<numorigfaces;c++)
 	{
 //		dface_t const &f=dfaces[c];
 		AddBSPFace(c,dorigfaces[c]);
@@ -30,6 +30,7 @@
 #include "utlqueue.h"
 #include "UtlSortVector.h"
 #include "convar.h"
+#include "checksum_crc.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -462,8 +463,7 @@ void KeyValues::Init()
 	m_bHasEscapeSequences = false;
 	m_bEvaluateConditionals = true;
 
-	// for future proof
-	memset( unused, 0, sizeof(unused) );
+	m_nDocumentFlags = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -487,18 +487,31 @@ void KeyValues::RemoveEverything()
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
 	for ( dat = m_pPeer; dat && dat != this; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
-	delete [] m_sValue;
+	FreeAllocatedValue();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: free the string values, leaving alone any that belong to a document
+//-----------------------------------------------------------------------------
+void KeyValues::FreeAllocatedValue()
+{
+	if ( !( m_nDocumentFlags & DOCUMENT_VALUE ) )
+	{
+		delete [] m_sValue;
+	}
 	m_sValue = NULL;
+	m_nDocumentFlags &= ~DOCUMENT_VALUE;
+
 	delete [] m_wsValue;
 	m_wsValue = NULL;
 }
@@ -735,6 +748,119 @@ bool KeyValues::LoadFromFile( IBaseFileSystem *filesystem, const char *resourceN
 	return bRetOK;
 }
 
+//-----------------------------------------------------------------------------
+// Binary cache (.kvc) header. The cache is valid for one text file, parsed
+// with one set of options on one platform.
+//-----------------------------------------------------------------------------
+#define KEYVALUES_CACHE_ID			(('1'<<24)+('C'<<16)+('V'<<8)+'K')
+#define KEYVALUES_CACHE_VERSION		1
+
+struct KeyValuesCacheHeader_t
+{
+	int		id;
+	int		version;
+	CRC32_t	nPathCRC;		// resource name, lower case with fixed slashes
+	CRC32_t	nTextCRC;
+	int		nTextSize;
+	int		nOptions;		// parse options and platform, see KeyValuesCacheOptions
+	int		nDataSize;		// WriteAsBinary data that follows
+};
+
+static int KeyValuesCacheOptions( bool bHasEscapeSequences, bool bEvaluateConditionals )
+{
+	// conditionals are evaluated for the platform doing the parsing
+	return ( bHasEscapeSequences ? 0x01 : 0 ) | ( bEvaluateConditionals ? 0x02 : 0 ) |
+		( IsX360() ? 0x10 : 0 ) | ( IsOSX() ? 0x20 : 0 ) | ( IsLinux() ? 0x40 : 0 ) | ( IsWindows() ? 0x80 : 0 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Load keyValues from disk, through the binary cache
+//-----------------------------------------------------------------------------
+bool KeyValues::LoadFromFileCached( IBaseFileSystem *filesystem, const char *resourceName, const char *pathID )
+{
+	Assert( filesystem );
+
+	static bool s_bCacheDisabled = !!CommandLine()->FindParm( "-nokvc" );
+	if ( s_bCacheDisabled )
+		return LoadFromFile( filesystem, resourceName, pathID );
+
+	// The text is needed either way, to check the cache against
+	CUtlBuffer text;
+	if ( !filesystem->ReadFile( resourceName, pathID, text ) )
+		return false;
+
+	char szPath[MAX_PATH];
+	Q_strncpy( szPath, resourceName, sizeof( szPath ) );
+	Q_strlower( szPath );
+	Q_FixSlashes( szPath, '/' );
+
+	KeyValuesCacheHeader_t header;
+	header.id = KEYVALUES_CACHE_ID;
+	header.version = KEYVALUES_CACHE_VERSION;
+	header.nPathCRC = CRC32_ProcessSingleBuffer( szPath, Q_strlen( szPath ) );
+	header.nTextCRC = CRC32_ProcessSingleBuffer( text.Base(), text.TellPut() );
+	header.nTextSize = text.TellPut();
+	header.nOptions = KeyValuesCacheOptions( m_bHasEscapeSequences != 0, m_bEvaluateConditionals != 0 );
+	header.nDataSize = 0;
+
+	char szCacheName[MAX_PATH];
+	Q_snprintf( szCacheName, sizeof( szCacheName ), "%s.kvc", resourceName );
+
+	bool bHasEscapeSequences = m_bHasEscapeSequences != 0;
+	bool bEvaluateConditionals = m_bEvaluateConditionals != 0;
+
+	CUtlBuffer cache;
+	if ( filesystem->ReadFile( szCacheName, "MOD", cache ) && cache.TellPut() >= (int)sizeof( header ) )
+	{
+		KeyValuesCacheHeader_t cacheHeader;
+		cache.Get( &cacheHeader, sizeof( cacheHeader ) );
+		header.nDataSize = cacheHeader.nDataSize;
+
+		if ( !Q_memcmp( &header, &cacheHeader, sizeof( header ) ) && cache.TellPut() - cache.TellGet() == cacheHeader.nDataSize )
+		{
+			if ( ReadAsBinary( cache ) )
+			{
+				// ReadAsBinary resets the parse options
+				UsesEscapeSequences( bHasEscapeSequences );
+				UsesConditionals( bEvaluateConditionals );
+				return true;
+			}
+
+			DevMsg( "KeyValues::LoadFromFileCached: %s is damaged, rebuilding it\n", szCacheName );
+			RemoveEverything();
+			Init();
+			UsesEscapeSequences( bHasEscapeSequences );
+			UsesConditionals( bEvaluateConditionals );
+		}
+	}
+
+	// Parse the text, null terminated as LoadFromFile does it
+	text.PutChar( 0 );
+	text.PutChar( 0 );
+	if ( !LoadFromBuffer( resourceName, (const char *)text.Base(), filesystem, pathID ) )
+		return false;
+
+	// A cached file with #include or #base wouldn't notice the other files changing
+	if ( Q_stristr( (const char *)text.Base(), "#include" ) || Q_stristr( (const char *)text.Base(), "#base" ) )
+		return true;
+
+	CUtlBuffer data;
+	if ( WriteAsBinary( data ) )
+	{
+		header.nDataSize = data.TellPut();
+
+		cache.Purge();
+		cache.Put( &header, sizeof( header ) );
+		cache.Put( data.Base(), data.TellPut() );
+		if ( !filesystem->WriteFile( szCacheName, "MOD", cache ) )
+		{
+			DevMsg( "KeyValues::LoadFromFileCached: couldn't write %s\n", szCacheName );
+		}
+	}
+
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Save the keyvalues to disk
 //			Creates the path to the file if it doesn't exist
@@ -1592,11 +1718,8 @@ void KeyValues::SetColor( const char *keyName, Color value)
 
 void KeyValues::SetStringValue( char const *strValue )
 {
-	// delete the old value
-	delete [] m_sValue;
-	// make sure we're not storing the WSTRING  - as we're converting over to STRING
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+	FreeAllocatedValue();
 
 	if (!strValue)
 	{
@@ -1626,11 +1749,8 @@ void KeyValues::SetString( const char *keyName, const char *value )
 			return;
 		}
 
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1655,11 +1775,8 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 	KeyValues *dat = FindKey( keyName, true );
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_wsValue;
-		// make sure we're not storing the STRING  - as we're converting over to WSTRING
-		delete [] dat->m_sValue;
-		dat->m_sValue = NULL;
+		// delete the old value, and make sure we're not storing the STRING - as we're converting over to WSTRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1699,11 +1816,8 @@ void KeyValues::SetUint64( const char *keyName, uint64 value )
 
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		dat->m_sValue = new char[sizeof(uint64)];
 		*((uint64 *)dat->m_sValue) = value;
@@ -2014,7 +2128,10 @@ bool KeyValues::IsEmpty(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::Clear( void )
 {
-	delete m_pSub;
+	if ( m_pSub )
+	{
+		m_pSub->deleteThis();
+	}
 	m_pSub = NULL;
 	m_iDataType = TYPE_NONE;
 }
@@ -2036,6 +2153,15 @@ KeyValues::types_t KeyValues::GetDataType(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::deleteThis()
 {
+	// Document keys only let go of what they own, their memory goes with the document
+	if ( m_nDocumentFlags & DOCUMENT_NODE )
+	{
+		RemoveEverything();
+		m_pSub = NULL;
+		m_pPeer = NULL;
+		return;
+	}
+
 	delete this;
 }
 
@@ -2468,11 +2594,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 				break;
 			}
 			
-			if (dat->m_sValue)
-			{
-				delete[] dat->m_sValue;
-				dat->m_sValue = NULL;
-			}
+			dat->FreeAllocatedValue();
 
 			int len = Q_strlen( value );
 
@@ -2579,6 +2701,706 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Tokenizer for CKeyValuesDocument. Produces the same tokens as
+//			KeyValues::ReadToken, but terminates them in the text itself
+//			instead of copying them out. A token ending on a control character
+//			can't overwrite it, so that one character is remembered until the
+//			tokenizer moves past it.
+//-----------------------------------------------------------------------------
+class CKeyValuesDocument::CTokenizer
+{
+public:
+	CTokenizer( char *pText, int nLength, bool bHasEscapeSequences ) :
+		m_pCur( pText ), m_pEnd( pText + nLength ), m_pSaved( NULL ), m_chSaved( 0 ),
+		m_bHasEscapeSequences( bHasEscapeSequences ), m_pPushed( NULL ), m_bPushedQuoted( false ), m_bPushedConditional( false )
+	{
+	}
+
+	const char *ReadToken( bool &wasQuoted, bool &wasConditional );
+
+	// Hands the last token out again on the next ReadToken, for the conditional look-ahead
+	void UnreadToken( const char *pToken, bool wasQuoted, bool wasConditional )
+	{
+		m_pPushed = pToken;
+		m_bPushedQuoted = wasQuoted;
+		m_bPushedConditional = wasConditional;
+	}
+
+	bool IsValid() const { return m_pCur < m_pEnd || m_pPushed; }
+
+private:
+	char Peek() const { return ( m_pCur == m_pSaved ) ? m_chSaved : *m_pCur; }
+	void Terminate( char *p )
+	{
+		m_pSaved = p;
+		m_chSaved = *p;
+		*p = 0;
+	}
+
+	char *m_pCur;
+	char *m_pEnd;
+	char *m_pSaved;
+	char m_chSaved;
+	bool m_bHasEscapeSequences;
+
+	const char *m_pPushed;
+	bool m_bPushedQuoted;
+	bool m_bPushedConditional;
+};
+
+const char *CKeyValuesDocument::CTokenizer::ReadToken( bool &wasQuoted, bool &wasConditional )
+{
+	if ( m_pPushed )
+	{
+		const char *pToken = m_pPushed;
+		wasQuoted = m_bPushedQuoted;
+		wasConditional = m_bPushedConditional;
+		m_pPushed = NULL;
+		return pToken;
+	}
+
+	wasQuoted = false;
+	wasConditional = false;
+
+	// eating white spaces and remarks loop
+	while ( true )
+	{
+		while ( m_pCur < m_pEnd && V_isspace( Peek() ) )
+		{
+			m_pCur++;
+		}
+
+		if ( m_pCur >= m_pEnd )
+			return NULL;	// file ends after reading whitespaces
+
+		// stop if it's not a comment; a new token starts here
+		if ( Peek() != '/' || m_pCur + 1 >= m_pEnd || m_pCur[1] != '/' )
+			break;
+
+		while ( m_pCur < m_pEnd && *m_pCur++ != '\n' )
+		{
+		}
+	}
+
+	char c = Peek();
+
+	// read quoted strings specially, collapsing escape sequences where they are
+	if ( c == '\"' )
+	{
+		wasQuoted = true;
+		char *pToken = ++m_pCur;
+		char *pWrite = pToken;
+		while ( m_pCur < m_pEnd && *m_pCur != '\"' )
+		{
+			c = *m_pCur++;
+			if ( c == '\\' && m_bHasEscapeSequences )
+			{
+				// same conversions as the C string one CUtlBuffer uses, including
+				// writing a terminator for an unknown sequence
+				char ch = ( m_pCur < m_pEnd ) ? *m_pCur : 0;
+				switch ( ch )
+				{
+				case 'n':	c = '\n'; break;
+				case 't':	c = '\t'; break;
+				case 'v':	c = '\v'; break;
+				case 'b':	c = '\b'; break;
+				case 'r':	c = '\r'; break;
+				case 'f':	c = '\f'; break;
+				case 'a':	c = '\a'; break;
+				case '\\':
+				case '\?':
+				case '\'':
+				case '\"':	c = ch; break;
+				default:	c = 0; break;
+				}
+
+				if ( c )
+				{
+					m_pCur++;
+				}
+			}
+			*pWrite++ = c;
+		}
+
+		// step over the closing quote and end the token on top of it
+		if ( m_pCur < m_pEnd )
+		{
+			m_pCur++;
+		}
+		*pWrite = 0;
+		return pToken;
+	}
+
+	if ( c == '{' || c == '}' )
+	{
+		// it's a control char, just add this one char and stop reading
+		m_pCur++;
+		return ( c == '{' ) ? "{" : "}";
+	}
+
+	// read in the token until we hit a whitespace or a control character
+	bool bConditionalStart = false;
+	char *pToken = m_pCur;
+	while ( m_pCur < m_pEnd )
+	{
+		c = *m_pCur;
+
+		// end of file
+		if ( c == 0 )
+			break;
+
+		// break if any control character appears in non quoted tokens
+		if ( c == '"' || c == '{' || c == '}' )
+			break;
+
+		if ( c == '[' )
+			bConditionalStart = true;
+
+		if ( c == ']' && bConditionalStart )
+		{
+			wasConditional = true;
+		}
+
+		// break on whitespace
+		if ( V_isspace( c ) )
+			break;
+
+		m_pCur++;
+	}
+
+	if ( m_pCur < m_pEnd )
+	{
+		Terminate( m_pCur );
+	}
+	return pToken;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Constructor
+//-----------------------------------------------------------------------------
+CKeyValuesDocument::CKeyValuesDocument()
+{
+	m_pRoot = NULL;
+	m_bHasEscapeSequences = false;
+	m_bEvaluateConditionals = true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Destructor
+//-----------------------------------------------------------------------------
+CKeyValuesDocument::~CKeyValuesDocument()
+{
+	Clear();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: release every key, the heap ones one by one and the arena at once
+//-----------------------------------------------------------------------------
+void CKeyValuesDocument::Clear()
+{
+	if ( m_pRoot )
+	{
+		m_pRoot->deleteThis();
+		m_pRoot = NULL;
+	}
+
+	if ( m_Arena.GetBase() )
+	{
+		m_Arena.Term();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Load a file into the document
+//-----------------------------------------------------------------------------
+KeyValues *CKeyValuesDocument::LoadFromFile( IBaseFileSystem *filesystem, const char *resourceName, const char *pathID )
+{
+	Assert( filesystem );
+
+	Clear();
+
+	FileHandle_t f = filesystem->Open( resourceName, "rb", pathID );
+	if ( !f )
+		return NULL;
+
+	s_LastFileLoadingFrom = (char*)resourceName;
+
+	// the text goes straight into the arena, where it will be parsed
+	int fileSize = filesystem->Size( f );
+	char *pText = AllocText( fileSize );
+	bool bRetOK = pText && ( filesystem->Read( pText, fileSize, f ) == fileSize );
+
+	filesystem->Close( f );
+
+	if ( !bRetOK )
+	{
+		Clear();
+		return NULL;
+	}
+
+	return Parse( resourceName, pText, fileSize, filesystem, pathID );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Load a copy of a buffer into the document
+//-----------------------------------------------------------------------------
+KeyValues *CKeyValuesDocument::LoadFromBuffer( char const *resourceName, const char *pBuffer, int nLength, IBaseFileSystem* pFileSystem, const char *pPathID )
+{
+	Clear();
+
+	if ( !pBuffer )
+		return NULL;
+
+	if ( nLength < 0 )
+	{
+		nLength = Q_strlen( pBuffer );
+	}
+
+	char *pText = AllocText( nLength );
+	if ( !pText )
+		return NULL;
+
+	Q_memcpy( pText, pBuffer, nLength );
+	return Parse( resourceName, pText, nLength, pFileSystem, pPathID );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Set up the arena for a text of the given length and copy nothing yet.
+//			Keys are sized for a fairly dense file; the rare file that has
+//			more of them gets the rest from the heap.
+//-----------------------------------------------------------------------------
+char *CKeyValuesDocument::AllocText( int nLength )
+{
+	Assert( !m_Arena.GetBase() );
+
+	// twice the text, for a unicode file converted to UTF-8, then the keys and their uint64 values
+	unsigned nKeys = nLength / 16 + 16;
+	unsigned nSize = 2 * ( nLength + 2 ) + nKeys * ( AlignValue( sizeof( KeyValues ), 8 ) + sizeof( uint64 ) );
+	if ( !m_Arena.Init( nSize, 64 * 1024, 0, 8 ) )
+		return NULL;
+
+	char *pText = (char *)m_Arena.Alloc( nLength + 2 );
+	if ( pText )
+	{
+		// double NULL terminating in case this is a unicode file
+		pText[nLength] = 0;
+		pText[nLength + 1] = 0;
+	}
+	return pText;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Allocate from the arena, or return NULL once it's full
+//-----------------------------------------------------------------------------
+void *CKeyValuesDocument::AllocArena( unsigned nBytes )
+{
+	if ( m_Arena.GetUsed() + (int)AlignValue( nBytes, 8 ) > m_Arena.GetMaxSize() )
+		return NULL;
+
+	return m_Arena.Alloc( nBytes );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Create a key in the arena, or on the heap once that runs out
+//-----------------------------------------------------------------------------
+KeyValues *CKeyValuesDocument::AllocKey( const char *pName )
+{
+	KeyValues *pKey = (KeyValues *)AllocArena( sizeof( KeyValues ) );
+	if ( !pKey )
+	{
+		pKey = new KeyValues( pName );
+	}
+	else
+	{
+		pKey->Init();
+		pKey->SetName( pName );
+		pKey->m_nDocumentFlags = KeyValues::DOCUMENT_NODE;
+	}
+
+	pKey->UsesEscapeSequences( m_bHasEscapeSequences );
+	pKey->UsesConditionals( m_bEvaluateConditionals );
+	return pKey;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Type a value the way KeyValues::RecursiveLoadFromBuffer does, but
+//			point at strings in the text instead of copying them
+//-----------------------------------------------------------------------------
+void CKeyValuesDocument::SetValue( KeyValues *dat, char *value )
+{
+	dat->FreeAllocatedValue();
+
+	int len = Q_strlen( value );
+
+	// Here, let's determine if we got a float or an int....
+	char* pIEnd;	// pos where int scan ended
+	char* pFEnd;	// pos where float scan ended
+	const char* pSEnd = value + len ; // pos where token ends
+
+	int ival = strtol( value, &pIEnd, 10 );
+	float fval = (float)strtod( value, &pFEnd );
+	bool bOverflow = ( ival == LONG_MAX || ival == LONG_MIN ) && errno == ERANGE;
+#ifdef POSIX
+	// strtod supports hex representation in strings under posix but we DON'T
+	// want that support in keyvalues, so undo it here if needed
+	if ( len > 1 &&  tolower(value[1]) == 'x' )
+	{
+		fval = 0.0f;
+		pFEnd = (char *)value;
+	}
+#endif
+
+	if ( *value == 0 )
+	{
+		dat->m_iDataType = KeyValues::TYPE_STRING;
+	}
+	else if ( ( 18 == len ) && ( value[0] == '0' ) && ( value[1] == 'x' ) )
+	{
+		// an 18-byte value prefixed with "0x" (followed by 16 hex digits) is an int64 value
+		int64 retVal = 0;
+		for( int i=2; i < 2 + 16; i++ )
+		{
+			char digit = value[i];
+			if ( digit >= 'a' ) 
+				digit -= 'a' - ( '9' + 1 );
+			else
+				if ( digit >= 'A' )
+					digit -= 'A' - ( '9' + 1 );
+			retVal = ( retVal * 16 ) + ( digit - '0' );
+		}
+
+		dat->m_sValue = (char *)AllocArena( sizeof( uint64 ) );
+		if ( dat->m_sValue )
+		{
+			dat->m_nDocumentFlags |= KeyValues::DOCUMENT_VALUE;
+		}
+		else
+		{
+			dat->m_sValue = new char[sizeof( uint64 )];
+		}
+		*((uint64 *)dat->m_sValue) = retVal;
+		dat->m_iDataType = KeyValues::TYPE_UINT64;
+		return;
+	}
+	else if ( (pFEnd > pIEnd) && (pFEnd == pSEnd) )
+	{
+		dat->m_flValue = fval;
+		dat->m_iDataType = KeyValues::TYPE_FLOAT;
+		return;
+	}
+	else if (pIEnd == pSEnd && !bOverflow)
+	{
+		dat->m_iValue = ival;
+		dat->m_iDataType = KeyValues::TYPE_INT;
+		return;
+	}
+	else
+	{
+		dat->m_iDataType = KeyValues::TYPE_STRING;
+	}
+
+	// the string stays where it was parsed
+	dat->m_sValue = value;
+	dat->m_nDocumentFlags |= KeyValues::DOCUMENT_VALUE;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Parse the text in the arena, KeyValues::LoadFromBuffer style
+//-----------------------------------------------------------------------------
+KeyValues *CKeyValuesDocument::Parse( char const *resourceName, char *pText, int nLength, IBaseFileSystem* pFileSystem, const char *pPathID )
+{
+	// Translate Unicode files into UTF-8 before proceeding
+	if ( nLength > 2 && (uint8)pText[0] == 0xFF && (uint8)pText[1] == 0xFE )
+	{
+		int nUTF8Len = V_UnicodeToUTF8( (wchar_t*)(pText+2), NULL, 0 );
+		char *pUTF8Buf = (char *)AllocArena( nUTF8Len );
+		if ( !pUTF8Buf )
+		{
+			Clear();
+			return NULL;
+		}
+
+		V_UnicodeToUTF8( (wchar_t*)(pText+2), pUTF8Buf, nUTF8Len );
+		pText = pUTF8Buf;
+		nLength = Q_strlen( pUTF8Buf );
+	}
+
+	CTokenizer tokenizer( pText, nLength, m_bHasEscapeSequences );
+
+	// the first key stands in for the KeyValues that LoadFromBuffer is called on
+	m_pRoot = AllocKey( "" );
+
+	KeyValues *pPreviousKey = NULL;
+	KeyValues *pCurrentKey = m_pRoot;
+	CUtlVector< KeyValues * > includedKeys;
+	CUtlVector< KeyValues * > baseKeys;
+	bool wasQuoted;
+	bool wasConditional;
+	g_KeyValuesErrorStack.SetFilename( resourceName );	
+	do 
+	{
+		bool bAccepted = true;
+
+		// the first thing must be a key
+		const char *s = tokenizer.ReadToken( wasQuoted, wasConditional );
+		if ( !s || *s == 0 )
+			break;
+
+		// included files are loaded onto the heap by the regular parser
+		if ( !Q_stricmp( s, "#include" ) )	// special include macro (not a key name)
+		{
+			s = tokenizer.ReadToken( wasQuoted, wasConditional );
+			// Name of subfile to load is now in s
+
+			if ( !s || *s == 0 )
+			{
+				g_KeyValuesErrorStack.ReportError("#include is NULL " );
+			}
+			else
+			{
+				m_pRoot->ParseIncludedKeys( resourceName, s, pFileSystem, pPathID, includedKeys );
+			}
+
+			continue;
+		}
+		else if ( !Q_stricmp( s, "#base" ) )
+		{
+			s = tokenizer.ReadToken( wasQuoted, wasConditional );
+			// Name of subfile to load is now in s
+
+			if ( !s || *s == 0 )
+			{
+				g_KeyValuesErrorStack.ReportError("#base is NULL " );
+			}
+			else
+			{
+				m_pRoot->ParseIncludedKeys( resourceName, s, pFileSystem, pPathID, baseKeys );
+			}
+
+			continue;
+		}
+
+		if ( !pCurrentKey )
+		{
+			pCurrentKey = AllocKey( s );
+
+			if ( pPreviousKey )
+			{
+				pPreviousKey->SetNextKey( pCurrentKey );
+			}
+		}
+		else
+		{
+			pCurrentKey->SetName( s );
+		}
+
+		// get the '{'
+		s = tokenizer.ReadToken( wasQuoted, wasConditional );
+
+		if ( wasConditional )
+		{
+			bAccepted = !m_bEvaluateConditionals || EvaluateConditional( s );
+
+			// Now get the '{'
+			s = tokenizer.ReadToken( wasQuoted, wasConditional );
+		}
+
+		if ( s && *s == '{' && !wasQuoted )
+		{
+			// header is valid so load the file
+			RecursiveParse( pCurrentKey, tokenizer );
+		}
+		else
+		{
+			g_KeyValuesErrorStack.ReportError("LoadFromBuffer: missing {" );
+		}
+
+		if ( !bAccepted )
+		{
+			if ( pPreviousKey )
+			{
+				pPreviousKey->SetNextKey( NULL );
+			}
+			pCurrentKey->Clear();
+		}
+		else
+		{
+			pPreviousKey = pCurrentKey;
+			pCurrentKey = NULL;
+		}
+	} while ( tokenizer.IsValid() );
+
+	// the included keys join the document and are freed with it
+	m_pRoot->AppendIncludedKeys( includedKeys );
+
+	m_pRoot->MergeBaseKeys( baseKeys );
+	for ( int i = baseKeys.Count() - 1; i >= 0; i-- )
+	{
+		baseKeys[ i ]->deleteThis();
+	}
+
+	g_KeyValuesErrorStack.SetFilename( "" );	
+
+	return m_pRoot;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: KeyValues::RecursiveLoadFromBuffer over the in place tokenizer
+//-----------------------------------------------------------------------------
+void CKeyValuesDocument::RecursiveParse( KeyValues *pParent, CTokenizer &tokenizer )
+{
+	CKeyErrorContext errorReport( pParent );
+	bool wasQuoted;
+	bool wasConditional;
+	if ( errorReport.GetStackLevel() > 100 )
+	{
+		g_KeyValuesErrorStack.ReportError( "RecursiveLoadFromBuffer:  recursion overflow" );
+		return;
+	}
+
+	// keep this out of the stack until a key is parsed
+	CKeyErrorContext errorKey( INVALID_KEY_SYMBOL );
+
+	KeyValues *pLastChild = pParent->FindLastSubKey();
+
+	// Keep parsing until we hit the closing brace which terminates this block, or a parse error
+	while ( 1 )
+	{
+		bool bAccepted = true;
+
+		// get the key name
+		const char * name = tokenizer.ReadToken( wasQuoted, wasConditional );
+
+		if ( !name )	// EOF stop reading
+		{
+			g_KeyValuesErrorStack.ReportError("RecursiveLoadFromBuffer:  got EOF instead of keyname" );
+			break;
+		}
+
+		if ( !*name ) // empty token, maybe "" or EOF
+		{
+			g_KeyValuesErrorStack.ReportError("RecursiveLoadFromBuffer:  got empty keyname" );
+			break;
+		}
+
+		if ( *name == '}' && !wasQuoted )	// top level closed, stop reading
+			break;
+
+		// Always create the key; note that this could potentially
+		// cause some duplication, but that's what we want sometimes
+		KeyValues *dat = AllocKey( name );
+		pParent->AddSubkeyUsingKnownLastChild( dat, pLastChild );
+
+		errorKey.Reset( dat->GetNameSymbol() );
+
+		// get the value
+		const char * value = tokenizer.ReadToken( wasQuoted, wasConditional );
+
+		if ( wasConditional && value )
+		{
+			bAccepted = !m_bEvaluateConditionals || EvaluateConditional( value );
+
+			// get the real value
+			value = tokenizer.ReadToken( wasQuoted, wasConditional );
+		}
+
+		if ( !value )
+		{
+			g_KeyValuesErrorStack.ReportError("RecursiveLoadFromBuffer:  got NULL key" );
+			break;
+		}
+		
+		if ( *value == '}' && !wasQuoted )
+		{
+			g_KeyValuesErrorStack.ReportError("RecursiveLoadFromBuffer:  got } in key" );
+			break;
+		}
+
+		if ( *value == '{' && !wasQuoted )
+		{
+			// this isn't a key, it's a section
+			errorKey.Reset( INVALID_KEY_SYMBOL );
+			// sub value list
+			RecursiveParse( dat, tokenizer );
+		}
+		else 
+		{
+			if ( wasConditional )
+			{
+				g_KeyValuesErrorStack.ReportError("RecursiveLoadFromBuffer:  got conditional between key and value" );
+				break;
+			}
+
+			// every token but the control ones is in the text, so it can be kept as is
+			SetValue( dat, const_cast< char * >( value ) );
+
+			// Look ahead one token for a conditional tag
+			const char *peek = tokenizer.ReadToken( wasQuoted, wasConditional );
+			if ( wasConditional )
+			{
+				bAccepted = !m_bEvaluateConditionals || EvaluateConditional( peek );
+			}
+			else if ( peek )
+			{
+				tokenizer.UnreadToken( peek, wasQuoted, wasConditional );
+			}
+		}
+
+		Assert( dat->m_pPeer == NULL );
+		if ( bAccepted )
+		{
+			Assert( pLastChild == NULL || pLastChild->m_pPeer == dat );
+			pLastChild = dat;
+		}
+		else
+		{
+			if ( pLastChild == NULL )
+			{
+				Assert( pParent->m_pSub == dat );
+				pParent->m_pSub = NULL;
+			}
+			else
+			{
+				Assert( pLastChild->m_pPeer == dat );
+				pLastChild->m_pPeer = NULL;
+			}
+
+			dat->deleteThis();
+			dat = NULL;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: How many heap allocations the document holds besides its arena:
+//			keys and values set after loading, #include and #base keys, and
+//			whatever didn't fit in the arena
+//-----------------------------------------------------------------------------
+int CKeyValuesDocument::GetHeapAllocationCount() const
+{
+	return CountHeapAllocations( m_pRoot );
+}
+
+int CKeyValuesDocument::CountHeapAllocations( const KeyValues *pKey )
+{
+	int nCount = 0;
+	for ( ; pKey; pKey = pKey->m_pPeer )
+	{
+		if ( !( pKey->m_nDocumentFlags & KeyValues::DOCUMENT_NODE ) )
+			nCount++;
+
+		if ( pKey->m_sValue && !( pKey->m_nDocumentFlags & KeyValues::DOCUMENT_VALUE ) )
+			nCount++;
+
+		if ( pKey->m_wsValue )
+			nCount++;
+
+		nCount += CountHeapAllocations( pKey->m_pSub );
+	}
+	return nCount;
+}
+
 // writes KeyValue as binary data to buffer
 bool KeyValues::WriteAsBinary( CUtlBuffer &buffer )
 {
@@ -2604,7 +3426,15 @@ bool KeyValues::WriteAsBinary( CUtlBuffer &buffer )
 		{
 		case TYPE_NONE:
 			{
-				dat->m_pSub->WriteAsBinary( buffer );
+				if ( dat->m_pSub )
+				{
+					dat->m_pSub->WriteAsBinary( buffer );
+				}
+				else
+				{
+					// no subkeys, just the end marker
+					buffer.PutUnsignedChar( TYPE_NUMTYPES );
+				}
 				break;
 			}
 		case TYPE_STRING:
@@ -2706,8 +3536,17 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 		{
 		case TYPE_NONE:
 			{
-				dat->m_pSub = new KeyValues("");
-				dat->m_pSub->ReadAsBinary( buffer, nStackDepth + 1 );
+				// an empty section is only its end marker, don't turn that into a nameless subkey
+				const unsigned char *pNext = (const unsigned char *)buffer.PeekGet( sizeof( unsigned char ), 0 );
+				if ( pNext && *pNext == TYPE_NUMTYPES )
+				{
+					buffer.GetUnsignedChar();
+				}
+				else
+				{
+					dat->m_pSub = new KeyValues("");
+					dat->m_pSub->ReadAsBinary( buffer, nStackDepth + 1 );
+				}
 				break;
 			}
 		case TYPE_STRING:
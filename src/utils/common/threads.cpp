@@ -19,9 +19,6 @@
 #include "threads.h"
 #include "pacifier.h"
 
-#define	MAX_THREADS	16
-
-
 class CRunThreadsData
 {
 public:
@@ -30,18 +27,36 @@ public:
 	RunThreadsFn m_Fn;
 };
 
-CRunThreadsData g_RunThreadsData[MAX_THREADS];
+CUtlVector<CRunThreadsData> g_RunThreadsData;
 
 
-int		dispatch;
+volatile LONG	dispatch;
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+CUtlVector<HANDLE> g_ThreadHandles;
 
+// Only one thread at a time updates the pacifier; the others don't wait for it.
+CRITICAL_SECTION		pacifiercrit;
+
+
+static void UpdateThreadWorkPacifier( int claimed )
+{
+	if ( !threaded )
+	{
+		UpdatePacifier( (float)claimed / workcount );
+		return;
+	}
+
+	if ( TryEnterCriticalSection( &pacifiercrit ) )
+	{
+		UpdatePacifier( (float)claimed / workcount );
+		LeaveCriticalSection( &pacifiercrit );
+	}
+}
 
 
 /*
@@ -52,39 +67,61 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
-
-	ThreadLock ();
-
-	if (dispatch == workcount)
-	{
-		ThreadUnlock ();
+	if ( dispatch >= workcount )
 		return -1;
-	}
 
-	UpdatePacifier( (float)dispatch / workcount );
+	int r = InterlockedExchangeAdd( &dispatch, 1 );
+	if ( r >= workcount )
+		return -1;
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+	UpdateThreadWorkPacifier( r );
 
 	return r;
 }
 
 
+/*
+=============
+GetThreadWorkRange
+
+Guided scheduling: each claim takes a share of what's left, so there are few
+claims while there's plenty of work and single items at the end.
+=============
+*/
+bool GetThreadWorkRange( int *pStart, int *pEnd )
+{
+	int remaining = workcount - dispatch;
+	if ( remaining <= 0 )
+		return false;
+
+	int chunk = remaining / ( max( numthreads, 1 ) * 4 );
+	if ( chunk < 1 )
+		chunk = 1;
+
+	int start = InterlockedExchangeAdd( &dispatch, chunk );
+	if ( start >= workcount )
+		return false;
+
+	UpdateThreadWorkPacifier( start );
+
+	*pStart = start;
+	*pEnd = min( start + chunk, workcount );
+	return true;
+}
+
+
 ThreadWorkerFn workfunction;
 
 void ThreadWorkerFunction( int iThread, void *pUserData )
 {
-	int		work;
+	int		start, end;
 
-	while (1)
+	while ( GetThreadWorkRange( &start, &end ) )
 	{
-		work = GetThreadWork ();
-		if (work == -1)
-			break;
-		 
-		workfunction( iThread, work );
+		for ( int work = start; work < end; work++ )
+		{
+			workfunction( iThread, work );
+		}
 	}
 }
 
@@ -117,10 +154,40 @@ public:
 	CCritInit()
 	{
 		InitializeCriticalSection (&crit);
+		InitializeCriticalSection (&pacifiercrit);
 	}
 } g_CritInit;
 
 
+CToolThreadArrayBase *CToolThreadArrayBase::s_pHead = NULL;
+
+CToolThreadArrayBase::CToolThreadArrayBase()
+{
+	m_pNext = s_pHead;
+	s_pHead = this;
+}
+
+CToolThreadArrayBase::~CToolThreadArrayBase()
+{
+	for ( CToolThreadArrayBase **ppArray = &s_pHead; *ppArray; ppArray = &(*ppArray)->m_pNext )
+	{
+		if ( *ppArray == this )
+		{
+			*ppArray = m_pNext;
+			break;
+		}
+	}
+}
+
+void CToolThreadArrayBase::SetAllThreadCounts( int nThreads )
+{
+	for ( CToolThreadArrayBase *pArray = s_pHead; pArray; pArray = pArray->m_pNext )
+	{
+		pArray->SetThreadCount( nThreads );
+	}
+}
+
+
 
 void SetLowPriority()
 {
@@ -136,10 +203,12 @@ void ThreadSetDefault (void)
 	{
 		GetSystemInfo (&info);
 		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		if (numthreads < 1)
 			numthreads = 1;
 	}
 
+	CToolThreadArrayBase::SetAllThreadCounts( numthreads );
+
 	Msg ("%i threads\n", numthreads);
 }
 
@@ -177,10 +246,13 @@ DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
 void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePriority )
 {
 	Assert( numthreads > 0 );
-	threaded = true;
 
-	if ( numthreads > MAX_TOOL_THREADS )
-		numthreads = MAX_TOOL_THREADS;
+	// size per-thread storage before anything can index it
+	CToolThreadArrayBase::SetAllThreadCounts( numthreads );
+	g_RunThreadsData.SetCount( numthreads );
+	g_ThreadHandles.SetCount( numthreads );
+
+	threaded = true;
 
 	for ( int i=0; i < numthreads ;i++ )
 	{
@@ -212,7 +284,11 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
+	// can only wait on MAXIMUM_WAIT_OBJECTS handles at once
+	for ( int i=0; i < numthreads; i += MAXIMUM_WAIT_OBJECTS )
+	{
+		WaitForMultipleObjects( min( numthreads - i, MAXIMUM_WAIT_OBJECTS ), &g_ThreadHandles[i], TRUE, INFINITE );
+	}
 	for ( int i=0; i < numthreads; i++ )
 		CloseHandle( g_ThreadHandles[i] );
 
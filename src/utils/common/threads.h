@@ -16,14 +16,15 @@
 #pragma once
 
 
-// Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
-// large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
-#define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
+#include "tier1/utlvector.h"
 
 
 extern	int		numthreads;
 
+// Arrays that are indexed by thread should be CToolThreadArrays, which have
+// numthreads+1 entries so THREADINDEX_MAIN can be used from the main thread.
+#define THREADINDEX_MAIN	(numthreads)
+
 // If set to true, then all the threads that are created are low priority.
 extern bool	g_bLowPriorityThreads;
 
@@ -43,8 +44,15 @@ enum ERunThreadsPriority
 void SetLowPriority();
 
 void ThreadSetDefault (void);
+
+// Claim one work item, or -1 when there is none left
 int	GetThreadWork (void);
 
+// Claim a run of work items [*pStart, *pEnd). Runs start large and shrink as
+// the work runs out so threads finish together. Returns false when there is
+// none left.
+bool GetThreadWorkRange( int *pStart, int *pEnd );
+
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
 
 void RunThreadsOn ( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData=NULL );
@@ -57,6 +65,58 @@ void ThreadLock (void);
 void ThreadUnlock (void);
 
 
+//-----------------------------------------------------------------------------
+// Per-thread storage. Every CToolThreadArray is resized (never shrunk) to
+// numthreads+1 entries before threads are started, and new entries are value
+// initialized.
+//-----------------------------------------------------------------------------
+class CToolThreadArrayBase
+{
+public:
+	CToolThreadArrayBase();
+	virtual ~CToolThreadArrayBase();
+
+	virtual void SetThreadCount( int nThreads ) = 0;
+
+	// Called by ThreadSetDefault and RunThreads_Start
+	static void SetAllThreadCounts( int nThreads );
+
+private:
+	CToolThreadArrayBase *m_pNext;
+	static CToolThreadArrayBase *s_pHead;
+};
+
+template< class T >
+class CToolThreadArray : public CToolThreadArrayBase
+{
+public:
+	CToolThreadArray()
+	{
+		if ( numthreads > 0 )
+			SetThreadCount( numthreads );
+	}
+
+	T &operator[]( int iThread )
+	{
+		Assert( iThread >= 0 && iThread < m_Data.Count() );
+		return m_Data[iThread];
+	}
+
+	int Count() const	{ return m_Data.Count(); }
+
+	virtual void SetThreadCount( int nThreads )
+	{
+		while ( m_Data.Count() < nThreads + 1 )
+		{
+			m_Data[ m_Data.AddToTail() ] = T();
+		}
+	}
+
+private:
+	CUtlVector< T > m_Data;
+};
+
+
 #ifndef NO_THREAD_NAMES
 #define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
 #define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
@@ -0,0 +1,198 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Builds the kd-tree and the bvh for a map's faces, traces the same
+//			rays through both and reports build times, rays per second and
+//			any rays the two structures disagree on.
+//
+// $NoKeywords: $
+//
+//===========================================================================//
+#include <stdio.h>
+#include "cmdlib.h"
+#include "bsplib.h"
+#include "threads.h"
+#include "raytrace.h"
+#include "tier0/icommandline.h"
+#include "vstdlib/random.h"
+
+#define DEFAULT_PACKETS 250000
+
+// kept as plain floats so the arrays don't need to be aligned
+struct BenchPacket_t
+{
+	Vector m_vecOrigin;
+	Vector m_vecDir[4];
+	float m_flLength[4];
+};
+
+struct BenchResult_t
+{
+	int32 m_nHitID[4];
+	float m_flHitDistance[4];
+};
+
+void Usage( void )
+{
+	printf( "Usage: raytrace_bench [-packets #] [-threads #] mapfile.bsp\n"
+		"  -packets # : Number of four ray packets to trace (default: %d).\n"
+		"  -threads # : Threads used by the bvh build.\n", DEFAULT_PACKETS );
+	exit( -1 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads the map's faces into an environment and builds it. Returns
+//			the build time in seconds.
+//-----------------------------------------------------------------------------
+static double BuildEnvironment( RayTracingEnvironment &env, uint32 nFlags )
+{
+	env.Flags = nFlags | RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS | RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS;
+	env.InitializeFromLoadedBSP();
+
+	double flStart = Plat_FloatTime();
+	env.SetupAccelerationStructure();
+	return Plat_FloatTime() - flStart;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Traces every packet and returns the time taken in seconds
+//-----------------------------------------------------------------------------
+static double TraceAll( RayTracingEnvironment &env, CUtlVector<BenchPacket_t> &packets, CUtlVector<BenchResult_t> &results )
+{
+	results.SetCount( packets.Count() );
+
+	double flStart = Plat_FloatTime();
+	for ( int p = 0; p < packets.Count(); p++ )
+	{
+		BenchPacket_t const &packet = packets[p];
+		FourRays rays;
+		rays.origin.DuplicateVector( packet.m_vecOrigin );
+		rays.direction.LoadAndSwizzle( packet.m_vecDir[0], packet.m_vecDir[1], packet.m_vecDir[2], packet.m_vecDir[3] );
+		fltx4 TMax = LoadUnalignedSIMD( packet.m_flLength );
+
+		RayTracingResult rslt;
+		env.Trace4Rays( rays, Four_Zeros, TMax, &rslt );
+		for ( int r = 0; r < 4; r++ )
+		{
+			results[p].m_nHitID[r] = rslt.HitIds[r];
+			results[p].m_flHitDistance[r] = SubFloat( rslt.HitDistance, r );
+		}
+	}
+	return Plat_FloatTime() - flStart;
+}
+
+int main( int argc, char **argv )
+{
+	CommandLine()->CreateCmdLine( argc, argv );
+	MathLib_Init( 2.2f, 2.2f, 0.0f, 2.0f, false, false, false, false );
+	InstallSpewFunction();
+
+	int nPackets = DEFAULT_PACKETS;
+	int i;
+	for ( i = 1; i < argc - 1; i++ )
+	{
+		if ( !Q_stricmp( argv[i], "-packets" ) )
+		{
+			nPackets = max( 1, atoi( argv[++i] ) );
+		}
+		else if ( !Q_stricmp( argv[i], "-threads" ) )
+		{
+			numthreads = atoi( argv[++i] );
+		}
+		else
+		{
+			Usage();
+		}
+	}
+	if ( i != argc - 1 )
+	{
+		Usage();
+	}
+
+	CmdLib_InitFileSystem( argv[argc - 1] );
+	ThreadSetDefault();
+
+	char source[1024];
+	Q_strncpy( source, ExpandArg( argv[argc - 1] ), sizeof( source ) );
+	Q_DefaultExtension( source, ".bsp", sizeof( source ) );
+	LoadBSPFile( source );
+
+	RayTracingEnvironment *pKDTree = new RayTracingEnvironment;
+	RayTracingEnvironment *pBVH = new RayTracingEnvironment;
+	double flKDBuild = BuildEnvironment( *pKDTree, 0 );
+	double flBVHBuild = BuildEnvironment( *pBVH, RTE_FLAGS_USE_BVH );
+	Msg( "%d triangles, %d kd-tree nodes, %d bvh nodes\n", pKDTree->OptimizedTriangleList.Count(),
+		pKDTree->OptimizedKDTree.Count(), pBVH->OptimizedBVH.Count() );
+
+	// Packets of four nearly parallel rays from random points in the map, like
+	// the ones vrad traces from a sample towards a light
+	CUniformRandomStream random;
+	random.SetSeed( 1 );
+	Vector vecMins = pKDTree->m_MinBound;
+	Vector vecMaxs = pKDTree->m_MaxBound;
+	float flLength = ( vecMaxs - vecMins ).Length();
+
+	CUtlVector<BenchPacket_t> packets;
+	packets.SetCount( nPackets );
+	for ( int p = 0; p < nPackets; p++ )
+	{
+		BenchPacket_t &packet = packets[p];
+		packet.m_vecOrigin.Init( random.RandomFloat( vecMins.x, vecMaxs.x ), random.RandomFloat( vecMins.y, vecMaxs.y ),
+			random.RandomFloat( vecMins.z, vecMaxs.z ) );
+		Vector vecDir( random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ) );
+		VectorNormalize( vecDir );
+		for ( int r = 0; r < 4; r++ )
+		{
+			packet.m_vecDir[r] = vecDir + 0.02f * Vector( random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ) );
+			VectorNormalize( packet.m_vecDir[r] );
+			packet.m_flLength[r] = random.RandomFloat( 0.1f, 1.0f ) * flLength;
+		}
+	}
+
+	CUtlVector<BenchResult_t> kdResults, bvhResults;
+	double flKDTrace = TraceAll( *pKDTree, packets, kdResults );
+	double flBVHTrace = TraceAll( *pBVH, packets, bvhResults );
+
+	// Hits past the end of a ray aren't hits. Two different triangles at exactly
+	// the same distance are a tie that either structure may break either way.
+	int nHits = 0, nMismatches = 0, nTies = 0;
+	for ( int p = 0; p < nPackets; p++ )
+	{
+		for ( int r = 0; r < 4; r++ )
+		{
+			float flKDDist = kdResults[p].m_flHitDistance[r];
+			float flBVHDist = bvhResults[p].m_flHitDistance[r];
+			bool bKDHit = ( kdResults[p].m_nHitID[r] != -1 ) && ( flKDDist <= packets[p].m_flLength[r] );
+			bool bBVHHit = ( bvhResults[p].m_nHitID[r] != -1 ) && ( flBVHDist <= packets[p].m_flLength[r] );
+			if ( bKDHit )
+			{
+				nHits++;
+			}
+
+			if ( bKDHit != bBVHHit )
+			{
+				nMismatches++;
+			}
+			else if ( bKDHit && ( flKDDist != flBVHDist ) )
+			{
+				nMismatches++;
+			}
+			else if ( bKDHit && ( kdResults[p].m_nHitID[r] != bvhResults[p].m_nHitID[r] ) )
+			{
+				nTies++;
+			}
+		}
+	}
+
+	int nRays = nPackets * 4;
+	Msg( "\n%d rays, %d hits\n", nRays, nHits );
+	Msg( "          build (s)   trace (s)   rays/sec\n" );
+	Msg( "kd-tree   %9.3f   %9.3f   %10.0f\n", flKDBuild, flKDTrace, nRays / max( flKDTrace, 1.0e-6 ) );
+	Msg( "bvh       %9.3f   %9.3f   %10.0f\n", flBVHBuild, flBVHTrace, nRays / max( flBVHTrace, 1.0e-6 ) );
+	Msg( "\n%d mismatched rays, %d ties\n", nMismatches, nTies );
+
+	delete pKDTree;
+	delete pBVH;
+
+	CmdLib_Cleanup();
+	return nMismatches ? 1 : 0;
+}
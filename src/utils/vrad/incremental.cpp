@@ -7,6 +7,8 @@
 //=============================================================================//
 #include "incremental.h"
 #include "lightmap.h"
+#include "bsptreedata.h"
+#include "collisionutils.h"
 
 
 
@@ -718,7 +720,6 @@ void CIncremental::LinkLightsToFaces( CUtlVector<CFaceLightList> &faceLights )
 
 CIncLight::CIncLight()
 {
-	memset( m_pCachedFaces, 0, sizeof(m_pCachedFaces) );
 	InitializeCriticalSection( &m_CS );
 }
 
@@ -764,3 +765,1002 @@ CLightFace* CIncLight::FindOrCreateLightFace( int iFace, int lmSize, bool *bNew
 }
 
 
+
+
+// -------------------------------------------------------------------------------- //
+// CIncrementalCache.
+// -------------------------------------------------------------------------------- //
+
+struct LightKey_t
+{
+	CRC32_t	m_CRC;
+	int		m_nIndex;
+};
+
+struct OccluderTri_t
+{
+	int		m_nCell[3];
+	int		m_nTri;
+};
+
+
+class CCacheLeafList : public ISpatialLeafEnumerator
+{
+public:
+	virtual bool EnumerateLeaf( int leaf, int context )
+	{
+		m_list.AddToTail( leaf );
+		return true;
+	}
+
+	CUtlVectorFixedGrowable<int, 32> m_list;
+};
+
+
+static int CompareCells( const int *a, const int *b )
+{
+	for ( int i = 0; i < 3; i++ )
+	{
+		if ( a[i] != b[i] )
+			return ( a[i] < b[i] ) ? -1 : 1;
+	}
+	return 0;
+}
+
+static int CompareOccluderTris( const void *p1, const void *p2 )
+{
+	const OccluderTri_t *a = (const OccluderTri_t*)p1;
+	const OccluderTri_t *b = (const OccluderTri_t*)p2;
+
+	int nCompare = CompareCells( a->m_nCell, b->m_nCell );
+	if ( nCompare )
+		return nCompare;
+	return a->m_nTri - b->m_nTri;
+}
+
+static int CompareLightKeys( const void *p1, const void *p2 )
+{
+	const LightKey_t *a = (const LightKey_t*)p1;
+	const LightKey_t *b = (const LightKey_t*)p2;
+
+	if ( a->m_CRC != b->m_CRC )
+		return ( a->m_CRC < b->m_CRC ) ? -1 : 1;
+	return a->m_nIndex - b->m_nIndex;
+}
+
+static void HashTriangle( CRC32_t *pCRC, int iTri )
+{
+	TriGeometryData_t &tri = g_RtEnv.OptimizedTriangleList[iTri].m_Data.m_GeometryData;
+
+	// Only the kind of triangle matters, not which face or prop it came from
+	int nType = tri.m_nTriangleID & ~( TRACE_ID_STATICPROP - 1 );
+	CRC32_ProcessBuffer( pCRC, tri.m_VertexCoordData, sizeof( tri.m_VertexCoordData ) );
+	CRC32_ProcessBuffer( pCRC, &tri.m_nFlags, sizeof( tri.m_nFlags ) );
+	CRC32_ProcessBuffer( pCRC, &nType, sizeof( nType ) );
+
+	if ( iTri < g_RtEnv.TriangleColors.Count() )
+	{
+		CRC32_ProcessBuffer( pCRC, &g_RtEnv.TriangleColors[iTri], sizeof( Vector ) );
+	}
+	if ( iTri < g_RtEnv.TriangleMaterials.Count() )
+	{
+		CRC32_ProcessBuffer( pCRC, &g_RtEnv.TriangleMaterials[iTri], sizeof( int32 ) );
+	}
+}
+
+// Everything about a face that its lighting depends on, other than the lights
+// and the occluders around it
+static CRC32_t FaceSignature( int iFace )
+{
+	dface_t *f = &g_pFaces[iFace];
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	texinfo_t *pTexInfo = &texinfo[f->texinfo];
+	CRC32_ProcessBuffer( &crc, pTexInfo, sizeof( texinfo_t ) );
+	if ( pTexInfo->texdata >= 0 )
+	{
+		CRC32_ProcessBuffer( &crc, &dtexdata[pTexInfo->texdata].reflectivity, sizeof( Vector ) );
+	}
+
+	dplane_t *pPlane = &dplanes[f->planenum];
+	CRC32_ProcessBuffer( &crc, &pPlane->normal, sizeof( Vector ) );
+	CRC32_ProcessBuffer( &crc, &pPlane->dist, sizeof( float ) );
+	CRC32_ProcessBuffer( &crc, &f->side, sizeof( f->side ) );
+	CRC32_ProcessBuffer( &crc, &f->numedges, sizeof( f->numedges ) );
+	CRC32_ProcessBuffer( &crc, &f->smoothingGroups, sizeof( f->smoothingGroups ) );
+	CRC32_ProcessBuffer( &crc, f->m_LightmapTextureMinsInLuxels, sizeof( f->m_LightmapTextureMinsInLuxels ) );
+	CRC32_ProcessBuffer( &crc, f->m_LightmapTextureSizeInLuxels, sizeof( f->m_LightmapTextureSizeInLuxels ) );
+	CRC32_ProcessBuffer( &crc, &face_offset[iFace], sizeof( Vector ) );
+
+	for ( int i = 0; i < f->numedges; i++ )
+	{
+		int se = dsurfedges[f->firstedge + i];
+		int v = ( se < 0 ) ? dedges[-se].v[1] : dedges[se].v[0];
+		CRC32_ProcessBuffer( &crc, &dvertexes[v].point, sizeof( Vector ) );
+	}
+
+	// Smoothed normals pick up the faces around this one
+	faceneighbor_t *fn = &faceneighbor[iFace];
+	CRC32_ProcessBuffer( &crc, &fn->facenormal, sizeof( Vector ) );
+	if ( fn->normal )
+	{
+		CRC32_ProcessBuffer( &crc, fn->normal, f->numedges * sizeof( Vector ) );
+	}
+
+	if ( f->dispinfo != -1 )
+	{
+		ddispinfo_t *pDisp = &g_dispinfo[f->dispinfo];
+		CRC32_ProcessBuffer( &crc, &pDisp->startPosition, sizeof( Vector ) );
+		CRC32_ProcessBuffer( &crc, &pDisp->power, sizeof( int ) );
+		CRC32_ProcessBuffer( &crc, &pDisp->smoothingAngle, sizeof( float ) );
+		CRC32_ProcessBuffer( &crc, &g_DispVerts[pDisp->m_iDispVertStart], pDisp->NumVerts() * sizeof( CDispVert ) );
+	}
+
+	CRC32_Final( &crc );
+	return crc;
+}
+
+// Displacements are smoothed across their neighbors, so any change to one
+// relights them all
+static CRC32_t DispSignature()
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	for ( int i = 0; i < g_dispinfo.Count(); i++ )
+	{
+		CRC32_ProcessBuffer( &crc, &g_dispinfo[i].startPosition, sizeof( Vector ) );
+	}
+	CRC32_ProcessBuffer( &crc, g_DispVerts.Base(), g_DispVerts.Count() * sizeof( CDispVert ) );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+static CRC32_t LightSignature( directlight_t *dl )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, &dl->light, sizeof( dl->light ) );
+	CRC32_ProcessBuffer( &crc, &dl->m_flStartFadeDistance, sizeof( float ) );
+	CRC32_ProcessBuffer( &crc, &dl->m_flEndFadeDistance, sizeof( float ) );
+	CRC32_ProcessBuffer( &crc, &dl->m_flCapDist, sizeof( float ) );
+	if ( dl->light.type == emit_skylight )
+	{
+		CRC32_ProcessBuffer( &crc, &g_SunAngularExtent, sizeof( float ) );
+	}
+	CRC32_Final( &crc );
+
+	// 0 marks an unused light index in the cache
+	return crc ? crc : 1;
+}
+
+template< class T >
+static bool GetVector( CUtlBuffer &buf, CUtlVector<T> &vec )
+{
+	int nCount = buf.GetInt();
+	if ( nCount < 0 || nCount > buf.GetBytesRemaining() / (int)sizeof( T ) )
+		return false;
+
+	vec.SetCount( nCount );
+	buf.Get( vec.Base(), nCount * sizeof( T ) );
+	return buf.IsValid();
+}
+
+template< class T >
+static void PutVector( long fp, const CUtlVector<T> &vec )
+{
+	FileWrite( fp, vec.Count() );
+	FileWrite( fp, vec.Base(), vec.Count() * sizeof( T ) );
+}
+
+
+CIncrementalCache::CIncrementalCache()
+{
+	m_szFilename[0] = 0;
+	m_OptionsCRC = 0;
+	m_VisCRC = 0;
+	m_bValid = false;
+	m_bSameGeometry = false;
+	m_bRestoredTransfers = false;
+	m_nOldPatches = 0;
+	m_nOldBounceOffset = -1;
+	m_nOldFaceDataStart = 0;
+	m_nOldFaceDataSize = 0;
+}
+
+
+void CIncrementalCache::Init( char const *pFilename, int argc, char **argv )
+{
+	Q_MakeAbsolutePath( m_szFilename, sizeof( m_szFilename ), pFilename );
+
+	// The cache's name, the thread count and verbosity don't change the lighting
+	CRC32_Init( &m_OptionsCRC );
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !Q_stricmp( argv[i], "-incremental" ) || !Q_stricmp( argv[i], "-threads" ) )
+		{
+			i++;
+			continue;
+		}
+		if ( !Q_stricmp( argv[i], "-v" ) || !Q_stricmp( argv[i], "-verbose" ) || !Q_stricmp( argv[i], "-low" ) )
+			continue;
+
+		CRC32_ProcessBuffer( &m_OptionsCRC, argv[i], Q_strlen( argv[i] ) + 1 );
+	}
+	CRC32_Final( &m_OptionsCRC );
+}
+
+
+void CIncrementalCache::HashOccluders()
+{
+	int nTris = g_RtEnv.OptimizedTriangleList.Count();
+
+	// Bucket the triangles by the cell their centroid is in
+	CUtlVector<OccluderTri_t> tris;
+	tris.SetCount( nTris );
+	for ( int i = 0; i < nTris; i++ )
+	{
+		CacheOptimizedTriangle &tri = g_RtEnv.OptimizedTriangleList[i];
+		Vector vecCenter = ( tri.Vertex( 0 ) + tri.Vertex( 1 ) + tri.Vertex( 2 ) ) * ( 1.0f / 3.0f );
+		for ( int j = 0; j < 3; j++ )
+		{
+			tris[i].m_nCell[j] = (int)floor( vecCenter[j] / OCCLUDER_CELL_SIZE );
+		}
+		tris[i].m_nTri = i;
+	}
+	qsort( tris.Base(), nTris, sizeof( OccluderTri_t ), CompareOccluderTris );
+
+	m_Cells.RemoveAll();
+	for ( int i = 0; i < nTris; i++ )
+	{
+		if ( !m_Cells.Count() || CompareCells( m_Cells.Tail().m_nCell, tris[i].m_nCell ) )
+		{
+			OccluderCell_t &cell = m_Cells[m_Cells.AddToTail()];
+			memcpy( cell.m_nCell, tris[i].m_nCell, sizeof( cell.m_nCell ) );
+			CRC32_Init( &cell.m_CRC );
+			ClearBounds( cell.m_vecMins, cell.m_vecMaxs );
+		}
+
+		OccluderCell_t &cell = m_Cells.Tail();
+		HashTriangle( &cell.m_CRC, tris[i].m_nTri );
+
+		CacheOptimizedTriangle &tri = g_RtEnv.OptimizedTriangleList[tris[i].m_nTri];
+		for ( int j = 0; j < 3; j++ )
+		{
+			AddPointToBounds( tri.Vertex( j ), cell.m_vecMins, cell.m_vecMaxs );
+		}
+	}
+	for ( int i = 0; i < m_Cells.Count(); i++ )
+	{
+		CRC32_Final( &m_Cells[i].m_CRC );
+	}
+
+	// Static props are only checksummed on their own for the report
+	m_PropCRCs.RemoveAll();
+	for ( int i = 0; i < nTris; i++ )
+	{
+		int nID = g_RtEnv.OptimizedTriangleList[i].m_Data.m_GeometryData.m_nTriangleID;
+		if ( !( nID & TRACE_ID_STATICPROP ) )
+			continue;
+
+		int nProp = nID & ( TRACE_ID_STATICPROP - 1 );
+		while ( m_PropCRCs.Count() <= nProp )
+		{
+			CRC32_Init( &m_PropCRCs[m_PropCRCs.AddToTail()] );
+		}
+		HashTriangle( &m_PropCRCs[nProp], i );
+	}
+	for ( int i = 0; i < m_PropCRCs.Count(); i++ )
+	{
+		CRC32_Final( &m_PropCRCs[i] );
+	}
+}
+
+
+void CIncrementalCache::Prepare()
+{
+	// This run's faces and lights
+	CRC32_t dispCRC = DispSignature();
+	m_FaceCRCs.SetCount( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		m_FaceCRCs[i] = FaceSignature( i );
+		if ( g_pFaces[i].dispinfo != -1 )
+		{
+			m_FaceCRCs[i] ^= dispCRC;
+		}
+	}
+
+	m_FaceLights.SetCount( numfaces );
+	m_FaceRestored.SetCount( numfaces );
+	memset( m_FaceRestored.Base(), 0, numfaces );
+	m_FaceCandidates.SetCount( numfaces );
+	memset( m_FaceCandidates.Base(), 0, numfaces );
+
+	m_LightCRCs.SetCount( numdlights );
+	m_Lights.SetCount( numdlights );
+	memset( m_LightCRCs.Base(), 0, numdlights * sizeof( CRC32_t ) );
+	memset( m_Lights.Base(), 0, numdlights * sizeof( directlight_t* ) );
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		m_LightCRCs[dl->index] = LightSignature( dl );
+		m_Lights[dl->index] = dl;
+	}
+
+	CRC32_Init( &m_VisCRC );
+	CRC32_ProcessBuffer( &m_VisCRC, dvisdata, visdatasize );
+	CRC32_Final( &m_VisCRC );
+
+	m_bValid = Load();
+	if ( !m_bValid )
+	{
+		m_OldData.Purge();
+		return;
+	}
+
+	DiffLights();
+	DiffOccluders();
+
+	// Faces that changed, or that a removed or changed light used to reach, are relit
+	int nChangedFaces = 0;
+	int nCandidates = 0;
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		if ( m_FaceCRCs[iFace] != m_OldFaceCRCs[iFace] )
+		{
+			nChangedFaces++;
+			continue;
+		}
+
+		int nSize;
+		const byte *pRecord = OldFaceRecord( iFace, &nSize );
+		if ( !pRecord )
+			continue;
+
+		CUtlBuffer buf( pRecord, nSize, CUtlBuffer::READ_ONLY );
+		buf.SeekGet( CUtlBuffer::SEEK_HEAD, MAXLIGHTMAPS + 2 * sizeof( int ) );
+		int nLights = buf.GetInt();
+		bool bCandidate = ( nLights >= 0 );
+		for ( int i = 0; bCandidate && i < nLights; i++ )
+		{
+			int iOldLight = buf.GetInt();
+			bCandidate = buf.IsValid() && iOldLight >= 0 && iOldLight < m_OldLightMap.Count() && m_OldLightMap[iOldLight] >= 0;
+		}
+
+		m_FaceCandidates[iFace] = bCandidate;
+		if ( bCandidate )
+		{
+			nCandidates++;
+		}
+	}
+
+	m_bSameGeometry = !nChangedFaces && !m_ChangedOccluders.Count() && ( m_nOldPatches == g_Patches.Count() );
+
+	Msg( "Incremental: %d faces changed, %d of %d may keep their lighting\n", nChangedFaces, nCandidates, numfaces );
+}
+
+
+bool CIncrementalCache::Load()
+{
+	m_OldData.Purge();
+	if ( !g_pFileSystem->FileExists( m_szFilename ) )
+	{
+		Msg( "Incremental: no cache in %s yet, lighting everything\n", m_szFilename );
+		return false;
+	}
+
+	if ( !g_pFileSystem->ReadFile( m_szFilename, NULL, m_OldData ) )
+	{
+		Warning( "Incremental: couldn't read %s, lighting everything\n", m_szFilename );
+		return false;
+	}
+
+	CUtlBuffer &buf = m_OldData;
+	int nVersion = buf.GetInt();
+	int nHDR = buf.GetInt();
+	CRC32_t optionsCRC = buf.GetUnsignedInt();
+	CRC32_t visCRC = buf.GetUnsignedInt();
+	int nFaces = buf.GetInt();
+	m_nOldPatches = buf.GetInt();
+	if ( !buf.IsValid() || nVersion != INCREMENTALCACHE_VERSION )
+	{
+		Msg( "Incremental: %s is from another version of vrad, lighting everything\n", m_szFilename );
+		return false;
+	}
+	if ( nHDR != (int)g_bHDR || optionsCRC != m_OptionsCRC || visCRC != m_VisCRC || nFaces != numfaces )
+	{
+		Msg( "Incremental: options, vis or faces changed since %s was written, lighting everything\n", m_szFilename );
+		return false;
+	}
+
+	bool bValid = GetVector( buf, m_OldCells ) && GetVector( buf, m_OldPropCRCs ) && GetVector( buf, m_OldLightCRCs );
+	if ( bValid && buf.GetBytesRemaining() >= numfaces * (int)( sizeof( CRC32_t ) + sizeof( int ) ) )
+	{
+		m_OldFaceCRCs.SetCount( numfaces );
+		buf.Get( m_OldFaceCRCs.Base(), numfaces * sizeof( CRC32_t ) );
+		m_OldFaceDataOffsets.SetCount( numfaces );
+		buf.Get( m_OldFaceDataOffsets.Base(), numfaces * sizeof( int ) );
+
+		m_nOldFaceDataSize = buf.GetInt();
+		m_nOldFaceDataStart = buf.TellGet();
+		bValid = buf.IsValid() && m_nOldFaceDataSize >= 0 && m_nOldFaceDataSize <= buf.GetBytesRemaining();
+	}
+	else
+	{
+		bValid = false;
+	}
+
+	if ( !bValid )
+	{
+		Warning( "Incremental: %s is corrupt, lighting everything\n", m_szFilename );
+		return false;
+	}
+
+	// The transfers and bounced light are only there if the last run bounced.
+	// Make sure the whole list is there before anything relies on it.
+	buf.SeekGet( CUtlBuffer::SEEK_CURRENT, m_nOldFaceDataSize );
+	m_nOldBounceOffset = -1;
+	if ( buf.GetInt() )
+	{
+		int nOffset = buf.TellGet();
+		for ( int i = 0; bValid && i < m_nOldPatches; i++ )
+		{
+			buf.SeekGet( CUtlBuffer::SEEK_CURRENT, sizeof( Vector ) + sizeof( bumplights_t ) + sizeof( int ) );
+			int nBytes = buf.GetInt();
+			bValid = buf.IsValid() && nBytes >= 0 && nBytes <= buf.GetBytesRemaining();
+			buf.SeekGet( CUtlBuffer::SEEK_CURRENT, nBytes );
+		}
+		if ( bValid )
+		{
+			m_nOldBounceOffset = nOffset;
+		}
+	}
+
+	return true;
+}
+
+
+const byte *CIncrementalCache::OldFaceRecord( int iFace, int *pSize )
+{
+	int nOffset = m_OldFaceDataOffsets[iFace];
+	if ( nOffset < 0 || nOffset >= m_nOldFaceDataSize )
+		return NULL;
+
+	*pSize = m_nOldFaceDataSize - nOffset;
+	return (const byte*)m_OldData.Base() + m_nOldFaceDataStart + nOffset;
+}
+
+
+void CIncrementalCache::DiffLights()
+{
+	// Lights are matched by their contents; their order doesn't matter
+	CUtlVector<LightKey_t> oldKeys, newKeys;
+	for ( int i = 0; i < m_OldLightCRCs.Count(); i++ )
+	{
+		if ( m_OldLightCRCs[i] )
+		{
+			LightKey_t &key = oldKeys[oldKeys.AddToTail()];
+			key.m_CRC = m_OldLightCRCs[i];
+			key.m_nIndex = i;
+		}
+	}
+	for ( int i = 0; i < m_Lights.Count(); i++ )
+	{
+		if ( m_Lights[i] )
+		{
+			LightKey_t &key = newKeys[newKeys.AddToTail()];
+			key.m_CRC = m_LightCRCs[i];
+			key.m_nIndex = i;
+		}
+	}
+	qsort( oldKeys.Base(), oldKeys.Count(), sizeof( LightKey_t ), CompareLightKeys );
+	qsort( newKeys.Base(), newKeys.Count(), sizeof( LightKey_t ), CompareLightKeys );
+
+	m_OldLightMap.SetCount( m_OldLightCRCs.Count() );
+	for ( int i = 0; i < m_OldLightMap.Count(); i++ )
+	{
+		m_OldLightMap[i] = -1;
+	}
+
+	CUtlVector<byte> matched;
+	matched.SetCount( m_Lights.Count() );
+	memset( matched.Base(), 0, matched.Count() );
+
+	int nMatched = 0;
+	int o = 0, n = 0;
+	while ( o < oldKeys.Count() && n < newKeys.Count() )
+	{
+		if ( oldKeys[o].m_CRC == newKeys[n].m_CRC )
+		{
+			m_OldLightMap[oldKeys[o].m_nIndex] = newKeys[n].m_nIndex;
+			matched[newKeys[n].m_nIndex] = true;
+			nMatched++;
+			o++;
+			n++;
+		}
+		else if ( oldKeys[o].m_CRC < newKeys[n].m_CRC )
+		{
+			o++;
+		}
+		else
+		{
+			n++;
+		}
+	}
+
+	m_NewLights.RemoveAll();
+	m_SameLights.RemoveAll();
+	for ( int i = 0; i < m_Lights.Count(); i++ )
+	{
+		if ( !m_Lights[i] )
+			continue;
+
+		if ( matched[i] )
+		{
+			m_SameLights.AddToTail( m_Lights[i] );
+		}
+		else
+		{
+			m_NewLights.AddToTail( m_Lights[i] );
+		}
+	}
+
+	Msg( "Incremental: %d of %d lights new or changed, %d removed or changed\n",
+		m_NewLights.Count(), newKeys.Count(), oldKeys.Count() - nMatched );
+}
+
+
+void CIncrementalCache::DiffOccluders()
+{
+	// Both cell lists are sorted, so walk them together
+	m_ChangedOccluders.RemoveAll();
+	int o = 0, n = 0;
+	while ( o < m_OldCells.Count() || n < m_Cells.Count() )
+	{
+		int nCompare;
+		if ( o == m_OldCells.Count() )
+		{
+			nCompare = 1;
+		}
+		else if ( n == m_Cells.Count() )
+		{
+			nCompare = -1;
+		}
+		else
+		{
+			nCompare = CompareCells( m_OldCells[o].m_nCell, m_Cells[n].m_nCell );
+		}
+
+		if ( nCompare < 0 )
+		{
+			// Everything in this cell went away
+			AddChangedOccluder( m_OldCells[o].m_vecMins, m_OldCells[o].m_vecMaxs );
+			o++;
+		}
+		else if ( nCompare > 0 )
+		{
+			AddChangedOccluder( m_Cells[n].m_vecMins, m_Cells[n].m_vecMaxs );
+			n++;
+		}
+		else
+		{
+			if ( m_OldCells[o].m_CRC != m_Cells[n].m_CRC )
+			{
+				Vector vecMins = m_OldCells[o].m_vecMins;
+				Vector vecMaxs = m_OldCells[o].m_vecMaxs;
+				AddPointToBounds( m_Cells[n].m_vecMins, vecMins, vecMaxs );
+				AddPointToBounds( m_Cells[n].m_vecMaxs, vecMins, vecMaxs );
+				AddChangedOccluder( vecMins, vecMaxs );
+			}
+			o++;
+			n++;
+		}
+	}
+
+	int nChangedProps = 0;
+	for ( int i = 0; i < max( m_PropCRCs.Count(), m_OldPropCRCs.Count() ); i++ )
+	{
+		if ( i >= m_PropCRCs.Count() || i >= m_OldPropCRCs.Count() || m_PropCRCs[i] != m_OldPropCRCs[i] )
+		{
+			nChangedProps++;
+		}
+	}
+
+	Msg( "Incremental: %d occluder cells changed, %d static props added, moved or removed\n",
+		m_ChangedOccluders.Count(), nChangedProps );
+}
+
+
+void CIncrementalCache::AddChangedOccluder( const Vector &vecMins, const Vector &vecMaxs )
+{
+	ChangedOccluder_t &occluder = m_ChangedOccluders[m_ChangedOccluders.AddToTail()];
+	occluder.m_vecMins = vecMins;
+	occluder.m_vecMaxs = vecMaxs;
+
+	CCacheLeafList leaves;
+	ToolBSPTree()->EnumerateLeavesInBox( vecMins, vecMaxs, &leaves, 0 );
+	for ( int i = 0; i < leaves.m_list.Count(); i++ )
+	{
+		int nCluster = dleafs[leaves.m_list[i]].cluster;
+		if ( nCluster >= 0 && occluder.m_Clusters.Find( nCluster ) == -1 )
+		{
+			occluder.m_Clusters.AddToTail( nCluster );
+		}
+	}
+}
+
+
+bool CIncrementalCache::IsFaceCached( int iFace ) const
+{
+	return m_bValid && m_FaceCandidates[iFace];
+}
+
+
+bool CIncrementalCache::LightReachesBox( directlight_t *dl, const int *pClusters, int nClusters, const Vector &vecMins, const Vector &vecMaxs ) const
+{
+	// No clusters means a sample is outside of them, and PVSCheck lets those see every light
+	if ( nClusters )
+	{
+		bool bVisible = false;
+		for ( int i = 0; i < nClusters && !bVisible; i++ )
+		{
+			bVisible = ( PVSCheck( dl->pvs, pClusters[i] ) != 0 );
+		}
+		if ( !bVisible )
+			return false;
+	}
+
+	// Lights with a hard falloff don't reach past their end fade distance
+	if ( ( dl->light.type != emit_skylight ) && ( dl->light.type != emit_skyambient ) &&
+		 ( dl->m_flEndFadeDistance > dl->m_flStartFadeDistance ) )
+	{
+		if ( CalcSqrDistanceToAABB( vecMins, vecMaxs, dl->light.origin ) > dl->m_flEndFadeDistance * dl->m_flEndFadeDistance )
+			return false;
+	}
+
+	return true;
+}
+
+
+bool CIncrementalCache::OccluderCanShadow( const ChangedOccluder_t &occluder, directlight_t *dl, const Vector &vecMins, const Vector &vecMaxs ) const
+{
+	// Sweep the face's box along the shadow rays
+	Vector vecCenter = ( vecMins + vecMaxs ) * 0.5f;
+	Vector vecExtents = ( vecMaxs - vecMins ) * 0.5f;
+	Vector vecDelta;
+
+	switch ( dl->light.type )
+	{
+	case emit_skyambient:
+		// Sky ambient is gathered from every direction
+		return true;
+
+	case emit_skylight:
+		{
+			// Straight out of the sun, jittered by its angular extent
+			float flJitter = MAX_TRACE_LENGTH * g_SunAngularExtent;
+			vecExtents += Vector( flJitter, flJitter, flJitter );
+			VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, vecDelta );
+		}
+		break;
+
+	default:
+		vecDelta = dl->light.origin - vecCenter;
+		break;
+	}
+
+	if ( IsBoxIntersectingBox( occluder.m_vecMins, occluder.m_vecMaxs, vecMins, vecMaxs ) )
+		return true;
+
+	return IsBoxIntersectingRay( occluder.m_vecMins - vecExtents, occluder.m_vecMaxs + vecExtents, vecCenter, vecDelta );
+}
+
+
+bool CIncrementalCache::RestoreFace( int iFace, facelight_t *fl, int normalCount, const Vector &vecMins, const Vector &vecMaxs )
+{
+	// The clusters the face could be lit in. A sample outside any cluster sees every light.
+	CUtlVectorFixedGrowable<int, 32> clusters;
+	bool bAllClusters = false;
+	for ( int i = 0; i < fl->numsamples && !bAllClusters; i++ )
+	{
+		bAllClusters = ( ClusterFromPoint( fl->sample[i].pos ) < 0 );
+	}
+	if ( !bAllClusters )
+	{
+		CCacheLeafList leaves;
+		ToolBSPTree()->EnumerateLeavesInBox( vecMins, vecMaxs, &leaves, 0 );
+		for ( int i = 0; i < leaves.m_list.Count(); i++ )
+		{
+			int nCluster = dleafs[leaves.m_list[i]].cluster;
+			if ( nCluster >= 0 && clusters.Find( nCluster ) == -1 )
+			{
+				clusters.AddToTail( nCluster );
+			}
+		}
+		bAllClusters = !clusters.Count();
+	}
+	int nClusters = bAllClusters ? 0 : clusters.Count();
+
+	// New or changed lights that reach the face
+	for ( int i = 0; i < m_NewLights.Count(); i++ )
+	{
+		if ( LightReachesBox( m_NewLights[i], clusters.Base(), nClusters, vecMins, vecMaxs ) )
+			return false;
+	}
+
+	// Changed occluders that could now cast, or no longer cast, a shadow on it
+	if ( m_ChangedOccluders.Count() )
+	{
+		byte pvs[(MAX_MAP_CLUSTERS+7)/8];
+		bool bAllVisible = bAllClusters || !visdatasize;
+		if ( !bAllVisible )
+		{
+			byte clusterPVS[(MAX_MAP_CLUSTERS+7)/8];
+			int nBytes = ( dvis->numclusters + 7 ) / 8;
+			memset( pvs, 0, nBytes );
+			for ( int i = 0; i < nClusters; i++ )
+			{
+				DecompressVis( &dvisdata[dvis->bitofs[clusters[i]][DVIS_PVS]], clusterPVS );
+				for ( int j = 0; j < nBytes; j++ )
+				{
+					pvs[j] |= clusterPVS[j];
+				}
+			}
+		}
+
+		CUtlVectorFixedGrowable<int, 16> visible;
+		for ( int i = 0; i < m_ChangedOccluders.Count(); i++ )
+		{
+			const ChangedOccluder_t &occluder = m_ChangedOccluders[i];
+			bool bVisible = bAllVisible || !occluder.m_Clusters.Count();
+			for ( int j = 0; j < occluder.m_Clusters.Count() && !bVisible; j++ )
+			{
+				bVisible = ( PVSCheck( pvs, occluder.m_Clusters[j] ) != 0 );
+			}
+			if ( bVisible )
+			{
+				visible.AddToTail( i );
+			}
+		}
+
+		for ( int i = 0; visible.Count() && i < m_SameLights.Count(); i++ )
+		{
+			directlight_t *dl = m_SameLights[i];
+			if ( !LightReachesBox( dl, clusters.Base(), nClusters, vecMins, vecMaxs ) )
+				continue;
+
+			for ( int j = 0; j < visible.Count(); j++ )
+			{
+				if ( OccluderCanShadow( m_ChangedOccluders[visible[j]], dl, vecMins, vecMaxs ) )
+					return false;
+			}
+		}
+	}
+
+	// Nothing that could change the face did, so put the last run's lighting back
+	int nSize;
+	const byte *pRecord = OldFaceRecord( iFace, &nSize );
+	CUtlBuffer buf( pRecord, nSize, CUtlBuffer::READ_ONLY );
+
+	byte styles[MAXLIGHTMAPS];
+	buf.Get( styles, MAXLIGHTMAPS );
+	int nSamples = buf.GetInt();
+	int nNormalCount = buf.GetInt();
+	if ( nSamples != fl->numsamples || nNormalCount != normalCount || styles[0] != 0 )
+		return false;
+
+	int nLights = buf.GetInt();
+	CUtlVector<int> &faceLights = m_FaceLights[iFace];
+	faceLights.RemoveAll();
+	for ( int i = 0; i < nLights; i++ )
+	{
+		faceLights.AddToTail( m_OldLightMap[buf.GetInt()] );
+	}
+
+	int nBytes = nSamples * sizeof( LightingValue_t );
+	int nStyles;
+	for ( nStyles = 0; nStyles < MAXLIGHTMAPS && styles[nStyles] != 255; nStyles++ )
+		;
+	if ( buf.GetBytesRemaining() < nStyles * normalCount * nBytes )
+	{
+		faceLights.RemoveAll();
+		return false;
+	}
+
+	dface_t *f = &g_pFaces[iFace];
+	for ( int k = 0; k < nStyles; k++ )
+	{
+		// style 0 is already allocated
+		f->styles[k] = styles[k];
+		if ( k > 0 )
+		{
+			AllocateLightstyleSamples( fl, k, normalCount );
+		}
+		for ( int n = 0; n < normalCount; n++ )
+		{
+			buf.Get( fl->light[k][n], nBytes );
+		}
+	}
+
+	m_FaceRestored[iFace] = true;
+	return true;
+}
+
+
+void CIncrementalCache::AddLightToFace( int iFace, int iLight )
+{
+	// Only the thread lighting the face touches its list
+	CUtlVector<int> &faceLights = m_FaceLights[iFace];
+	if ( faceLights.Find( iLight ) == -1 )
+	{
+		faceLights.AddToTail( iLight );
+	}
+}
+
+
+void CIncrementalCache::SaveFacelights()
+{
+	m_FaceData.Purge();
+	m_FaceDataOffsets.SetCount( numfaces );
+
+	int nRestored = 0;
+	int nLit = 0;
+	for ( int iFace = 0; iFace < numfaces; iFace++ )
+	{
+		dface_t *f = &g_pFaces[iFace];
+		facelight_t *fl = &facelight[iFace];
+		if ( f->styles[0] == 255 || !fl->numsamples )
+		{
+			m_FaceDataOffsets[iFace] = -1;
+			continue;
+		}
+
+		if ( m_FaceRestored[iFace] )
+		{
+			nRestored++;
+		}
+		else
+		{
+			nLit++;
+		}
+
+		int normalCount = fl->light[0][1] ? NUM_BUMP_VECTS+1 : 1;
+		CUtlVector<int> &faceLights = m_FaceLights[iFace];
+
+		m_FaceDataOffsets[iFace] = m_FaceData.TellPut();
+		m_FaceData.Put( f->styles, MAXLIGHTMAPS );
+		m_FaceData.PutInt( fl->numsamples );
+		m_FaceData.PutInt( normalCount );
+		m_FaceData.PutInt( faceLights.Count() );
+		m_FaceData.Put( faceLights.Base(), faceLights.Count() * sizeof( int ) );
+		for ( int k = 0; k < MAXLIGHTMAPS && f->styles[k] != 255; k++ )
+		{
+			for ( int n = 0; n < normalCount; n++ )
+			{
+				m_FaceData.Put( fl->light[k][n], fl->numsamples * sizeof( LightingValue_t ) );
+			}
+		}
+	}
+
+	Msg( "Incremental: kept the lighting on %d faces, lit %d\n", nRestored, nLit );
+}
+
+
+bool CIncrementalCache::RestoreTransfers()
+{
+	if ( !m_bSameGeometry || m_nOldBounceOffset < 0 )
+		return false;
+
+	CUtlBuffer buf( (const byte*)m_OldData.Base() + m_nOldBounceOffset, m_OldData.TellPut() - m_nOldBounceOffset, CUtlBuffer::READ_ONLY );
+
+	// One allocation, in patch order, like PackTransfers leaves them
+	int nPatchCount = g_Patches.Count();
+	int nTotalBytes = 0;
+	int nTotalTransfers = 0;
+	for ( int i = 0; i < nPatchCount; i++ )
+	{
+		buf.SeekGet( CUtlBuffer::SEEK_CURRENT, sizeof( Vector ) + sizeof( bumplights_t ) );
+		nTotalTransfers += buf.GetInt();
+		int nBytes = buf.GetInt();
+		buf.SeekGet( CUtlBuffer::SEEK_CURRENT, nBytes );
+		nTotalBytes += nBytes;
+	}
+
+	byte *pPacked = nTotalBytes ? (byte*)malloc( nTotalBytes ) : NULL;
+	byte *pOut = pPacked;
+	buf.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+	for ( int i = 0; i < nPatchCount; i++ )
+	{
+		CPatch &patch = g_Patches[i];
+		buf.SeekGet( CUtlBuffer::SEEK_CURRENT, sizeof( Vector ) + sizeof( bumplights_t ) );
+		patch.numtransfers = buf.GetInt();
+		patch.transferbytes = buf.GetInt();
+		patch.transfers = patch.transferbytes ? pOut : NULL;
+		buf.Get( pOut, patch.transferbytes );
+		pOut += patch.transferbytes;
+	}
+
+	m_bRestoredTransfers = true;
+	Msg( "Incremental: geometry unchanged, reusing %d transfers (%5.1f megs)\n",
+		nTotalTransfers, (float)nTotalBytes / ( 1024*1024 ) );
+	return true;
+}
+
+
+void CIncrementalCache::WarmStartBounce( Vector *pEmitLight )
+{
+	int nPatchCount = g_Patches.Count();
+	m_DirectLight.SetCount( nPatchCount );
+	memcpy( m_DirectLight.Base(), pEmitLight, nPatchCount * sizeof( Vector ) );
+
+	if ( !m_bRestoredTransfers )
+		return;
+
+	CUtlBuffer buf( (const byte*)m_OldData.Base() + m_nOldBounceOffset, m_OldData.TellPut() - m_nOldBounceOffset, CUtlBuffer::READ_ONLY );
+	for ( int i = 0; i < nPatchCount; i++ )
+	{
+		Vector vecOldDirect;
+		buf.Get( &vecOldDirect, sizeof( Vector ) );
+		buf.Get( &g_Patches[i].totallight, sizeof( bumplights_t ) );
+		pEmitLight[i] -= vecOldDirect;
+
+		buf.GetInt();
+		buf.SeekGet( CUtlBuffer::SEEK_CURRENT, buf.GetInt() );
+	}
+
+	Msg( "Incremental: bouncing the change in direct light since the last run\n" );
+}
+
+
+bool CIncrementalCache::Write()
+{
+	long fp = FileOpen( m_szFilename, false );
+	if ( !fp )
+	{
+		Warning( "Incremental: couldn't write %s\n", m_szFilename );
+		return false;
+	}
+
+	FileWrite( fp, (int)INCREMENTALCACHE_VERSION );
+	FileWrite( fp, (int)g_bHDR );
+	FileWrite( fp, m_OptionsCRC );
+	FileWrite( fp, m_VisCRC );
+	FileWrite( fp, numfaces );
+	FileWrite( fp, g_Patches.Count() );
+
+	PutVector( fp, m_Cells );
+	PutVector( fp, m_PropCRCs );
+	PutVector( fp, m_LightCRCs );
+	FileWrite( fp, m_FaceCRCs.Base(), numfaces * sizeof( CRC32_t ) );
+	FileWrite( fp, m_FaceDataOffsets.Base(), numfaces * sizeof( int ) );
+	FileWrite( fp, m_FaceData.TellPut() );
+	FileWrite( fp, m_FaceData.Base(), m_FaceData.TellPut() );
+
+	// Transfers and bounced light, if there was a bounce
+	bool bBounce = ( m_DirectLight.Count() == g_Patches.Count() ) && g_Patches.Count();
+	FileWrite( fp, (int)bBounce );
+	if ( bBounce )
+	{
+		for ( int i = 0; i < g_Patches.Count(); i++ )
+		{
+			CPatch &patch = g_Patches[i];
+			FileWrite( fp, m_DirectLight[i] );
+			FileWrite( fp, patch.totallight );
+			FileWrite( fp, patch.numtransfers );
+			FileWrite( fp, patch.transferbytes );
+			FileWrite( fp, patch.transfers, patch.transferbytes );
+		}
+	}
+
+	FileClose( fp );
+
+	if ( FileError() )
+	{
+		Warning( "Incremental: error writing %s\n", m_szFilename );
+		return false;
+	}
+
+	// The old cache isn't needed any more
+	m_OldData.Purge();
+	return true;
+}
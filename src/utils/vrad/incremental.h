@@ -18,9 +18,14 @@
 #include "utlvector.h"
 #include "utlbuffer.h"
 #include "vrad.h"
+#include "tier1/checksum_crc.h"
 
 
 #define INCREMENTALFILE_VERSION	31241
+#define INCREMENTALCACHE_VERSION	1
+
+// Occluders are compared a cell at a time
+#define OCCLUDER_CELL_SIZE		256.0f
 
 
 class CIncLight;
@@ -64,7 +69,7 @@ public:
 	// This is the light for which m_LightFaces was built.
 	dworldlight_t	m_Light;
 
-	CLightFace		*m_pCachedFaces[MAX_TOOL_THREADS+1];
+	CToolThreadArray<CLightFace*>	m_pCachedFaces;
 
 	// The list of faces that this light contributes to.
 	CUtlLinkedList<CLightFace*, unsigned short>	m_LightFaces;
@@ -171,5 +176,115 @@ private:
 };
 
 
+// -incremental <cachefile>. Keeps each face's direct lighting, the transfers
+// and the bounced light from the last run, works out which lights, faces and
+// occluders changed since, and only relights what those could have touched.
+class CIncrementalCache
+{
+public:
+					CIncrementalCache();
+
+	// Options that change the lighting invalidate the whole cache.
+	void			Init( char const *pFilename, int argc, char **argv );
+
+	// Checksums g_RtEnv's triangles. Must be called before the acceleration
+	// structure is built, while the triangles still have their vertices.
+	void			HashOccluders();
+
+	// Loads the last run's cache and diffs it against this one. Call once the
+	// direct lights exist, before BuildFacelights.
+	void			Prepare();
+
+	// True if the face's cached lighting might still be good.
+	bool			IsFaceCached( int iFace ) const;
+
+	// Restores the face's cached lighting if no new or changed light reaches
+	// the box and no changed occluder could shadow it from the lights that
+	// do. The box must contain every point the face is sampled at.
+	bool			RestoreFace( int iFace, facelight_t *fl, int normalCount, const Vector &vecMins, const Vector &vecMaxs );
+
+	// Called from BuildFacelights for each light that reaches a face.
+	void			AddLightToFace( int iFace, int iLight );
+
+	// Snapshots every face's direct lighting; call after BuildFacelights.
+	void			SaveFacelights();
+
+	// Restores the last run's transfers if no geometry changed. Replaces MakeAllScales.
+	bool			RestoreTransfers();
+
+	// Called by BounceLight with emitlight set to the direct light. When the
+	// transfers were restored, replaces emitlight with the change since the
+	// last run and totallight with the last run's bounced light, so only the
+	// difference is bounced. Radiosity is linear, so the sum is the same.
+	void			WarmStartBounce( Vector *pEmitLight );
+
+	// Writes the cache for the next run. Call after BounceLight, before FinalLightFace.
+	bool			Write();
+
+private:
+	struct OccluderCell_t
+	{
+		int			m_nCell[3];
+		CRC32_t		m_CRC;
+		Vector		m_vecMins;
+		Vector		m_vecMaxs;
+	};
+
+	struct ChangedOccluder_t
+	{
+		Vector		m_vecMins;
+		Vector		m_vecMaxs;
+		CUtlVector<int> m_Clusters;		// clusters the box is in, empty if none
+	};
+
+	bool			Load();
+	void			DiffLights();
+	void			DiffOccluders();
+	void			AddChangedOccluder( const Vector &vecMins, const Vector &vecMaxs );
+
+	bool			LightReachesBox( directlight_t *dl, const int *pClusters, int nClusters, const Vector &vecMins, const Vector &vecMaxs ) const;
+	bool			OccluderCanShadow( const ChangedOccluder_t &occluder, directlight_t *dl, const Vector &vecMins, const Vector &vecMaxs ) const;
+	const byte		*OldFaceRecord( int iFace, int *pSize );
+
+	char			m_szFilename[MAX_PATH];
+	CRC32_t			m_OptionsCRC;
+	CRC32_t			m_VisCRC;
+
+	// This run
+	CUtlVector<OccluderCell_t>	m_Cells;
+	CUtlVector<CRC32_t>			m_PropCRCs;
+	CUtlVector<CRC32_t>			m_LightCRCs;		// by directlight_t::index
+	CUtlVector<directlight_t*>	m_Lights;
+	CUtlVector<CRC32_t>			m_FaceCRCs;
+	CUtlVector< CUtlVector<int> >	m_FaceLights;	// lights that reached each face
+	CUtlVector<byte>			m_FaceRestored;
+	CUtlBuffer					m_FaceData;
+	CUtlVector<int>				m_FaceDataOffsets;
+	CUtlVector<Vector>			m_DirectLight;		// each patch's emitlight before bouncing
+
+	// The last run, and how it differs
+	CUtlBuffer					m_OldData;
+	bool						m_bValid;
+	bool						m_bSameGeometry;
+	bool						m_bRestoredTransfers;
+	int							m_nOldPatches;
+	int							m_nOldBounceOffset;	// -1 if the last run didn't bounce
+	CUtlVector<OccluderCell_t>	m_OldCells;
+	CUtlVector<CRC32_t>			m_OldPropCRCs;
+	CUtlVector<CRC32_t>			m_OldLightCRCs;
+	CUtlVector<CRC32_t>			m_OldFaceCRCs;
+	CUtlVector<int>				m_OldLightMap;		// old light index -> new one, -1 if gone or changed
+	CUtlVector<int>				m_OldFaceDataOffsets;
+	int							m_nOldFaceDataStart;
+	int							m_nOldFaceDataSize;
+	CUtlVector<byte>			m_FaceCandidates;
+	CUtlVector<directlight_t*>	m_NewLights;		// new or changed lights
+	CUtlVector<directlight_t*>	m_SameLights;
+	CUtlVector<ChangedOccluder_t>	m_ChangedOccluders;
+};
+
+extern CIncrementalCache *g_pIncrementalCache;	// null unless -incremental
+
+
 
 #endif // INCREMENTAL_H
@@ -11,6 +11,7 @@
 #include "radial.h"
 #include "mathlib/bumpvects.h"
 #include "tier1/utlvector.h"
+#include "incremental.h"
 #include "vmpi.h"
 #include "mathlib/anorms.h"
 #include "map_utils.h"
@@ -2382,7 +2383,7 @@ void DumpSamples( int ndxFace, facelight_t *pFaceLight )
 //-----------------------------------------------------------------------------
 // Allocates light sample data
 //-----------------------------------------------------------------------------
-static inline void AllocateLightstyleSamples( facelight_t* fl, int styleIndex, int numnormals )
+void AllocateLightstyleSamples( facelight_t* fl, int styleIndex, int numnormals )
 {
 	for (int n = 0; n < numnormals; ++n)
 	{
@@ -2554,6 +2555,11 @@ static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, i
 			}
 		}
 
+		if ( g_pIncrementalCache )
+		{
+			g_pIncrementalCache->AddLightToFace( info.m_FaceNum, dl->index );
+		}
+
 		for( int n = 0; n < info.m_NormalCount; ++n )
 		{
 			for ( int i = 0; i < numSamples; i++ )
@@ -2619,10 +2625,17 @@ static void ResampleLightAt4Points( SSE_SampleInfo_t& info, int lightStyleIndex,
 
 		// Apply the PVS check filter and compute falloff x dot
 		fltx4 fxdot[NUM_BUMP_VECTS + 1];
+		bool bContributes = false;
 		for ( int b = 0; b < info.m_NormalCount; b++ )
 		{
 			fxdot[b] = MulSIMD( out.m_flFalloff, out.m_flDot[b] );
 			fxdot[b] = MulSIMD( fxdot[b], dotMask );
+			bContributes = bContributes || !IsAllZeros( fxdot[b] );
+		}
+
+		if ( g_pIncrementalCache && bContributes )
+		{
+			g_pIncrementalCache->AddLightToFace( info.m_FaceNum, dl->index );
 		}
 
 		// Compute the contributions to each of the bumped lightmaps
@@ -3056,6 +3069,64 @@ static void InitSampleInfo( lightinfo_t const& l, int iThread, SSE_SampleInfo_t&
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Puts back the -incremental cache's lighting for a face if nothing that could
+// change it did. Returns false if the face has to be lit.
+//-----------------------------------------------------------------------------
+static bool RestoreCachedFacelight( lightinfo_t &l, SSE_SampleInfo_t &sampleInfo, int numGroups )
+{
+	facelight_t *fl = sampleInfo.m_pFaceLight;
+
+	// Everywhere the face is sampled: within a luxel of each sample (supersampling),
+	// and a unit off the surface
+	Vector vecPad;
+	for ( int j = 0; j < 3; j++ )
+	{
+		vecPad[j] = fabs( l.luxelToWorldSpace[0][j] ) + fabs( l.luxelToWorldSpace[1][j] ) + 2.0f;
+	}
+
+	Vector vecMins, vecMaxs;
+	ClearBounds( vecMins, vecMaxs );
+	for ( int i = 0; i < fl->numsamples; i++ )
+	{
+		AddPointToBounds( fl->sample[i].pos, vecMins, vecMaxs );
+	}
+	vecMins -= vecPad;
+	vecMaxs += vecPad;
+
+	if ( !g_pIncrementalCache->RestoreFace( sampleInfo.m_FaceNum, fl, sampleInfo.m_NormalCount, vecMins, vecMaxs ) )
+		return false;
+
+	// Smooth faces still get their sample normals fixed up like lighting would
+	if ( !l.isflat )
+	{
+		for ( int grp = 0; grp < numGroups; ++grp )
+		{
+			sample_t *sample = fl->sample + 4 * grp;
+			int numSamples = min ( 4, fl->numsamples - 4 * grp );
+
+			Vector v[4], n[4];
+			for ( int i = 0; i < 4; i++ )
+			{
+				v[i] = ( i < numSamples ) ? sample[i].pos : sample[numSamples - 1].pos;
+				n[i] = ( i < numSamples ) ? sample[i].normal : sample[numSamples - 1].normal;
+			}
+
+			FourVectors positions;
+			FourVectors normals;
+			positions.LoadAndSwizzle( v[0], v[1], v[2], v[3] );
+			normals.LoadAndSwizzle( n[0], n[1], n[2], n[3] );
+
+			ComputeIlluminationPointAndNormalsSSE( l, positions, normals, &sampleInfo, numSamples );
+
+			for ( int i = 0; i < numSamples; i++ )
+				sample[i].normal = sampleInfo.m_PointNormals[0].Vec( i );
+		}
+	}
+
+	return true;
+}
+
 void BuildFacelights (int iThread, int facenum)
 {
 	int	i, j;
@@ -3113,8 +3184,12 @@ void BuildFacelights (int iThread, int facenum)
 	f->styles[0] = 0;
 	AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
 
+	// -incremental keeps the last run's lighting where nothing around the face changed
+	bool bRestored = g_pIncrementalCache && g_pIncrementalCache->IsFaceCached( facenum ) &&
+		RestoreCachedFacelight( l, sampleInfo, numGroups );
+
 	// sample the lights at each sample location
-	for ( int grp = 0; grp < numGroups; ++grp )
+	for ( int grp = 0; grp < numGroups && !bRestored; ++grp )
 	{
 		int nSample = 4 * grp;
 
@@ -3161,7 +3236,8 @@ void BuildFacelights (int iThread, int facenum)
 	}
 
 	// get rid of the -extra functionality on displacement surfaces
-	if (do_extra && !sampleInfo.m_IsDispFace)
+	// (restored faces were supersampled when they were cached)
+	if (do_extra && !sampleInfo.m_IsDispFace && !bRestored)
 	{
 		// For each lightstyle, perform a supersampling pass
 		for ( i = 0; i < MAXLIGHTMAPS; ++i )
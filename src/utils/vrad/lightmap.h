@@ -133,6 +133,8 @@ struct SSE_SampleInfo_t
 
 extern void InitLightinfo( lightinfo_t *l, int facenum );
 
+void AllocateLightstyleSamples( facelight_t* fl, int styleIndex, int numnormals );
+
 void FreeDLights();
 
 void ExportDirectLightsToWorldLights();
@@ -292,10 +292,11 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		int numtransfers;
 		pBuf->read( &numtransfers, sizeof(numtransfers) );
 		patch->numtransfers = numtransfers;
+		pBuf->read( &patch->transferbytes, sizeof(patch->transferbytes) );
 		if (numtransfers) 
 		{
-			patch->transfers = new transfer_t[numtransfers];
-			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
+			patch->transfers = (byte *)malloc( patch->transferbytes );
+			pBuf->read(patch->transfers, patch->transferbytes);
 		}
 		
 		total_transfer += numtransfers;
@@ -315,7 +316,7 @@ public:
 	transfer_t *m_pBuildVisLeafsTransfers;
 };
 
-CVMPIVisLeafsData g_VMPIVisLeafsData[MAX_TOOL_THREADS+1];
+CToolThreadArray<CVMPIVisLeafsData> g_VMPIVisLeafsData;
 
 
 
@@ -330,7 +331,8 @@ void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 		++pData->m_nPatchesInCluster;
 		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
 		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		pData->m_pVisLeafsMB->write(&patch->transferbytes, sizeof(patch->transferbytes));
+		pData->m_pVisLeafsMB->write( patch->transfers, patch->transferbytes );
 	}
 }
 
@@ -378,7 +380,10 @@ void RunMPIBuildVisLeafs()
 		StartPacifier("");
 	}
 
-	memset( g_VMPIVisLeafsData, 0, sizeof( g_VMPIVisLeafsData ) );
+	for ( int i=0; i < g_VMPIVisLeafsData.Count(); i++ )
+	{
+		memset( &g_VMPIVisLeafsData[i], 0, sizeof( CVMPIVisLeafsData ) );
+	}
 	if ( !g_bMPIMaster || VMPI_GetActiveWorkUnitDistributor() == k_eWorkUnitDistributor_SDK )
 	{
 		// Allocate space for the transfers for each thread.
@@ -81,7 +81,7 @@ float TraceLeafBrushes( int leafIndex, const Vector &start, const Vector &end, C
 	return 1.0f;
 }
 
-DispTested_t s_DispTested[MAX_TOOL_THREADS+1];
+CToolThreadArray<DispTested_t> s_DispTested;
 
 // this just uses the average coverage for the triangle
 class CCoverageCount : public ITransparentTriangleCallback
@@ -19,6 +19,7 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "incremental.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -80,8 +81,10 @@ char		level_lights[MAX_PATH] = "";
 
 char		vismatfile[_MAX_PATH] = "";
 char		incrementfile[_MAX_PATH] = "";
+char		g_szIncrementalCache[_MAX_PATH] = "";
 
 IIncremental *g_pIncremental = 0;
+CIncrementalCache *g_pIncrementalCache = NULL;
 bool		g_bInterrupt = false;	// Wsed with background lighting in WC. Tells VRAD
 									// to stop lighting.
 float g_SunAngularExtent=0.0;
@@ -91,6 +94,7 @@ float g_flSkySampleScale = 1.0;
 bool g_bLargeDispSampleRadius = false;
 
 bool g_bOnlyStaticProps = false;
+bool g_bProgressiveBounce = false;
 bool g_bShowStaticPropNormals = false;
 
 
@@ -1199,11 +1203,135 @@ void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers )
 }
 
 
+//-----------------------------------------------------------------------------
+// Compressed transfer lists
+//
+// A patch's transfers are sorted by patch and stored as a float scale (the
+// largest transfer) followed by blocks of up to TRANSFER_BLOCK_SIZE transfers.
+// Each block is the quantized transfers, two bytes each, then the gaps between
+// successive patch indices as 7 bit varints. After the vis matrix is built,
+// PackTransfers moves every list into one allocation in patch order, which is
+// the order GatherLight walks them.
+//-----------------------------------------------------------------------------
+static int TransferIndexBytes( unsigned int nDelta )
+{
+	int nBytes = 1;
+	while ( nDelta >= 0x80 )
+	{
+		nDelta >>= 7;
+		nBytes++;
+	}
+	return nBytes;
+}
+
+// Transfers are stored as a fraction of the largest one, with a 4 bit
+// exponent and a 12 bit rounded mantissa, so each is within 1/8192 of its
+// float value. Fractions under 2^-14 use exponent 15 and are stored linearly.
+static unsigned short QuantizeTransfer( float flFraction )
+{
+	if ( flFraction <= 0.0f )
+		return 0xF000;
+
+	if ( flFraction < 1.0f / 16384.0f )
+	{
+		int nLinear = (int)( flFraction * 67108864.0f + 0.5f );	// 2^26
+		if ( nLinear < 4096 )
+			return 0xF000 | nLinear;
+		return 14 << 12;
+	}
+
+	int nExp;
+	float flMantissa = frexp( min( flFraction, 1.0f ), &nExp );
+	int nShift = 1 - nExp;
+	int nMantissa = (int)( ( flMantissa * 2.0f - 1.0f ) * 4096.0f + 0.5f );
+	if ( nMantissa == 4096 )
+	{
+		nShift--;
+		nMantissa = 0;
+	}
+	return ( nShift << 12 ) | nMantissa;
+}
+
+static FORCEINLINE float DequantizeTransfer( unsigned short nQuantized )
+{
+	unsigned int nShift = nQuantized >> 12;
+	unsigned int nMantissa = nQuantized & 0xFFF;
+	if ( nShift == 15 )
+		return (float)nMantissa * ( 1.0f / 67108864.0f );
+
+	union
+	{
+		unsigned int nBits;
+		float flValue;
+	} value;
+	value.nBits = ( ( 127 - nShift ) << 23 ) | ( nMantissa << 11 );
+	return value.flValue;
+}
+
+static int CompareTransfers( const void *p1, const void *p2 )
+{
+	return ( (const transfer_t *)p1 )->patch - ( (const transfer_t *)p2 )->patch;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Walks a patch's compressed transfers a block at a time
+//-----------------------------------------------------------------------------
+class CTransferDecoder
+{
+public:
+	CTransferDecoder( const CPatch *pPatch )
+	{
+		m_pData = pPatch->transfers;
+		m_nRemaining = pPatch->numtransfers;
+		m_nPatch = 0;
+		m_flScale = 0.0f;
+		if ( m_nRemaining )
+		{
+			memcpy( &m_flScale, m_pData, sizeof( float ) );
+			m_pData += sizeof( float );
+		}
+	}
+
+	// Fills pOut with the next block and returns its size, 0 when done
+	int NextBlock( transfer_t *pOut )
+	{
+		int nCount = min( m_nRemaining, TRANSFER_BLOCK_SIZE );
+		const byte *pQuantized = m_pData;
+		const byte *pIndex = m_pData + nCount * 2;
+		for ( int i = 0; i < nCount; i++ )
+		{
+			unsigned int nDelta = 0;
+			int nShift = 0;
+			while ( *pIndex & 0x80 )
+			{
+				nDelta |= ( *pIndex++ & 0x7F ) << nShift;
+				nShift += 7;
+			}
+			nDelta |= *pIndex++ << nShift;
+
+			m_nPatch += nDelta;
+			pOut[i].patch = m_nPatch;
+			pOut[i].transfer = m_flScale * DequantizeTransfer( pQuantized[0] | ( pQuantized[1] << 8 ) );
+			pQuantized += 2;
+		}
+
+		m_pData = pIndex;
+		m_nRemaining -= nCount;
+		return nCount;
+	}
+
+private:
+	const byte *m_pData;
+	int m_nRemaining;
+	int m_nPatch;
+	float m_flScale;
+};
+
 void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 {
 	int		j;
 	float	total;
-	transfer_t	*t, *t2;
+	transfer_t	*t2;
 	total = 0;
 
 	if( ndxPatch == g_Patches.InvalidIndex() )
@@ -1218,11 +1346,6 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 			max_transfer = patch->numtransfers;
 		}
 
-
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
-
 		// get total transfer energy
 		t2 = all_transfers;
 
@@ -1238,17 +1361,55 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else	
 			total = 1.0f/M_PI;
 
-		t = patch->transfers;
+		// sort by patch so the indices delta encode, and find the largest transfer to scale by
+		qsort( all_transfers, patch->numtransfers, sizeof( transfer_t ), CompareTransfers );
+
+		float flMaxTransfer = 0.0f;
+		int nBytes = sizeof( float ) + patch->numtransfers * 2;
+		int nPrevPatch = 0;
 		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+		for (j=0 ; j<patch->numtransfers ; j++, t2++)
 		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
+			t2->transfer *= total;
+			flMaxTransfer = max( flMaxTransfer, t2->transfer );
+			nBytes += TransferIndexBytes( t2->patch - nPrevPatch );
+			nPrevPatch = t2->patch;
 		}
-		if (patch->numtransfers > max_transfer)
+
+		patch->transfers = ( byte* )malloc( nBytes );
+		if (!patch->transfers)
+			Error ("Memory allocation failure");
+		patch->transferbytes = nBytes;
+
+		byte *pOut = patch->transfers;
+		memcpy( pOut, &flMaxTransfer, sizeof( float ) );
+		pOut += sizeof( float );
+
+		float flOOMaxTransfer = 1.0f / flMaxTransfer;
+		nPrevPatch = 0;
+		for ( j = 0; j < patch->numtransfers; j += TRANSFER_BLOCK_SIZE )
 		{
-			max_transfer = patch->numtransfers;
+			int nCount = min( patch->numtransfers - j, TRANSFER_BLOCK_SIZE );
+			t2 = &all_transfers[j];
+			for ( int k = 0; k < nCount; k++ )
+			{
+				unsigned short nQuantized = QuantizeTransfer( t2[k].transfer * flOOMaxTransfer );
+				*pOut++ = nQuantized & 0xFF;
+				*pOut++ = nQuantized >> 8;
+			}
+			for ( int k = 0; k < nCount; k++ )
+			{
+				unsigned int nDelta = t2[k].patch - nPrevPatch;
+				nPrevPatch = t2[k].patch;
+				while ( nDelta >= 0x80 )
+				{
+					*pOut++ = ( nDelta & 0x7F ) | 0x80;
+					nDelta >>= 7;
+				}
+				*pOut++ = nDelta;
+			}
 		}
+		Assert( pOut == patch->transfers + nBytes );
 	}
 	else
 	{
@@ -1261,6 +1422,40 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 	ThreadUnlock ();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Moves every patch's transfer list into a single allocation, in
+//			patch order. Returns its size.
+//-----------------------------------------------------------------------------
+static int PackTransfers( void )
+{
+	int nTotalBytes = 0;
+	int nPatchCount = g_Patches.Count();
+	for ( int i = 0; i < nPatchCount; i++ )
+	{
+		nTotalBytes += g_Patches[i].transferbytes;
+	}
+	if ( !nTotalBytes )
+		return 0;
+
+	byte *pPacked = ( byte* )malloc( nTotalBytes );
+	if ( !pPacked )
+		Error( "Memory allocation failure" );
+
+	byte *pOut = pPacked;
+	for ( int i = 0; i < nPatchCount; i++ )
+	{
+		CPatch *patch = &g_Patches[i];
+		if ( !patch->transferbytes )
+			continue;
+
+		memcpy( pOut, patch->transfers, patch->transferbytes );
+		free( patch->transfers );
+		patch->transfers = pOut;
+		pOut += patch->transferbytes;
+	}
+	return nTotalBytes;
+}
+
 /*
 =============
 WriteWorld
@@ -1436,7 +1631,12 @@ void CollectLight( Vector& total )
 				VectorAdd( patch->totallight.light[j], addlight[i].light[j], patch->totallight.light[j] );
 			}
 			VectorCopy( addlight[i].light[0], emitlight[i] );
-			VectorAdd( total, emitlight[i], total );
+
+			// emitlight goes negative where -incremental bounces a drop in light
+			for ( j = 0; j < 3; j++ )
+			{
+				total[j] += fabs( emitlight[i][j] );
+			}
 		}
 		else
 		{
@@ -1532,9 +1732,182 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+//-----------------------------------------------------------------------------
+// -progressivebounce. Instead of every patch shooting whatever it received
+// last bounce, received light is held until its patch is among those holding
+// most of the unshot light, and patches none of whose transfers come from a
+// shooting patch skip the gather. Which patches a receiver gathers from is
+// tracked coarsely, as buckets of patch indices.
+//-----------------------------------------------------------------------------
+#define NUM_SOURCE_BUCKETS		1024
+#define SOURCE_BUCKET_WORDS		( NUM_SOURCE_BUCKETS / 64 )
+
+// Each bounce shoots enough patches that at most this much of the unshot light is held back
+#define PROGRESSIVE_HOLD_FRACTION	0.1f
+
+// Held light is binned by power of two, from 2^-64 up
+#define HELD_LIGHT_BINS			128
+#define HELD_LIGHT_MIN_EXP		-64
+
+struct sourcebuckets_t
+{
+	uint64	bits[SOURCE_BUCKET_WORDS];
+};
+
+static CUtlVector<Vector>			unshotlight;
+static CUtlVector<sourcebuckets_t>	g_SourceBuckets;	// per receiver
+static sourcebuckets_t				g_ShootingBuckets;
+static bool							g_bGatherShootersOnly = false;
+
+static inline int SourceBucket( int iPatch )
+{
+	return (int)( (int64)iPatch * NUM_SOURCE_BUCKETS / g_Patches.Count() );
+}
+
+static void BuildSourceBuckets( int iThread, int iPatch )
+{
+	sourcebuckets_t &buckets = g_SourceBuckets[iPatch];
+	memset( &buckets, 0, sizeof( buckets ) );
+
+	transfer_t block[TRANSFER_BLOCK_SIZE];
+	int num;
+	CTransferDecoder decoder( &g_Patches[iPatch] );
+	while ( ( num = decoder.NextBlock( block ) ) != 0 )
+	{
+		for ( int k = 0; k < num; k++ )
+		{
+			int nBucket = SourceBucket( block[k].patch );
+			buckets.bits[nBucket >> 6] |= (uint64)1 << ( nBucket & 63 );
+		}
+	}
+}
+
+static inline bool SourcesShooting( int iPatch )
+{
+	const sourcebuckets_t &buckets = g_SourceBuckets[iPatch];
+	for ( int i = 0; i < SOURCE_BUCKET_WORDS; i++ )
+	{
+		if ( buckets.bits[i] & g_ShootingBuckets.bits[i] )
+			return true;
+	}
+	return false;
+}
+
+static inline int HeldLightBin( const Vector &v, float *pLight )
+{
+	*pLight = fabs( v.x ) + fabs( v.y ) + fabs( v.z );
+	if ( *pLight <= 0.0f )
+		return -1;
+
+	int nExp;
+	frexp( *pLight, &nExp );
+	return clamp( nExp - HELD_LIGHT_MIN_EXP, 0, HELD_LIGHT_BINS - 1 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds the light each leaf patch received last bounce to what it's
+//			holding, and picks the patches that shoot it this bounce. Returns
+//			how many shoot and how many patches will gather; held is the light
+//			still held back afterwards.
+//-----------------------------------------------------------------------------
+static int SelectShooters( int &nGatherers, Vector &held )
+{
+	int nPatchCount = g_Patches.Count();
+
+	float binLight[HELD_LIGHT_BINS];
+	memset( binLight, 0, sizeof( binLight ) );
+	float flTotal = 0.0f;
+	for ( int i = 0; i < nPatchCount; i++ )
+	{
+		CPatch *patch = &g_Patches[i];
+		if ( patch->sky || patch->child1 != g_Patches.InvalidIndex() )
+			continue;
+
+		VectorAdd( unshotlight[i], emitlight[i], unshotlight[i] );
+
+		float flLight;
+		int nBin = HeldLightBin( unshotlight[i], &flLight );
+		if ( nBin >= 0 )
+		{
+			binLight[nBin] += flLight;
+			flTotal += flLight;
+		}
+	}
+
+	// Hold back the dimmest patches, as long as they don't add up to much
+	int nCutoff = 0;
+	float flHeld = 0.0f;
+	while ( nCutoff < HELD_LIGHT_BINS && flHeld + binLight[nCutoff] <= flTotal * PROGRESSIVE_HOLD_FRACTION )
+	{
+		flHeld += binLight[nCutoff];
+		nCutoff++;
+	}
+
+	memset( &g_ShootingBuckets, 0, sizeof( g_ShootingBuckets ) );
+	VectorFill( held, 0 );
+	int nShooters = 0;
+
+	// children before their parents, like CollectLight
+	for ( int i = nPatchCount - 1; i >= 0; i-- )
+	{
+		CPatch *patch = &g_Patches[i];
+		if ( patch->sky )
+		{
+			VectorFill( emitlight[i], 0 );
+			continue;
+		}
+
+		if ( patch->child1 == g_Patches.InvalidIndex() )
+		{
+			float flLight;
+			if ( HeldLightBin( unshotlight[i], &flLight ) >= nCutoff )
+			{
+				VectorCopy( unshotlight[i], emitlight[i] );
+				VectorFill( unshotlight[i], 0 );
+				nShooters++;
+			}
+			else
+			{
+				VectorFill( emitlight[i], 0 );
+				for ( int j = 0; j < 3; j++ )
+				{
+					held[j] += fabs( unshotlight[i][j] );
+				}
+			}
+		}
+		else
+		{
+			CPatch *child1 = &g_Patches[patch->child1];
+			CPatch *child2 = &g_Patches[patch->child2];
+			float s1 = child1->area / (child1->area + child2->area);
+			float s2 = child2->area / (child1->area + child2->area);
+			VectorScale( emitlight[patch->child1], s1, emitlight[i] );
+			VectorMA( emitlight[i], s2, emitlight[patch->child2], emitlight[i] );
+		}
+
+		if ( emitlight[i] != vec3_origin )
+		{
+			int nBucket = SourceBucket( i );
+			g_ShootingBuckets.bits[nBucket >> 6] |= (uint64)1 << ( nBucket & 63 );
+		}
+	}
+
+	nGatherers = 0;
+	for ( int i = 0; i < nPatchCount; i++ )
+	{
+		if ( g_Patches[i].numtransfers && SourcesShooting( i ) )
+		{
+			nGatherers++;
+		}
+	}
+
+	return nShooters;
+}
+
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
+	transfer_t	block[TRANSFER_BLOCK_SIZE];
 	transfer_t	*trans;
 	int			num;
 	CPatch		*patch;
@@ -1546,10 +1919,12 @@ void GatherLight (int threadnum, void *pUserData)
 		if (j == -1)
 			break;
 
+		// -progressivebounce: nothing this patch gathers from is shooting
+		if ( g_bGatherShootersOnly && !SourcesShooting( j ) )
+			continue;
+
 		patch = &g_Patches[j];
 
-		trans = patch->transfers;
-		num = patch->numtransfers;
 		if ( patch->needsBumpmap )
 		{
 			Vector delta;
@@ -1589,33 +1964,38 @@ void GatherLight (int threadnum, void *pUserData)
 			}
 
 			float dot;
-			for (k=0 ; k<num ; k++, trans++)
+			CTransferDecoder decoder( patch );
+			while ( ( num = decoder.NextBlock( block ) ) != 0 )
 			{
-				CPatch *patch2 = &g_Patches[trans->patch];
-
-				// get vector to other patch
-				VectorSubtract (patch2->origin, patch->origin, delta);
-				VectorNormalize (delta);
-				// find light emitted from other patch
-				for(i=0; i<3; i++)
+				trans = block;
+				for (k=0 ; k<num ; k++, trans++)
 				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
-				}
-				// remove normal already factored into transfer steradian
-				float scale = 1.0f / DotProduct (delta, patch->normal);
-				VectorScale( v, trans->transfer * scale, v );
-				
-				Vector bumpTransfer;
-				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-				{
-					dot = DotProduct( delta, normals[i] );
-					if ( dot <= 0 )
+					CPatch *patch2 = &g_Patches[trans->patch];
+
+					// get vector to other patch
+					VectorSubtract (patch2->origin, patch->origin, delta);
+					VectorNormalize (delta);
+					// find light emitted from other patch
+					for(i=0; i<3; i++)
+					{
+						v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
+					}
+					// remove normal already factored into transfer steradian
+					float scale = 1.0f / DotProduct (delta, patch->normal);
+					VectorScale( v, trans->transfer * scale, v );
+
+					Vector bumpTransfer;
+					for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 					{
-//						Assert( i > 0 ); // if this hits, then the transfer shouldn't be here.  It doesn't face the flat normal of this face!
-						continue;
+						dot = DotProduct( delta, normals[i] );
+						if ( dot <= 0 )
+						{
+//							Assert( i > 0 ); // if this hits, then the transfer shouldn't be here.  It doesn't face the flat normal of this face!
+							continue;
+						}
+						bumpTransfer = v * dot;
+						VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
 					}
-					bumpTransfer = v * dot;
-					VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
 				}
 			}
 			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
@@ -1626,14 +2006,19 @@ void GatherLight (int threadnum, void *pUserData)
 		else
 		{
 			VectorFill( sum, 0 );
-			for (k=0 ; k<num ; k++, trans++)
+			CTransferDecoder decoder( patch );
+			while ( ( num = decoder.NextBlock( block ) ) != 0 )
 			{
-				for(i=0; i<3; i++)
+				trans = block;
+				for (k=0 ; k<num ; k++, trans++)
 				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					for(i=0; i<3; i++)
+					{
+						v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					}
+					VectorScale( v, trans->transfer, v );
+					VectorAdd( sum, v, sum );
 				}
-				VectorScale( v, trans->transfer, v );
-				VectorAdd( sum, v, sum );
 			}
 			VectorCopy( sum, addlight[j].light[0] );
 		}
@@ -1667,6 +2052,12 @@ void BounceLight (void)
 		VectorFill( g_Patches[i].totallight.light[0], 0 );
 	}
 
+	// -incremental starts from the last run's bounced light
+	if ( g_pIncrementalCache )
+	{
+		g_pIncrementalCache->WarmStartBounce( emitlight.Base() );
+	}
+
 #if 0
 	FileHandle_t dFp = g_pFileSystem->Open( "lightemit.txt", "w" );
 
@@ -1700,9 +2091,36 @@ void BounceLight (void)
 	}
 #endif
 
+	int nReceivers = 0;
+	if ( g_bProgressiveBounce )
+	{
+		unshotlight.SetCount( uiPatchCount );
+		memset( unshotlight.Base(), 0, uiPatchCount * sizeof( Vector ) );
+		g_SourceBuckets.SetCount( uiPatchCount );
+		RunThreadsOnIndividual( uiPatchCount, false, BuildSourceBuckets );
+
+		for ( i = 0; i < uiPatchCount; i++ )
+		{
+			if ( g_Patches[i].numtransfers )
+				nReceivers++;
+		}
+	}
+
+	int nTotalGathered = 0;
 	i = 0;
 	while ( bouncing )
 	{
+		// The first bounce shoots everything; after that -progressivebounce holds
+		// back light on the patches that have the least of it
+		int nShooters = uiPatchCount;
+		int nGatherers = nReceivers;
+		Vector held( 0, 0, 0 );
+		if ( g_bProgressiveBounce && i > 0 )
+		{
+			nShooters = SelectShooters( nGatherers, held );
+			g_bGatherShootersOnly = true;
+		}
+
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
 		unsigned int uiPatchCount = g_Patches.Size();
@@ -1712,8 +2130,19 @@ void BounceLight (void)
 		// light is always received to leaf patches
 		CollectLight( added );
 
-		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f)\n", i+1, added[0], added[1], added[2] );
+		if ( g_bProgressiveBounce )
+		{
+			nTotalGathered += nGatherers;
+			Msg ("\tBounce #%i: %d patches shot, %d of %d gathered, added RGB(%.0f, %.0f, %.0f), held RGB(%.0f, %.0f, %.0f)\n",
+				i+1, nShooters, nGatherers, nReceivers, added[0], added[1], added[2], held[0], held[1], held[2] );
+		}
+		else
+		{
+			qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f)\n", i+1, added[0], added[1], added[2] );
+		}
 
+		// Light that's held back still has to be shot
+		VectorAdd( added, held, added );
 		if ( i+1 == numbounce || (added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0) )
 			bouncing = false;
 
@@ -1724,6 +2153,16 @@ void BounceLight (void)
 			WriteWorld (name, 0);
 		}
 	}
+
+	if ( g_bProgressiveBounce )
+	{
+		Msg ("Progressive bounce: %d bounces, %d patch gathers (%.1f full bounces)\n",
+			i, nTotalGathered, nReceivers ? (float)nTotalGathered / nReceivers : 0.0f );
+
+		g_bGatherShootersOnly = false;
+		unshotlight.Purge();
+		g_SourceBuckets.Purge();
+	}
 }
 
 
@@ -1930,10 +2369,12 @@ void MakeAllScales (void)
 	// release visibility matrix
 	FreeVisMatrix ();
 
+	int nTransferBytes = PackTransfers();
+
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf ("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	Msg("transfer lists: %5.1f megs (%5.1f megs uncompressed)\n"
+		, (float)nTransferBytes / (1024*1024), (float)total_transfer * sizeof(transfer_t) / (1024*1024));
 }
 
 
@@ -2017,6 +2458,12 @@ bool RadWorld_Go()
 		// likely that all faces are going to be touched by at least one light so don't
 		// waste time here.
 		BuildFacesVisibleToLights( true );
+
+		// Work out what changed since the last -incremental run
+		if ( g_pIncrementalCache )
+		{
+			g_pIncrementalCache->Prepare();
+		}
 	}
 
 	// build initial facelights
@@ -2044,6 +2491,11 @@ bool RadWorld_Go()
 	}
 	else
 	{
+		if ( g_pIncrementalCache )
+		{
+			g_pIncrementalCache->SaveFacelights();
+		}
+
 		// free up the direct lights now that we have facelights
 		ExportDirectLightsToWorldLights();
 
@@ -2065,12 +2517,21 @@ bool RadWorld_Go()
 			addlight.SetSize( g_Patches.Size() );
 			memset( addlight.Base(), 0, g_Patches.Size() * sizeof( bumplights_t ) );
 
-			MakeAllScales ();
+			// -incremental keeps the last run's transfers if no geometry changed
+			if ( !g_pIncrementalCache || !g_pIncrementalCache->RestoreTransfers() )
+			{
+				MakeAllScales ();
+			}
 
 			// spread light around
 			BounceLight ();
 		}
 
+		if ( g_pIncrementalCache )
+		{
+			g_pIncrementalCache->Write();
+		}
+
 		//
 		// displacement surface luxel accumulation (make threaded!!!)
 		//
@@ -2268,6 +2729,10 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
+	// -incremental compares the occluders while they still have their vertices
+	if ( g_pIncrementalCache )
+		g_pIncrementalCache->HashOccluders();
+
 	// Build acceleration structure
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
@@ -2392,6 +2857,26 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDisablePropSelfShadowing = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-bvh" ) )
+		{
+			g_RtEnv.Flags |= RTE_FLAGS_USE_BVH;
+		}
+		else if ( !Q_stricmp( argv[i], "-progressivebounce" ) )
+		{
+			g_bProgressiveBounce = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-incremental" ) )
+		{
+			if ( ++i < argc && *argv[i] )
+			{
+				Q_strncpy( g_szIncrementalCache, argv[i], sizeof( g_szIncrementalCache ) );
+			}
+			else
+			{
+				Warning("Error: expected a filepath after '-incremental'\n" );
+				return -1;
+			}
+		}
 		else if ( !Q_stricmp( argv[i], "-textureshadows" ) )
 		{
 			g_bTextureShadows = true;
@@ -2854,6 +3339,13 @@ void PrintUsage( int argc, char **argv )
 		"  -textureshadows : Allows texture alpha channels to block light - rays intersecting alpha surfaces will sample the texture\n"
 		"  -noskyboxrecurse : Turn off recursion into 3d skybox (skybox shadows on world)\n"
 		"  -nossprops      : Globally disable self-shadowing on static props\n"
+		"  -bvh            : Trace rays through a bvh instead of a kd-tree. Same results,\n"
+		"                    faster to build on large maps.\n"
+		"  -progressivebounce : Hold back light on dimly lit patches until it adds up, and\n"
+		"                    skip gathering on patches that can't receive any. Faster on\n"
+		"                    bright maps, converges to the same threshold.\n"
+		"  -incremental <file> : Keep lighting in a cache file between runs and only relight\n"
+		"                    faces that changed lights, geometry or props could affect.\n"
 		"\n"
 #if 1 // Disabled for the initial SDK release with VMPI so we can get feedback from selected users.
 		);
@@ -2911,6 +3403,16 @@ int RunVRAD( int argc, char **argv )
 	CmdLib_InitFileSystem( argv[ i ] );
 	Q_FileBase( source, source, sizeof( source ) );
 
+	if ( g_szIncrementalCache[0] )
+	{
+		if ( g_bUseMPI )
+		{
+			Error( "-incremental can't be used with -mpi.\n" );
+		}
+		g_pIncrementalCache = new CIncrementalCache;
+		g_pIncrementalCache->Init( g_szIncrementalCache, argc, argv );
+	}
+
 	VRAD_LoadBSP( argv[i] );
 
 	if ( (! onlydetail) && (! g_bOnlyStaticProps ) )
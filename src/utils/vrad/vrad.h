@@ -112,6 +112,10 @@ struct transfer_t
 	float	transfer;
 };
 
+// Patches keep their transfers compressed, sorted by patch and split into
+// blocks of up to TRANSFER_BLOCK_SIZE. See MakeScales.
+#define TRANSFER_BLOCK_SIZE		64
+
 
 struct LightingValue_t
 {
@@ -237,7 +241,8 @@ struct CPatch
 //	struct		patch_s		*nextclusterchild;		// next terminal child in cluster
 
 	int			numtransfers;
-	transfer_t	*transfers;
+	int			transferbytes;			// size of the compressed transfer list
+	byte		*transfers;
 
 	short		indices[3];				// displacement use these for subdivision
 };
@@ -604,8 +609,8 @@ public:
 	virtual void AddPolysForRayTrace() = 0;
 };
 
-//extern PropTested_t s_PropTested[MAX_TOOL_THREADS+1];
-extern DispTested_t s_DispTested[MAX_TOOL_THREADS+1];
+//extern CToolThreadArray<PropTested_t> s_PropTested;
+extern CToolThreadArray<DispTested_t> s_DispTested;
 
 IVradStaticPropMgr* StaticPropMgr();
 